@@ -761,6 +761,33 @@ gum_x86_writer_put_jmp_near_ptr (GumX86Writer * self,
   self->code += 6;
 }
 
+static void
+gum_x86_writer_put_jmp_imm_ptr (GumX86Writer * self,
+                                guint32 address)
+{
+  self->code[0] = 0xff;
+  self->code[1] = 0x24;
+  self->code[2] = 0x25;
+  *((guint32 *) (self->code + 3)) = address;
+  self->code += 7;
+}
+
+void
+gum_x86_writer_put_jmp_fs_u32_ptr (GumX86Writer * self,
+                                   guint32 fs_offset)
+{
+  gum_x86_writer_put_byte (self, 0x64);
+  gum_x86_writer_put_jmp_imm_ptr (self, fs_offset);
+}
+
+void
+gum_x86_writer_put_jmp_gs_u32_ptr (GumX86Writer * self,
+                                   guint32 gs_offset)
+{
+  gum_x86_writer_put_byte (self, 0x65);
+  gum_x86_writer_put_jmp_imm_ptr (self, gs_offset);
+}
+
 void
 gum_x86_writer_put_jcc (GumX86Writer * self,
                         guint8 opcode,
@@ -2016,6 +2043,25 @@ gum_x86_writer_put_test_reg_u32 (GumX86Writer * self,
   }
 }
 
+void
+gum_x86_writer_put_cmp_reg_reg (GumX86Writer * self,
+                                GumCpuReg reg_a,
+                                GumCpuReg reg_b)
+{
+  GumCpuRegInfo a, b;
+
+  gum_x86_writer_describe_cpu_reg (self, reg_a, &a);
+  gum_x86_writer_describe_cpu_reg (self, reg_b, &b);
+
+  g_return_if_fail (a.width == b.width);
+
+  gum_x86_writer_put_prefix_for_registers (self, &a, 32, &a, &b, NULL);
+
+  self->code[0] = 0x39;
+  self->code[1] = 0xc0 | (b.index << 3) | a.index;
+  self->code += 2;
+}
+
 void
 gum_x86_writer_put_cmp_reg_i32 (GumX86Writer * self,
                                 GumCpuReg reg,
@@ -179,6 +179,8 @@ void gum_x86_writer_put_jmp_near_label (GumX86Writer * self, gconstpointer label
 void gum_x86_writer_put_jmp_reg (GumX86Writer * self, GumCpuReg reg);
 void gum_x86_writer_put_jmp_reg_ptr (GumX86Writer * self, GumCpuReg reg);
 void gum_x86_writer_put_jmp_near_ptr (GumX86Writer * self, GumAddress address);
+void gum_x86_writer_put_jmp_fs_u32_ptr (GumX86Writer * self, guint32 fs_offset);
+void gum_x86_writer_put_jmp_gs_u32_ptr (GumX86Writer * self, guint32 gs_offset);
 void gum_x86_writer_put_jcc (GumX86Writer * self, guint8 opcode, gconstpointer target, GumBranchHint hint);
 void gum_x86_writer_put_jcc_short (GumX86Writer * self, guint8 opcode, gconstpointer target, GumBranchHint hint);
 void gum_x86_writer_put_jcc_near (GumX86Writer * self, guint8 opcode, gconstpointer target, GumBranchHint hint);
@@ -247,6 +249,7 @@ void gum_x86_writer_put_popfx (GumX86Writer * self);
 
 void gum_x86_writer_put_test_reg_reg (GumX86Writer * self, GumCpuReg reg_a, GumCpuReg reg_b);
 void gum_x86_writer_put_test_reg_u32 (GumX86Writer * self, GumCpuReg reg, guint32 imm_value);
+void gum_x86_writer_put_cmp_reg_reg (GumX86Writer * self, GumCpuReg reg_a, GumCpuReg reg_b);
 void gum_x86_writer_put_cmp_reg_i32 (GumX86Writer * self, GumCpuReg reg, gint32 imm_value);
 void gum_x86_writer_put_cmp_reg_offset_ptr_reg (GumX86Writer * self, GumCpuReg reg_a, gssize offset, GumCpuReg reg_b);
 void gum_x86_writer_put_cmp_imm_ptr_imm_u32 (GumX86Writer * self, gconstpointer imm_ptr, guint32 imm_value);
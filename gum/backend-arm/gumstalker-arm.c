@@ -20,6 +20,8 @@
 
 #include "gumstalker.h"
 
+#include <string.h>
+
 struct _GumStalkerPrivate
 {
   gboolean dummy;
@@ -85,6 +87,88 @@ gum_stalker_set_trust_threshold (GumStalker * self,
 {
 }
 
+gsize
+gum_stalker_get_code_budget (GumStalker * self)
+{
+  return 0;
+}
+
+void
+gum_stalker_set_code_budget (GumStalker * self,
+                             gsize code_budget)
+{
+}
+
+void
+gum_stalker_set_transformer (GumStalker * self,
+                             GumStalkerTransformerCallback callback,
+                             gpointer data,
+                             GDestroyNotify notify)
+{
+  if (notify != NULL)
+    notify (data);
+}
+
+gboolean
+gum_stalker_iterator_next (GumStalkerIterator * self,
+                           const GumStalkerInstruction ** insn)
+{
+  return FALSE;
+}
+
+void
+gum_stalker_iterator_keep (GumStalkerIterator * self)
+{
+}
+
+gint
+gum_stalker_get_hot_trace_threshold (GumStalker * self)
+{
+  return -1;
+}
+
+void
+gum_stalker_set_hot_trace_threshold (GumStalker * self,
+                                     gint hot_trace_threshold)
+{
+}
+
+gboolean
+gum_stalker_get_shared_cache (GumStalker * self)
+{
+  return FALSE;
+}
+
+void
+gum_stalker_set_shared_cache (GumStalker * self,
+                              gboolean enabled)
+{
+}
+
+gboolean
+gum_stalker_get_write_tracking (GumStalker * self)
+{
+  return FALSE;
+}
+
+void
+gum_stalker_set_write_tracking (GumStalker * self,
+                                gboolean enabled)
+{
+}
+
+gboolean
+gum_stalker_get_lazy_fp_save (GumStalker * self)
+{
+  return FALSE;
+}
+
+void
+gum_stalker_set_lazy_fp_save (GumStalker * self,
+                              gboolean enabled)
+{
+}
+
 void
 gum_stalker_stop (GumStalker * self)
 {
@@ -120,6 +204,20 @@ gum_stalker_follow (GumStalker * self,
 {
 }
 
+void
+gum_stalker_follow_threads (GumStalker * self,
+                            const GumThreadId * thread_ids,
+                            guint n_thread_ids,
+                            GumEventSink * sink)
+{
+}
+
+void
+gum_stalker_follow_all (GumStalker * self,
+                        GumEventSink * sink)
+{
+}
+
 void
 gum_stalker_unfollow (GumStalker * self,
                       GumThreadId thread_id)
@@ -136,9 +234,57 @@ gum_stalker_add_call_probe (GumStalker * self,
   return 0;
 }
 
+GumProbeId
+gum_stalker_add_call_probe_full (GumStalker * self,
+                                 gpointer target_address,
+                                 GumCallProbeCallback callback,
+                                 gpointer data,
+                                 GDestroyNotify notify,
+                                 GumCallProbeFlags flags)
+{
+  return 0;
+}
+
 void
 gum_stalker_remove_call_probe (GumStalker * self,
                                GumProbeId id)
 {
 }
 
+void
+gum_stalker_enumerate_indirect_branches (GumStalker * self,
+                                         GumFoundIndirectBranchFunc func,
+                                         gpointer user_data)
+{
+}
+
+void
+gum_stalker_get_stats (GumStalker * self,
+                       GumStalkerStats * stats)
+{
+  memset (stats, 0, sizeof (GumStalkerStats));
+}
+
+gboolean
+gum_stalker_get_thread_stats (GumStalker * self,
+                              GumThreadId thread_id,
+                              GumStalkerStats * stats)
+{
+  return FALSE;
+}
+
+void
+gum_stalker_drain_call_counts (GumStalker * self,
+                               GumEventSink * sink,
+                               GumFoundCallCountFunc func,
+                               gpointer user_data)
+{
+}
+
+void
+gum_stalker_enumerate_block_stats (GumStalker * self,
+                                   GumFoundBlockStatsFunc func,
+                                   gpointer user_data)
+{
+}
+
@@ -209,6 +209,25 @@ gum_process_modify_thread (GumThreadId thread_id,
   return success;
 }
 
+guint
+gum_process_modify_threads (const GumThreadId * thread_ids,
+                            guint n_thread_ids,
+                            GumModifyThreadFunc func,
+                            gpointer user_data)
+{
+  guint n_modified = 0;
+  guint i;
+
+  /* Suspending a thread is synchronous here, so one at a time is cheap */
+  for (i = 0; i != n_thread_ids; i++)
+  {
+    if (gum_process_modify_thread (thread_ids[i], func, user_data))
+      n_modified++;
+  }
+
+  return n_modified;
+}
+
 void
 gum_process_enumerate_threads (GumFoundThreadFunc func,
                                gpointer user_data)
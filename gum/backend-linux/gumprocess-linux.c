@@ -22,6 +22,7 @@
 #include "gumlinux.h"
 
 #include <elf.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -55,6 +56,16 @@ typedef Elf64_Sym GumElfSymbol;
 
 typedef struct _GumFindModuleContext GumFindModuleContext;
 typedef struct _GumFindExportContext GumFindExportContext;
+typedef struct _GumModifyThreadSlot GumModifyThreadSlot;
+
+enum _GumModifyThreadState
+{
+  GUM_MODIFY_THREAD_PENDING,
+  GUM_MODIFY_THREAD_LOADED,
+  GUM_MODIFY_THREAD_MODIFIED,
+  GUM_MODIFY_THREAD_STORED,
+  GUM_MODIFY_THREAD_FAILED
+};
 
 struct _GumFindModuleContext
 {
@@ -69,7 +80,16 @@ struct _GumFindExportContext
   const gchar * symbol_name;
 };
 
+struct _GumModifyThreadSlot
+{
+  GumThreadId thread_id;
+  volatile gint state;
+  GumCpuContext cpu_context;
+};
+
 #ifndef HAVE_ANDROID
+static void gum_modify_current_thread (GumModifyThreadFunc func,
+    gpointer user_data);
 static void gum_do_modify_thread (int sig, siginfo_t * siginfo,
     void * context);
 static void gum_store_cpu_context (GumThreadId thread_id,
@@ -93,10 +113,8 @@ static GumPageProtection gum_page_protection_from_proc_perms_string (
 
 #ifndef HAVE_ANDROID
 G_LOCK_DEFINE_STATIC (gum_modify_thread);
-static volatile gboolean gum_modify_thread_did_load_cpu_context;
-static volatile gboolean gum_modify_thread_did_modify_cpu_context;
-static volatile gboolean gum_modify_thread_did_store_cpu_context;
-static GumCpuContext gum_modify_thread_cpu_context;
+static GumModifyThreadSlot * gum_modify_thread_slots = NULL;
+static guint gum_modify_thread_n_slots = 0;
 #endif
 
 GumThreadId
@@ -110,79 +128,190 @@ gum_process_modify_thread (GumThreadId thread_id,
                            GumModifyThreadFunc func,
                            gpointer user_data)
 {
-  gboolean success = FALSE;
+  return gum_process_modify_threads (&thread_id, 1, func, user_data) == 1;
+}
+
+guint
+gum_process_modify_threads (const GumThreadId * thread_ids,
+                            guint n_thread_ids,
+                            GumModifyThreadFunc func,
+                            gpointer user_data)
+{
+  guint n_modified = 0;
 #ifndef HAVE_ANDROID
-  struct sigaction action, old_action;
+  GumThreadId current_thread_id;
+  gboolean includes_current_thread = FALSE;
+  GumModifyThreadSlot * slots;
+  guint n_slots = 0, n_pending = 0, i;
 
-  if (thread_id == gum_process_get_current_thread_id ())
-  {
-    ucontext_t uc;
-    volatile gboolean modified = FALSE;
+  current_thread_id = gum_process_get_current_thread_id ();
 
-    getcontext (&uc);
-    if (!modified)
+  slots = g_new (GumModifyThreadSlot, MAX (n_thread_ids, 1));
+  for (i = 0; i != n_thread_ids; i++)
+  {
+    if (thread_ids[i] == current_thread_id)
     {
-      GumCpuContext cpu_context;
-
-      gum_cpu_context_from_linux (&uc, &cpu_context);
-      func (thread_id, &cpu_context, user_data);
-      gum_cpu_context_to_linux (&cpu_context, &uc);
-
-      modified = TRUE;
-      setcontext (&uc);
+      includes_current_thread = TRUE;
+      continue;
     }
 
-    success = TRUE;
+    slots[n_slots].thread_id = thread_ids[i];
+    slots[n_slots].state = GUM_MODIFY_THREAD_PENDING;
+    n_slots++;
   }
-  else
+
+  if (n_slots != 0)
   {
+    struct sigaction action, old_action;
+    pid_t pid;
+
     G_LOCK (gum_modify_thread);
 
-    gum_modify_thread_did_load_cpu_context = FALSE;
-    gum_modify_thread_did_modify_cpu_context = FALSE;
-    gum_modify_thread_did_store_cpu_context = FALSE;
+    gum_modify_thread_slots = slots;
+    gum_modify_thread_n_slots = n_slots;
 
     action.sa_sigaction = gum_do_modify_thread;
     sigemptyset (&action.sa_mask);
     action.sa_flags = SA_SIGINFO;
     sigaction (GUM_HIJACK_SIGNAL, &action, &old_action);
 
-    if (syscall (SYS_tgkill, getpid (), thread_id, GUM_HIJACK_SIGNAL) == 0)
+    /*
+     * Signal them all before waiting on any, so that they stop concurrently
+     * and each one is released as soon as it has been dealt with.
+     */
+    pid = getpid ();
+    for (i = 0; i != n_slots; i++)
     {
-      /* FIXME: timeout? */
-      while (!gum_modify_thread_did_load_cpu_context)
-        g_thread_yield ();
-      func (thread_id, &gum_modify_thread_cpu_context, user_data);
-      gum_modify_thread_did_modify_cpu_context = TRUE;
-      while (!gum_modify_thread_did_store_cpu_context)
-        g_thread_yield ();
+      if (syscall (SYS_tgkill, pid, slots[i].thread_id,
+          GUM_HIJACK_SIGNAL) == 0)
+        n_pending++;
+      else
+        slots[i].state = GUM_MODIFY_THREAD_FAILED;
+    }
+
+    while (n_pending != 0)
+    {
+      gboolean made_progress = FALSE;
 
-      success = TRUE;
+      for (i = 0; i != n_slots; i++)
+      {
+        GumModifyThreadSlot * slot = &slots[i];
+
+        if (g_atomic_int_get (&slot->state) == GUM_MODIFY_THREAD_LOADED)
+        {
+          func (slot->thread_id, &slot->cpu_context, user_data);
+          g_atomic_int_set (&slot->state, GUM_MODIFY_THREAD_MODIFIED);
+
+          n_pending--;
+          made_progress = TRUE;
+        }
+      }
+
+      if (made_progress)
+        continue;
+
+      /*
+       * A thread that exits after being signalled never runs the handler,
+       * so we give up on those that are gone instead of waiting forever.
+       */
+      for (i = 0; i != n_slots; i++)
+      {
+        GumModifyThreadSlot * slot = &slots[i];
+
+        if (g_atomic_int_get (&slot->state) == GUM_MODIFY_THREAD_PENDING &&
+            syscall (SYS_tgkill, pid, slot->thread_id, 0) != 0 &&
+            errno == ESRCH)
+        {
+          g_atomic_int_set (&slot->state, GUM_MODIFY_THREAD_FAILED);
+          n_pending--;
+        }
+      }
+
+      g_thread_yield ();
+    }
+
+    for (i = 0; i != n_slots; i++)
+    {
+      GumModifyThreadSlot * slot = &slots[i];
+
+      if (slot->state == GUM_MODIFY_THREAD_FAILED)
+        continue;
+
+      while (g_atomic_int_get (&slot->state) != GUM_MODIFY_THREAD_STORED)
+        g_thread_yield ();
+      n_modified++;
     }
 
     sigaction (GUM_HIJACK_SIGNAL, &old_action, NULL);
 
+    gum_modify_thread_slots = NULL;
+    gum_modify_thread_n_slots = 0;
+
     G_UNLOCK (gum_modify_thread);
   }
+
+  g_free (slots);
+
+  if (includes_current_thread)
+  {
+    gum_modify_current_thread (func, user_data);
+    n_modified++;
+  }
 #endif
 
-  return success;
+  return n_modified;
 }
 
 #ifndef HAVE_ANDROID
+static void
+gum_modify_current_thread (GumModifyThreadFunc func,
+                           gpointer user_data)
+{
+  ucontext_t uc;
+  volatile gboolean modified = FALSE;
+
+  getcontext (&uc);
+  if (!modified)
+  {
+    GumCpuContext cpu_context;
+
+    gum_cpu_context_from_linux (&uc, &cpu_context);
+    func (gum_process_get_current_thread_id (), &cpu_context, user_data);
+    gum_cpu_context_to_linux (&cpu_context, &uc);
+
+    modified = TRUE;
+    setcontext (&uc);
+  }
+}
+
 static void
 gum_do_modify_thread (int sig,
                       siginfo_t * siginfo,
                       void * context)
 {
   ucontext_t * uc = (ucontext_t *) context;
+  GumThreadId thread_id;
+  GumModifyThreadSlot * slot = NULL;
+  guint i;
+
+  thread_id = syscall (__NR_gettid);
+  for (i = 0; i != gum_modify_thread_n_slots; i++)
+  {
+    if (gum_modify_thread_slots[i].thread_id == thread_id)
+    {
+      slot = &gum_modify_thread_slots[i];
+      break;
+    }
+  }
+  if (slot == NULL)
+    return;
 
-  gum_cpu_context_from_linux (uc, &gum_modify_thread_cpu_context);
-  gum_modify_thread_did_load_cpu_context = TRUE;
-  while (!gum_modify_thread_did_modify_cpu_context)
+  gum_cpu_context_from_linux (uc, &slot->cpu_context);
+  g_atomic_int_set (&slot->state, GUM_MODIFY_THREAD_LOADED);
+  while (g_atomic_int_get (&slot->state) != GUM_MODIFY_THREAD_MODIFIED)
     ;
-  gum_cpu_context_to_linux (&gum_modify_thread_cpu_context, uc);
-  gum_modify_thread_did_store_cpu_context = TRUE;
+  gum_cpu_context_to_linux (&slot->cpu_context, uc);
+  g_atomic_int_set (&slot->state, GUM_MODIFY_THREAD_STORED);
 }
 #endif
 
@@ -198,6 +327,10 @@ gum_process_enumerate_threads (GumFoundThreadFunc func,
   dir = g_dir_open ("/proc/self/task", 0, NULL);
   g_assert (dir != NULL);
 
+  /*
+   * Each thread is only stopped once we know the caller wants to hear
+   * about it, so an early stop leaves the rest of them alone.
+   */
   while (carry_on && (name = g_dir_read_name (dir)) != NULL)
   {
     gchar * path, * info = NULL;
@@ -24,6 +24,11 @@
 #include <psapi.h>
 #include <tlhelp32.h>
 
+typedef LONG (WINAPI * GumNtContinueFunc) (CONTEXT * context,
+    BOOLEAN test_alert);
+
+static void gum_modify_current_thread (GumModifyThreadFunc func,
+    gpointer user_data);
 static gboolean gum_windows_get_thread_details (DWORD thread_id,
     GumThreadDetails * details);
 static void gum_cpu_context_from_windows (const CONTEXT * context,
@@ -48,6 +53,12 @@ gum_process_modify_thread (GumThreadId thread_id,
   __declspec (align (64)) CONTEXT context = { 0, };
   GumCpuContext cpu_context;
 
+  if (thread_id == GetCurrentThreadId ())
+  {
+    gum_modify_current_thread (func, user_data);
+    return TRUE;
+  }
+
   thread = OpenThread (THREAD_GET_CONTEXT | THREAD_SET_CONTEXT |
       THREAD_SUSPEND_RESUME, FALSE, thread_id);
   if (thread == NULL)
@@ -79,6 +90,119 @@ beach:
   return success;
 }
 
+guint
+gum_process_modify_threads (const GumThreadId * thread_ids,
+                            guint n_thread_ids,
+                            GumModifyThreadFunc func,
+                            gpointer user_data)
+{
+  guint n_modified = 0;
+  DWORD current_thread_id;
+  gboolean includes_current_thread = FALSE;
+  HANDLE * threads;
+  guint i;
+
+  current_thread_id = GetCurrentThreadId ();
+
+  threads = g_new0 (HANDLE, MAX (n_thread_ids, 1));
+
+  /* Stop them all up front so that they are dealt with in a single pass */
+  for (i = 0; i != n_thread_ids; i++)
+  {
+    HANDLE thread;
+
+    /* Suspending ourselves would never return */
+    if (thread_ids[i] == current_thread_id)
+    {
+      includes_current_thread = TRUE;
+      continue;
+    }
+
+    thread = OpenThread (THREAD_GET_CONTEXT | THREAD_SET_CONTEXT |
+        THREAD_SUSPEND_RESUME, FALSE, thread_ids[i]);
+    if (thread == NULL)
+      continue;
+
+    if (SuspendThread (thread) == (DWORD) -1)
+    {
+      CloseHandle (thread);
+      continue;
+    }
+
+    threads[i] = thread;
+  }
+
+  for (i = 0; i != n_thread_ids; i++)
+  {
+    HANDLE thread = threads[i];
+    __declspec (align (64)) CONTEXT context = { 0, };
+    GumCpuContext cpu_context;
+    gboolean success = FALSE;
+
+    if (thread == NULL)
+      continue;
+
+    context.ContextFlags = CONTEXT_CONTROL | CONTEXT_INTEGER;
+    if (GetThreadContext (thread, &context))
+    {
+      gum_cpu_context_from_windows (&context, &cpu_context);
+      func (thread_ids[i], &cpu_context, user_data);
+      gum_cpu_context_to_windows (&cpu_context, &context);
+
+      success = SetThreadContext (thread, &context);
+    }
+
+    /* Let it go right away rather than waiting for the others */
+    if (ResumeThread (thread) == (DWORD) -1)
+      success = FALSE;
+
+    if (success)
+      n_modified++;
+
+    CloseHandle (thread);
+  }
+
+  g_free (threads);
+
+  if (includes_current_thread)
+  {
+    gum_modify_current_thread (func, user_data);
+    n_modified++;
+  }
+
+  return n_modified;
+}
+
+static void
+gum_modify_current_thread (GumModifyThreadFunc func,
+                           gpointer user_data)
+{
+  static GumNtContinueFunc nt_continue = NULL;
+  __declspec (align (64)) CONTEXT context = { 0, };
+  volatile gboolean modified = FALSE;
+
+  if (nt_continue == NULL)
+  {
+    nt_continue = (GumNtContinueFunc) GetProcAddress (
+        GetModuleHandleW (L"ntdll.dll"), "NtContinue");
+    g_assert (nt_continue != NULL);
+  }
+
+  RtlCaptureContext (&context);
+  if (!modified)
+  {
+    GumCpuContext cpu_context;
+
+    gum_cpu_context_from_windows (&context, &cpu_context);
+    func (GetCurrentThreadId (), &cpu_context, user_data);
+    gum_cpu_context_to_windows (&cpu_context, &context);
+
+    /* Resumes right after RtlCaptureContext () with the modified state */
+    modified = TRUE;
+    nt_continue (&context, FALSE);
+  }
+}
+
 void
 gum_process_enumerate_threads (GumFoundThreadFunc func,
                                gpointer user_data)
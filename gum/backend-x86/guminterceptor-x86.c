@@ -316,7 +316,6 @@ _gum_function_context_activate_trampoline (FunctionContext * ctx)
 void
 _gum_function_context_deactivate_trampoline (FunctionContext * ctx)
 {
-  gum_mprotect (ctx->function_address, 16, GUM_PAGE_RWX);
   memcpy (ctx->function_address, ctx->overwritten_prologue,
       ctx->overwritten_prologue_len);
 }
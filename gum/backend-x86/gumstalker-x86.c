@@ -22,8 +22,10 @@
 
 #include "gumstalker.h"
 
+#include "guminterceptor.h"
 #include "gumx86writer.h"
 #include "gummemory.h"
+#include "gumprocess.h"
 #include "gumx86relocator.h"
 #include "gumspinlock.h"
 #include "gumtls.h"
@@ -38,34 +40,102 @@
 #include <windows.h>
 #include <psapi.h>
 #include <tchar.h>
+#else
+#include <signal.h>
+#include <sys/mman.h>
+# ifdef HAVE_DARWIN
+#  include <mach/mach.h>
+# else
+#  include <sys/syscall.h>
+#  include <unistd.h>
+# endif
 #endif
 
 #define GUM_STACK_SIZE_IN_PAGES              128
 #define GUM_CODE_ALIGNMENT                     8
 #define GUM_DATA_ALIGNMENT                     8
-#define GUM_CODE_SLAB_SIZE_IN_PAGES        20000
+#define GUM_CODE_SLAB_INITIAL_SIZE    (64 * 1024)
+#define GUM_CODE_SLAB_MAX_SIZE        (8 * 1024 * 1024)
+#define GUM_CODE_BUDGET_DEFAULT       (512 * 1024 * 1024)
 #define GUM_MAPPING_SLAB_SIZE_IN_PAGES       200
 #define GUM_EXEC_BLOCK_MIN_SIZE             1024
+#define GUM_EXEC_BLOCK_LINK_MAX_SIZE         256
+#define GUM_EXEC_BLOCK_MAX_LINK_SITES          4
+#define GUM_EXEC_INLINE_CACHE_SIZE             4
+#define GUM_EXEC_FRAME_SEARCH_DEPTH            4
+#define GUM_EXEC_RET_CACHE_SIZE              256
+#define GUM_EXEC_EVENT_BUFFER_SIZE          1024
+#define GUM_EXEC_EVENT_FLUSH_CYCLES    (1 << 24)
+#define GUM_EXEC_BLOCK_GATE_SIZE               5
+#define GUM_EXEC_TRACE_MAX_EXITS               4
+#define GUM_EXEC_TRACE_EXIT_MAX_SIZE         512
+#define GUM_TRACKED_PAGE_CAPACITY          16384
+#define GUM_LIVENESS_MAX_INSNS                64
+#define GUM_MAPPING_MAX_LOAD_PERCENT          75
 #define GUM_RED_ZONE_MAX_SIZE                128
 
+/* GPRs by their encoding index, followed by the arithmetic flags */
+#define GUM_LIVE_FLAGS                 (1 << 16)
+#define GUM_LIVE_ALL                     0x1ffff
+
+/* XSAVE state components that C code, ours or the app's, may clobber */
+#define GUM_XSTATE_X87                  (1 << 0)
+#define GUM_XSTATE_SSE                  (1 << 1)
+#define GUM_XSTATE_AVX                  (1 << 2)
+#define GUM_XSTATE_AVX512               (7 << 5)
+#define GUM_XSTATE_LEGACY_SIZE               512
+#define GUM_XSTATE_HEADER_SIZE                64
+#define GUM_CPUID1_ECX_OSXSAVE         (1 << 27)
+#define GUM_CPUIDD1_EAX_XSAVEOPT        (1 << 0)
+
+#if defined (HAVE_LINUX) && !defined (HAVE_ANDROID) && defined (__GNUC__)
+# define GUM_STALKER_HAVE_SHARED_CACHE 1
+#endif
+
 typedef struct _GumInfectContext GumInfectContext;
 typedef struct _GumDisinfectContext GumDisinfectContext;
 
 typedef struct _GumCallProbe GumCallProbe;
+typedef struct _GumCallProbeArray GumCallProbeArray;
+typedef struct _GumCallProbeSlot GumCallProbeSlot;
+typedef struct _GumCallProbeReader GumCallProbeReader;
 typedef struct _GumSlab GumSlab;
+typedef struct _GumCallCounter GumCallCounter;
 
 typedef struct _GumExecFrame GumExecFrame;
+typedef struct _GumExecHotState GumExecHotState;
 typedef struct _GumExecCtx GumExecCtx;
 typedef struct _GumExecBlock GumExecBlock;
+typedef struct _GumExecBlockLink GumExecBlockLink;
+typedef struct _GumExecBlockLinkSite GumExecBlockLinkSite;
+typedef struct _GumExecInlineCache GumExecInlineCache;
+typedef struct _GumExecInlineCacheEntry GumExecInlineCacheEntry;
 
 typedef guint GumPrologType;
-typedef guint GumCodeContext;
 typedef struct _GumGeneratorContext GumGeneratorContext;
 typedef struct _GumAddressMapping GumAddressMapping;
 typedef struct _GumInstruction GumInstruction;
 typedef struct _GumBranchTarget GumBranchTarget;
+typedef struct _GumTrackedPage GumTrackedPage;
+typedef struct _GumQueryProtectionCtx GumQueryProtectionCtx;
+typedef guint GumTrackedPageState;
 
 typedef guint GumVirtualizationRequirements;
+typedef guint GumFpSaveMethod;
+
+typedef void (GUM_THUNK * GumReadCyclesFunc) (guint64 * cycles);
+typedef void (GUM_THUNK * GumCpuQueryFunc) (guint32 * regs);
+typedef void (GUM_THUNK * GumFpStateFunc) (gpointer area);
+#ifdef G_OS_WIN32
+typedef BOOL (WINAPI * GumVirtualFreeFunc) (LPVOID address, SIZE_T size,
+    DWORD free_type);
+typedef BOOL (WINAPI * GumUnmapViewOfFileFunc) (LPCVOID address);
+typedef BOOL (WINAPI * GumVirtualProtectFunc) (LPVOID address, SIZE_T size,
+    DWORD new_protect, PDWORD old_protect);
+#else
+typedef int (* GumMunmapFunc) (void * address, size_t size);
+typedef int (* GumMprotectFunc) (void * address, size_t size, int prot);
+#endif
 
 struct _GumStalkerPrivate
 {
@@ -75,13 +145,41 @@ struct _GumStalkerPrivate
   GSList * contexts;
   GumTlsKey exec_ctx;
 
-  GArray * exclusions;
+  GArray * exclusions; /* sorted and coalesced */
   gint trust_threshold;
+  gint hot_trace_threshold;
+  gsize code_budget;
+  volatile gint code_pages;
   volatile gboolean any_probes_attached;
+  volatile gint fpu_probe_count; /* with GUM_CALL_PROBE_NEEDS_FPU */
   volatile gint last_probe_id;
-  GumSpinlock probe_lock;
+  GumSpinlock probe_lock; /* serializes writers only */
   GHashTable * probe_target_by_id;
-  GHashTable * probe_array_by_address;
+  GHashTable * probe_slot_by_address;
+  GHashTable * volatile probe_index; /* immutable snapshot of the above */
+  GumSpinlock call_counts_lock;
+  GHashTable * retired_call_counts; /* sink -> target -> guint64 */
+
+  gboolean shared_cache_enabled;
+  gboolean write_tracking_enabled;
+  GMutex * shared_mutex;
+  GumExecCtx * shared_ctx;
+  guint32 hot_state_tls_offset;
+
+  gpointer read_cycles_code;
+  GumReadCyclesFunc read_cycles;
+
+  GumFpSaveMethod fp_save_method;
+  guint32 fp_save_mask;
+  guint fp_save_size;
+  gboolean lazy_fp_save;
+  gpointer fp_state_code;
+  GumFpStateFunc save_fp_state;
+  GumFpStateFunc restore_fp_state;
+
+  GumStalkerTransformerCallback transformer;
+  gpointer transformer_data;
+  GDestroyNotify transformer_data_destroy;
 
 #ifdef G_OS_WIN32
   gpointer user32_start, user32_end;
@@ -108,6 +206,37 @@ struct _GumCallProbe
   GumCallProbeCallback callback;
   gpointer user_data;
   GDestroyNotify user_notify;
+  GumCallProbeFlags flags;
+};
+
+/*
+ * Probes are published RCU-style: readers load immutable snapshots with a
+ * single atomic read, and writers replace them wholesale and wait for all
+ * threads to leave their read-side sections before freeing the old ones.
+ */
+struct _GumCallProbeArray
+{
+  guint len;
+  GumCallProbe probes[1];
+};
+
+struct _GumCallProbeSlot
+{
+  gpointer target_address;
+  GumCallProbeArray * volatile probes;
+};
+
+struct _GumCallProbeReader
+{
+  GumExecCtx * ctx;
+  gint epoch;
+};
+
+struct _GumCallCounter
+{
+  gpointer target;
+  volatile gsize count; /* only ever written by the thread's own code */
+  gsize reported;
 };
 
 struct _GumSlab
@@ -115,7 +244,10 @@ struct _GumSlab
   guint8 * data;
   guint offset;
   guint size;
-  GumSlab * next; /* TODO: implement worker adding a new slab when needed */
+  guint n_pages;
+  gboolean retired;
+  gboolean pinned;
+  GumSlab * next;
 };
 
 struct _GumExecFrame
@@ -124,6 +256,26 @@ struct _GumExecFrame
   gpointer code_address;
 };
 
+/*
+ * Everything generated code reads or writes on behalf of a thread. Private
+ * contexts keep it inline and address it absolutely, while contexts taking
+ * part in the shared cache keep it in TLS so that code compiled once can be
+ * executed by any thread.
+ */
+struct _GumExecHotState
+{
+  GumExecCtx * ctx;
+  GumExecBlock * current_block;
+  GumExecFrame * current_frame;
+  GumExecFrame * first_frame;
+  GumExecFrame * ret_cache;
+
+  gpointer resume_at;
+  gpointer return_at;
+  gpointer app_stack;
+  gpointer fp_save_area;
+};
+
 enum _GumExecCtxState
 {
   GUM_EXEC_CTX_ACTIVE,
@@ -146,22 +298,75 @@ struct _GumExecCtx
   GumEventType sink_mask;
   gpointer sink_process_impl; /* cached */
   GumEvent tmp_event;
+  GumEvent * event_buffer; /* only if the sink takes batches */
+  GumEvent * event_cursor;
+  GumEvent * event_buffer_end;
+  guint8 * compact_buffer; /* only if the sink takes encoded chunks */
+  guint64 last_flush_cycles;
 
   gboolean unfollow_called_while_still_following;
-  GumExecBlock * current_block;
-  GumExecFrame * current_frame;
-  GumExecFrame * first_frame;
   GumExecFrame * frames;
 
-  gpointer resume_at;
-  gpointer return_at;
-  gpointer app_stack;
+  GumExecHotState * hot;
+  GumExecHotState private_hot;
+  gboolean is_shared;
+  gboolean hot_state_in_tls;
+
+  /*
+   * Where prologs stash FPU and vector state. It is per thread rather than
+   * on the stack as XSAVEOPT skips writing state that is unchanged since
+   * the last XRSTOR from the same address, which would bring back whatever
+   * the app had written there in the meantime.
+   */
+  gpointer fp_save_area;
+  gboolean lazy_fp_save;
 
   gpointer thunks;
   gpointer infect_thunk;
+  gpointer infect_real_address;
+  gpointer flush_events_thunk;
+  gpointer unfollow_thunk;
+
+  GumExecBlock * blocks;
+  GumSpinlock blocks_lock;
+
+  GumExecBlockLink * links;
+  GumExecInlineCache * inline_caches;
+
+  /* only with GUM_CALL_COUNT, grown by the thread and drained by others */
+  GHashTable * call_counters;
+  GumSpinlock call_counters_lock;
 
-  GumSlab code_slab;
+  GumExecFrame ret_cache[GUM_EXEC_RET_CACHE_SIZE];
+
+  /* only ever updated by the thread itself, so read without locking */
+  GumStalkerStats stats;
+  guint64 start_cycles;
+
+  volatile gint probe_epoch; /* odd while reading probes */
+  gint write_generation; /* last page write we invalidated blocks for */
+
+  /*
+   * Code slabs, newest first. Evicted slabs are kept around until the thread
+   * can no longer be running their code, and forever if a call out to an
+   * excluded range might still return into them.
+   */
+  GumSlab * code_slabs;
+  GumSlab * retired_slabs;
+  GumSlab * condemned_slabs;
+  GumSlab * pinned_slabs;
+  /*
+   * The address mapping table starts out in the pages following the context
+   * and is moved to a table twice the size whenever it fills up. Tables the
+   * shared context has outgrown are kept, as other threads read it without
+   * locking.
+   */
   GumSlab mapping_slab;
+  volatile guint mapping_mask;
+  guint mapping_count;
+  guint mapping_limit;
+  guint8 * initial_mappings;
+  GSList * outgrown_mappings;
 };
 
 struct _GumAddressMapping
@@ -178,13 +383,23 @@ struct _GumExecBlock
 
   guint8 * real_begin;
   guint8 * real_end;
-  guint8 * real_snapshot;
+  guint8 * real_snapshot; /* NULL if its pages are write-protected */
   guint8 * code_begin;
   guint8 * code_end;
+  guint8 * unfollow_code;
 
   guint8 state;
   gint recycle_count;
+  guint recompile_count;
   gboolean has_call_to_excluded_range;
+  gboolean is_stale;
+
+  /* decremented by the block itself, which becomes a trace once it hits 0 */
+  volatile gint trace_countdown;
+  gboolean is_trace;
+
+  GumExecBlockLink * incoming_links;
+  GumExecBlock * next;
 
 #ifdef G_OS_WIN32
   DWORD previous_dr0;
@@ -194,6 +409,59 @@ struct _GumExecBlock
 #endif
 };
 
+/*
+ * A branch in one block that has been patched to go straight to another,
+ * along with the code it replaced so that it can be undone.
+ */
+struct _GumExecBlockLink
+{
+  GumExecBlock * target;
+  GumExecBlockLink * next_incoming;
+
+  GumExecBlockLink * prev;
+  GumExecBlockLink * next;
+
+  guint8 * code_start;
+  guint code_size;
+  guint8 * original_code;
+};
+
+struct _GumExecBlockLinkSite
+{
+  gpointer code_start;
+  GumPrologType opened_prolog;
+  gpointer target_address;
+  gpointer ret_real_address;
+  gpointer ret_code_address;
+};
+
+struct _GumExecInlineCacheEntry
+{
+  gpointer real_address;
+  gpointer code_address;
+  GumExecBlock * block;
+};
+
+/*
+ * The most recent targets of an indirect call or jmp, checked by the code
+ * generated for it before resorting to the slow path. Lives in the code slab
+ * right next to that code.
+ */
+struct _GumExecInlineCache
+{
+  volatile guint hits; /* must be first, bumped by generated code */
+  volatile guint misses;
+
+  GumExecCtx * ctx;
+  GumExecBlock * block;
+  gpointer real_address;
+  gboolean can_run_natively;
+  GumExecInlineCache * next;
+
+  guint next_victim;
+  GumExecInlineCacheEntry entries[GUM_EXEC_INLINE_CACHE_SIZE];
+};
+
 enum _GumExecState
 {
   GUM_EXEC_NORMAL,
@@ -208,10 +476,11 @@ enum _GumPrologType
   GUM_PROLOG_FULL
 };
 
-enum _GumCodeContext
+enum _GumFpSaveMethod
 {
-  GUM_CODE_INTERRUPTIBLE,
-  GUM_CODE_UNINTERRUPTIBLE
+  GUM_FP_SAVE_FXSAVE,
+  GUM_FP_SAVE_XSAVE,
+  GUM_FP_SAVE_XSAVEOPT
 };
 
 struct _GumGeneratorContext
@@ -223,6 +492,30 @@ struct _GumGeneratorContext
   GumPrologType opened_prolog;
   guint state_preserve_stack_offset;
   guint accumulated_stack_delta;
+
+  GumExecBlockLinkSite link_sites[GUM_EXEC_BLOCK_MAX_LINK_SITES];
+  guint n_link_sites;
+
+  gpointer * block_end_slot;
+
+  /* what each of the block's leading instructions may read */
+  guint32 live_in[GUM_LIVENESS_MAX_INSNS];
+  guint n_analyzed_insns;
+  guint insn_index;
+
+  /* where event code keeps the event and its scratch value */
+  GumCpuReg event_reg;
+  GumCpuReg scratch_reg;
+
+  /* where the hot stub resumes, if the block counts its executions */
+  guint8 * hot_resume_code;
+  gboolean hot_check_saves_flags;
+
+  /* targets of the unlikely sides of the branches a trace ran through */
+  gboolean is_trace;
+  gpointer trace_head;
+  gpointer trace_exits[GUM_EXEC_TRACE_MAX_EXITS];
+  guint n_trace_exits;
 };
 
 struct _GumInstruction
@@ -232,6 +525,18 @@ struct _GumInstruction
   guint8 * end;
 };
 
+struct _GumStalkerIterator
+{
+  GumExecBlock * exec_block;
+  GumGeneratorContext * generator_context;
+
+  GumInstruction instruction;
+  GumStalkerInstruction public_instruction;
+  GumVirtualizationRequirements requirements;
+  gboolean is_kept;
+  gboolean is_done;
+};
+
 struct _GumBranchTarget
 {
   gpointer origin_ip;
@@ -255,6 +560,36 @@ enum _GumVirtualizationRequirements
   GUM_REQUIRE_SINGLE_STEP     = 1 << 2
 };
 
+/*
+ * Process-wide, as there is only one fault handler. Slots are claimed with
+ * a CAS and never released, so the handler can look pages up without locks.
+ */
+struct _GumTrackedPage
+{
+  gpointer volatile address;
+  volatile gint state;
+  guint native_protection; /* as found, to restore once written to */
+};
+
+struct _GumQueryProtectionCtx
+{
+  GumAddress address;
+  GumPageProtection prot;
+  gboolean found;
+};
+
+enum _GumTrackedPageState
+{
+  GUM_TRACKED_PAGE_PENDING,
+  GUM_TRACKED_PAGE_PROTECTED,
+  GUM_TRACKED_PAGE_WRITTEN,
+  GUM_TRACKED_PAGE_UNTRACKABLE
+};
+
+#define GUM_EXEC_HOT_OFFSET(f) G_STRUCT_OFFSET (GumExecHotState, f)
+#define GUM_EXEC_RET_CACHE_INDEX(a) \
+    (GPOINTER_TO_SIZE (a) & (GUM_EXEC_RET_CACHE_SIZE - 1))
+
 #define GUM_STALKER_LOCK(o) g_mutex_lock ((o)->priv->mutex)
 #define GUM_STALKER_UNLOCK(o) g_mutex_unlock ((o)->priv->mutex)
 
@@ -267,63 +602,246 @@ enum _GumVirtualizationRequirements
 #endif
 #define GUM_THUNK_ARGLIST_STACK_RESERVE 64 /* x64 ABI compatibility */
 
+#ifdef GUM_STALKER_HAVE_SHARED_CACHE
+static __thread GumExecHotState gum_exec_tls_hot_state
+    __attribute__ ((tls_model ("initial-exec")));
+#endif
+
+/*
+ * Registers event code may borrow, in order of preference. Any with an
+ * encoding index of 8 or above would need a REX prefix that some of the
+ * writer's memory operand forms don't emit.
+ */
+static const struct
+{
+  GumCpuReg reg;
+  guint index;
+} gum_event_frame_regs[] = {
+  { GUM_REG_XAX, 0 },
+  { GUM_REG_XCX, 1 },
+  { GUM_REG_XDX, 2 },
+  { GUM_REG_XBX, 3 },
+  { GUM_REG_XSI, 6 },
+  { GUM_REG_XDI, 7 }
+};
+
+G_LOCK_DEFINE_STATIC (gum_page_tracker);
+static GumTrackedPage * gum_tracked_pages = NULL;
+static gsize gum_tracked_page_size = 0;
+static volatile gint gum_page_write_generation = 0;
+#ifndef G_OS_WIN32
+static struct sigaction gum_page_tracker_old_sigsegv;
+static struct sigaction gum_page_tracker_old_sigbus;
+#endif
+
 static void gum_stalker_finalize (GObject * object);
 
 void _gum_stalker_do_follow_me (GumStalker * self, GumEventSink * sink,
     volatile gpointer * ret_addr_ptr);
+static gboolean gum_stalker_collect_thread_id (GumThreadDetails * details,
+    gpointer user_data);
 static void gum_stalker_infect (GumThreadId thread_id,
     GumCpuContext * cpu_context, gpointer user_data);
 static void gum_stalker_disinfect (GumThreadId thread_id,
     GumCpuContext * cpu_context, gpointer user_data);
 
-static void gum_stalker_free_probe_array (gpointer data);
+static void gum_stalker_query_fp_save_support (GumStalker * self);
+static void gum_stalker_write_cpu_query (GumX86Writer * cw,
+    const guint8 * insn, guint insn_size);
+static void gum_stalker_write_fp_save (GumStalker * self, guint32 mask,
+    GumX86Writer * cw);
+static void gum_stalker_write_fp_restore (GumStalker * self, guint32 mask,
+    GumX86Writer * cw);
+
+static void gum_stalker_publish_probe_index (GumStalker * self);
+static void gum_stalker_synchronize_probes (GumStalker * self);
+static void gum_stalker_forget_retired_call_counts (gpointer data,
+    GObject * where_the_sink_was);
+static GumCallProbeArray * gum_call_probe_array_append (
+    const GumCallProbeArray * array, const GumCallProbe * probe);
+static GumCallProbeArray * gum_call_probe_array_remove (
+    const GumCallProbeArray * array, GumProbeId id, GumCallProbe * removed);
+static void gum_call_probe_array_free (GumCallProbeArray * array,
+    gboolean notify);
+static void gum_call_probe_slot_free (gpointer data);
 
 static GumExecCtx * gum_stalker_create_exec_ctx (GumStalker * self,
     GumThreadId thread_id, GumEventSink * sink);
+static GumExecCtx * gum_exec_ctx_new (GumStalker * self, GumThreadId thread_id,
+    GumEventSink * sink);
 static GumExecCtx * gum_stalker_get_exec_ctx (GumStalker * self);
+static void gum_exec_ctx_query_stats (GumExecCtx * ctx,
+    GumStalkerStats * stats);
+static gboolean gum_stalker_is_excluding (GumStalker * self,
+    gconstpointer address);
 static void gum_stalker_invalidate_caches (GumStalker * self);
 
+static void gum_page_tracker_init (void);
+static gboolean gum_page_tracker_protect (guint8 * begin, guint8 * end);
+static gboolean gum_page_tracker_is_intact (guint8 * begin, guint8 * end);
+static GumTrackedPage * gum_page_tracker_lookup (gpointer address);
+static gboolean gum_page_tracker_query_protection (gpointer page,
+    guint * native_protection);
+static gboolean gum_page_tracker_set_writable (gpointer page,
+    gboolean writable, guint native_protection);
+static gboolean gum_page_tracker_handle_write (gpointer address);
+static void gum_page_tracker_forget (gpointer address, gsize size);
+#ifdef G_OS_WIN32
+static gboolean gum_page_tracker_on_exception (
+    EXCEPTION_RECORD * exception_record, CONTEXT * context,
+    gpointer user_data);
+static BOOL WINAPI gum_page_tracker_replacement_virtual_free (LPVOID address,
+    SIZE_T size, DWORD free_type);
+static BOOL WINAPI gum_page_tracker_replacement_unmap_view_of_file (
+    LPCVOID address);
+static BOOL WINAPI gum_page_tracker_replacement_virtual_protect (
+    LPVOID address, SIZE_T size, DWORD new_protect, PDWORD old_protect);
+static gsize gum_page_tracker_query_allocation_size (gpointer address);
+#else
+static gboolean gum_page_tracker_find_protection (const GumMemoryRange * range,
+    GumPageProtection prot, gpointer user_data);
+static void gum_page_tracker_on_fault (int sig, siginfo_t * siginfo,
+    void * context);
+static int gum_page_tracker_replacement_munmap (void * address, size_t size);
+static int gum_page_tracker_replacement_mprotect (void * address, size_t size,
+    int prot);
+#endif
+
 static void gum_exec_ctx_free (GumExecCtx * ctx);
+static void gum_exec_ctx_emit_event (GumExecCtx * ctx, const GumEvent * ev);
+static void gum_exec_ctx_flush_events (GumExecCtx * ctx);
+static void gum_exec_ctx_bind_to_current_thread (GumExecCtx * ctx);
+static void gum_exec_ctx_activate (GumExecCtx * ctx);
+static void gum_exec_ctx_invalidate_written_blocks (GumExecCtx * ctx);
+static void gum_exec_ctx_unbind_from_current_thread (GumExecCtx * ctx);
 static void gum_exec_ctx_unfollow (GumExecCtx * ctx, gpointer resume_at);
+static void gum_exec_ctx_request_unfollow (GumExecCtx * ctx);
+static void gum_exec_ctx_close_gates (GumExecCtx * ctx);
 static gboolean gum_exec_ctx_has_executed (GumExecCtx * ctx);
-static void gum_exec_ctx_add_code_slab_if_neeed (GumExecCtx * ctx);
+static gboolean gum_exec_ctx_add_code_slab (GumExecCtx * ctx,
+    gboolean force);
+static void gum_exec_ctx_evict_code (GumExecCtx * ctx);
+static void gum_exec_ctx_free_slabs (GumExecCtx * ctx, GumSlab * slabs);
 static gpointer GUM_THUNK gum_exec_ctx_replace_current_block_with (
     GumExecCtx * ctx, gpointer start_address);
+static gpointer gum_exec_ctx_replace_current_block_from_cache (
+    GumExecInlineCache * ic, gpointer start_address);
+static gpointer GUM_THUNK gum_exec_ctx_replace_current_block_for_call (
+    GumExecCtx * ctx, gpointer start_address);
+static gpointer GUM_THUNK gum_exec_ctx_replace_current_block_from_call (
+    GumExecCtx * ctx, gpointer start_address);
+static gpointer GUM_THUNK gum_exec_ctx_replace_current_block_from_jmp (
+    GumExecCtx * ctx, gpointer start_address);
+static gpointer GUM_THUNK gum_exec_ctx_replace_current_block_from_ret (
+    GumExecCtx * ctx, gpointer start_address);
 static void gum_exec_ctx_create_thunks (GumExecCtx * ctx);
 static void gum_exec_ctx_destroy_thunks (GumExecCtx * ctx);
 
 static GumExecBlock * gum_exec_ctx_obtain_block_for (GumExecCtx * ctx,
     gpointer real_address, gpointer * code_address);
+static GumExecBlock * gum_exec_ctx_obtain_shared_block_for (GumExecCtx * ctx,
+    gpointer real_address, gpointer * code_address);
+static GumExecBlock * gum_exec_ctx_compile_block (GumExecCtx * ctx,
+    gpointer real_address, gboolean as_trace, gpointer * code_address);
+static void gum_exec_ctx_promote_to_trace (GumExecCtx * ctx,
+    GumExecBlock * block, gpointer resume_at);
+static gint gum_exec_ctx_query_block_heat (GumExecCtx * ctx,
+    gpointer real_address, GumGeneratorContext * gc);
 static void gum_exec_ctx_clear_address_mappings (GumExecCtx * ctx);
 static void gum_exec_ctx_add_address_mapping (GumExecCtx * ctx,
     gpointer real_address, gpointer code_address, GumExecBlock * block);
 static void gum_exec_ctx_remove_address_mapping (GumExecCtx * ctx,
     gpointer real_address);
+static void gum_exec_ctx_grow_address_mappings (GumExecCtx * ctx);
+static GumAddressMapping * gum_exec_ctx_lookup_address_mapping (
+    GumExecCtx * ctx, gpointer real_address);
+static void gum_exec_ctx_write_mov_reg_hot_ptr (GumExecCtx * ctx,
+    GumCpuReg dst_reg, guint field_offset, GumX86Writer * cw);
+static void gum_exec_ctx_write_mov_hot_ptr_reg (GumExecCtx * ctx,
+    guint field_offset, GumCpuReg src_reg, GumX86Writer * cw);
+static void gum_exec_ctx_write_jmp_hot_ptr (GumExecCtx * ctx,
+    guint field_offset, GumX86Writer * cw);
+static void gum_exec_ctx_write_mov_reg_ctx (GumExecCtx * ctx,
+    GumCpuReg dst_reg, GumX86Writer * cw);
 static void gum_exec_ctx_write_prolog (GumExecCtx * ctx, GumPrologType type,
     gpointer ip, GumX86Writer * cw);
 static void gum_exec_ctx_write_epilog (GumExecCtx * ctx, GumPrologType type,
     GumX86Writer * cw);
+static guint32 gum_exec_ctx_query_fp_save_mask (GumExecCtx * ctx,
+    GumPrologType type);
+static void gum_exec_ctx_write_mov_fp_save_area (GumExecCtx * ctx,
+    GumCpuReg dst_reg, GumX86Writer * cw);
+static GumCallCounter * gum_exec_ctx_obtain_call_counter (GumExecCtx * ctx,
+    gpointer target);
+static void gum_exec_ctx_count_indirect_call (GumExecCtx * ctx,
+    gpointer target);
+static void gum_call_counter_free (GumCallCounter * counter);
+static void gum_exec_ctx_retire_call_counts (GumExecCtx * ctx);
 static void gum_exec_ctx_write_push_branch_target_address (GumExecCtx * ctx,
     const GumBranchTarget * target, GumGeneratorContext * gc);
 static void gum_exec_ctx_load_real_register_into (GumExecCtx * ctx,
     GumCpuReg target_register, GumCpuReg source_register,
     gpointer ip, GumGeneratorContext * gc);
 
-static int gum_address_mapping_compare (const void * a, const void * b);
+static guint gum_address_mapping_hash (gpointer real_address);
 
 static GumExecBlock * gum_exec_block_new (GumExecCtx * ctx);
 static GumExecBlock * gum_exec_block_obtain (GumExecCtx * ctx,
     gpointer real_address, gpointer * code_address);
-static gboolean gum_exec_block_is_full (GumExecBlock * block);
+static GumExecBlock * gum_exec_block_obtain_shared (GumExecCtx * ctx,
+    gpointer real_address, gpointer * code_address);
+static GumExecCtx * gum_exec_block_get_thread_ctx (GumExecBlock * block);
+static gboolean gum_exec_block_is_full (GumExecBlock * block,
+    GumGeneratorContext * gc);
 static void gum_exec_block_commit (GumExecBlock * block);
+static void gum_exec_block_write_gate (GumExecBlock * block,
+    GumGeneratorContext * gc);
+static void gum_exec_block_write_unfollow_stub (GumExecBlock * block,
+    gpointer real_address, GumGeneratorContext * gc);
+static void gum_exec_block_write_hot_check (GumExecBlock * block,
+    GumGeneratorContext * gc);
+static void gum_exec_block_write_hot_stub (GumExecBlock * block,
+    GumGeneratorContext * gc);
+static gboolean gum_exec_block_can_extend_trace (GumExecBlock * block,
+    gpointer taken_address, gpointer not_taken_address,
+    GumGeneratorContext * gc);
+static void gum_exec_block_write_trace_exits (GumExecBlock * block,
+    GumGeneratorContext * gc);
+static void gum_exec_block_close_gate (GumExecBlock * block);
 
+static gboolean gum_exec_block_can_link (GumExecBlock * block);
 static void gum_exec_block_backpatch_call (GumExecBlock * block,
     gpointer code_start, GumPrologType opened_prolog, gpointer target_address,
     gpointer ret_real_address, gpointer ret_code_address);
 static void gum_exec_block_backpatch_jmp (GumExecBlock * block,
     gpointer code_start, GumPrologType opened_prolog, gpointer target_address);
 static void gum_exec_block_backpatch_ret (GumExecBlock * block,
-    gpointer code_start, gpointer target_address);
+    gpointer code_start, GumExecBlock * target_block,
+    gpointer target_address);
+static void gum_exec_block_link_call (GumExecBlock * block,
+    GumExecBlock * target_block, gpointer code_start,
+    GumPrologType opened_prolog, gpointer target_address,
+    gpointer ret_real_address, gpointer ret_code_address);
+static void gum_exec_block_link_jmp (GumExecBlock * block,
+    GumExecBlock * target_block, gpointer code_start,
+    GumPrologType opened_prolog, gpointer target_address);
+static void gum_exec_block_link_pending_sites (GumExecBlock * block,
+    GumGeneratorContext * gc);
+static void gum_exec_block_add_pending_link_site (GumExecBlock * block,
+    GumGeneratorContext * gc, gpointer code_start,
+    GumPrologType opened_prolog, gpointer target_address,
+    gpointer ret_real_address, gpointer ret_code_address);
+static GumExecBlockLink * gum_exec_block_link_new (GumExecBlock * block,
+    GumExecBlock * target_block, gpointer code_start);
+static void gum_exec_block_link_commit (GumExecBlockLink * link,
+    GumX86Writer * cw);
+static void gum_exec_block_unlink_incoming (GumExecBlock * block);
+static void gum_exec_ctx_unlink_all_blocks (GumExecCtx * ctx,
+    gboolean restore_code);
+static void gum_exec_ctx_clear_inline_caches (GumExecCtx * ctx,
+    GumExecBlock * block);
+static void gum_exec_ctx_clear_ret_cache (GumExecCtx * ctx,
+    GumExecBlock * block);
 
 static GumVirtualizationRequirements gum_exec_block_virtualize_branch_insn (
     GumExecBlock * block, GumGeneratorContext * gc);
@@ -340,18 +858,34 @@ static void gum_exec_block_write_ret_transfer_code (GumExecBlock * block,
     GumGeneratorContext * gc);
 static void gum_exec_block_write_single_step_transfer_code (
     GumExecBlock * block, GumGeneratorContext * gc);
+static gboolean gum_exec_block_can_cache_target (GumExecBlock * block,
+    const GumBranchTarget * target);
+static void gum_exec_block_write_inline_cache_code (GumExecBlock * block,
+    const GumBranchTarget * target, gboolean can_run_natively,
+    GumGeneratorContext * gc);
 
 static void gum_exec_block_write_call_event_code (GumExecBlock * block,
-    const GumBranchTarget * target, GumGeneratorContext * gc,
-    GumCodeContext cc);
+    const GumBranchTarget * target, GumGeneratorContext * gc);
+static void gum_exec_block_write_call_count_code (GumExecBlock * block,
+    const GumBranchTarget * target, GumGeneratorContext * gc);
 static void gum_exec_block_write_ret_event_code (GumExecBlock * block,
-    GumGeneratorContext * gc, GumCodeContext cc);
+    GumGeneratorContext * gc);
 static void gum_exec_block_write_exec_event_code (GumExecBlock * block,
-    GumGeneratorContext * gc, GumCodeContext cc);
+    GumGeneratorContext * gc);
+static void gum_exec_block_write_block_exec_event_code (GumExecBlock * block,
+    gpointer real_address, GumGeneratorContext * gc);
+static gboolean gum_exec_block_open_event_frame (GumExecBlock * block,
+    GumGeneratorContext * gc);
+static void gum_exec_block_close_event_frame (GumExecBlock * block,
+    gboolean lightweight, GumGeneratorContext * gc);
+static gboolean gum_event_frame_reg_needs_saving (guint i, guint32 live,
+    GumGeneratorContext * gc);
 static void gum_exec_block_write_event_init_code (GumExecBlock * block,
     GumEventType type, GumGeneratorContext * gc);
 static void gum_exec_block_write_event_submit_code (GumExecBlock * block,
-    GumGeneratorContext * gc, GumCodeContext cc);
+    GumGeneratorContext * gc);
+static void gum_exec_block_write_event_append_code (GumExecBlock * block,
+    GumGeneratorContext * gc);
 
 static void gum_exec_block_write_call_probe_code (GumExecBlock * block,
     const GumBranchTarget * target, GumGeneratorContext * gc);
@@ -361,13 +895,18 @@ static void gum_exec_block_open_prolog (GumExecBlock * block,
 static void gum_exec_block_close_prolog (GumExecBlock * block,
     GumGeneratorContext * gc);
 
+static void gum_exec_block_analyze_liveness (gconstpointer real_address,
+    GumGeneratorContext * gc);
+static guint32 gum_generator_context_get_live_regs (GumGeneratorContext * gc);
+static void gum_x86_insn_describe_liveness (const ud_t * insn, guint32 * use,
+    guint32 * def);
+static gint gum_liveness_index_from_ud (enum ud_type reg, guint * width);
+
 static void gum_write_segment_prefix (uint8_t segment, GumX86Writer * cw);
 
 static GumCpuReg gum_cpu_meta_reg_from_real_reg (GumCpuReg reg);
 static GumCpuReg gum_cpu_reg_from_ud (enum ud_type reg);
 
-static void gum_tls_key_set (GumTlsKey key, gpointer data);
-
 #ifdef G_OS_WIN32
 static gboolean gum_stalker_handle_exception (
     EXCEPTION_RECORD * exception_record, CONTEXT * context,
@@ -397,12 +936,20 @@ gum_stalker_init (GumStalker * self)
 
   priv->exclusions = g_array_new (FALSE, FALSE, sizeof (GumMemoryRange));
   priv->trust_threshold = 1;
+  priv->hot_trace_threshold = -1;
+  priv->code_budget = GUM_CODE_BUDGET_DEFAULT;
+  priv->code_pages = 0;
 
   gum_spinlock_init (&priv->probe_lock);
   priv->probe_target_by_id =
       g_hash_table_new_full (NULL, NULL, NULL, NULL);
-  priv->probe_array_by_address =
-      g_hash_table_new_full (NULL, NULL, NULL, gum_stalker_free_probe_array);
+  priv->probe_slot_by_address =
+      g_hash_table_new_full (NULL, NULL, NULL, gum_call_probe_slot_free);
+  priv->probe_index = g_hash_table_new (NULL, NULL);
+
+  gum_spinlock_init (&priv->call_counts_lock);
+  priv->retired_call_counts = g_hash_table_new_full (NULL, NULL,
+      NULL, (GDestroyNotify) g_hash_table_unref);
 
 #if defined (G_OS_WIN32) && GLIB_SIZEOF_VOID_P == 4
   gum_win_exception_hook_add (gum_stalker_handle_exception, self);
@@ -456,6 +1003,75 @@ gum_stalker_init (GumStalker * self)
   priv->mutex = g_mutex_new ();
   priv->contexts = NULL;
   GUM_TLS_KEY_INIT (&priv->exec_ctx);
+
+  priv->shared_cache_enabled = FALSE;
+  priv->shared_mutex = g_mutex_new ();
+  priv->shared_ctx = NULL;
+
+  {
+    GumX86Writer cw;
+    GumCpuReg first_arg_reg;
+
+    priv->read_cycles_code = gum_alloc_n_pages (1, GUM_PAGE_RWX);
+    gum_x86_writer_init (&cw, priv->read_cycles_code);
+    gum_x86_writer_put_lfence (&cw);
+    gum_x86_writer_put_rdtsc (&cw);
+    first_arg_reg = gum_x86_writer_get_cpu_register_for_nth_argument (&cw, 0);
+    gum_x86_writer_put_mov_reg_ptr_reg (&cw, first_arg_reg, GUM_REG_EAX);
+    gum_x86_writer_put_mov_reg_offset_ptr_reg (&cw, first_arg_reg, 4,
+        GUM_REG_EDX);
+    gum_x86_writer_put_ret (&cw);
+    gum_x86_writer_free (&cw);
+
+    priv->read_cycles =
+        GUM_POINTER_TO_FUNCPTR (GumReadCyclesFunc, priv->read_cycles_code);
+  }
+
+  gum_stalker_query_fp_save_support (self);
+  priv->lazy_fp_save = FALSE;
+
+  {
+    GumX86Writer cw;
+    GumCpuReg first_arg_reg;
+
+    priv->fp_state_code = gum_alloc_n_pages (1, GUM_PAGE_RWX);
+    gum_x86_writer_init (&cw, priv->fp_state_code);
+    first_arg_reg = gum_x86_writer_get_cpu_register_for_nth_argument (&cw, 0);
+
+    priv->save_fp_state = GUM_POINTER_TO_FUNCPTR (GumFpStateFunc,
+        gum_x86_writer_cur (&cw));
+    if (first_arg_reg != GUM_REG_XCX)
+      gum_x86_writer_put_mov_reg_reg (&cw, GUM_REG_XCX, first_arg_reg);
+    gum_stalker_write_fp_save (self, priv->fp_save_mask, &cw);
+    gum_x86_writer_put_ret (&cw);
+
+    priv->restore_fp_state = GUM_POINTER_TO_FUNCPTR (GumFpStateFunc,
+        gum_x86_writer_cur (&cw));
+    if (first_arg_reg != GUM_REG_XCX)
+      gum_x86_writer_put_mov_reg_reg (&cw, GUM_REG_XCX, first_arg_reg);
+    gum_stalker_write_fp_restore (self, priv->fp_save_mask, &cw);
+    gum_x86_writer_put_ret (&cw);
+
+    gum_x86_writer_free (&cw);
+  }
+
+#ifdef GUM_STALKER_HAVE_SHARED_CACHE
+  {
+    guint8 * thread_pointer;
+
+    /*
+     * The TLS block is at a fixed distance from the thread pointer, which
+     * itself is the first word of the thread control block.
+     */
+# if GLIB_SIZEOF_VOID_P == 8
+    asm ("movq %%fs:0, %0" : "=r" (thread_pointer));
+# else
+    asm ("movl %%gs:0, %0" : "=r" (thread_pointer));
+# endif
+    priv->hot_state_tls_offset = (guint32)
+        ((guint8 *) &gum_exec_tls_hot_state - thread_pointer);
+  }
+#endif
 }
 
 static void
@@ -468,19 +1084,209 @@ gum_stalker_finalize (GObject * object)
   gum_win_exception_hook_remove (gum_stalker_handle_exception);
 #endif
 
-  g_hash_table_unref (priv->probe_array_by_address);
+  g_hash_table_unref (priv->probe_index);
+  g_hash_table_unref (priv->probe_slot_by_address);
   g_hash_table_unref (priv->probe_target_by_id);
 
   gum_spinlock_free (&priv->probe_lock);
 
+  {
+    GHashTableIter iter;
+    gpointer sink;
+
+    g_hash_table_iter_init (&iter, priv->retired_call_counts);
+    while (g_hash_table_iter_next (&iter, &sink, NULL))
+    {
+      g_object_weak_unref (G_OBJECT (sink),
+          gum_stalker_forget_retired_call_counts, self);
+    }
+    g_hash_table_unref (priv->retired_call_counts);
+  }
+  gum_spinlock_free (&priv->call_counts_lock);
+
   g_array_free (priv->exclusions, TRUE);
 
   g_assert (priv->contexts == NULL);
   g_mutex_free (priv->mutex);
 
+  if (priv->shared_ctx != NULL)
+    gum_exec_ctx_free (priv->shared_ctx);
+  g_mutex_free (priv->shared_mutex);
+
+  gum_free_pages (priv->fp_state_code);
+  gum_free_pages (priv->read_cycles_code);
+
+  if (priv->transformer_data_destroy != NULL)
+    priv->transformer_data_destroy (priv->transformer_data);
+
   G_OBJECT_CLASS (gum_stalker_parent_class)->finalize (object);
 }
 
+static void
+gum_stalker_query_fp_save_support (GumStalker * self)
+{
+  GumStalkerPrivate * priv = self->priv;
+  const guint8 cpuid[] = {
+    0x0f, 0xa2 /* cpuid */
+  };
+  const guint8 xgetbv[] = {
+    0x0f, 0x01, 0xd0 /* xgetbv */
+  };
+  gpointer code;
+  GumX86Writer cw;
+  GumCpuQueryFunc query_cpuid, query_xgetbv;
+  guint32 regs[4];
+  guint32 enabled;
+  guint component;
+
+  priv->fp_save_method = GUM_FP_SAVE_FXSAVE;
+  priv->fp_save_mask = GUM_XSTATE_X87 | GUM_XSTATE_SSE;
+  priv->fp_save_size = GUM_XSTATE_LEGACY_SIZE;
+
+  code = gum_alloc_n_pages (1, GUM_PAGE_RWX);
+  gum_x86_writer_init (&cw, code);
+  query_cpuid = GUM_POINTER_TO_FUNCPTR (GumCpuQueryFunc,
+      gum_x86_writer_cur (&cw));
+  gum_stalker_write_cpu_query (&cw, cpuid, sizeof (cpuid));
+  query_xgetbv = GUM_POINTER_TO_FUNCPTR (GumCpuQueryFunc,
+      gum_x86_writer_cur (&cw));
+  gum_stalker_write_cpu_query (&cw, xgetbv, sizeof (xgetbv));
+  gum_x86_writer_free (&cw);
+
+  regs[0] = 0;
+  regs[2] = 0;
+  query_cpuid (regs);
+  if (regs[0] < 0xd)
+    goto beach;
+
+  regs[0] = 1;
+  regs[2] = 0;
+  query_cpuid (regs);
+  if ((regs[2] & GUM_CPUID1_ECX_OSXSAVE) == 0)
+    goto beach;
+
+  regs[2] = 0;
+  query_xgetbv (regs);
+  enabled = regs[0] & (GUM_XSTATE_X87 | GUM_XSTATE_SSE | GUM_XSTATE_AVX |
+      GUM_XSTATE_AVX512);
+  if ((enabled & GUM_XSTATE_SSE) == 0)
+    goto beach;
+
+  /* The standard format puts each component at a fixed offset */
+  priv->fp_save_mask = enabled;
+  priv->fp_save_size = GUM_XSTATE_LEGACY_SIZE + GUM_XSTATE_HEADER_SIZE;
+  for (component = 2; component != 32; component++)
+  {
+    if ((enabled & (1 << component)) == 0)
+      continue;
+
+    regs[0] = 0xd;
+    regs[2] = component;
+    query_cpuid (regs);
+    priv->fp_save_size = MAX (priv->fp_save_size, regs[1] + regs[0]);
+  }
+
+  regs[0] = 0xd;
+  regs[2] = 1;
+  query_cpuid (regs);
+  priv->fp_save_method = ((regs[0] & GUM_CPUIDD1_EAX_XSAVEOPT) != 0)
+      ? GUM_FP_SAVE_XSAVEOPT
+      : GUM_FP_SAVE_XSAVE;
+
+beach:
+  gum_free_pages (code);
+}
+
+/*
+ * Emits a function that takes EAX and ECX from regs[0] and regs[2], runs
+ * the given instruction, and stores EAX, EBX, ECX and EDX back into regs.
+ */
+static void
+gum_stalker_write_cpu_query (GumX86Writer * cw,
+                             const guint8 * insn,
+                             guint insn_size)
+{
+  GumCpuReg regs_reg;
+
+  regs_reg = gum_x86_writer_get_cpu_register_for_nth_argument (cw, 0);
+
+  gum_x86_writer_put_push_reg (cw, GUM_REG_XBX);
+  gum_x86_writer_put_push_reg (cw, GUM_REG_XSI);
+  gum_x86_writer_put_mov_reg_reg (cw, GUM_REG_XSI, regs_reg);
+  gum_x86_writer_put_mov_reg_reg_offset_ptr (cw, GUM_REG_EAX, GUM_REG_XSI, 0);
+  gum_x86_writer_put_mov_reg_reg_offset_ptr (cw, GUM_REG_ECX, GUM_REG_XSI, 8);
+  gum_x86_writer_put_bytes (cw, insn, insn_size);
+  gum_x86_writer_put_mov_reg_offset_ptr_reg (cw, GUM_REG_XSI, 0, GUM_REG_EAX);
+  gum_x86_writer_put_mov_reg_offset_ptr_reg (cw, GUM_REG_XSI, 4, GUM_REG_EBX);
+  gum_x86_writer_put_mov_reg_offset_ptr_reg (cw, GUM_REG_XSI, 8, GUM_REG_ECX);
+  gum_x86_writer_put_mov_reg_offset_ptr_reg (cw, GUM_REG_XSI, 12,
+      GUM_REG_EDX);
+  gum_x86_writer_put_pop_reg (cw, GUM_REG_XSI);
+  gum_x86_writer_put_pop_reg (cw, GUM_REG_XBX);
+  gum_x86_writer_put_ret (cw);
+}
+
+/* Both expect the save area in XCX and clobber XAX and XDX */
+
+static void
+gum_stalker_write_fp_save (GumStalker * self,
+                          guint32 mask,
+                          GumX86Writer * cw)
+{
+  const guint8 fxsave[] = {
+    0x0f, 0xae, 0x01 /* fxsave [xcx] */
+  };
+  const guint8 xsave[] = {
+    0x0f, 0xae, 0x21 /* xsave [xcx] */
+  };
+  const guint8 xsaveopt[] = {
+    0x0f, 0xae, 0x31 /* xsaveopt [xcx] */
+  };
+
+  switch (self->priv->fp_save_method)
+  {
+    case GUM_FP_SAVE_FXSAVE:
+      gum_x86_writer_put_bytes (cw, fxsave, sizeof (fxsave));
+      break;
+    case GUM_FP_SAVE_XSAVE:
+      gum_x86_writer_put_mov_reg_u32 (cw, GUM_REG_EAX, mask);
+      gum_x86_writer_put_mov_reg_u32 (cw, GUM_REG_EDX, 0);
+      gum_x86_writer_put_bytes (cw, xsave, sizeof (xsave));
+      break;
+    case GUM_FP_SAVE_XSAVEOPT:
+      gum_x86_writer_put_mov_reg_u32 (cw, GUM_REG_EAX, mask);
+      gum_x86_writer_put_mov_reg_u32 (cw, GUM_REG_EDX, 0);
+      gum_x86_writer_put_bytes (cw, xsaveopt, sizeof (xsaveopt));
+      break;
+    default:
+      g_assert_not_reached ();
+  }
+}
+
+static void
+gum_stalker_write_fp_restore (GumStalker * self,
+                             guint32 mask,
+                             GumX86Writer * cw)
+{
+  const guint8 fxrstor[] = {
+    0x0f, 0xae, 0x09 /* fxrstor [xcx] */
+  };
+  const guint8 xrstor[] = {
+    0x0f, 0xae, 0x29 /* xrstor [xcx] */
+  };
+
+  if (self->priv->fp_save_method == GUM_FP_SAVE_FXSAVE)
+  {
+    gum_x86_writer_put_bytes (cw, fxrstor, sizeof (fxrstor));
+  }
+  else
+  {
+    gum_x86_writer_put_mov_reg_u32 (cw, GUM_REG_EAX, mask);
+    gum_x86_writer_put_mov_reg_u32 (cw, GUM_REG_EDX, 0);
+    gum_x86_writer_put_bytes (cw, xrstor, sizeof (xrstor));
+  }
+}
+
 GumStalker *
 gum_stalker_new (void)
 {
@@ -491,7 +1297,47 @@ void
 gum_stalker_exclude (GumStalker * self,
                      const GumMemoryRange * range)
 {
-  g_array_append_val (self->priv->exclusions, *range);
+  GArray * exclusions = self->priv->exclusions;
+  GumAddress start, end;
+  guint lo, hi;
+  GumMemoryRange merged;
+
+  if (range->size == 0)
+    return;
+
+  start = range->base_address;
+  end = range->base_address + range->size;
+
+  /* find the first range that we overlap or touch */
+  lo = 0;
+  hi = exclusions->len;
+  while (lo < hi)
+  {
+    guint mid = lo + ((hi - lo) / 2);
+    GumMemoryRange * r = &g_array_index (exclusions, GumMemoryRange, mid);
+
+    if (r->base_address + r->size < start)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  for (hi = lo; hi != exclusions->len; hi++)
+  {
+    GumMemoryRange * r = &g_array_index (exclusions, GumMemoryRange, hi);
+
+    if (r->base_address > end)
+      break;
+
+    start = MIN (start, r->base_address);
+    end = MAX (end, r->base_address + r->size);
+  }
+
+  merged.base_address = start;
+  merged.size = end - start;
+
+  g_array_remove_range (exclusions, lo, hi - lo);
+  g_array_insert_vals (exclusions, lo, &merged, 1);
 }
 
 gint
@@ -508,19 +1354,144 @@ gum_stalker_set_trust_threshold (GumStalker * self,
 }
 
 void
-gum_stalker_stop (GumStalker * self)
+gum_stalker_set_transformer (GumStalker * self,
+                             GumStalkerTransformerCallback callback,
+                             gpointer data,
+                             GDestroyNotify notify)
 {
   GumStalkerPrivate * priv = self->priv;
-  gboolean rescan_needed;
-  GSList * cur;
 
-  gum_spinlock_acquire (&priv->probe_lock);
-  g_hash_table_remove_all (priv->probe_target_by_id);
-  g_hash_table_remove_all (priv->probe_array_by_address);
-  priv->any_probes_attached = FALSE;
-  gum_spinlock_release (&priv->probe_lock);
+  if (priv->transformer_data_destroy != NULL)
+    priv->transformer_data_destroy (priv->transformer_data);
 
-  GUM_STALKER_LOCK (self);
+  priv->transformer = callback;
+  priv->transformer_data = data;
+  priv->transformer_data_destroy = notify;
+}
+
+gint
+gum_stalker_get_hot_trace_threshold (GumStalker * self)
+{
+  return self->priv->hot_trace_threshold;
+}
+
+void
+gum_stalker_set_hot_trace_threshold (GumStalker * self,
+                                     gint hot_trace_threshold)
+{
+  self->priv->hot_trace_threshold = hot_trace_threshold;
+}
+
+gsize
+gum_stalker_get_code_budget (GumStalker * self)
+{
+  return self->priv->code_budget;
+}
+
+void
+gum_stalker_set_code_budget (GumStalker * self,
+                             gsize code_budget)
+{
+  self->priv->code_budget = code_budget;
+}
+
+gboolean
+gum_stalker_get_shared_cache (GumStalker * self)
+{
+  return self->priv->shared_cache_enabled;
+}
+
+void
+gum_stalker_set_shared_cache (GumStalker * self,
+                              gboolean enabled)
+{
+#ifdef GUM_STALKER_HAVE_SHARED_CACHE
+  GumStalkerPrivate * priv = self->priv;
+
+  GUM_STALKER_LOCK (self);
+
+  if (enabled && priv->shared_ctx == NULL)
+  {
+    GumExecCtx * shared = gum_exec_ctx_new (self, 0, NULL);
+
+    shared->is_shared = TRUE;
+    shared->hot_state_in_tls = TRUE;
+
+    priv->shared_ctx = shared;
+  }
+
+  priv->shared_cache_enabled = enabled;
+
+  GUM_STALKER_UNLOCK (self);
+#else
+  (void) self;
+  (void) enabled;
+#endif
+}
+
+gboolean
+gum_stalker_get_write_tracking (GumStalker * self)
+{
+  return self->priv->write_tracking_enabled;
+}
+
+void
+gum_stalker_set_write_tracking (GumStalker * self,
+                                gboolean enabled)
+{
+  if (enabled)
+    gum_page_tracker_init ();
+
+  self->priv->write_tracking_enabled = enabled;
+}
+
+gboolean
+gum_stalker_get_lazy_fp_save (GumStalker * self)
+{
+  return self->priv->lazy_fp_save;
+}
+
+void
+gum_stalker_set_lazy_fp_save (GumStalker * self,
+                              gboolean enabled)
+{
+  self->priv->lazy_fp_save = enabled;
+}
+
+void
+gum_stalker_stop (GumStalker * self)
+{
+  GumStalkerPrivate * priv = self->priv;
+  gboolean rescan_needed;
+  GSList * retired = NULL;
+  GHashTableIter iter;
+  GumCallProbeSlot * slot;
+  GSList * cur;
+
+  gum_spinlock_acquire (&priv->probe_lock);
+  g_hash_table_remove_all (priv->probe_target_by_id);
+  g_hash_table_iter_init (&iter, priv->probe_slot_by_address);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &slot))
+  {
+    if (slot->probes != NULL)
+    {
+      retired = g_slist_prepend (retired, slot->probes);
+      g_atomic_pointer_set (&slot->probes, NULL);
+    }
+  }
+  priv->any_probes_attached = FALSE;
+  priv->fpu_probe_count = 0;
+  gum_spinlock_release (&priv->probe_lock);
+
+  if (retired != NULL)
+  {
+    gum_stalker_synchronize_probes (self);
+    for (cur = retired; cur != NULL; cur = cur->next)
+      gum_call_probe_array_free ((GumCallProbeArray *) cur->data, TRUE);
+    g_slist_free (retired);
+  }
+
+  GUM_STALKER_LOCK (self);
 
   do
   {
@@ -604,9 +1575,9 @@ _gum_stalker_do_follow_me (GumStalker * self,
 
   ctx = gum_stalker_create_exec_ctx (self,
       gum_process_get_current_thread_id (), sink);
-  GUM_TLS_KEY_SET_VALUE (self->priv->exec_ctx, ctx);
-  ctx->current_block = gum_exec_ctx_obtain_block_for (ctx, *ret_addr_ptr,
+  ctx->hot->current_block = gum_exec_ctx_obtain_block_for (ctx, *ret_addr_ptr,
       &code_address);
+  gum_exec_ctx_bind_to_current_thread (ctx);
   *ret_addr_ptr = code_address;
 
   gum_event_sink_start (sink);
@@ -620,18 +1591,20 @@ gum_stalker_unfollow_me (GumStalker * self)
   ctx = gum_stalker_get_exec_ctx (self);
   g_assert (ctx != NULL);
 
+  gum_exec_ctx_flush_events (ctx);
+  gum_exec_ctx_retire_call_counts (ctx);
   gum_event_sink_stop (ctx->sink);
 
-  if (ctx->current_block != NULL &&
-      ctx->current_block->has_call_to_excluded_range)
+  if (ctx->hot->current_block != NULL &&
+      ctx->hot->current_block->has_call_to_excluded_range)
   {
-    ctx->state = GUM_EXEC_CTX_UNFOLLOW_PENDING;
+    gum_exec_ctx_request_unfollow (ctx);
   }
   else
   {
     g_assert (ctx->unfollow_called_while_still_following);
 
-    GUM_TLS_KEY_SET_VALUE (self->priv->exec_ctx, NULL);
+    gum_exec_ctx_unbind_from_current_thread (ctx);
 
     GUM_STALKER_LOCK (self);
     self->priv->contexts = g_slist_remove (self->priv->contexts, ctx);
@@ -665,6 +1638,97 @@ gum_stalker_follow (GumStalker * self,
   }
 }
 
+void
+gum_stalker_follow_threads (GumStalker * self,
+                            const GumThreadId * thread_ids,
+                            guint n_thread_ids,
+                            GumEventSink * sink)
+{
+  GumThreadId current_thread_id;
+  gboolean includes_current_thread = FALSE;
+  GArray * others;
+  GumInfectContext ctx;
+  guint i;
+
+  current_thread_id = gum_process_get_current_thread_id ();
+
+  others = g_array_sized_new (FALSE, FALSE, sizeof (GumThreadId),
+      n_thread_ids);
+  for (i = 0; i != n_thread_ids; i++)
+  {
+    if (thread_ids[i] == current_thread_id)
+      includes_current_thread = TRUE;
+    else
+      g_array_append_val (others, thread_ids[i]);
+  }
+
+  /*
+   * All of them are stopped in one pass, and each compiles its own entry
+   * block once let go, so none of them waits for the others.
+   */
+  ctx.stalker = self;
+  ctx.sink = sink;
+  gum_process_modify_threads ((GumThreadId *) others->data, others->len,
+      gum_stalker_infect, &ctx);
+
+  g_array_free (others, TRUE);
+
+  if (includes_current_thread)
+    gum_stalker_follow_me (self, sink);
+}
+
+void
+gum_stalker_follow_all (GumStalker * self,
+                        GumEventSink * sink)
+{
+  GArray * thread_ids;
+  GSList * cur;
+  guint i;
+
+  thread_ids = g_array_new (FALSE, FALSE, sizeof (GumThreadId));
+  gum_process_enumerate_threads (gum_stalker_collect_thread_id, thread_ids);
+
+  /*
+   * Leave alone the ones we're already following, or that are still on
+   * their way out. Threads whose context only awaits garbage collection
+   * are back to running natively, so they get followed again.
+   */
+  GUM_STALKER_LOCK (self);
+  for (cur = self->priv->contexts; cur != NULL; cur = cur->next)
+  {
+    GumExecCtx * ctx = (GumExecCtx *) cur->data;
+
+    if (ctx->state == GUM_EXEC_CTX_DESTROY_PENDING)
+      continue;
+
+    for (i = 0; i != thread_ids->len; i++)
+    {
+      if (g_array_index (thread_ids, GumThreadId, i) == ctx->thread_id)
+      {
+        g_array_remove_index_fast (thread_ids, i);
+        break;
+      }
+    }
+  }
+  GUM_STALKER_UNLOCK (self);
+
+  gum_stalker_follow_threads (self, (GumThreadId *) thread_ids->data,
+      thread_ids->len, sink);
+
+  g_array_free (thread_ids, TRUE);
+}
+
+static gboolean
+gum_stalker_collect_thread_id (GumThreadDetails * details,
+                               gpointer user_data)
+{
+  GArray * thread_ids = (GArray *) user_data;
+
+  g_array_append_val (thread_ids, details->id);
+
+  return TRUE;
+}
+
 void
 gum_stalker_unfollow (GumStalker * self,
                       GumThreadId thread_id)
@@ -688,7 +1752,7 @@ gum_stalker_unfollow (GumStalker * self,
 
         if (gum_exec_ctx_has_executed (ctx))
         {
-          ctx->state = GUM_EXEC_CTX_UNFOLLOW_PENDING;
+          gum_exec_ctx_request_unfollow (ctx);
         }
         else
         {
@@ -698,7 +1762,7 @@ gum_stalker_unfollow (GumStalker * self,
           dc.success = FALSE;
           gum_process_modify_thread (thread_id, gum_stalker_disinfect, &dc);
           if (!dc.success)
-            ctx->state = GUM_EXEC_CTX_UNFOLLOW_PENDING;
+            gum_exec_ctx_request_unfollow (ctx);
         }
 
         break;
@@ -717,31 +1781,30 @@ gum_stalker_infect (GumThreadId thread_id,
   GumInfectContext * infect_context = (GumInfectContext *) user_data;
   GumStalker * self = infect_context->stalker;
   GumExecCtx * ctx;
-  gpointer code_address;
   GumX86Writer cw;
 #if GLIB_SIZEOF_VOID_P == 4
-  guint align_correction = 8;
+  guint align_correction = 12;
 #else
   guint align_correction = 0;
 #endif
 
   ctx = gum_stalker_create_exec_ctx (self, thread_id, infect_context->sink);
 
-  ctx->current_block = gum_exec_ctx_obtain_block_for (ctx,
-      GSIZE_TO_POINTER (GUM_CPU_CONTEXT_XIP (cpu_context)), &code_address);
+  /* The entry block is compiled by the thread itself once it resumes */
+  ctx->infect_real_address =
+      GSIZE_TO_POINTER (GUM_CPU_CONTEXT_XIP (cpu_context));
   GUM_CPU_CONTEXT_XIP (cpu_context) = GPOINTER_TO_SIZE (ctx->infect_thunk);
 
   gum_x86_writer_init (&cw, ctx->infect_thunk);
   gum_exec_ctx_write_prolog (ctx, GUM_PROLOG_MINIMAL,
-      ctx->current_block->real_begin, &cw);
+      ctx->infect_real_address, &cw);
   gum_x86_writer_put_sub_reg_imm (&cw, GUM_REG_XSP, align_correction);
   gum_x86_writer_put_call_with_arguments (&cw,
-      GUM_FUNCPTR_TO_POINTER (gum_tls_key_set), 2,
-      GUM_ARG_POINTER, self->priv->exec_ctx,
+      GUM_FUNCPTR_TO_POINTER (gum_exec_ctx_activate), 1,
       GUM_ARG_POINTER, ctx);
   gum_x86_writer_put_add_reg_imm (&cw, GUM_REG_XSP, align_correction);
   gum_exec_ctx_write_epilog (ctx, GUM_PROLOG_MINIMAL, &cw);
-  gum_x86_writer_put_jmp (&cw, code_address);
+  gum_exec_ctx_write_jmp_hot_ptr (ctx, GUM_EXEC_HOT_OFFSET (resume_at), &cw);
   gum_x86_writer_free (&cw);
 
   gum_event_sink_start (infect_context->sink);
@@ -764,7 +1827,7 @@ gum_stalker_disinfect (GumThreadId thread_id,
   if (infection_not_active_yet)
   {
     GUM_CPU_CONTEXT_XIP (cpu_context) =
-        GPOINTER_TO_SIZE (ctx->current_block->real_begin);
+        GPOINTER_TO_SIZE (ctx->infect_real_address);
 
     self->priv->contexts = g_slist_remove (self->priv->contexts, ctx);
     gum_exec_ctx_free (ctx);
@@ -779,35 +1842,69 @@ gum_stalker_add_call_probe (GumStalker * self,
                             GumCallProbeCallback callback,
                             gpointer data,
                             GDestroyNotify notify)
+{
+  return gum_stalker_add_call_probe_full (self, target_address, callback, data,
+      notify, GUM_CALL_PROBE_DEFAULT);
+}
+
+GumProbeId
+gum_stalker_add_call_probe_full (GumStalker * self,
+                                 gpointer target_address,
+                                 GumCallProbeCallback callback,
+                                 gpointer data,
+                                 GDestroyNotify notify,
+                                 GumCallProbeFlags flags)
 {
   GumStalkerPrivate * priv = self->priv;
   GumCallProbe probe;
-  GArray * probes;
+  GumCallProbeSlot * slot;
+  GumCallProbeArray * old_probes;
+  GHashTable * old_index = NULL;
 
   probe.id = g_atomic_int_exchange_and_add (&priv->last_probe_id, 1) + 1;
   probe.callback = callback;
   probe.user_data = data;
   probe.user_notify = notify;
+  probe.flags = flags;
 
   gum_spinlock_acquire (&priv->probe_lock);
 
   g_hash_table_insert (priv->probe_target_by_id, GSIZE_TO_POINTER (probe.id),
       target_address);
 
-  probes = (GArray *)
-      g_hash_table_lookup (priv->probe_array_by_address, target_address);
-  if (probes == NULL)
+  /* Slots live as long as we do, so generated code may refer to them */
+  slot = (GumCallProbeSlot *)
+      g_hash_table_lookup (priv->probe_slot_by_address, target_address);
+  if (slot == NULL)
   {
-    probes = g_array_sized_new (FALSE, FALSE, sizeof (GumCallProbe), 4);
-    g_hash_table_insert (priv->probe_array_by_address, target_address, probes);
+    slot = g_slice_new (GumCallProbeSlot);
+    slot->target_address = target_address;
+    slot->probes = NULL;
+    g_hash_table_insert (priv->probe_slot_by_address, target_address, slot);
+
+    old_index = priv->probe_index;
+    gum_stalker_publish_probe_index (self);
   }
 
-  g_array_append_val (probes, probe);
+  old_probes = slot->probes;
+  g_atomic_pointer_set (&slot->probes,
+      gum_call_probe_array_append (old_probes, &probe));
 
   priv->any_probes_attached = TRUE;
+  if ((flags & GUM_CALL_PROBE_NEEDS_FPU) != 0)
+    g_atomic_int_inc (&priv->fpu_probe_count);
 
   gum_spinlock_release (&priv->probe_lock);
 
+  if (old_probes != NULL || old_index != NULL)
+  {
+    gum_stalker_synchronize_probes (self);
+    if (old_probes != NULL)
+      gum_call_probe_array_free (old_probes, FALSE);
+    if (old_index != NULL)
+      g_hash_table_unref (old_index);
+  }
+
   gum_stalker_invalidate_caches (self);
 
   return probe.id;
@@ -819,6 +1916,8 @@ gum_stalker_remove_call_probe (GumStalker * self,
 {
   GumStalkerPrivate * priv = self->priv;
   gpointer target_address;
+  GumCallProbeArray * old_probes = NULL;
+  GumCallProbe removed = { 0, };
 
   gum_spinlock_acquire (&priv->probe_lock);
 
@@ -826,584 +1925,2586 @@ gum_stalker_remove_call_probe (GumStalker * self,
       g_hash_table_lookup (priv->probe_target_by_id, GSIZE_TO_POINTER (id));
   if (target_address != NULL)
   {
-    GArray * probes;
-    gint match_index = -1;
-    guint i;
-    GumCallProbe * probe;
+    GumCallProbeSlot * slot;
 
     g_hash_table_remove (priv->probe_target_by_id, GSIZE_TO_POINTER (id));
 
-    probes = (GArray *)
-        g_hash_table_lookup (priv->probe_array_by_address, target_address);
-    g_assert (probes != NULL);
-
-    for (i = 0; i != probes->len; i++)
-    {
-      if (g_array_index (probes, GumCallProbe, i).id == id)
-      {
-        match_index = i;
-        break;
-      }
-    }
-    g_assert_cmpint (match_index, !=, -1);
-
-    probe = &g_array_index (probes, GumCallProbe, match_index);
-    if (probe->user_notify != NULL)
-      probe->user_notify (probe->user_data);
-    g_array_remove_index (probes, match_index);
+    slot = (GumCallProbeSlot *)
+        g_hash_table_lookup (priv->probe_slot_by_address, target_address);
+    g_assert (slot != NULL && slot->probes != NULL);
 
-    if (probes->len == 0)
-      g_hash_table_remove (priv->probe_array_by_address, target_address);
+    old_probes = slot->probes;
+    g_atomic_pointer_set (&slot->probes,
+        gum_call_probe_array_remove (old_probes, id, &removed));
 
     priv->any_probes_attached =
-        g_hash_table_size (priv->probe_array_by_address) != 0;
+        g_hash_table_size (priv->probe_target_by_id) != 0;
+    if ((removed.flags & GUM_CALL_PROBE_NEEDS_FPU) != 0)
+      g_atomic_int_add (&priv->fpu_probe_count, -1);
   }
 
   gum_spinlock_release (&priv->probe_lock);
 
+  if (old_probes == NULL)
+    return;
+
+  gum_stalker_synchronize_probes (self);
+  gum_call_probe_array_free (old_probes, FALSE);
+  if (removed.user_notify != NULL)
+    removed.user_notify (removed.user_data);
+
   gum_stalker_invalidate_caches (self);
 }
 
-static void
-gum_stalker_free_probe_array (gpointer data)
+void
+gum_stalker_enumerate_indirect_branches (GumStalker * self,
+                                         GumFoundIndirectBranchFunc func,
+                                         gpointer user_data)
 {
-  GArray * probes = (GArray *) data;
+  GArray * all_stats;
+  GSList * cur;
   guint i;
 
-  for (i = 0; i != probes->len; i++)
-  {
-    GumCallProbe * probe = &g_array_index (probes, GumCallProbe, i);
-    if (probe->user_notify != NULL)
-      probe->user_notify (probe->user_data);
-  }
+  all_stats = g_array_new (FALSE, FALSE, sizeof (GumIndirectBranchStats));
 
-  g_array_free (probes, TRUE);
-}
+  /* Snapshot first so that func is free to call back into us */
+  GUM_STALKER_LOCK (self);
 
-static GumExecCtx *
-gum_stalker_create_exec_ctx (GumStalker * self,
-                             GumThreadId thread_id,
-                             GumEventSink * sink)
-{
-  GumStalkerPrivate * priv = self->priv;
-  guint base_size;
-  GumExecCtx * ctx;
+  for (cur = self->priv->contexts; cur != NULL; cur = cur->next)
+  {
+    GumExecCtx * ctx = (GumExecCtx *) cur->data;
+    GumExecInlineCache * ic;
 
-  base_size = sizeof (GumExecCtx) / priv->page_size;
-  if (sizeof (GumExecCtx) % priv->page_size != 0)
-    base_size++;
+    for (ic = ctx->inline_caches; ic != NULL; ic = ic->next)
+    {
+      GumIndirectBranchStats stats;
 
-  ctx = (GumExecCtx *)
-      gum_alloc_n_pages (base_size + GUM_CODE_SLAB_SIZE_IN_PAGES +
-          GUM_MAPPING_SLAB_SIZE_IN_PAGES + 1, GUM_PAGE_RWX);
-  ctx->state = GUM_EXEC_CTX_ACTIVE;
-  ctx->invalidate_pending = FALSE;
+      stats.thread_id = ctx->thread_id;
+      stats.address = ic->real_address;
+      stats.hits = ic->hits;
+      stats.misses = ic->misses;
 
-  ctx->code_slab.data = ((guint8 *) ctx) + (base_size * priv->page_size);
-  ctx->code_slab.offset = 0;
-  ctx->code_slab.size = GUM_CODE_SLAB_SIZE_IN_PAGES * priv->page_size;
-  ctx->code_slab.next = NULL;
+      g_array_append_val (all_stats, stats);
+    }
+  }
 
-  ctx->mapping_slab.data = ctx->code_slab.data + ctx->code_slab.size;
-  ctx->mapping_slab.offset = 0;
-  ctx->mapping_slab.size = GUM_MAPPING_SLAB_SIZE_IN_PAGES * priv->page_size;
-  ctx->mapping_slab.next = NULL;
+  GUM_STALKER_UNLOCK (self);
 
-  ctx->frames = (GumExecFrame *)
-      ctx->mapping_slab.data + ctx->mapping_slab.size;
-  ctx->first_frame = (GumExecFrame *) (ctx->mapping_slab.data +
-      ctx->mapping_slab.size + priv->page_size - sizeof (GumExecFrame));
-  ctx->current_frame = ctx->first_frame;
+  for (i = 0; i != all_stats->len; i++)
+  {
+    if (!func (&g_array_index (all_stats, GumIndirectBranchStats, i),
+        user_data))
+    {
+      break;
+    }
+  }
 
-  ctx->resume_at = NULL;
-  ctx->return_at = NULL;
-  ctx->app_stack = NULL;
+  g_array_free (all_stats, TRUE);
+}
 
-  ctx->stalker = g_object_ref (self);
-  ctx->thread_id = thread_id;
+void
+gum_stalker_get_stats (GumStalker * self,
+                       GumStalkerStats * stats)
+{
+  GumStalkerPrivate * priv = self->priv;
+  GumStalkerStats ctx_stats;
+  GSList * cur;
 
-  gum_x86_writer_init (&ctx->code_writer, NULL);
-  gum_x86_relocator_init (&ctx->relocator, NULL, &ctx->code_writer);
+  memset (stats, 0, sizeof (GumStalkerStats));
 
-  ctx->sink = (GumEventSink *) g_object_ref (sink);
-  ctx->sink_mask = gum_event_sink_query_mask (sink);
-  ctx->sink_process_impl = GUM_FUNCPTR_TO_POINTER (
-      GUM_EVENT_SINK_GET_INTERFACE (sink)->process);
+  GUM_STALKER_LOCK (self);
 
-  gum_exec_ctx_create_thunks (ctx);
+  for (cur = priv->contexts; cur != NULL; cur = cur->next)
+  {
+    gum_exec_ctx_query_stats ((GumExecCtx *) cur->data, &ctx_stats);
+
+    stats->blocks_compiled += ctx_stats.blocks_compiled;
+    stats->blocks_recompiled += ctx_stats.blocks_recompiled;
+    stats->traces_compiled += ctx_stats.traces_compiled;
+    stats->bytes_emitted += ctx_stats.bytes_emitted;
+    stats->backpatches += ctx_stats.backpatches;
+    stats->invalidations += ctx_stats.invalidations;
+    stats->evictions += ctx_stats.evictions;
+
+    stats->slow_paths += ctx_stats.slow_paths;
+    stats->call_slow_paths += ctx_stats.call_slow_paths;
+    stats->jmp_slow_paths += ctx_stats.jmp_slow_paths;
+    stats->ret_slow_paths += ctx_stats.ret_slow_paths;
+    stats->inline_cache_misses += ctx_stats.inline_cache_misses;
+
+    stats->total_cycles += ctx_stats.total_cycles;
+    stats->obtain_cycles += ctx_stats.obtain_cycles;
+
+    stats->code_slab_size += ctx_stats.code_slab_size;
+    stats->code_slab_used += ctx_stats.code_slab_used;
+    stats->mapping_count += ctx_stats.mapping_count;
+    stats->mapping_capacity += ctx_stats.mapping_capacity;
+  }
 
-  GUM_STALKER_LOCK (self);
-  self->priv->contexts = g_slist_prepend (self->priv->contexts, ctx);
   GUM_STALKER_UNLOCK (self);
 
-  return ctx;
-}
-
-static GumExecCtx *
-gum_stalker_get_exec_ctx (GumStalker * self)
-{
-  return (GumExecCtx *) GUM_TLS_KEY_GET_VALUE (self->priv->exec_ctx);
+  g_mutex_lock (priv->shared_mutex);
+  if (priv->shared_ctx != NULL)
+  {
+    gum_exec_ctx_query_stats (priv->shared_ctx, &ctx_stats);
+
+    stats->blocks_compiled += ctx_stats.blocks_compiled;
+    stats->bytes_emitted += ctx_stats.bytes_emitted;
+    stats->code_slab_size += ctx_stats.code_slab_size;
+    stats->code_slab_used += ctx_stats.code_slab_used;
+    stats->mapping_count += ctx_stats.mapping_count;
+    stats->mapping_capacity += ctx_stats.mapping_capacity;
+  }
+  g_mutex_unlock (priv->shared_mutex);
 }
 
-static void
-gum_stalker_invalidate_caches (GumStalker * self)
+gboolean
+gum_stalker_get_thread_stats (GumStalker * self,
+                              GumThreadId thread_id,
+                              GumStalkerStats * stats)
 {
+  gboolean found = FALSE;
   GSList * cur;
 
   GUM_STALKER_LOCK (self);
 
-  for (cur = self->priv->contexts; cur != NULL; cur = cur->next)
+  for (cur = self->priv->contexts; cur != NULL && !found; cur = cur->next)
   {
     GumExecCtx * ctx = (GumExecCtx *) cur->data;
 
-    gum_exec_ctx_add_code_slab_if_neeed (ctx);
-
-    ctx->invalidate_pending = TRUE;
+    if (ctx->thread_id == thread_id)
+    {
+      gum_exec_ctx_query_stats (ctx, stats);
+      found = TRUE;
+    }
   }
 
   GUM_STALKER_UNLOCK (self);
+
+  return found;
 }
 
-static void
-gum_exec_ctx_free (GumExecCtx * ctx)
+void
+gum_stalker_drain_call_counts (GumStalker * self,
+                               GumEventSink * sink,
+                               GumFoundCallCountFunc func,
+                               gpointer user_data)
 {
-  GumSlab * slab;
+  GHashTable * totals, * retired;
+  GSList * cur;
+  GHashTableIter iter;
+  gpointer target;
+  guint64 * total;
+
+  totals = g_hash_table_new_full (NULL, NULL, NULL, g_free);
+
+  /* Snapshot first so that func is free to call back into us */
+  GUM_STALKER_LOCK (self);
 
-  slab = ctx->code_slab.next;
-  while (slab != NULL)
+  for (cur = self->priv->contexts; cur != NULL; cur = cur->next)
   {
-    GumSlab * next = slab->next;
-    gum_free_pages (slab);
-    slab = next;
-  }
+    GumExecCtx * ctx = (GumExecCtx *) cur->data;
+    GumCallCounter * counter;
 
-  gum_exec_ctx_destroy_thunks (ctx);
+    if (ctx->sink != sink || ctx->call_counters == NULL)
+      continue;
 
-  g_object_unref (ctx->sink);
+    gum_spinlock_acquire (&ctx->call_counters_lock);
 
-  gum_x86_relocator_free (&ctx->relocator);
-  gum_x86_writer_free (&ctx->code_writer);
+    g_hash_table_iter_init (&iter, ctx->call_counters);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &counter))
+    {
+      gsize count = counter->count;
 
-  g_object_unref (ctx->stalker);
+      if (count == counter->reported)
+        continue;
 
-  gum_free_pages (ctx);
-}
+      total = (guint64 *) g_hash_table_lookup (totals, counter->target);
+      if (total == NULL)
+      {
+        total = g_new0 (guint64, 1);
+        g_hash_table_insert (totals, counter->target, total);
+      }
+      *total += count - counter->reported;
 
-static void
-gum_exec_ctx_unfollow (GumExecCtx * ctx,
-                       gpointer resume_at)
-{
-  ctx->resume_at = resume_at;
+      counter->reported = count;
+    }
 
-  GUM_TLS_KEY_SET_VALUE (ctx->stalker->priv->exec_ctx, NULL);
-  ctx->current_block = NULL;
-  ctx->state = GUM_EXEC_CTX_DESTROY_PENDING;
-}
+    gum_spinlock_release (&ctx->call_counters_lock);
+  }
 
-static gboolean
-gum_exec_ctx_has_executed (GumExecCtx * ctx)
-{
-  return ctx->resume_at != NULL;
-}
+  GUM_STALKER_UNLOCK (self);
 
-static void
-gum_exec_ctx_add_code_slab_if_neeed (GumExecCtx * ctx)
-{
-  GumSlab * slab;
+  /* Counted by threads that are no longer followed */
+  gum_spinlock_acquire (&self->priv->call_counts_lock);
+  retired = (GHashTable *)
+      g_hash_table_lookup (self->priv->retired_call_counts, sink);
+  if (retired != NULL)
+  {
+    g_hash_table_steal (self->priv->retired_call_counts, sink);
+    g_object_weak_unref (G_OBJECT (sink),
+        gum_stalker_forget_retired_call_counts, self);
+  }
+  gum_spinlock_release (&self->priv->call_counts_lock);
 
-  slab = &ctx->code_slab;
-  while (slab->next != NULL)
-    slab = slab->next;
-  if (slab->size - slab->offset > slab->size / 2)
+  if (retired != NULL)
   {
-    GumSlab * s;
+    guint64 * retired_count;
 
-    s = gum_alloc_n_pages (GUM_CODE_SLAB_SIZE_IN_PAGES, GUM_PAGE_RWX);
-    s->data = (guint8 *) (s + 1);
-    s->offset = 0;
-    s->size = (GUM_CODE_SLAB_SIZE_IN_PAGES * ctx->stalker->priv->page_size)
-        - sizeof (GumSlab);
-    s->next = NULL;
+    g_hash_table_iter_init (&iter, retired);
+    while (g_hash_table_iter_next (&iter, &target,
+        (gpointer *) &retired_count))
+    {
+      total = (guint64 *) g_hash_table_lookup (totals, target);
+      if (total == NULL)
+      {
+        total = g_new0 (guint64, 1);
+        g_hash_table_insert (totals, target, total);
+      }
+      *total += *retired_count;
+    }
 
-    slab->next = s;
+    g_hash_table_unref (retired);
   }
-}
 
-static gpointer GUM_THUNK
-gum_exec_ctx_replace_current_block_with (GumExecCtx * ctx,
-                                         gpointer start_address)
-{
-  if (ctx->invalidate_pending)
+  g_hash_table_iter_init (&iter, totals);
+  while (g_hash_table_iter_next (&iter, &target, (gpointer *) &total))
   {
-    gum_exec_ctx_clear_address_mappings (ctx);
+    GumCallCount count;
 
-    ctx->invalidate_pending = FALSE;
-  }
+    count.target = target;
+    count.count = *total;
 
-  if (start_address == gum_stalker_unfollow_me)
-  {
-    ctx->unfollow_called_while_still_following = TRUE;
-    ctx->current_block = NULL;
-    ctx->resume_at = start_address;
-  }
-  else if (ctx->state == GUM_EXEC_CTX_UNFOLLOW_PENDING)
-  {
-    gum_exec_ctx_unfollow (ctx, start_address);
-  }
-  else
-  {
-    ctx->current_block = gum_exec_ctx_obtain_block_for (ctx, start_address,
-        &ctx->resume_at);
+    func (&count, user_data);
   }
 
-  return ctx->resume_at;
+  g_hash_table_unref (totals);
 }
 
-static void
-gum_exec_ctx_create_thunks (GumExecCtx * ctx)
+void
+gum_stalker_enumerate_block_stats (GumStalker * self,
+                                   GumFoundBlockStatsFunc func,
+                                   gpointer user_data)
 {
-  GumX86Writer cw;
+  GArray * all_stats;
+  GSList * cur;
+  guint i;
 
-  g_assert (ctx->thunks == NULL);
+  all_stats = g_array_new (FALSE, FALSE, sizeof (GumBlockStats));
 
-  ctx->thunks = gum_alloc_n_pages (1, GUM_PAGE_RWX);
-  gum_x86_writer_init (&cw, ctx->thunks);
+  /* Snapshot first so that func is free to call back into us */
+  GUM_STALKER_LOCK (self);
 
-  ctx->infect_thunk = gum_x86_writer_cur (&cw);
+  for (cur = self->priv->contexts; cur != NULL; cur = cur->next)
+  {
+    GumExecCtx * ctx = (GumExecCtx *) cur->data;
+    GumExecBlock * block;
 
-  gum_x86_writer_free (&cw);
+    gum_spinlock_acquire (&ctx->blocks_lock);
+
+    for (block = ctx->blocks; block != NULL; block = block->next)
+    {
+      GumBlockStats stats;
+
+      stats.thread_id = ctx->thread_id;
+      stats.address = block->real_begin;
+      stats.size = block->real_end - block->real_begin;
+      stats.code_size = block->code_end - block->code_begin;
+      stats.lookups = MAX (block->recycle_count, 0);
+      stats.recompilations = block->recompile_count;
+
+      g_array_append_val (all_stats, stats);
+    }
+
+    gum_spinlock_release (&ctx->blocks_lock);
+  }
+
+  GUM_STALKER_UNLOCK (self);
+
+  for (i = 0; i != all_stats->len; i++)
+  {
+    if (!func (&g_array_index (all_stats, GumBlockStats, i), user_data))
+      break;
+  }
+
+  g_array_free (all_stats, TRUE);
 }
 
 static void
-gum_exec_ctx_destroy_thunks (GumExecCtx * ctx)
+gum_stalker_publish_probe_index (GumStalker * self)
 {
-  gum_free_pages (ctx->thunks);
-}
+  GumStalkerPrivate * priv = self->priv;
+  GHashTable * index;
+  GHashTableIter iter;
+  gpointer address, slot;
 
-#if ENABLE_DEBUG
+  index = g_hash_table_new (NULL, NULL);
+  g_hash_table_iter_init (&iter, priv->probe_slot_by_address);
+  while (g_hash_table_iter_next (&iter, &address, &slot))
+    g_hash_table_insert (index, address, slot);
+
+  g_atomic_pointer_set (&priv->probe_index, index);
+}
 
 static void
-gum_disasm (guint8 * code, guint size, const gchar * prefix)
+gum_stalker_synchronize_probes (GumStalker * self)
 {
-  ud_t ud_obj;
+  GumStalkerPrivate * priv = self->priv;
+  GArray * readers;
+  GSList * cur;
+  guint i;
 
-  ud_init (&ud_obj);
-  ud_set_input_buffer (&ud_obj, code, size);
-  ud_set_mode (&ud_obj, GUM_CPU_MODE);
-  ud_set_pc (&ud_obj, GPOINTER_TO_SIZE (code));
-  ud_set_syntax (&ud_obj, UD_SYN_INTEL);
+  /*
+   * Waits for every thread that might still see the previous snapshot to
+   * leave its read-side section. Must not be called from a probe callback.
+   *
+   * The read-side section spans the probe callbacks, which are free to call
+   * back into us, so we only hold the lock while looking at the contexts.
+   */
+  readers = g_array_new (FALSE, FALSE, sizeof (GumCallProbeReader));
 
-  while (ud_disassemble (&ud_obj))
+  GUM_STALKER_LOCK (self);
+  for (cur = priv->contexts; cur != NULL; cur = cur->next)
   {
-    printf ("%s0x%" G_GINT64_MODIFIER "x\t%s\n",
-        prefix, (guint64) ud_insn_off (&ud_obj), ud_insn_asm (&ud_obj));
-  }
-}
+    GumCallProbeReader reader;
 
-static void
-gum_hexdump (guint8 * data, guint size, const gchar * prefix)
-{
-  guint i, line_offset;
+    reader.ctx = (GumExecCtx *) cur->data;
+    reader.epoch = g_atomic_int_get (&reader.ctx->probe_epoch);
+    if ((reader.epoch & 1) != 0)
+      g_array_append_val (readers, reader);
+  }
+  GUM_STALKER_UNLOCK (self);
 
-  line_offset = 0;
-  for (i = 0; i != size; i++)
+  for (i = 0; i != readers->len; i++)
   {
-    if (line_offset == 0)
-      printf ("%s0x%" G_GINT64_MODIFIER "x\t%02x", prefix, (guint64) data + i,
-          data[i]);
-    else
-      printf (" %02x", data[i]);
+    GumCallProbeReader * reader =
+        &g_array_index (readers, GumCallProbeReader, i);
+    gboolean still_reading;
 
-    line_offset++;
-    if (line_offset == 16 && i != size - 1)
+    do
     {
-      printf ("\n");
-      line_offset = 0;
+      GUM_STALKER_LOCK (self);
+      still_reading = g_slist_find (priv->contexts, reader->ctx) != NULL &&
+          g_atomic_int_get (&reader->ctx->probe_epoch) == reader->epoch;
+      GUM_STALKER_UNLOCK (self);
+
+      if (still_reading)
+        g_thread_yield ();
     }
+    while (still_reading);
   }
 
-  if (line_offset != 0)
-    printf ("\n");
+  g_array_free (readers, TRUE);
 }
 
-#endif
+static GumCallProbeArray *
+gum_call_probe_array_append (const GumCallProbeArray * array,
+                             const GumCallProbe * probe)
+{
+  guint len = (array != NULL) ? array->len : 0;
+  GumCallProbeArray * result;
+
+  result = (GumCallProbeArray *) g_malloc (
+      G_STRUCT_OFFSET (GumCallProbeArray, probes) +
+      ((len + 1) * sizeof (GumCallProbe)));
+  result->len = len + 1;
+  if (len != 0)
+    memcpy (result->probes, array->probes, len * sizeof (GumCallProbe));
+  result->probes[len] = *probe;
+
+  return result;
+}
 
-static GumExecBlock *
-gum_exec_ctx_obtain_block_for (GumExecCtx * ctx,
-                               gpointer real_address,
-                               gpointer * code_address)
+static GumCallProbeArray *
+gum_call_probe_array_remove (const GumCallProbeArray * array,
+                             GumProbeId id,
+                             GumCallProbe * removed)
 {
-  GumExecBlock * block;
-  GumX86Writer * cw = &ctx->code_writer;
-  GumX86Relocator * rl = &ctx->relocator;
-  GumGeneratorContext gc;
+  GumCallProbeArray * result;
+  guint i, j;
 
-  if (ctx->stalker->priv->trust_threshold >= 0)
+  if (array->len == 1)
   {
-    block = gum_exec_block_obtain (ctx, real_address, code_address);
-    if (block != NULL)
-    {
-      if (block->recycle_count >= ctx->stalker->priv->trust_threshold ||
-          memcmp (real_address, block->real_snapshot,
-            block->real_end - block->real_begin) == 0)
-      {
-        block->recycle_count++;
-        return block;
-      }
-      else
-      {
-        gum_exec_ctx_remove_address_mapping (ctx, real_address);
-      }
-    }
+    g_assert_cmpuint (array->probes[0].id, ==, id);
+    *removed = array->probes[0];
+    return NULL;
   }
 
-  block = gum_exec_block_new (ctx);
-  *code_address = block->code_begin;
-  gum_exec_ctx_add_address_mapping (ctx, real_address, block->code_begin,
-      block);
-  gum_x86_writer_reset (cw, block->code_begin);
-  gum_x86_relocator_reset (rl, real_address, cw);
+  result = (GumCallProbeArray *) g_malloc (
+      G_STRUCT_OFFSET (GumCallProbeArray, probes) +
+      ((array->len - 1) * sizeof (GumCallProbe)));
+  result->len = array->len - 1;
 
-  gc.instruction = NULL;
-  gc.relocator = rl;
-  gc.code_writer = cw;
-  gc.continuation_real_address = NULL;
-  gc.opened_prolog = GUM_PROLOG_NONE;
-  gc.state_preserve_stack_offset = 0;
-  gc.accumulated_stack_delta = 0;
+  for (i = 0, j = 0; i != array->len; i++)
+  {
+    if (array->probes[i].id == id)
+      *removed = array->probes[i];
+    else
+      result->probes[j++] = array->probes[i];
+  }
+  g_assert_cmpuint (j, ==, result->len);
 
-#if ENABLE_DEBUG
-  printf ("\n\n***\n\nCreating block for %p:\n", real_address);
-#endif
+  return result;
+}
 
-  while (TRUE)
+static void
+gum_call_probe_array_free (GumCallProbeArray * array,
+                           gboolean notify)
+{
+  if (notify)
   {
-    guint n_read;
-    GumInstruction insn;
-    GumVirtualizationRequirements requirements = GUM_REQUIRE_NOTHING;
+    guint i;
 
-    n_read = gum_x86_relocator_read_one (rl, NULL);
-    g_assert_cmpuint (n_read, !=, 0);
+    for (i = 0; i != array->len; i++)
+    {
+      GumCallProbe * probe = &array->probes[i];
+      if (probe->user_notify != NULL)
+        probe->user_notify (probe->user_data);
+    }
+  }
 
-    insn.ud = gum_x86_relocator_peek_next_write_insn (rl);
-    insn.begin = gum_x86_relocator_peek_next_write_source (rl);
-    insn.end = insn.begin + ud_insn_len (insn.ud);
+  g_free (array);
+}
 
-    g_assert (insn.ud != NULL && insn.begin != NULL);
+static void
+gum_call_probe_slot_free (gpointer data)
+{
+  GumCallProbeSlot * slot = (GumCallProbeSlot *) data;
 
-#if ENABLE_DEBUG
-    gum_disasm (insn.begin, insn.end - insn.begin, "");
-    gum_hexdump (insn.begin, insn.end - insn.begin, "; ");
-#endif
+  if (slot->probes != NULL)
+    gum_call_probe_array_free (slot->probes, TRUE);
 
-    gc.instruction = &insn;
+  g_slice_free (GumCallProbeSlot, slot);
+}
 
-    if ((ctx->sink_mask & GUM_EXEC) != 0)
-      gum_exec_block_write_exec_event_code (block, &gc, GUM_CODE_INTERRUPTIBLE);
+static GumExecCtx *
+gum_stalker_create_exec_ctx (GumStalker * self,
+                             GumThreadId thread_id,
+                             GumEventSink * sink)
+{
+  GumStalkerPrivate * priv = self->priv;
+  GumExecCtx * ctx;
 
-    switch (insn.ud->mnemonic)
-    {
-      case UD_Icall:
-      case UD_Ijmp:
-        requirements = gum_exec_block_virtualize_branch_insn (block, &gc);
-        break;
-      case UD_Iret:
-        requirements = gum_exec_block_virtualize_ret_insn (block, &gc);
-        break;
-      case UD_Isysenter:
-        requirements = gum_exec_block_virtualize_sysenter_insn (block, &gc);
-        break;
-      default:
-        if (gum_mnemonic_is_jcc (insn.ud->mnemonic))
-          requirements = gum_exec_block_virtualize_branch_insn (block, &gc);
-        else
-          requirements = GUM_REQUIRE_RELOCATION;
-        break;
-    }
+  ctx = gum_exec_ctx_new (self, thread_id, sink);
 
-    gum_exec_block_close_prolog (block, &gc);
+  GUM_STALKER_LOCK (self);
+  /*
+   * Blocks that emit events refer to the sink and to the context's scratch
+   * event, so only contexts without any may execute shared code.
+   */
+  ctx->hot_state_in_tls = priv->shared_cache_enabled &&
+      priv->trust_threshold >= 0 &&
+      ctx->sink_mask == GUM_NOTHING;
+  priv->contexts = g_slist_prepend (priv->contexts, ctx);
+  GUM_STALKER_UNLOCK (self);
 
-    if ((requirements & GUM_REQUIRE_RELOCATION) != 0)
-    {
-      if ((requirements & GUM_REQUIRE_MAPPING) != 0)
-      {
-        gum_exec_ctx_add_address_mapping (ctx, insn.begin,
-            gum_x86_writer_cur (cw), block);
-      }
+  return ctx;
+}
 
-      gum_x86_relocator_write_one_no_label (rl);
+static GumExecCtx *
+gum_exec_ctx_new (GumStalker * self,
+                  GumThreadId thread_id,
+                  GumEventSink * sink)
+{
+  GumStalkerPrivate * priv = self->priv;
+  guint base_size;
+  GumExecCtx * ctx;
 
-      if ((requirements & GUM_REQUIRE_MAPPING) != 0)
-      {
-        gum_exec_ctx_add_address_mapping (ctx, insn.end,
-            gum_x86_writer_cur (cw), block);
-      }
-    }
-    else if ((requirements & GUM_REQUIRE_SINGLE_STEP) != 0)
-    {
-      gum_x86_relocator_skip_one_no_label (rl);
-      gum_exec_block_write_single_step_transfer_code (block, &gc);
-    }
+  base_size = sizeof (GumExecCtx) / priv->page_size;
+  if (sizeof (GumExecCtx) % priv->page_size != 0)
+    base_size++;
 
-#if ENABLE_DEBUG
-    {
-      guint8 * begin = block->code_end;
-      block->code_end = gum_x86_writer_cur (cw);
-      gum_disasm (begin, block->code_end - begin, "\t");
-      gum_hexdump (begin, block->code_end - begin, "\t; ");
-    }
-#else
-    block->code_end = gum_x86_writer_cur (cw);
-#endif
+  ctx = (GumExecCtx *) gum_alloc_n_pages (
+      base_size + GUM_MAPPING_SLAB_SIZE_IN_PAGES + 1, GUM_PAGE_RWX);
+  ctx->state = GUM_EXEC_CTX_ACTIVE;
+  ctx->invalidate_pending = FALSE;
+  ctx->write_generation = g_atomic_int_get (&gum_page_write_generation);
 
-    if (gum_exec_block_is_full (block))
-    {
-      gc.continuation_real_address = insn.end;
-      break;
-    }
-    else if (insn.ud->mnemonic == UD_Icall)
-    {
-      /* We always stop on a call unless it's to an excluded range */
-      if ((requirements & GUM_REQUIRE_RELOCATION) != 0)
-      {
-        rl->eob = FALSE;
-      }
-      else
-      {
-        break;
-      }
-    }
-    else if (gum_x86_relocator_eob (rl))
-    {
-      break;
-    }
-  }
+  ctx->blocks = NULL;
+  gum_spinlock_init (&ctx->blocks_lock);
 
-  if (gc.continuation_real_address != NULL)
-  {
-    GumBranchTarget continue_target = { 0, };
+  ctx->code_slabs = NULL;
+  ctx->retired_slabs = NULL;
+  ctx->condemned_slabs = NULL;
+  ctx->pinned_slabs = NULL;
 
-    continue_target.is_indirect = FALSE;
-    continue_target.absolute_address = gc.continuation_real_address;
+  ctx->mapping_slab.data = ((guint8 *) ctx) + (base_size * priv->page_size);
+  ctx->mapping_slab.offset = 0;
+  ctx->mapping_slab.size = GUM_MAPPING_SLAB_SIZE_IN_PAGES * priv->page_size;
+  ctx->mapping_slab.next = NULL;
 
-    gum_exec_block_write_jmp_transfer_code (block, &continue_target, &gc);
+  ctx->mapping_mask = 1;
+  while ((ctx->mapping_mask + 1) * sizeof (GumAddressMapping) <=
+      ctx->mapping_slab.size)
+  {
+    ctx->mapping_mask = (ctx->mapping_mask << 1) | 1;
   }
+  ctx->mapping_mask >>= 1;
+  ctx->mapping_slab.offset =
+      (ctx->mapping_mask + 1) * sizeof (GumAddressMapping);
+  ctx->mapping_count = 0;
+  ctx->mapping_limit =
+      ((ctx->mapping_mask + 1) / 100) * GUM_MAPPING_MAX_LOAD_PERCENT;
+  ctx->initial_mappings = ctx->mapping_slab.data;
+  ctx->outgrown_mappings = NULL;
 
-  gum_x86_writer_put_int3 (cw); /* should never get here */
+  ctx->frames = (GumExecFrame *)
+      ctx->mapping_slab.data + ctx->mapping_slab.size;
 
-  gum_x86_writer_flush (cw);
+  ctx->hot = &ctx->private_hot;
+  ctx->hot->ctx = ctx;
+  ctx->hot->current_block = NULL;
+  ctx->hot->first_frame = (GumExecFrame *) (ctx->mapping_slab.data +
+      ctx->mapping_slab.size + priv->page_size - sizeof (GumExecFrame));
+  ctx->hot->current_frame = ctx->hot->first_frame;
+  ctx->hot->ret_cache = ctx->ret_cache;
+  ctx->hot->resume_at = NULL;
+  ctx->hot->return_at = NULL;
+  ctx->hot->app_stack = NULL;
+  ctx->is_shared = FALSE;
+  ctx->hot_state_in_tls = FALSE;
 
-  block->code_end = (guint8 *) gum_x86_writer_cur (cw);
+  /* Page-aligned, and therefore suitably aligned for XSAVE, and zeroed */
+  ctx->fp_save_area = gum_alloc_n_pages (
+      (priv->fp_save_size + priv->page_size - 1) / priv->page_size,
+      GUM_PAGE_RW);
+  ctx->hot->fp_save_area = ctx->fp_save_area;
+  ctx->lazy_fp_save = priv->lazy_fp_save;
 
-  block->real_begin = (guint8 *) rl->input_start;
-  block->real_end = (guint8 *) rl->input_cur;
+  ctx->links = NULL;
+  ctx->inline_caches = NULL;
 
-  gum_exec_block_commit (block);
+  ctx->call_counters = NULL;
+  gum_spinlock_init (&ctx->call_counters_lock);
 
-  return block;
-}
+  memset (ctx->ret_cache, 0, sizeof (ctx->ret_cache));
 
-static void
-gum_exec_ctx_clear_address_mappings (GumExecCtx * ctx)
-{
-  GumSlab * slab;
+  ctx->stalker = g_object_ref (self);
+  ctx->thread_id = thread_id;
+
+  memset (&ctx->stats, 0, sizeof (ctx->stats));
+  ctx->stats.thread_id = thread_id;
+  priv->read_cycles (&ctx->start_cycles);
+
+  gum_x86_writer_init (&ctx->code_writer, NULL);
+  gum_x86_relocator_init (&ctx->relocator, NULL, &ctx->code_writer);
 
-  for (slab = &ctx->mapping_slab; slab != NULL; slab = slab->next)
+  if (sink != NULL)
   {
-    slab->offset = 0;
+    ctx->sink = (GumEventSink *) g_object_ref (sink);
+    ctx->sink_mask = gum_event_sink_query_mask (sink);
+    ctx->sink_process_impl = GUM_FUNCPTR_TO_POINTER (
+        GUM_EVENT_SINK_GET_INTERFACE (sink)->process);
   }
-}
-
-static void
+  else
+  {
+    ctx->sink = NULL;
+    ctx->sink_mask = GUM_NOTHING;
+    ctx->sink_process_impl = NULL;
+  }
+
+  if (sink != NULL &&
+      (GUM_EVENT_SINK_GET_INTERFACE (sink)->process_batch != NULL ||
+       GUM_EVENT_SINK_GET_INTERFACE (sink)->process_compact != NULL))
+  {
+    ctx->event_buffer = g_new (GumEvent, GUM_EXEC_EVENT_BUFFER_SIZE);
+    ctx->event_buffer_end = ctx->event_buffer + GUM_EXEC_EVENT_BUFFER_SIZE;
+  }
+  else
+  {
+    ctx->event_buffer = NULL;
+    ctx->event_buffer_end = NULL;
+  }
+  if (sink != NULL &&
+      GUM_EVENT_SINK_GET_INTERFACE (sink)->process_compact != NULL)
+  {
+    ctx->compact_buffer = g_malloc (
+        GUM_EXEC_EVENT_BUFFER_SIZE * GUM_EVENT_ENCODED_MAX_SIZE);
+  }
+  else
+  {
+    ctx->compact_buffer = NULL;
+  }
+  ctx->event_cursor = ctx->event_buffer;
+  ctx->last_flush_cycles = ctx->start_cycles;
+
+  if ((ctx->sink_mask & GUM_CALL_COUNT) != 0)
+  {
+    ctx->call_counters = g_hash_table_new_full (NULL, NULL, NULL,
+        (GDestroyNotify) gum_call_counter_free);
+  }
+
+  gum_exec_ctx_create_thunks (ctx);
+
+  return ctx;
+}
+
+static GumExecCtx *
+gum_stalker_get_exec_ctx (GumStalker * self)
+{
+  return (GumExecCtx *) GUM_TLS_KEY_GET_VALUE (self->priv->exec_ctx);
+}
+
+static gboolean
+gum_stalker_is_excluding (GumStalker * self,
+                          gconstpointer address)
+{
+  GArray * exclusions = self->priv->exclusions;
+  GumAddress a = GUM_ADDRESS (address);
+  guint lo, hi;
+
+  lo = 0;
+  hi = exclusions->len;
+  while (lo < hi)
+  {
+    guint mid = lo + ((hi - lo) / 2);
+    GumMemoryRange * r = &g_array_index (exclusions, GumMemoryRange, mid);
+
+    if (a < r->base_address)
+      hi = mid;
+    else if (a >= r->base_address + r->size)
+      lo = mid + 1;
+    else
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+static void
+gum_stalker_invalidate_caches (GumStalker * self)
+{
+  GumExecCtx * shared = self->priv->shared_ctx;
+  GSList * cur;
+
+  if (shared != NULL)
+  {
+    g_mutex_lock (self->priv->shared_mutex);
+    gum_exec_ctx_clear_address_mappings (shared);
+    g_mutex_unlock (self->priv->shared_mutex);
+  }
+
+  GUM_STALKER_LOCK (self);
+
+  for (cur = self->priv->contexts; cur != NULL; cur = cur->next)
+  {
+    GumExecCtx * ctx = (GumExecCtx *) cur->data;
+
+    ctx->invalidate_pending = TRUE;
+  }
+
+  GUM_STALKER_UNLOCK (self);
+}
+
+static void
+gum_page_tracker_init (void)
+{
+  G_LOCK (gum_page_tracker);
+
+  /*
+   * Never torn down, as pages protected on our behalf may be written to
+   * long after the last stalker is gone.
+   */
+  if (gum_tracked_pages == NULL)
+  {
+    gsize size, page_size;
+    GumInterceptor * interceptor;
+
+    page_size = gum_query_page_size ();
+    size = GUM_TRACKED_PAGE_CAPACITY * sizeof (GumTrackedPage);
+
+    gum_tracked_page_size = page_size;
+    gum_tracked_pages = (GumTrackedPage *) gum_alloc_n_pages (
+        (size + page_size - 1) / page_size, GUM_PAGE_RW);
+
+    /*
+     * Whatever gets mapped at an unmapped page's address isn't protected, and
+     * a page reprotected behind our back may be written to without faulting.
+     */
+    interceptor = gum_interceptor_obtain ();
+
+#ifdef G_OS_WIN32
+    gum_win_exception_hook_add (gum_page_tracker_on_exception, NULL);
+
+    gum_interceptor_replace_function (interceptor,
+        GUM_FUNCPTR_TO_POINTER (VirtualFree),
+        GUM_FUNCPTR_TO_POINTER (gum_page_tracker_replacement_virtual_free),
+        NULL);
+    gum_interceptor_replace_function (interceptor,
+        GUM_FUNCPTR_TO_POINTER (UnmapViewOfFile),
+        GUM_FUNCPTR_TO_POINTER (
+            gum_page_tracker_replacement_unmap_view_of_file),
+        NULL);
+    gum_interceptor_replace_function (interceptor,
+        GUM_FUNCPTR_TO_POINTER (VirtualProtect),
+        GUM_FUNCPTR_TO_POINTER (gum_page_tracker_replacement_virtual_protect),
+        NULL);
+#else
+    {
+      struct sigaction action;
+
+      action.sa_sigaction = gum_page_tracker_on_fault;
+      sigemptyset (&action.sa_mask);
+      action.sa_flags = SA_SIGINFO;
+      sigaction (SIGSEGV, &action, &gum_page_tracker_old_sigsegv);
+      sigaction (SIGBUS, &action, &gum_page_tracker_old_sigbus);
+    }
+
+    gum_interceptor_replace_function (interceptor,
+        GUM_FUNCPTR_TO_POINTER (munmap),
+        GUM_FUNCPTR_TO_POINTER (gum_page_tracker_replacement_munmap),
+        NULL);
+    gum_interceptor_replace_function (interceptor,
+        GUM_FUNCPTR_TO_POINTER (mprotect),
+        GUM_FUNCPTR_TO_POINTER (gum_page_tracker_replacement_mprotect),
+        NULL);
+#endif
+  }
+
+  G_UNLOCK (gum_page_tracker);
+}
+
+static gboolean
+gum_page_tracker_protect (guint8 * begin,
+                          guint8 * end)
+{
+  gsize page_mask = ~(gum_tracked_page_size - 1);
+  guint8 * page;
+
+  for (page = GSIZE_TO_POINTER (GPOINTER_TO_SIZE (begin) & page_mask);
+      page < end;
+      page += gum_tracked_page_size)
+  {
+    guint i, n;
+
+    for (i = GPOINTER_TO_SIZE (page) / gum_tracked_page_size, n = 0;
+        n != GUM_TRACKED_PAGE_CAPACITY;
+        i++, n++)
+    {
+      GumTrackedPage * p = &gum_tracked_pages[i % GUM_TRACKED_PAGE_CAPACITY];
+
+      if (g_atomic_pointer_compare_and_exchange (&p->address, NULL, page))
+      {
+        gboolean success;
+
+        success =
+            gum_page_tracker_query_protection (page, &p->native_protection) &&
+            gum_page_tracker_set_writable (page, FALSE, p->native_protection);
+        g_atomic_int_set (&p->state, success
+            ? GUM_TRACKED_PAGE_PROTECTED
+            : GUM_TRACKED_PAGE_UNTRACKABLE);
+        break;
+      }
+      else if (g_atomic_pointer_get (&p->address) == page)
+      {
+        /* The page may have been mapped anew since we last protected it */
+        if (g_atomic_int_get (&p->state) == GUM_TRACKED_PAGE_PROTECTED)
+          gum_page_tracker_set_writable (page, FALSE, p->native_protection);
+        break;
+      }
+    }
+
+    /* Out of slots, the caller keeps a snapshot instead */
+    if (n == GUM_TRACKED_PAGE_CAPACITY)
+      return FALSE;
+  }
+
+  return gum_page_tracker_is_intact (begin, end);
+}
+
+static gboolean
+gum_page_tracker_is_intact (guint8 * begin,
+                            guint8 * end)
+{
+  gsize page_mask = ~(gum_tracked_page_size - 1);
+  guint8 * page;
+
+  for (page = GSIZE_TO_POINTER (GPOINTER_TO_SIZE (begin) & page_mask);
+      page < end;
+      page += gum_tracked_page_size)
+  {
+    GumTrackedPage * p;
+
+    p = gum_page_tracker_lookup (page);
+    if (p == NULL ||
+        g_atomic_int_get (&p->state) != GUM_TRACKED_PAGE_PROTECTED)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Called from the fault handler, so mustn't take locks or allocate */
+static GumTrackedPage *
+gum_page_tracker_lookup (gpointer address)
+{
+  gsize page_number;
+  guint i, n;
+
+  if (gum_tracked_pages == NULL)
+    return NULL;
+
+  page_number = GPOINTER_TO_SIZE (address) / gum_tracked_page_size;
+
+  for (i = page_number, n = 0; n != GUM_TRACKED_PAGE_CAPACITY; i++, n++)
+  {
+    GumTrackedPage * p = &gum_tracked_pages[i % GUM_TRACKED_PAGE_CAPACITY];
+    gpointer page = g_atomic_pointer_get (&p->address);
+
+    if (page == NULL)
+      return NULL;
+    else if (GPOINTER_TO_SIZE (page) / gum_tracked_page_size == page_number)
+      return p;
+  }
+
+  return NULL;
+}
+
+/*
+ * Looks up the page's protection as found, before we touch it. Not safe to
+ * call from the fault handler.
+ */
+static gboolean
+gum_page_tracker_query_protection (gpointer page,
+                                   guint * native_protection)
+{
+#ifdef G_OS_WIN32
+  MEMORY_BASIC_INFORMATION mbi;
+
+  if (VirtualQuery (page, &mbi, sizeof (mbi)) == 0 ||
+      mbi.State != MEM_COMMIT)
+    return FALSE;
+
+  *native_protection = mbi.Protect;
+  return TRUE;
+#else
+  GumQueryProtectionCtx ctx;
+
+  ctx.address = GUM_ADDRESS (page);
+  ctx.found = FALSE;
+  gum_process_enumerate_ranges (GUM_PAGE_NO_ACCESS,
+      gum_page_tracker_find_protection, &ctx);
+  if (!ctx.found)
+    return FALSE;
+
+  *native_protection = PROT_NONE;
+  if ((ctx.prot & GUM_PAGE_READ) != 0)
+    *native_protection |= PROT_READ;
+  if ((ctx.prot & GUM_PAGE_WRITE) != 0)
+    *native_protection |= PROT_WRITE;
+  if ((ctx.prot & GUM_PAGE_EXECUTE) != 0)
+    *native_protection |= PROT_EXEC;
+  return TRUE;
+#endif
+}
+
+#ifndef G_OS_WIN32
+
+static gboolean
+gum_page_tracker_find_protection (const GumMemoryRange * range,
+                                  GumPageProtection prot,
+                                  gpointer user_data)
+{
+  GumQueryProtectionCtx * ctx = (GumQueryProtectionCtx *) user_data;
+
+  if (ctx->address >= range->base_address &&
+      ctx->address < range->base_address + range->size)
+  {
+    ctx->prot = prot;
+    ctx->found = TRUE;
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+#endif
+
+/*
+ * Switches a page between the protection it was found with and the same
+ * minus write access. Pages that weren't writable to begin with aren't ours
+ * to protect, and blocks compiled from them keep a snapshot. Unlike
+ * gum_mprotect() this may fail, it is safe to call from the fault handler,
+ * and it goes around our mprotect() and VirtualProtect() replacements.
+ */
+static gboolean
+gum_page_tracker_set_writable (gpointer page,
+                               gboolean writable,
+                               guint native_protection)
+{
+#ifdef G_OS_WIN32
+  DWORD base, read_only, old_protect;
+
+  base = native_protection & 0xff;
+  switch (base)
+  {
+    case PAGE_READWRITE:
+    case PAGE_WRITECOPY:
+      read_only = PAGE_READONLY;
+      break;
+    case PAGE_EXECUTE_READWRITE:
+    case PAGE_EXECUTE_WRITECOPY:
+      read_only = PAGE_EXECUTE_READ;
+      break;
+    default:
+      return FALSE;
+  }
+
+  return VirtualProtectEx (GetCurrentProcess (), page, gum_tracked_page_size,
+      writable ? native_protection : (native_protection & ~0xff) | read_only,
+      &old_protect);
+#else
+  int prot;
+
+  if ((native_protection & PROT_WRITE) == 0)
+    return FALSE;
+
+  prot = writable ? native_protection : native_protection & ~PROT_WRITE;
+
+# ifdef HAVE_DARWIN
+  return mach_vm_protect (mach_task_self (), GPOINTER_TO_SIZE (page),
+      gum_tracked_page_size, FALSE, prot) == KERN_SUCCESS;
+# else
+  return syscall (SYS_mprotect, page, gum_tracked_page_size, prot) == 0;
+# endif
+#endif
+}
+
+/*
+ * Lets the write go through and records it, leaving it to each thread to
+ * throw away the affected blocks the next time it leaves translated code.
+ * Once written to, a page stays unprotected and blocks compiled from it
+ * fall back to keeping a snapshot.
+ */
+static gboolean
+gum_page_tracker_handle_write (gpointer address)
+{
+  GumTrackedPage * p;
+  gint state;
+
+  p = gum_page_tracker_lookup (address);
+  if (p == NULL)
+    return FALSE;
+
+  /* Protected a moment ago, we only need to wait for it to say so */
+  while ((state = g_atomic_int_get (&p->state)) == GUM_TRACKED_PAGE_PENDING)
+    ;
+
+  if (state != GUM_TRACKED_PAGE_PROTECTED &&
+      state != GUM_TRACKED_PAGE_WRITTEN)
+    return FALSE;
+
+  if (!gum_page_tracker_set_writable (g_atomic_pointer_get (&p->address),
+      TRUE, p->native_protection))
+    return FALSE;
+
+  /* The page must read as written by the time the generation moves */
+  if (g_atomic_int_compare_and_exchange (&p->state,
+      GUM_TRACKED_PAGE_PROTECTED, GUM_TRACKED_PAGE_WRITTEN))
+  {
+    g_atomic_int_inc (&gum_page_write_generation);
+  }
+
+  return TRUE;
+}
+
+/*
+ * Treats pages that are unmapped or reprotected by someone else as written
+ * to. Blocks compiled from them are thrown away before anything mapped at
+ * the same address is mistaken for their code, or the pages are written to
+ * without faulting. The slots stay claimed, so the pages fall back to
+ * snapshots.
+ */
+static void
+gum_page_tracker_forget (gpointer address,
+                         gsize size)
+{
+  gsize page_mask = ~(gum_tracked_page_size - 1);
+  guint8 * end = (guint8 *) address + size;
+  guint8 * page;
+  gboolean any_forgotten = FALSE;
+
+  for (page = GSIZE_TO_POINTER (GPOINTER_TO_SIZE (address) & page_mask);
+      page < end;
+      page += gum_tracked_page_size)
+  {
+    GumTrackedPage * p;
+
+    p = gum_page_tracker_lookup (page);
+    if (p == NULL)
+      continue;
+
+    while (g_atomic_int_get (&p->state) == GUM_TRACKED_PAGE_PENDING)
+      ;
+
+    if (g_atomic_int_compare_and_exchange (&p->state,
+        GUM_TRACKED_PAGE_PROTECTED, GUM_TRACKED_PAGE_WRITTEN))
+    {
+      any_forgotten = TRUE;
+    }
+  }
+
+  if (any_forgotten)
+    g_atomic_int_inc (&gum_page_write_generation);
+}
+
+#ifdef G_OS_WIN32
+
+static gboolean
+gum_page_tracker_on_exception (EXCEPTION_RECORD * exception_record,
+                               CONTEXT * context,
+                               gpointer user_data)
+{
+  (void) context;
+  (void) user_data;
+
+  if (exception_record->ExceptionCode != EXCEPTION_ACCESS_VIOLATION ||
+      exception_record->ExceptionInformation[0] != 1)
+    return FALSE;
+
+  return gum_page_tracker_handle_write (
+      (gpointer) exception_record->ExceptionInformation[1]);
+}
+
+static BOOL WINAPI
+gum_page_tracker_replacement_virtual_free (LPVOID address,
+                                           SIZE_T size,
+                                           DWORD free_type)
+{
+  GumInvocationContext * ctx;
+  GumVirtualFreeFunc virtual_free_impl;
+
+  ctx = gum_interceptor_get_current_invocation ();
+  virtual_free_impl = GUM_POINTER_TO_FUNCPTR (GumVirtualFreeFunc,
+      ctx->function);
+
+  gum_page_tracker_forget (address, (free_type == MEM_RELEASE)
+      ? gum_page_tracker_query_allocation_size (address)
+      : size);
+
+  return virtual_free_impl (address, size, free_type);
+}
+
+static BOOL WINAPI
+gum_page_tracker_replacement_unmap_view_of_file (LPCVOID address)
+{
+  GumInvocationContext * ctx;
+  GumUnmapViewOfFileFunc unmap_view_of_file_impl;
+
+  ctx = gum_interceptor_get_current_invocation ();
+  unmap_view_of_file_impl = GUM_POINTER_TO_FUNCPTR (GumUnmapViewOfFileFunc,
+      ctx->function);
+
+  gum_page_tracker_forget ((gpointer) address,
+      gum_page_tracker_query_allocation_size ((gpointer) address));
+
+  return unmap_view_of_file_impl (address);
+}
+
+static BOOL WINAPI
+gum_page_tracker_replacement_virtual_protect (LPVOID address,
+                                              SIZE_T size,
+                                              DWORD new_protect,
+                                              PDWORD old_protect)
+{
+  GumInvocationContext * ctx;
+  GumVirtualProtectFunc virtual_protect_impl;
+
+  ctx = gum_interceptor_get_current_invocation ();
+  virtual_protect_impl = GUM_POINTER_TO_FUNCPTR (GumVirtualProtectFunc,
+      ctx->function);
+
+  /* Even if it stays read-only, its protection is no longer ours to restore */
+  gum_page_tracker_forget (address, size);
+
+  return virtual_protect_impl (address, size, new_protect, old_protect);
+}
+
+static gsize
+gum_page_tracker_query_allocation_size (gpointer address)
+{
+  MEMORY_BASIC_INFORMATION mbi;
+  gpointer allocation_base;
+  guint8 * p;
+
+  if (VirtualQuery (address, &mbi, sizeof (mbi)) == 0)
+    return 0;
+  allocation_base = mbi.AllocationBase;
+
+  p = (guint8 *) allocation_base;
+  while (VirtualQuery (p, &mbi, sizeof (mbi)) != 0 &&
+      mbi.AllocationBase == allocation_base)
+  {
+    p += mbi.RegionSize;
+  }
+
+  return p - (guint8 *) address;
+}
+
+#else
+
+static void
+gum_page_tracker_on_fault (int sig,
+                           siginfo_t * siginfo,
+                           void * context)
+{
+  struct sigaction * action;
+
+  if (gum_page_tracker_handle_write (siginfo->si_addr))
+    return;
+
+  action = (sig == SIGSEGV)
+      ? &gum_page_tracker_old_sigsegv
+      : &gum_page_tracker_old_sigbus;
+
+  /*
+   * SIG_DFL and SIG_IGN aren't functions. One sent by kill() and ignored is
+   * simply dropped. Anything else takes the process down, as the kernel
+   * doesn't let a fault be ignored, so we only step aside for the default
+   * action on the way out and stay installed otherwise.
+   */
+  if (action->sa_handler == SIG_IGN && siginfo->si_code <= 0)
+    return;
+
+  if (action->sa_handler == SIG_DFL || action->sa_handler == SIG_IGN)
+  {
+    signal (sig, SIG_DFL);
+    if (siginfo->si_code <= 0)
+      raise (sig);
+    return;
+  }
+
+  if ((action->sa_flags & SA_SIGINFO) != 0)
+    action->sa_sigaction (sig, siginfo, context);
+  else
+    action->sa_handler (sig);
+}
+
+static int
+gum_page_tracker_replacement_munmap (void * address,
+                                     size_t size)
+{
+  GumInvocationContext * ctx;
+  GumMunmapFunc munmap_impl;
+
+  ctx = gum_interceptor_get_current_invocation ();
+  munmap_impl = GUM_POINTER_TO_FUNCPTR (GumMunmapFunc, ctx->function);
+
+  gum_page_tracker_forget (address, size);
+
+  return munmap_impl (address, size);
+}
+
+static int
+gum_page_tracker_replacement_mprotect (void * address,
+                                       size_t size,
+                                       int prot)
+{
+  GumInvocationContext * ctx;
+  GumMprotectFunc mprotect_impl;
+
+  ctx = gum_interceptor_get_current_invocation ();
+  mprotect_impl = GUM_POINTER_TO_FUNCPTR (GumMprotectFunc, ctx->function);
+
+  /* Even if it stays read-only, its protection is no longer ours to restore */
+  gum_page_tracker_forget (address, size);
+
+  return mprotect_impl (address, size, prot);
+}
+
+#endif
+
+static void
+gum_exec_ctx_free (GumExecCtx * ctx)
+{
+  /* Unlinking touches the target blocks, so do it while they still exist */
+  gum_exec_ctx_unlink_all_blocks (ctx, FALSE);
+
+  gum_exec_ctx_free_slabs (ctx, ctx->code_slabs);
+  gum_exec_ctx_free_slabs (ctx, ctx->retired_slabs);
+  gum_exec_ctx_free_slabs (ctx, ctx->condemned_slabs);
+  gum_exec_ctx_free_slabs (ctx, ctx->pinned_slabs);
+
+  if (ctx->mapping_slab.data != ctx->initial_mappings)
+    gum_free_pages (ctx->mapping_slab.data);
+  while (ctx->outgrown_mappings != NULL)
+  {
+    gum_free_pages (ctx->outgrown_mappings->data);
+    ctx->outgrown_mappings = g_slist_delete_link (ctx->outgrown_mappings,
+        ctx->outgrown_mappings);
+  }
+
+  gum_exec_ctx_destroy_thunks (ctx);
+  gum_free_pages (ctx->fp_save_area);
+
+  gum_exec_ctx_flush_events (ctx);
+  g_free (ctx->compact_buffer);
+  g_free (ctx->event_buffer);
+
+  if (ctx->call_counters != NULL)
+  {
+    gum_exec_ctx_retire_call_counts (ctx);
+    g_hash_table_unref (ctx->call_counters);
+  }
+  gum_spinlock_free (&ctx->call_counters_lock);
+
+  if (ctx->sink != NULL)
+    g_object_unref (ctx->sink);
+
+  gum_x86_relocator_free (&ctx->relocator);
+  gum_x86_writer_free (&ctx->code_writer);
+
+  gum_spinlock_free (&ctx->blocks_lock);
+
+  g_object_unref (ctx->stalker);
+
+  gum_free_pages (ctx);
+}
+
+static void
+gum_exec_ctx_emit_event (GumExecCtx * ctx,
+                         const GumEvent * ev)
+{
+  if (ctx->event_buffer != NULL)
+  {
+    *ctx->event_cursor++ = *ev;
+    if (ctx->event_cursor == ctx->event_buffer_end)
+      gum_exec_ctx_flush_events (ctx);
+  }
+  else
+  {
+    gum_event_sink_process (ctx->sink, ev);
+  }
+}
+
+static void
+gum_exec_ctx_flush_events (GumExecCtx * ctx)
+{
+  guint n_events = ctx->event_cursor - ctx->event_buffer;
+
+  if (n_events == 0)
+    return;
+
+  if (ctx->compact_buffer != NULL)
+  {
+    GumEventEncoder encoder;
+    gsize size;
+
+    /*
+     * Chunks from different threads interleave in the sink, so each one
+     * starts from a fresh encoder and can be decoded on its own.
+     */
+    gum_event_encoder_init (&encoder);
+    size = gum_event_encoder_encode (&encoder, ctx->event_buffer, n_events,
+        ctx->compact_buffer);
+    gum_event_sink_process_compact (ctx->sink, ctx->compact_buffer, size);
+  }
+  else
+  {
+    gum_event_sink_process_batch (ctx->sink, ctx->event_buffer, n_events);
+  }
+
+  ctx->event_cursor = ctx->event_buffer;
+  ctx->stalker->priv->read_cycles (&ctx->last_flush_cycles);
+}
+
+static void
+gum_exec_ctx_bind_to_current_thread (GumExecCtx * ctx)
+{
+  GUM_TLS_KEY_SET_VALUE (ctx->stalker->priv->exec_ctx, ctx);
+
+#ifdef GUM_STALKER_HAVE_SHARED_CACHE
+  if (ctx->hot_state_in_tls)
+  {
+    GumExecHotState * hot = &gum_exec_tls_hot_state;
+
+    /* Only one context at a time can run shared code on a given thread */
+    g_assert (hot->ctx == NULL);
+
+    /* app_stack is live if we got here from the infect thunk's prolog */
+    hot->ctx = ctx;
+    hot->current_block = ctx->private_hot.current_block;
+    hot->current_frame = ctx->private_hot.current_frame;
+    hot->first_frame = ctx->private_hot.first_frame;
+    hot->ret_cache = ctx->private_hot.ret_cache;
+    hot->resume_at = ctx->private_hot.resume_at;
+    hot->return_at = ctx->private_hot.return_at;
+    hot->fp_save_area = ctx->private_hot.fp_save_area;
+
+    ctx->hot = hot;
+  }
+#endif
+}
+
+static void
+gum_exec_ctx_invalidate_written_blocks (GumExecCtx * ctx)
+{
+  GumExecBlock * block;
+  gboolean any_invalidated = FALSE;
+
+  ctx->write_generation = g_atomic_int_get (&gum_page_write_generation);
+
+  gum_spinlock_acquire (&ctx->blocks_lock);
+  for (block = ctx->blocks; block != NULL; block = block->next)
+  {
+    GumAddressMapping * mapping;
+
+    if (block->real_snapshot != NULL || block->is_stale ||
+        gum_page_tracker_is_intact (block->real_begin, block->real_end))
+      continue;
+
+    gum_exec_block_unlink_incoming (block);
+    gum_exec_ctx_clear_inline_caches (ctx, block);
+    gum_exec_ctx_clear_ret_cache (ctx, block);
+
+    mapping = gum_exec_ctx_lookup_address_mapping (ctx, block->real_begin);
+    if (mapping != NULL && mapping->block == block)
+      gum_exec_ctx_remove_address_mapping (ctx, block->real_begin);
+
+    block->is_stale = TRUE;
+    any_invalidated = TRUE;
+  }
+  gum_spinlock_release (&ctx->blocks_lock);
+
+  if (any_invalidated)
+    ctx->stats.invalidations++;
+}
+
+static void
+gum_exec_ctx_activate (GumExecCtx * ctx)
+{
+  gum_exec_ctx_bind_to_current_thread (ctx);
+
+  ctx->hot->current_block = gum_exec_ctx_obtain_block_for (ctx,
+      ctx->infect_real_address, &ctx->hot->resume_at);
+}
+
+static void
+gum_exec_ctx_unbind_from_current_thread (GumExecCtx * ctx)
+{
+  GUM_TLS_KEY_SET_VALUE (ctx->stalker->priv->exec_ctx, NULL);
+
+#ifdef GUM_STALKER_HAVE_SHARED_CACHE
+  if (ctx->hot != &ctx->private_hot)
+  {
+    /*
+     * Generated code still jumps through the TLS copy on its way out, so it
+     * is left intact and only disowned.
+     */
+    ctx->private_hot = *ctx->hot;
+    ctx->hot->ctx = NULL;
+    ctx->hot = &ctx->private_hot;
+  }
+#endif
+}
+
+static void
+gum_exec_ctx_unfollow (GumExecCtx * ctx,
+                       gpointer resume_at)
+{
+  ctx->hot->resume_at = resume_at;
+
+  gum_exec_ctx_flush_events (ctx);
+  gum_exec_ctx_unbind_from_current_thread (ctx);
+  ctx->hot->current_block = NULL;
+  ctx->state = GUM_EXEC_CTX_DESTROY_PENDING;
+}
+
+static void
+gum_exec_ctx_request_unfollow (GumExecCtx * ctx)
+{
+  /*
+   * Blocks compiled from here on close their own gate once published, so
+   * the state must be visible before we walk the list.
+   */
+  g_atomic_int_set ((gint *) &ctx->state, GUM_EXEC_CTX_UNFOLLOW_PENDING);
+
+  gum_exec_ctx_close_gates (ctx);
+}
+
+static void
+gum_exec_ctx_close_gates (GumExecCtx * ctx)
+{
+  GumExecBlock * block;
+
+  gum_spinlock_acquire (&ctx->blocks_lock);
+  for (block = ctx->blocks; block != NULL; block = block->next)
+    gum_exec_block_close_gate (block);
+  gum_spinlock_release (&ctx->blocks_lock);
+}
+
+static gboolean
+gum_exec_ctx_has_executed (GumExecCtx * ctx)
+{
+  return ctx->hot->resume_at != NULL;
+}
+
+static void
+gum_exec_ctx_query_stats (GumExecCtx * ctx,
+                          GumStalkerStats * stats)
+{
+  guint64 now;
+
+  *stats = ctx->stats;
+
+  ctx->stalker->priv->read_cycles (&now);
+  stats->total_cycles = now - ctx->start_cycles;
+
+  stats->mapping_count = ctx->mapping_count;
+  stats->mapping_capacity = ctx->mapping_mask + 1;
+}
+
+static gboolean
+gum_exec_ctx_add_code_slab (GumExecCtx * ctx,
+                            gboolean force)
+{
+  GumStalkerPrivate * priv = ctx->stalker->priv;
+  guint n_pages, budget_pages;
+  GumSlab * slab;
+
+  if (ctx->code_slabs != NULL)
+  {
+    n_pages = MIN (ctx->code_slabs->n_pages * 2,
+        MAX (GUM_CODE_SLAB_MAX_SIZE / priv->page_size, 1));
+  }
+  else
+  {
+    n_pages = MAX (GUM_CODE_SLAB_INITIAL_SIZE / priv->page_size, 1);
+  }
+
+  budget_pages = MIN (priv->code_budget / priv->page_size, G_MAXINT);
+  if (g_atomic_int_exchange_and_add (&priv->code_pages, n_pages) + n_pages >
+      budget_pages && !force)
+  {
+    g_atomic_int_add (&priv->code_pages, -((gint) n_pages));
+    return FALSE;
+  }
+
+#if GLIB_SIZEOF_VOID_P == 8
+  {
+    GumAddressSpec spec;
+
+    /* Generated code addresses the context RIP-relative */
+    spec.near_address = ctx;
+    spec.max_distance = G_MAXINT32 - (n_pages * priv->page_size);
+
+    slab = (GumSlab *) gum_alloc_n_pages_near (n_pages, GUM_PAGE_RWX, &spec);
+  }
+#else
+  slab = (GumSlab *) gum_alloc_n_pages (n_pages, GUM_PAGE_RWX);
+#endif
+  slab->data = (guint8 *) (slab + 1);
+  slab->offset = 0;
+  slab->size = (n_pages * priv->page_size) - sizeof (GumSlab);
+  slab->n_pages = n_pages;
+  slab->retired = FALSE;
+  slab->pinned = FALSE;
+
+  slab->next = ctx->code_slabs;
+  ctx->code_slabs = slab;
+
+  ctx->stats.code_slab_size += slab->size;
+
+  return TRUE;
+}
+
+/*
+ * Drops all of the context's generated code so that it can be translated
+ * afresh, which is our way out once the stalker's code budget is used up.
+ *
+ * We are called while compiling, so the block that got us here still has to
+ * finish running its transfer code. Every other way into the evicted code is
+ * cut off, leaving only the frame that a call being resolved pushes on its
+ * way out. That frame is dropped on our next trip through the slow path, and
+ * the slabs are freed on the one after.
+ */
+static void
+gum_exec_ctx_evict_code (GumExecCtx * ctx)
+{
+  GumExecBlock * block;
+  GumSlab * slab, * next;
+
+  ctx->stats.evictions++;
+
+  gum_exec_ctx_unlink_all_blocks (ctx, TRUE);
+  gum_exec_ctx_clear_inline_caches (ctx, NULL);
+  ctx->inline_caches = NULL;
+  gum_exec_ctx_clear_ret_cache (ctx, NULL);
+  gum_exec_ctx_clear_address_mappings (ctx);
+  ctx->hot->current_frame = ctx->hot->first_frame;
+
+  gum_spinlock_acquire (&ctx->blocks_lock);
+  for (block = ctx->blocks; block != NULL; block = block->next)
+  {
+    if (block->has_call_to_excluded_range)
+      block->slab->pinned = TRUE;
+  }
+  ctx->blocks = NULL;
+  gum_spinlock_release (&ctx->blocks_lock);
+
+  for (slab = ctx->code_slabs; slab != NULL; slab = next)
+  {
+    next = slab->next;
+
+    slab->retired = TRUE;
+    if (slab->pinned)
+    {
+      slab->next = ctx->pinned_slabs;
+      ctx->pinned_slabs = slab;
+    }
+    else
+    {
+      slab->next = ctx->retired_slabs;
+      ctx->retired_slabs = slab;
+    }
+  }
+  ctx->code_slabs = NULL;
+
+  ctx->stats.code_slab_size = 0;
+  ctx->stats.code_slab_used = 0;
+}
+
+static void
+gum_exec_ctx_free_slabs (GumExecCtx * ctx,
+                         GumSlab * slabs)
+{
+  GumSlab * slab, * next;
+
+  for (slab = slabs; slab != NULL; slab = next)
+  {
+    next = slab->next;
+
+    g_atomic_int_add (&ctx->stalker->priv->code_pages,
+        -((gint) slab->n_pages));
+    gum_free_pages (slab);
+  }
+}
+
+static gpointer GUM_THUNK
+gum_exec_ctx_replace_current_block_with (GumExecCtx * ctx,
+                                         gpointer start_address)
+{
+  ctx->stats.slow_paths++;
+
+  if (ctx->condemned_slabs != NULL)
+  {
+    gum_exec_ctx_free_slabs (ctx, ctx->condemned_slabs);
+    ctx->condemned_slabs = NULL;
+  }
+
+  if (ctx->retired_slabs != NULL)
+  {
+    ctx->hot->current_frame = ctx->hot->first_frame;
+    ctx->condemned_slabs = ctx->retired_slabs;
+    ctx->retired_slabs = NULL;
+  }
+
+  if (ctx->invalidate_pending)
+  {
+    gum_exec_ctx_unlink_all_blocks (ctx, TRUE);
+    gum_exec_ctx_clear_inline_caches (ctx, NULL);
+    gum_exec_ctx_clear_ret_cache (ctx, NULL);
+    gum_exec_ctx_clear_address_mappings (ctx);
+
+    ctx->invalidate_pending = FALSE;
+    ctx->stats.invalidations++;
+  }
+
+  if (ctx->write_generation != g_atomic_int_get (&gum_page_write_generation))
+    gum_exec_ctx_invalidate_written_blocks (ctx);
+
+  if (start_address == gum_stalker_unfollow_me)
+  {
+    ctx->unfollow_called_while_still_following = TRUE;
+    ctx->hot->current_block = NULL;
+    ctx->hot->resume_at = start_address;
+  }
+  else if (ctx->state == GUM_EXEC_CTX_UNFOLLOW_PENDING)
+  {
+    gum_exec_ctx_unfollow (ctx, start_address);
+  }
+  else
+  {
+    GumReadCyclesFunc read_cycles = ctx->stalker->priv->read_cycles;
+    guint64 start, end;
+
+    read_cycles (&start);
+    ctx->hot->current_block = gum_exec_ctx_obtain_block_for (ctx,
+        start_address, &ctx->hot->resume_at);
+    read_cycles (&end);
+
+    ctx->stats.obtain_cycles += end - start;
+
+    /*
+     * Threads that emit few events would otherwise only hand them over
+     * when unfollowed, so we also flush every few milliseconds.
+     */
+    if (ctx->event_cursor != ctx->event_buffer &&
+        end - ctx->last_flush_cycles >= GUM_EXEC_EVENT_FLUSH_CYCLES)
+    {
+      gum_exec_ctx_flush_events (ctx);
+    }
+  }
+
+  return ctx->hot->resume_at;
+}
+
+static gpointer
+gum_exec_ctx_replace_current_block_from_cache (GumExecInlineCache * ic,
+                                               gpointer start_address)
+{
+  GumExecCtx * ctx = ic->ctx;
+  gpointer resume_at;
+  GumExecBlock * block;
+
+  ic->misses++;
+  ctx->stats.inline_cache_misses++;
+
+  if (ic->can_run_natively &&
+      gum_stalker_is_excluding (ctx->stalker, start_address))
+  {
+    /*
+     * Cached with the target itself as code address, which the call site
+     * recognizes and calls natively
+     */
+    resume_at = start_address;
+    ic->block->has_call_to_excluded_range = TRUE;
+    ctx->hot->current_block = ic->block;
+    ctx->hot->resume_at = resume_at;
+  }
+  else
+  {
+    resume_at = gum_exec_ctx_replace_current_block_with (ctx, start_address);
+  }
+
+  block = ctx->hot->current_block;
+  if (block != NULL && block->ctx == ctx && gum_exec_block_can_link (block))
+  {
+    GumExecInlineCacheEntry * entry = &ic->entries[ic->next_victim];
+
+    entry->real_address = start_address;
+    entry->code_address = resume_at;
+    entry->block = block;
+
+    ic->next_victim = (ic->next_victim + 1) % GUM_EXEC_INLINE_CACHE_SIZE;
+  }
+
+  return resume_at;
+}
+
+static gpointer GUM_THUNK
+gum_exec_ctx_replace_current_block_for_call (GumExecCtx * ctx,
+                                             gpointer start_address)
+{
+  GumExecBlock * block = ctx->hot->current_block;
+
+  if (block != NULL && gum_stalker_is_excluding (ctx->stalker, start_address))
+  {
+    /* Without linking the calling block is still the current one */
+    ctx->stats.slow_paths++;
+    block->has_call_to_excluded_range = TRUE;
+    ctx->hot->resume_at = start_address;
+    return start_address;
+  }
+
+  return gum_exec_ctx_replace_current_block_from_call (ctx, start_address);
+}
+
+static gpointer GUM_THUNK
+gum_exec_ctx_replace_current_block_from_call (GumExecCtx * ctx,
+                                              gpointer start_address)
+{
+  ctx->stats.call_slow_paths++;
+
+  return gum_exec_ctx_replace_current_block_with (ctx, start_address);
+}
+
+static gpointer GUM_THUNK
+gum_exec_ctx_replace_current_block_from_jmp (GumExecCtx * ctx,
+                                             gpointer start_address)
+{
+  ctx->stats.jmp_slow_paths++;
+
+  return gum_exec_ctx_replace_current_block_with (ctx, start_address);
+}
+
+static gpointer GUM_THUNK
+gum_exec_ctx_replace_current_block_from_ret (GumExecCtx * ctx,
+                                             gpointer start_address)
+{
+  gpointer resume_at;
+  GumExecBlock * block;
+
+  ctx->stats.ret_slow_paths++;
+
+  resume_at = gum_exec_ctx_replace_current_block_with (ctx, start_address);
+
+  block = ctx->hot->current_block;
+  if (block != NULL && block->ctx == ctx && gum_exec_block_can_link (block))
+  {
+    GumExecFrame * entry =
+        &ctx->ret_cache[GUM_EXEC_RET_CACHE_INDEX (start_address)];
+
+    entry->real_address = start_address;
+    entry->code_address = resume_at;
+  }
+
+  return resume_at;
+}
+
+static void
+gum_exec_ctx_create_thunks (GumExecCtx * ctx)
+{
+  GumX86Writer cw;
+
+  g_assert (ctx->thunks == NULL);
+
+  ctx->thunks = gum_alloc_n_pages (1, GUM_PAGE_RWX);
+  gum_x86_writer_init (&cw, ctx->thunks);
+
+  ctx->flush_events_thunk = gum_x86_writer_cur (&cw);
+  gum_exec_ctx_write_prolog (ctx, GUM_PROLOG_MINIMAL, NULL, &cw);
+#if GLIB_SIZEOF_VOID_P == 4
+  gum_x86_writer_put_sub_reg_imm (&cw, GUM_REG_XSP, 12);
+#endif
+  gum_x86_writer_put_call_with_arguments (&cw,
+      GUM_FUNCPTR_TO_POINTER (gum_exec_ctx_flush_events), 1,
+      GUM_ARG_POINTER, ctx);
+#if GLIB_SIZEOF_VOID_P == 4
+  gum_x86_writer_put_add_reg_imm (&cw, GUM_REG_XSP, 12);
+#endif
+  gum_exec_ctx_write_epilog (ctx, GUM_PROLOG_MINIMAL, &cw);
+  gum_x86_writer_put_ret (&cw);
+  gum_x86_writer_flush (&cw);
+
+  /*
+   * Entered from a block's unfollow stub with the red zone skipped, XAX
+   * pushed and the block's real address in XAX.
+   */
+  ctx->unfollow_thunk = gum_x86_writer_cur (&cw);
+  gum_exec_ctx_write_mov_hot_ptr_reg (ctx, GUM_EXEC_HOT_OFFSET (resume_at),
+      GUM_REG_XAX, &cw);
+  gum_x86_writer_put_pop_reg (&cw, GUM_REG_XAX);
+  gum_x86_writer_put_lea_reg_reg_offset (&cw, GUM_REG_XSP, GUM_REG_XSP,
+      GUM_RED_ZONE_MAX_SIZE);
+  gum_exec_ctx_write_prolog (ctx, GUM_PROLOG_MINIMAL, NULL, &cw);
+  gum_exec_ctx_write_mov_reg_hot_ptr (ctx, GUM_REG_XAX,
+      GUM_EXEC_HOT_OFFSET (resume_at), &cw);
+#if GLIB_SIZEOF_VOID_P == 4
+  gum_x86_writer_put_sub_reg_imm (&cw, GUM_REG_XSP, 8);
+#endif
+  gum_x86_writer_put_call_with_arguments (&cw,
+      GUM_FUNCPTR_TO_POINTER (gum_exec_ctx_unfollow), 2,
+      GUM_ARG_POINTER, ctx,
+      GUM_ARG_REGISTER, GUM_REG_XAX);
+#if GLIB_SIZEOF_VOID_P == 4
+  gum_x86_writer_put_add_reg_imm (&cw, GUM_REG_XSP, 8);
+#endif
+  gum_exec_ctx_write_epilog (ctx, GUM_PROLOG_MINIMAL, &cw);
+  gum_exec_ctx_write_jmp_hot_ptr (ctx, GUM_EXEC_HOT_OFFSET (resume_at), &cw);
+  gum_x86_writer_flush (&cw);
+
+  ctx->infect_thunk = gum_x86_writer_cur (&cw);
+
+  gum_x86_writer_free (&cw);
+}
+
+static void
+gum_exec_ctx_destroy_thunks (GumExecCtx * ctx)
+{
+  gum_free_pages (ctx->thunks);
+}
+
+#if ENABLE_DEBUG
+
+static void
+gum_disasm (guint8 * code, guint size, const gchar * prefix)
+{
+  ud_t ud_obj;
+
+  ud_init (&ud_obj);
+  ud_set_input_buffer (&ud_obj, code, size);
+  ud_set_mode (&ud_obj, GUM_CPU_MODE);
+  ud_set_pc (&ud_obj, GPOINTER_TO_SIZE (code));
+  ud_set_syntax (&ud_obj, UD_SYN_INTEL);
+
+  while (ud_disassemble (&ud_obj))
+  {
+    printf ("%s0x%" G_GINT64_MODIFIER "x\t%s\n",
+        prefix, (guint64) ud_insn_off (&ud_obj), ud_insn_asm (&ud_obj));
+  }
+}
+
+static void
+gum_hexdump (guint8 * data, guint size, const gchar * prefix)
+{
+  guint i, line_offset;
+
+  line_offset = 0;
+  for (i = 0; i != size; i++)
+  {
+    if (line_offset == 0)
+      printf ("%s0x%" G_GINT64_MODIFIER "x\t%02x", prefix, (guint64) data + i,
+          data[i]);
+    else
+      printf (" %02x", data[i]);
+
+    line_offset++;
+    if (line_offset == 16 && i != size - 1)
+    {
+      printf ("\n");
+      line_offset = 0;
+    }
+  }
+
+  if (line_offset != 0)
+    printf ("\n");
+}
+
+#endif
+
+static GumExecBlock *
+gum_exec_ctx_obtain_block_for (GumExecCtx * ctx,
+                               gpointer real_address,
+                               gpointer * code_address)
+{
+  GumExecBlock * block;
+  guint recompile_count = 0;
+
+  if (ctx->stalker->priv->trust_threshold >= 0)
+  {
+    block = gum_exec_block_obtain (ctx, real_address, code_address);
+    if (block != NULL)
+    {
+      if (block->real_snapshot == NULL ||
+          block->recycle_count >= ctx->stalker->priv->trust_threshold ||
+          memcmp (real_address, block->real_snapshot,
+            block->real_end - block->real_begin) == 0)
+      {
+        block->recycle_count++;
+        return block;
+      }
+      else
+      {
+        recompile_count = block->recompile_count + 1;
+
+        gum_exec_block_unlink_incoming (block);
+        gum_exec_ctx_clear_inline_caches (ctx, block);
+        gum_exec_ctx_clear_ret_cache (ctx, block);
+        gum_exec_ctx_remove_address_mapping (ctx, real_address);
+      }
+    }
+
+    if (ctx->hot_state_in_tls)
+    {
+      block = gum_exec_ctx_obtain_shared_block_for (ctx, real_address,
+          code_address);
+      if (block != NULL)
+        return block;
+    }
+  }
+
+  block = gum_exec_ctx_compile_block (ctx, real_address, FALSE,
+      code_address);
+  if (recompile_count != 0)
+  {
+    block->recompile_count = recompile_count;
+    ctx->stats.blocks_recompiled++;
+  }
+
+  /*
+   * Evicted, invalidated and recompiled blocks come through here again, so
+   * consumers that want unique coverage must dedup on the block's start.
+   */
+  if ((ctx->sink_mask & GUM_BLOCK) != 0)
+  {
+    GumEvent ev;
+
+    ev.block.type = GUM_BLOCK;
+    ev.block.begin = block->real_begin;
+    ev.block.end = block->real_end;
+
+    gum_exec_ctx_emit_event (ctx, &ev);
+  }
+
+  return block;
+}
+
+static GumExecBlock *
+gum_exec_ctx_obtain_shared_block_for (GumExecCtx * ctx,
+                                      gpointer real_address,
+                                      gpointer * code_address)
+{
+  GumStalkerPrivate * priv = ctx->stalker->priv;
+  GumExecCtx * shared = priv->shared_ctx;
+  GumExecBlock * block;
+
+  block = gum_exec_block_obtain_shared (shared, real_address, code_address);
+  if (block == NULL)
+  {
+    g_mutex_lock (priv->shared_mutex);
+    block = gum_exec_block_obtain (shared, real_address, code_address);
+    if (block == NULL)
+      block = gum_exec_ctx_compile_block (shared, real_address, FALSE,
+          code_address);
+    g_mutex_unlock (priv->shared_mutex);
+
+    return block;
+  }
+
+  if (block->real_snapshot == NULL)
+  {
+    /* Shared blocks are not on any list the write handling walks */
+    if (gum_page_tracker_is_intact (block->real_begin, block->real_end))
+    {
+      g_atomic_int_inc (&block->recycle_count);
+      return block;
+    }
+  }
+  else if (block->recycle_count >= priv->trust_threshold ||
+      memcmp (real_address, block->real_snapshot,
+        block->real_end - block->real_begin) == 0)
+  {
+    g_atomic_int_inc (&block->recycle_count);
+    return block;
+  }
+
+  /*
+   * The code changed under one of the threads sharing the block, so give
+   * this thread a private copy rather than pulling it from under the others.
+   */
+  return NULL;
+}
+
+static GumExecBlock *
+gum_exec_ctx_compile_block (GumExecCtx * ctx,
+                            gpointer real_address,
+                            gboolean as_trace,
+                            gpointer * code_address)
+{
+  GumStalkerPrivate * priv = ctx->stalker->priv;
+  GumExecBlock * block;
+  GumX86Writer * cw = &ctx->code_writer;
+  GumX86Relocator * rl = &ctx->relocator;
+  GumGeneratorContext gc;
+  GumStalkerIterator iterator;
+  gboolean counts_executions;
+
+  /* Traces would change what the block events report */
+  counts_executions = !as_trace && !ctx->is_shared &&
+      priv->hot_trace_threshold >= 0 &&
+      (ctx->sink_mask & (GUM_BLOCK | GUM_BLOCK_EXEC)) == 0;
+
+  block = gum_exec_block_new (ctx);
+  block->is_trace = as_trace;
+  if (counts_executions)
+    block->trace_countdown = MAX (priv->hot_trace_threshold, 1);
+  *code_address = block->code_begin;
+  if (!ctx->is_shared)
+  {
+    gum_exec_ctx_add_address_mapping (ctx, real_address, block->code_begin,
+        block);
+  }
+  gum_x86_writer_reset (cw, block->code_begin);
+  gum_x86_relocator_reset (rl, real_address, cw);
+
+  gc.instruction = NULL;
+  gc.relocator = rl;
+  gc.code_writer = cw;
+  gc.continuation_real_address = NULL;
+  gc.opened_prolog = GUM_PROLOG_NONE;
+  gc.state_preserve_stack_offset = 0;
+  gc.accumulated_stack_delta = 0;
+  gc.n_link_sites = 0;
+  gc.block_end_slot = NULL;
+  gc.n_analyzed_insns = 0;
+  gc.insn_index = 0;
+  gc.event_reg = GUM_REG_XAX;
+  gc.scratch_reg = GUM_REG_XCX;
+  gc.hot_resume_code = NULL;
+  gc.hot_check_saves_flags = FALSE;
+  gc.is_trace = as_trace;
+  gc.trace_head = real_address;
+  gc.n_trace_exits = 0;
+
+  /* Only the lightweight event frames and hot checks make use of it */
+  if ((ctx->event_buffer != NULL &&
+      (ctx->sink_mask & (GUM_EXEC | GUM_BLOCK_EXEC)) != 0) ||
+      counts_executions)
+  {
+    gum_exec_block_analyze_liveness (real_address, &gc);
+  }
+
+#if ENABLE_DEBUG
+  printf ("\n\n***\n\nCreating block for %p:\n", real_address);
+#endif
+
+  if (!ctx->is_shared)
+    gum_exec_block_write_gate (block, &gc);
+
+  if (counts_executions)
+    gum_exec_block_write_hot_check (block, &gc);
+
+  if ((ctx->sink_mask & GUM_BLOCK_EXEC) != 0)
+    gum_exec_block_write_block_exec_event_code (block, real_address, &gc);
+
+  iterator.exec_block = block;
+  iterator.generator_context = &gc;
+  iterator.instruction.ud = NULL;
+  iterator.requirements = GUM_REQUIRE_NOTHING;
+  iterator.is_kept = FALSE;
+  iterator.is_done = FALSE;
+
+  if (priv->transformer != NULL)
+  {
+    GumStalkerWriter output;
+
+    output.x86 = cw;
+    priv->transformer (&iterator, &output, priv->transformer_data);
+  }
+
+  /* Whatever the transformer didn't get to is kept as is */
+  while (gum_stalker_iterator_next (&iterator, NULL))
+    gum_stalker_iterator_keep (&iterator);
+
+  if (gc.continuation_real_address != NULL)
+  {
+    GumBranchTarget continue_target = { 0, };
+
+    continue_target.is_indirect = FALSE;
+    continue_target.absolute_address = gc.continuation_real_address;
+
+    gum_exec_block_write_jmp_transfer_code (block, &continue_target, &gc);
+  }
+
+  gum_x86_writer_put_int3 (cw); /* should never get here */
+
+  gum_exec_block_write_trace_exits (block, &gc);
+  if (gc.hot_resume_code != NULL)
+    gum_exec_block_write_hot_stub (block, &gc);
+
+  if (!ctx->is_shared)
+    gum_exec_block_write_unfollow_stub (block, real_address, &gc);
+
+  gum_x86_writer_flush (cw);
+
+  block->code_end = (guint8 *) gum_x86_writer_cur (cw);
+
+  block->real_begin = (guint8 *) rl->input_start;
+  block->real_end = (guint8 *) rl->input_cur;
+
+  if (gc.block_end_slot != NULL)
+    *gc.block_end_slot = block->real_end;
+
+  gum_exec_block_commit (block);
+
+  ctx->stats.blocks_compiled++;
+  ctx->stats.bytes_emitted += block->code_end - block->code_begin;
+  ctx->stats.code_slab_used +=
+      (block->slab->data + block->slab->offset) - (guint8 *) block;
+
+  gum_exec_block_link_pending_sites (block, &gc);
+
+  /* Other threads may pick it up as soon as it's mapped */
+  if (ctx->is_shared)
+  {
+    gum_exec_ctx_add_address_mapping (ctx, real_address, block->code_begin,
+        block);
+  }
+  else
+  {
+    gum_spinlock_acquire (&ctx->blocks_lock);
+    block->next = ctx->blocks;
+    ctx->blocks = block;
+    gum_spinlock_release (&ctx->blocks_lock);
+
+    /* An unfollow request may have walked the list before we got on it */
+    if (g_atomic_int_get ((gint *) &ctx->state) ==
+        GUM_EXEC_CTX_UNFOLLOW_PENDING)
+    {
+      gum_exec_block_close_gate (block);
+    }
+  }
+
+  return block;
+}
+
+gboolean
+gum_stalker_iterator_next (GumStalkerIterator * self,
+                           const GumStalkerInstruction ** insn)
+{
+  GumExecBlock * block = self->exec_block;
+  GumGeneratorContext * gc = self->generator_context;
+  GumX86Relocator * rl = gc->relocator;
+  GumX86Writer * cw = gc->code_writer;
+  GumInstruction * instruction = &self->instruction;
+  guint n_read;
+
+  if (self->is_done)
+    return FALSE;
+
+  if (instruction->ud != NULL)
+  {
+    if (!self->is_kept)
+    {
+      gum_x86_relocator_skip_one_no_label (rl);
+
+      /* Carry on past a dropped branch as if it was never there */
+      if (gum_x86_relocator_eob (rl))
+      {
+        gc->continuation_real_address = instruction->end;
+        self->is_done = TRUE;
+      }
+    }
+
+#if ENABLE_DEBUG
+    {
+      guint8 * begin = block->code_end;
+      block->code_end = gum_x86_writer_cur (cw);
+      gum_disasm (begin, block->code_end - begin, "\t");
+      gum_hexdump (begin, block->code_end - begin, "\t; ");
+    }
+#else
+    block->code_end = gum_x86_writer_cur (cw);
+#endif
+
+    gc->insn_index++;
+
+    if (!self->is_done)
+    {
+      if (gum_exec_block_is_full (block, gc))
+      {
+        gc->continuation_real_address = instruction->end;
+        self->is_done = TRUE;
+      }
+      else if (instruction->ud->mnemonic == UD_Icall)
+      {
+        /* We always stop on a call unless it's to an excluded range */
+        if ((self->requirements & GUM_REQUIRE_RELOCATION) != 0)
+          rl->eob = FALSE;
+        else
+          self->is_done = TRUE;
+      }
+      else if (gum_x86_relocator_eob (rl))
+      {
+        self->is_done = TRUE;
+      }
+    }
+
+    if (self->is_done)
+    {
+      gc->instruction = NULL;
+      return FALSE;
+    }
+  }
+
+  n_read = gum_x86_relocator_read_one (rl, NULL);
+  g_assert_cmpuint (n_read, !=, 0);
+
+  instruction->ud = gum_x86_relocator_peek_next_write_insn (rl);
+  instruction->begin = gum_x86_relocator_peek_next_write_source (rl);
+  instruction->end = instruction->begin + ud_insn_len (instruction->ud);
+
+  g_assert (instruction->ud != NULL && instruction->begin != NULL);
+
+#if ENABLE_DEBUG
+  gum_disasm (instruction->begin, instruction->end - instruction->begin, "");
+  gum_hexdump (instruction->begin, instruction->end - instruction->begin,
+      "; ");
+#endif
+
+  gc->instruction = instruction;
+  self->requirements = GUM_REQUIRE_NOTHING;
+  self->is_kept = FALSE;
+
+  self->public_instruction.begin = instruction->begin;
+  self->public_instruction.end = instruction->end;
+  self->public_instruction.ud = instruction->ud;
+  if (insn != NULL)
+    *insn = &self->public_instruction;
+
+  return TRUE;
+}
+
+void
+gum_stalker_iterator_keep (GumStalkerIterator * self)
+{
+  GumExecBlock * block = self->exec_block;
+  GumExecCtx * ctx = block->ctx;
+  GumGeneratorContext * gc = self->generator_context;
+  GumX86Relocator * rl = gc->relocator;
+  GumX86Writer * cw = gc->code_writer;
+  GumInstruction * insn = &self->instruction;
+  GumVirtualizationRequirements requirements = GUM_REQUIRE_NOTHING;
+
+  g_assert (insn->ud != NULL && !self->is_kept && !self->is_done);
+
+  if ((ctx->sink_mask & GUM_EXEC) != 0)
+    gum_exec_block_write_exec_event_code (block, gc);
+
+  switch (insn->ud->mnemonic)
+  {
+    case UD_Icall:
+    case UD_Ijmp:
+      requirements = gum_exec_block_virtualize_branch_insn (block, gc);
+      break;
+    case UD_Iret:
+      requirements = gum_exec_block_virtualize_ret_insn (block, gc);
+      break;
+    case UD_Isysenter:
+      requirements = gum_exec_block_virtualize_sysenter_insn (block, gc);
+      break;
+    default:
+      if (gum_mnemonic_is_jcc (insn->ud->mnemonic))
+        requirements = gum_exec_block_virtualize_branch_insn (block, gc);
+      else
+        requirements = GUM_REQUIRE_RELOCATION;
+      break;
+  }
+
+  gum_exec_block_close_prolog (block, gc);
+
+  if ((requirements & GUM_REQUIRE_RELOCATION) != 0)
+  {
+    if ((requirements & GUM_REQUIRE_MAPPING) != 0)
+    {
+      gum_exec_ctx_add_address_mapping (ctx, insn->begin,
+          gum_x86_writer_cur (cw), block);
+    }
+
+    gum_x86_relocator_write_one_no_label (rl);
+
+    if ((requirements & GUM_REQUIRE_MAPPING) != 0)
+    {
+      gum_exec_ctx_add_address_mapping (ctx, insn->end,
+          gum_x86_writer_cur (cw), block);
+    }
+  }
+  else if ((requirements & GUM_REQUIRE_SINGLE_STEP) != 0)
+  {
+    gum_x86_relocator_skip_one_no_label (rl);
+    gum_exec_block_write_single_step_transfer_code (block, gc);
+  }
+
+  self->requirements = requirements;
+  self->is_kept = TRUE;
+}
+
+static void
+gum_exec_ctx_promote_to_trace (GumExecCtx * ctx,
+                               GumExecBlock * block,
+                               gpointer resume_at)
+{
+  GumAddressMapping * mapping;
+  GumExecBlock * trace;
+
+  ctx->hot->current_block = block;
+  ctx->hot->resume_at = resume_at;
+
+  /* Anything pending is left for the next trip through a slow path */
+  if (ctx->invalidate_pending || block->is_stale ||
+      ctx->state != GUM_EXEC_CTX_ACTIVE ||
+      ctx->write_generation != g_atomic_int_get (&gum_page_write_generation))
+  {
+    goto try_again_later;
+  }
+
+  mapping = gum_exec_ctx_lookup_address_mapping (ctx, block->real_begin);
+  if (mapping == NULL || mapping->block != block)
+    goto try_again_later;
+
+  /* The block stays intact for anyone still holding on to it */
+  gum_exec_block_unlink_incoming (block);
+  gum_exec_ctx_clear_inline_caches (ctx, block);
+  gum_exec_ctx_clear_ret_cache (ctx, block);
+  gum_exec_ctx_remove_address_mapping (ctx, block->real_begin);
+
+  trace = gum_exec_ctx_compile_block (ctx, block->real_begin, TRUE,
+      &ctx->hot->resume_at);
+  ctx->hot->current_block = trace;
+
+  ctx->stats.traces_compiled++;
+
+  return;
+
+try_again_later:
+  block->trace_countdown = MAX (ctx->stalker->priv->hot_trace_threshold, 1);
+}
+
+static gint
+gum_exec_ctx_query_block_heat (GumExecCtx * ctx,
+                               gpointer real_address,
+                               GumGeneratorContext * gc)
+{
+  GumAddressMapping * mapping;
+  GumExecBlock * block;
+  gint threshold;
+
+  if (real_address == gc->trace_head)
+    return G_MAXINT;
+
+  mapping = gum_exec_ctx_lookup_address_mapping (ctx, real_address);
+  if (mapping == NULL || mapping->block->real_begin != real_address)
+    return 0;
+  block = mapping->block;
+
+  threshold = MAX (ctx->stalker->priv->hot_trace_threshold, 1);
+  if (block->is_trace || block->trace_countdown <= 0)
+    return threshold;
+  if (block->trace_countdown > threshold)
+    return 0;
+
+  return threshold - block->trace_countdown;
+}
+
+static void
+gum_exec_ctx_clear_address_mappings (GumExecCtx * ctx)
+{
+  if (ctx->mapping_count == 0)
+    return;
+
+  memset (ctx->mapping_slab.data, 0, ctx->mapping_slab.offset);
+  ctx->mapping_count = 0;
+}
+
+static void
 gum_exec_ctx_add_address_mapping (GumExecCtx * ctx,
                                   gpointer real_address,
                                   gpointer code_address,
                                   GumExecBlock * block)
 {
-  GumSlab * slab;
+  GumAddressMapping * mappings;
+  guint i;
 
   if (ctx->stalker->priv->trust_threshold < 0)
   {
     return;
   }
 
-  for (slab = &ctx->mapping_slab; slab != NULL; slab = slab->next)
+  mappings = (GumAddressMapping *) ctx->mapping_slab.data;
+
+  for (i = gum_address_mapping_hash (real_address) & ctx->mapping_mask;
+      mappings[i].real_address != NULL;
+      i = (i + 1) & ctx->mapping_mask)
   {
-    if (slab->size - slab->offset >= sizeof (GumAddressMapping))
+    if (mappings[i].real_address == real_address)
     {
-      GumAddressMapping * mapping, * cur;
-      guint offset_from_end;
+      mappings[i].code_address = code_address;
+      mappings[i].block = block;
+      return;
+    }
+  }
 
-      mapping = NULL;
+  if (ctx->mapping_count == ctx->mapping_limit)
+  {
+    gum_exec_ctx_grow_address_mappings (ctx);
+    gum_exec_ctx_add_address_mapping (ctx, real_address, code_address,
+        block);
+    return;
+  }
 
-      for (cur = (GumAddressMapping *) (slab->data + slab->offset -
-            sizeof (GumAddressMapping)), offset_from_end = 0;
-          cur >= (GumAddressMapping *) slab->data;
-          cur--, offset_from_end++)
-      {
-        if (real_address >= cur->real_address)
-        {
-          if (offset_from_end > 0)
-          {
-            mapping = cur + 1;
-            memmove (cur + 2, cur + 1, offset_from_end * sizeof (GumAddressMapping));
-          }
-          break;
-        }
-        else if (cur == (GumAddressMapping *) slab->data)
-        {
-          mapping = cur;
-          memmove (cur + 1, cur, (offset_from_end + 1) * sizeof (GumAddressMapping));
-        }
-      }
+  /* The key goes in last as the shared table is read without locking */
+  mappings[i].code_address = code_address;
+  mappings[i].block = block;
+  g_atomic_pointer_set (&mappings[i].real_address, real_address);
+  ctx->mapping_count++;
+}
 
-      if (mapping == NULL)
-        mapping = (GumAddressMapping *) (slab->data + slab->offset);
+static void
+gum_exec_ctx_remove_address_mapping (GumExecCtx * ctx,
+                                     gpointer real_address)
+{
+  GumAddressMapping * mappings, * hole;
+  guint i;
 
-      mapping->real_address = real_address;
-      mapping->code_address = code_address;
-      mapping->block = block;
+  hole = gum_exec_ctx_lookup_address_mapping (ctx, real_address);
+  if (hole == NULL)
+    return;
 
-      slab->offset += sizeof (GumAddressMapping);
+  mappings = (GumAddressMapping *) ctx->mapping_slab.data;
 
-      break;
+  /*
+   * Backward-shift deletion: move any entry that would no longer be
+   * reachable from its home slot into the hole, so lookups can keep
+   * stopping at the first empty slot and no tombstones are needed.
+   */
+  for (i = ((hole - mappings) + 1) & ctx->mapping_mask;
+      mappings[i].real_address != NULL;
+      i = (i + 1) & ctx->mapping_mask)
+  {
+    guint home, hole_index;
+
+    home = gum_address_mapping_hash (mappings[i].real_address) &
+        ctx->mapping_mask;
+    hole_index = hole - mappings;
+
+    if (((i - home) & ctx->mapping_mask) >=
+        ((i - hole_index) & ctx->mapping_mask))
+    {
+      *hole = mappings[i];
+      hole = &mappings[i];
     }
   }
+
+  hole->real_address = NULL;
+  hole->code_address = NULL;
+  hole->block = NULL;
+  ctx->mapping_count--;
 }
 
 static void
-gum_exec_ctx_remove_address_mapping (GumExecCtx * ctx,
+gum_exec_ctx_grow_address_mappings (GumExecCtx * ctx)
+{
+  GumAddressMapping * old_mappings, * new_mappings;
+  guint old_mask, new_mask, page_size, n_pages, i;
+  gsize size;
+
+  old_mappings = (GumAddressMapping *) ctx->mapping_slab.data;
+  old_mask = ctx->mapping_mask;
+  new_mask = (old_mask << 1) | 1;
+
+  page_size = ctx->stalker->priv->page_size;
+  size = (new_mask + 1) * sizeof (GumAddressMapping);
+  n_pages = (size + page_size - 1) / page_size;
+  new_mappings = (GumAddressMapping *) gum_alloc_n_pages (n_pages,
+      GUM_PAGE_RW);
+
+  for (i = 0; i <= old_mask; i++)
+  {
+    GumAddressMapping * m = &old_mappings[i];
+    guint j;
+
+    if (m->real_address == NULL)
+      continue;
+
+    j = gum_address_mapping_hash (m->real_address) & new_mask;
+    while (new_mappings[j].real_address != NULL)
+      j = (j + 1) & new_mask;
+    new_mappings[j] = *m;
+  }
+
+  /*
+   * Readers of the shared table load the mask before the table, so they
+   * either see the old mask, which is safe to use with both tables, or the
+   * new table.
+   */
+  g_atomic_pointer_set (&ctx->mapping_slab.data, (guint8 *) new_mappings);
+  g_atomic_int_set ((volatile gint *) &ctx->mapping_mask, new_mask);
+  ctx->mapping_slab.size = n_pages * page_size;
+  ctx->mapping_slab.offset = size;
+  ctx->mapping_limit = ((new_mask + 1) / 100) * GUM_MAPPING_MAX_LOAD_PERCENT;
+
+  if ((guint8 *) old_mappings == ctx->initial_mappings)
+    return;
+
+  if (ctx->is_shared)
+    ctx->outgrown_mappings = g_slist_prepend (ctx->outgrown_mappings,
+        old_mappings);
+  else
+    gum_free_pages (old_mappings);
+}
+
+static GumAddressMapping *
+gum_exec_ctx_lookup_address_mapping (GumExecCtx * ctx,
                                      gpointer real_address)
 {
-  GumAddressMapping mapping;
-  GumSlab * slab;
+  GumAddressMapping * mappings;
+  guint i;
 
-  mapping.real_address = real_address;
-  mapping.code_address = NULL;
-  mapping.block = NULL;
+  mappings = (GumAddressMapping *) ctx->mapping_slab.data;
 
-  for (slab = &ctx->mapping_slab; slab != NULL; slab = slab->next)
+  for (i = gum_address_mapping_hash (real_address) & ctx->mapping_mask;
+      mappings[i].real_address != NULL;
+      i = (i + 1) & ctx->mapping_mask)
   {
-    GumAddressMapping * match;
+    if (mappings[i].real_address == real_address)
+      return &mappings[i];
+  }
 
-    match = bsearch (&mapping, slab->data,
-        slab->offset / sizeof (GumAddressMapping), sizeof (GumAddressMapping),
-        gum_address_mapping_compare);
-    if (match != NULL)
-    {
-      GumAddressMapping * last_mapping;
+  return NULL;
+}
 
-      last_mapping = (GumAddressMapping *) (slab->data + slab->offset -
-          sizeof (GumAddressMapping));
-      if (match != last_mapping)
-      {
-        memmove (match, match + 1, (slab->data + slab->offset) -
-            ((guint8 *) (match + 1)));
-      }
-      slab->offset -= sizeof (GumAddressMapping);
+static void
+gum_exec_ctx_write_mov_reg_hot_ptr (GumExecCtx * ctx,
+                                    GumCpuReg dst_reg,
+                                    guint field_offset,
+                                    GumX86Writer * cw)
+{
+  if (ctx->hot_state_in_tls)
+  {
+    guint32 offset = ctx->stalker->priv->hot_state_tls_offset + field_offset;
 
-      return;
-    }
+#if GLIB_SIZEOF_VOID_P == 8
+    gum_x86_writer_put_mov_reg_fs_u32_ptr (cw, dst_reg, offset);
+#else
+    gum_x86_writer_put_mov_reg_gs_u32_ptr (cw, dst_reg, offset);
+#endif
+  }
+  else
+  {
+    gum_x86_writer_put_mov_reg_near_ptr (cw, dst_reg,
+        GUM_ADDRESS (ctx->hot) + field_offset);
+  }
+}
+
+static void
+gum_exec_ctx_write_mov_hot_ptr_reg (GumExecCtx * ctx,
+                                    guint field_offset,
+                                    GumCpuReg src_reg,
+                                    GumX86Writer * cw)
+{
+  if (ctx->hot_state_in_tls)
+  {
+    guint32 offset = ctx->stalker->priv->hot_state_tls_offset + field_offset;
+
+#if GLIB_SIZEOF_VOID_P == 8
+    gum_x86_writer_put_mov_fs_u32_ptr_reg (cw, offset, src_reg);
+#else
+    gum_x86_writer_put_mov_gs_u32_ptr_reg (cw, offset, src_reg);
+#endif
+  }
+  else
+  {
+    gum_x86_writer_put_mov_near_ptr_reg (cw,
+        GUM_ADDRESS (ctx->hot) + field_offset, src_reg);
+  }
+}
+
+static void
+gum_exec_ctx_write_jmp_hot_ptr (GumExecCtx * ctx,
+                                guint field_offset,
+                                GumX86Writer * cw)
+{
+  if (ctx->hot_state_in_tls)
+  {
+    guint32 offset = ctx->stalker->priv->hot_state_tls_offset + field_offset;
+
+#if GLIB_SIZEOF_VOID_P == 8
+    gum_x86_writer_put_jmp_fs_u32_ptr (cw, offset);
+#else
+    gum_x86_writer_put_jmp_gs_u32_ptr (cw, offset);
+#endif
+  }
+  else
+  {
+    gum_x86_writer_put_jmp_near_ptr (cw,
+        GUM_ADDRESS (ctx->hot) + field_offset);
+  }
+}
+
+static void
+gum_exec_ctx_write_mov_reg_ctx (GumExecCtx * ctx,
+                                GumCpuReg dst_reg,
+                                GumX86Writer * cw)
+{
+  if (ctx->is_shared)
+  {
+    gum_exec_ctx_write_mov_reg_hot_ptr (ctx, dst_reg,
+        GUM_EXEC_HOT_OFFSET (ctx), cw);
+  }
+  else
+  {
+    gum_x86_writer_put_mov_reg_address (cw, dst_reg, GUM_ADDRESS (ctx));
   }
 }
 
@@ -1413,12 +4514,10 @@ gum_exec_ctx_write_prolog (GumExecCtx * ctx,
                            gpointer ip,
                            GumX86Writer * cw)
 {
-  guint8 fxsave[] = {
-    0x0f, 0xae, 0x04, 0x24 /* fxsave [esp] */
-  };
+  guint32 fp_save_mask;
 
-  gum_x86_writer_put_mov_near_ptr_reg (cw, GUM_ADDRESS (&ctx->app_stack),
-      GUM_REG_XSP);
+  gum_exec_ctx_write_mov_hot_ptr_reg (ctx,
+      GUM_EXEC_HOT_OFFSET (app_stack), GUM_REG_XSP, cw);
   gum_x86_writer_put_lea_reg_reg_offset (cw, GUM_REG_XSP,
       GUM_REG_XSP, -GUM_RED_ZONE_MAX_SIZE);
 
@@ -1447,8 +4546,8 @@ gum_exec_ctx_write_prolog (GumExecCtx * ctx,
     gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XAX, GUM_ADDRESS (ip));
     gum_x86_writer_put_push_reg (cw, GUM_REG_XAX); /* GumCpuContext.xip */
 
-    gum_x86_writer_put_mov_reg_near_ptr (cw, GUM_REG_XAX,
-        GUM_ADDRESS (&ctx->app_stack));
+    gum_exec_ctx_write_mov_reg_hot_ptr (ctx, GUM_REG_XAX,
+        GUM_EXEC_HOT_OFFSET (app_stack), cw);
     gum_x86_writer_put_mov_reg_offset_ptr_reg (cw,
         GUM_REG_XSP, GUM_CPU_CONTEXT_OFFSET_XSP,
         GUM_REG_XAX);
@@ -1456,8 +4555,13 @@ gum_exec_ctx_write_prolog (GumExecCtx * ctx,
 
   gum_x86_writer_put_mov_reg_reg (cw, GUM_REG_XBX, GUM_REG_XSP);
   gum_x86_writer_put_and_reg_u32 (cw, GUM_REG_XSP, (guint32) ~(16 - 1));
-  gum_x86_writer_put_sub_reg_imm (cw, GUM_REG_XSP, 512);
-  gum_x86_writer_put_bytes (cw, fxsave, sizeof (fxsave));
+
+  fp_save_mask = gum_exec_ctx_query_fp_save_mask (ctx, type);
+  if (fp_save_mask != 0)
+  {
+    gum_exec_ctx_write_mov_fp_save_area (ctx, GUM_REG_XCX, cw);
+    gum_stalker_write_fp_save (ctx->stalker, fp_save_mask, cw);
+  }
 }
 
 static void
@@ -1465,40 +4569,182 @@ gum_exec_ctx_write_epilog (GumExecCtx * ctx,
                            GumPrologType type,
                            GumX86Writer * cw)
 {
-  guint8 fxrstor[] = {
-    0x0f, 0xae, 0x0c, 0x24 /* fxrstor [esp] */
-  };
+  guint32 fp_save_mask;
+
+  fp_save_mask = gum_exec_ctx_query_fp_save_mask (ctx, type);
+  if (fp_save_mask != 0)
+  {
+    gum_exec_ctx_write_mov_fp_save_area (ctx, GUM_REG_XCX, cw);
+    gum_stalker_write_fp_restore (ctx->stalker, fp_save_mask, cw);
+  }
+
+  gum_x86_writer_put_mov_reg_reg (cw, GUM_REG_XSP, GUM_REG_XBX);
+
+  if (type == GUM_PROLOG_MINIMAL)
+  {
+#if GLIB_SIZEOF_VOID_P == 8
+    gum_x86_writer_put_pop_reg (cw, GUM_REG_R11);
+    gum_x86_writer_put_pop_reg (cw, GUM_REG_R10);
+    gum_x86_writer_put_pop_reg (cw, GUM_REG_R9);
+    gum_x86_writer_put_pop_reg (cw, GUM_REG_R8);
+    gum_x86_writer_put_pop_reg (cw, GUM_REG_XDI);
+    gum_x86_writer_put_pop_reg (cw, GUM_REG_XSI);
+#endif
+
+    gum_x86_writer_put_pop_reg (cw, GUM_REG_XBX);
+    gum_x86_writer_put_pop_reg (cw, GUM_REG_XDX);
+    gum_x86_writer_put_pop_reg (cw, GUM_REG_XCX);
+    gum_x86_writer_put_pop_reg (cw, GUM_REG_XAX);
+  }
+  else /* GUM_PROLOG_FULL */
+  {
+    gum_x86_writer_put_pop_reg (cw, GUM_REG_XAX); /* discard
+                                                     GumCpuContext.xip */
+    gum_x86_writer_put_popax (cw);
+  }
+
+  gum_x86_writer_put_popfx (cw);
+
+  gum_exec_ctx_write_mov_reg_hot_ptr (ctx, GUM_REG_XSP,
+      GUM_EXEC_HOT_OFFSET (app_stack), cw);
+}
+
+static guint32
+gum_exec_ctx_query_fp_save_mask (GumExecCtx * ctx,
+                                 GumPrologType type)
+{
+  /* Call probes needing the FPU get it saved by the dispatcher when lazy */
+  if (type == GUM_PROLOG_FULL && ctx->lazy_fp_save)
+    return 0;
+
+  return ctx->stalker->priv->fp_save_mask;
+}
+
+static void
+gum_exec_ctx_write_mov_fp_save_area (GumExecCtx * ctx,
+                                     GumCpuReg dst_reg,
+                                     GumX86Writer * cw)
+{
+  if (ctx->is_shared)
+  {
+    gum_exec_ctx_write_mov_reg_hot_ptr (ctx, dst_reg,
+        GUM_EXEC_HOT_OFFSET (fp_save_area), cw);
+  }
+  else
+  {
+    gum_x86_writer_put_mov_reg_address (cw, dst_reg,
+        GUM_ADDRESS (ctx->fp_save_area));
+  }
+}
+
+/*
+ * Counters are only ever added by the thread itself, which therefore looks
+ * them up without locking, while drains walk them from other threads.
+ */
+static GumCallCounter *
+gum_exec_ctx_obtain_call_counter (GumExecCtx * ctx,
+                                  gpointer target)
+{
+  GumCallCounter * counter;
+
+  counter = (GumCallCounter *) g_hash_table_lookup (ctx->call_counters,
+      target);
+  if (counter == NULL)
+  {
+    counter = g_slice_new0 (GumCallCounter);
+    counter->target = target;
+
+    gum_spinlock_acquire (&ctx->call_counters_lock);
+    g_hash_table_insert (ctx->call_counters, target, counter);
+    gum_spinlock_release (&ctx->call_counters_lock);
+  }
+
+  return counter;
+}
+
+static void
+gum_exec_ctx_count_indirect_call (GumExecCtx * ctx,
+                                  gpointer target)
+{
+  gum_exec_ctx_obtain_call_counter (ctx, target)->count++;
+}
+
+static void
+gum_call_counter_free (GumCallCounter * counter)
+{
+  g_slice_free (GumCallCounter, counter);
+}
+
+/*
+ * The sink is gone without draining what its threads counted after being
+ * unfollowed, so there is nobody left to report it to.
+ */
+static void
+gum_stalker_forget_retired_call_counts (gpointer data,
+                                        GObject * where_the_sink_was)
+{
+  GumStalkerPrivate * priv = GUM_STALKER_CAST (data)->priv;
+
+  gum_spinlock_acquire (&priv->call_counts_lock);
+  g_hash_table_remove (priv->retired_call_counts, where_the_sink_was);
+  gum_spinlock_release (&priv->call_counts_lock);
+}
+
+/*
+ * Hands what hasn't been reported yet over to the stalker, keyed by sink,
+ * so that a drain after unfollow, e.g. the one a sink does when stopped,
+ * still gets to see it. Only called once the thread's code can no longer
+ * bump the counters, or by the thread itself.
+ */
+static void
+gum_exec_ctx_retire_call_counts (GumExecCtx * ctx)
+{
+  GumStalkerPrivate * priv = ctx->stalker->priv;
+  GHashTable * retired = NULL;
+  GHashTableIter iter;
+  GumCallCounter * counter;
+
+  if (ctx->call_counters == NULL)
+    return;
 
-  gum_x86_writer_put_bytes (cw, fxrstor, sizeof (fxrstor));
-  gum_x86_writer_put_mov_reg_reg (cw, GUM_REG_XSP, GUM_REG_XBX);
+  gum_spinlock_acquire (&ctx->call_counters_lock);
+  gum_spinlock_acquire (&priv->call_counts_lock);
 
-  if (type == GUM_PROLOG_MINIMAL)
+  g_hash_table_iter_init (&iter, ctx->call_counters);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &counter))
   {
-#if GLIB_SIZEOF_VOID_P == 8
-    gum_x86_writer_put_pop_reg (cw, GUM_REG_R11);
-    gum_x86_writer_put_pop_reg (cw, GUM_REG_R10);
-    gum_x86_writer_put_pop_reg (cw, GUM_REG_R9);
-    gum_x86_writer_put_pop_reg (cw, GUM_REG_R8);
-    gum_x86_writer_put_pop_reg (cw, GUM_REG_XDI);
-    gum_x86_writer_put_pop_reg (cw, GUM_REG_XSI);
-#endif
+    gsize count = counter->count;
+    guint64 * total;
 
-    gum_x86_writer_put_pop_reg (cw, GUM_REG_XBX);
-    gum_x86_writer_put_pop_reg (cw, GUM_REG_XDX);
-    gum_x86_writer_put_pop_reg (cw, GUM_REG_XCX);
-    gum_x86_writer_put_pop_reg (cw, GUM_REG_XAX);
-  }
-  else /* GUM_PROLOG_FULL */
-  {
-    gum_x86_writer_put_pop_reg (cw, GUM_REG_XAX); /* discard
-                                                     GumCpuContext.xip */
-    gum_x86_writer_put_popax (cw);
-  }
+    if (count == counter->reported)
+      continue;
 
-  gum_x86_writer_put_popfx (cw);
+    if (retired == NULL)
+    {
+      retired = (GHashTable *)
+          g_hash_table_lookup (priv->retired_call_counts, ctx->sink);
+      if (retired == NULL)
+      {
+        retired = g_hash_table_new_full (NULL, NULL, NULL, g_free);
+        g_hash_table_insert (priv->retired_call_counts, ctx->sink, retired);
+        g_object_weak_ref (G_OBJECT (ctx->sink),
+            gum_stalker_forget_retired_call_counts, ctx->stalker);
+      }
+    }
+
+    total = (guint64 *) g_hash_table_lookup (retired, counter->target);
+    if (total == NULL)
+    {
+      total = g_new0 (guint64, 1);
+      g_hash_table_insert (retired, counter->target, total);
+    }
+    *total += count - counter->reported;
+
+    counter->reported = count;
+  }
 
-  gum_x86_writer_put_mov_reg_near_ptr (cw, GUM_REG_XSP,
-      GUM_ADDRESS (&ctx->app_stack));
+  gum_spinlock_release (&priv->call_counts_lock);
+  gum_spinlock_release (&ctx->call_counters_lock);
 }
 
 static void
@@ -1567,277 +4813,785 @@ gum_exec_ctx_write_push_branch_target_address (GumExecCtx * ctx,
 }
 
 static void
-gum_exec_ctx_load_real_register_into (GumExecCtx * ctx,
-                                      GumCpuReg target_register,
-                                      GumCpuReg source_register,
-                                      gpointer ip,
-                                      GumGeneratorContext * gc)
+gum_exec_ctx_load_real_register_into (GumExecCtx * ctx,
+                                      GumCpuReg target_register,
+                                      GumCpuReg source_register,
+                                      gpointer ip,
+                                      GumGeneratorContext * gc)
+{
+  GumX86Writer * cw = gc->code_writer;
+  GumCpuReg source_meta;
+
+  source_meta = gum_cpu_meta_reg_from_real_reg (source_register);
+
+  if (source_meta >= GUM_REG_XAX && source_meta <= GUM_REG_XBX)
+  {
+    gum_x86_writer_put_mov_reg_reg_offset_ptr (cw, target_register,
+        GUM_REG_XBX, gc->state_preserve_stack_offset +
+        STATE_PRESERVE_TOPMOST_REGISTER_INDEX * sizeof (gpointer) -
+        ((source_meta - GUM_REG_XAX) * sizeof (gpointer)));
+  }
+#if GLIB_SIZEOF_VOID_P == 8
+  else if (source_meta >= GUM_REG_XSI && source_meta <= GUM_REG_XDI)
+  {
+    gum_x86_writer_put_mov_reg_reg_offset_ptr (cw, target_register,
+        GUM_REG_XBX, gc->state_preserve_stack_offset +
+        STATE_PRESERVE_TOPMOST_REGISTER_INDEX * sizeof (gpointer) -
+        ((source_meta - 2 - GUM_REG_XAX) * sizeof (gpointer)));
+  }
+  else if (source_meta >= GUM_REG_R8 && source_meta <= GUM_REG_R11)
+  {
+    gum_x86_writer_put_mov_reg_reg_offset_ptr (cw, target_register,
+        GUM_REG_XBX, gc->state_preserve_stack_offset +
+        STATE_PRESERVE_TOPMOST_REGISTER_INDEX * sizeof (gpointer) -
+        ((source_meta - 2 - GUM_REG_RAX) * sizeof (gpointer)));
+  }
+#endif
+  else if (source_meta == GUM_REG_XSP)
+  {
+    gum_exec_ctx_write_mov_reg_hot_ptr (ctx, target_register,
+        GUM_EXEC_HOT_OFFSET (app_stack), cw);
+    gum_x86_writer_put_lea_reg_reg_offset (cw, target_register,
+        target_register, gc->accumulated_stack_delta);
+  }
+  else if (source_meta == GUM_REG_XIP)
+  {
+    gum_x86_writer_put_mov_reg_address (cw, target_register,
+        GUM_ADDRESS (ip));
+  }
+  else if (source_meta == GUM_REG_NONE)
+  {
+    gum_x86_writer_put_xor_reg_reg (cw, target_register, target_register);
+  }
+  else
+  {
+    gum_x86_writer_put_mov_reg_reg (cw, target_register, source_register);
+  }
+}
+
+static guint
+gum_address_mapping_hash (gpointer real_address)
+{
+  gsize value = GPOINTER_TO_SIZE (real_address);
+  guint32 hash;
+
+#if GLIB_SIZEOF_VOID_P == 8
+  hash = (guint32) (value ^ (value >> 32));
+#else
+  hash = (guint32) value;
+#endif
+  hash *= 0x9e3779b1;
+
+  return hash ^ (hash >> 16);
+}
+
+static GumExecBlock *
+gum_exec_block_new (GumExecCtx * ctx)
+{
+  GumSlab * slab;
+
+  for (slab = ctx->code_slabs; slab != NULL; slab = slab->next)
+  {
+    if (slab->size - slab->offset >= GUM_EXEC_BLOCK_MIN_SIZE)
+    {
+      GumExecBlock * block = (GumExecBlock *) (slab->data + slab->offset);
+
+      block->ctx = ctx;
+      block->slab = slab;
+
+      block->code_begin = GSIZE_TO_POINTER (GPOINTER_TO_SIZE (slab->data +
+            slab->offset + sizeof (GumExecBlock) + GUM_CODE_ALIGNMENT - 1)
+          & ~(GUM_CODE_ALIGNMENT - 1));
+      block->code_end = block->code_begin;
+
+      block->state = GUM_EXEC_NORMAL;
+      block->recycle_count = 0;
+      block->recompile_count = 0;
+      block->has_call_to_excluded_range = FALSE;
+      block->is_stale = FALSE;
+      block->trace_countdown = G_MAXINT;
+      block->is_trace = FALSE;
+      block->incoming_links = NULL;
+      block->unfollow_code = NULL;
+      block->next = NULL;
+
+      slab->offset += block->code_begin - (slab->data + slab->offset);
+
+      return block;
+    }
+  }
+
+  if (!gum_exec_ctx_add_code_slab (ctx, FALSE))
+  {
+    /*
+     * The budget is soft: we can only evict our own code, and must carry on
+     * translating even if other contexts hold the rest of it. Other threads
+     * may be running the shared cache's code at any moment, so it is never
+     * evicted and grows past the budget instead.
+     */
+    if (!ctx->is_shared)
+      gum_exec_ctx_evict_code (ctx);
+    gum_exec_ctx_add_code_slab (ctx, TRUE);
+  }
+
+  return gum_exec_block_new (ctx);
+}
+
+static GumExecBlock *
+gum_exec_block_obtain (GumExecCtx * ctx,
+                       gpointer real_address,
+                       gpointer * code_address)
+{
+  GumAddressMapping * match;
+
+  match = gum_exec_ctx_lookup_address_mapping (ctx, real_address);
+  if (match == NULL)
+    return NULL;
+
+  *code_address = match->code_address;
+  return match->block;
+}
+
+static GumExecBlock *
+gum_exec_block_obtain_shared (GumExecCtx * ctx,
+                              gpointer real_address,
+                              gpointer * code_address)
+{
+  GumAddressMapping * mappings;
+  guint mask, i;
+
+  mask = (guint) g_atomic_int_get ((volatile gint *) &ctx->mapping_mask);
+  mappings = (GumAddressMapping *)
+      g_atomic_pointer_get (&ctx->mapping_slab.data);
+
+  for (i = gum_address_mapping_hash (real_address) & mask;
+      TRUE;
+      i = (i + 1) & mask)
+  {
+    GumAddressMapping * m = &mappings[i];
+    gpointer key, code;
+    GumExecBlock * block;
+
+    key = g_atomic_pointer_get (&m->real_address);
+    if (key == NULL)
+      return NULL;
+    else if (key != real_address)
+      continue;
+
+    code = g_atomic_pointer_get (&m->code_address);
+    block = (GumExecBlock *) g_atomic_pointer_get (&m->block);
+
+    /*
+     * Entries are only ever rewritten by a cache invalidation racing with us,
+     * in which case any block that still covers the code is fine to use.
+     */
+    if (g_atomic_pointer_get (&m->real_address) != real_address ||
+        block == NULL ||
+        (guint8 *) code < block->code_begin ||
+        (guint8 *) code >= block->code_end)
+    {
+      return NULL;
+    }
+
+    *code_address = code;
+    return block;
+  }
+}
+
+static GumExecCtx *
+gum_exec_block_get_thread_ctx (GumExecBlock * block)
+{
+#ifdef GUM_STALKER_HAVE_SHARED_CACHE
+  if (block->ctx->is_shared)
+    return gum_exec_tls_hot_state.ctx;
+#endif
+
+  return block->ctx;
+}
+
+static gboolean
+gum_exec_block_is_full (GumExecBlock * block,
+                        GumGeneratorContext * gc)
+{
+  guint8 * slab_end = block->slab->data + block->slab->size;
+  return slab_end - block->code_end < GUM_EXEC_BLOCK_MIN_SIZE +
+      (gc->n_trace_exits * GUM_EXEC_TRACE_EXIT_MAX_SIZE);
+}
+
+static void
+gum_exec_block_commit (GumExecBlock * block)
+{
+  guint real_size;
+  guint8 * aligned_end;
+
+  real_size = block->real_end - block->real_begin;
+  block->real_snapshot = block->code_end;
+  memcpy (block->real_snapshot, block->real_begin, real_size);
+
+  /*
+   * With its pages write-protected by us we get to hear about any change, so
+   * the snapshot is only needed to rule out one racing with the translation.
+   * Pages whose protection we don't own, such as ones that weren't writable
+   * to begin with, can be written to through another mapping or by another
+   * process without us noticing, so their blocks keep the snapshot.
+   */
+  if (block->ctx->stalker->priv->write_tracking_enabled &&
+      gum_page_tracker_protect (block->real_begin, block->real_end) &&
+      memcmp (block->real_begin, block->real_snapshot, real_size) == 0)
+  {
+    block->real_snapshot = NULL;
+    real_size = 0;
+  }
+
+  block->slab->offset += real_size;
+
+  aligned_end = GSIZE_TO_POINTER (GPOINTER_TO_SIZE (block->code_end +
+        real_size + GUM_DATA_ALIGNMENT - 1) & ~(GUM_DATA_ALIGNMENT - 1));
+  block->slab->offset += aligned_end - block->code_begin;
+}
+
+static void
+gum_exec_block_write_gate (GumExecBlock * block,
+                           GumGeneratorContext * gc)
+{
+  /* nop dword [eax + eax * 1 + 0] */
+  const guint8 gate[GUM_EXEC_BLOCK_GATE_SIZE] = {
+    0x0f, 0x1f, 0x44, 0x00, 0x00
+  };
+
+  g_assert (gum_x86_writer_cur (gc->code_writer) == block->code_begin);
+
+  gum_x86_writer_put_bytes (gc->code_writer, gate, sizeof (gate));
+}
+
+static void
+gum_exec_block_write_unfollow_stub (GumExecBlock * block,
+                                    gpointer real_address,
+                                    GumGeneratorContext * gc)
+{
+  GumX86Writer * cw = gc->code_writer;
+
+  block->unfollow_code = gum_x86_writer_cur (cw);
+
+  gum_x86_writer_put_lea_reg_reg_offset (cw, GUM_REG_XSP,
+      GUM_REG_XSP, -GUM_RED_ZONE_MAX_SIZE);
+  gum_x86_writer_put_push_reg (cw, GUM_REG_XAX);
+  gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XAX,
+      GUM_ADDRESS (real_address));
+  gum_x86_writer_put_jmp (cw, block->ctx->unfollow_thunk);
+}
+
+/*
+ * Counts down on entry and heads off to the hot stub when reaching zero.
+ * The flags are left alone unless the block's first instruction ignores
+ * them.
+ */
+static void
+gum_exec_block_write_hot_check (GumExecBlock * block,
+                                GumGeneratorContext * gc)
+{
+  GumX86Writer * cw = gc->code_writer;
+  /* dec dword [rip + rel32], or [abs32] on IA-32 */
+  guint8 dec_countdown[] = {
+    0xff, 0x0d, 0x00, 0x00, 0x00, 0x00
+  };
+  guint8 * countdown = (guint8 *) &block->trace_countdown;
+
+  gc->hot_check_saves_flags =
+      (gum_generator_context_get_live_regs (gc) & GUM_LIVE_FLAGS) != 0;
+
+  if (gc->hot_check_saves_flags)
+  {
+    gum_x86_writer_put_lea_reg_reg_offset (cw, GUM_REG_XSP,
+        GUM_REG_XSP, -GUM_RED_ZONE_MAX_SIZE);
+    gum_x86_writer_put_pushfx (cw);
+  }
+
+#if GLIB_SIZEOF_VOID_P == 8
+  *((gint32 *) (dec_countdown + 2)) = (gint32) (countdown -
+      ((guint8 *) gum_x86_writer_cur (cw) + sizeof (dec_countdown)));
+#else
+  *((guint32 *) (dec_countdown + 2)) = GPOINTER_TO_UINT (countdown);
+#endif
+  gum_x86_writer_put_bytes (cw, dec_countdown, sizeof (dec_countdown));
+  gum_x86_writer_put_jcc_near_label (cw, GUM_X86_JZ, countdown, GUM_UNLIKELY);
+
+  if (gc->hot_check_saves_flags)
+  {
+    gum_x86_writer_put_popfx (cw);
+    gum_x86_writer_put_lea_reg_reg_offset (cw, GUM_REG_XSP,
+        GUM_REG_XSP, GUM_RED_ZONE_MAX_SIZE);
+  }
+
+  gc->hot_resume_code = gum_x86_writer_cur (cw);
+}
+
+static void
+gum_exec_block_write_hot_stub (GumExecBlock * block,
+                               GumGeneratorContext * gc)
+{
+  GumExecCtx * ctx = block->ctx;
+  GumX86Writer * cw = gc->code_writer;
+#if GLIB_SIZEOF_VOID_P == 4
+  guint align_correction = 4;
+#endif
+
+  gum_x86_writer_put_label (cw, (gconstpointer) &block->trace_countdown);
+
+  if (gc->hot_check_saves_flags)
+  {
+    gum_x86_writer_put_popfx (cw);
+    gum_x86_writer_put_lea_reg_reg_offset (cw, GUM_REG_XSP,
+        GUM_REG_XSP, GUM_RED_ZONE_MAX_SIZE);
+  }
+
+  gum_exec_ctx_write_prolog (ctx, GUM_PROLOG_MINIMAL, NULL, cw);
+#if GLIB_SIZEOF_VOID_P == 4
+  gum_x86_writer_put_sub_reg_imm (cw, GUM_REG_XSP, align_correction);
+#endif
+  gum_x86_writer_put_call_with_arguments (cw,
+      GUM_FUNCPTR_TO_POINTER (gum_exec_ctx_promote_to_trace), 3,
+      GUM_ARG_POINTER, ctx,
+      GUM_ARG_POINTER, block,
+      GUM_ARG_POINTER, gc->hot_resume_code);
+#if GLIB_SIZEOF_VOID_P == 4
+  gum_x86_writer_put_add_reg_imm (cw, GUM_REG_XSP, align_correction);
+#endif
+  gum_exec_ctx_write_epilog (ctx, GUM_PROLOG_MINIMAL, cw);
+  gum_exec_ctx_write_jmp_hot_ptr (ctx, GUM_EXEC_HOT_OFFSET (resume_at), cw);
+}
+
+/*
+ * Traces only run through a branch when the block it falls through to has
+ * been at least as busy as the one it would jump to, leaving a jcc to an
+ * exit stub behind. Getting back to the head of the trace always wins, as
+ * that's what keeps a loop in one piece.
+ */
+static gboolean
+gum_exec_block_can_extend_trace (GumExecBlock * block,
+                                 gpointer taken_address,
+                                 gpointer not_taken_address,
+                                 GumGeneratorContext * gc)
+{
+  guint8 * slab_end = block->slab->data + block->slab->size;
+  gint heat;
+
+  if (!gc->is_trace || gc->n_trace_exits == G_N_ELEMENTS (gc->trace_exits))
+    return FALSE;
+
+  if (slab_end - (guint8 *) gum_x86_writer_cur (gc->code_writer) <
+      GUM_EXEC_BLOCK_MIN_SIZE +
+      ((gc->n_trace_exits + 1) * GUM_EXEC_TRACE_EXIT_MAX_SIZE))
+  {
+    return FALSE;
+  }
+
+  heat = gum_exec_ctx_query_block_heat (block->ctx, not_taken_address, gc);
+
+  return heat != 0 &&
+      heat >= gum_exec_ctx_query_block_heat (block->ctx, taken_address, gc);
+}
+
+static void
+gum_exec_block_write_trace_exits (GumExecBlock * block,
+                                  GumGeneratorContext * gc)
 {
-  GumX86Writer * cw = gc->code_writer;
-  GumCpuReg source_meta;
-
-  source_meta = gum_cpu_meta_reg_from_real_reg (source_register);
+  guint i;
 
-  if (source_meta >= GUM_REG_XAX && source_meta <= GUM_REG_XBX)
+  for (i = 0; i != gc->n_trace_exits; i++)
   {
-    gum_x86_writer_put_mov_reg_reg_offset_ptr (cw, target_register,
-        GUM_REG_XBX, gc->state_preserve_stack_offset +
-        STATE_PRESERVE_TOPMOST_REGISTER_INDEX * sizeof (gpointer) -
-        ((source_meta - GUM_REG_XAX) * sizeof (gpointer)));
+    GumBranchTarget target = { 0, };
+
+    target.is_indirect = FALSE;
+    target.absolute_address = gc->trace_exits[i];
+
+    gum_x86_writer_put_label (gc->code_writer, &gc->trace_exits[i]);
+    gum_exec_block_write_jmp_transfer_code (block, &target, gc);
   }
-#if GLIB_SIZEOF_VOID_P == 8
-  else if (source_meta >= GUM_REG_XSI && source_meta <= GUM_REG_XDI)
+}
+
+static void
+gum_exec_block_close_gate (GumExecBlock * block)
+{
+  gsize distance;
+
+  distance = block->unfollow_code -
+      (block->code_begin + GUM_EXEC_BLOCK_GATE_SIZE);
+  g_assert_cmpuint (distance, <, 1 << 24);
+
+  /*
+   * The gate is aligned, so turning its first four bytes into a jmp is a
+   * single store that the thread may race with but never see half-done.
+   * The gate's last byte is already zero and serves as the top byte of the
+   * displacement.
+   */
+  g_atomic_int_set ((gint *) block->code_begin, 0xe9 | (distance << 8));
+}
+
+static gboolean
+gum_exec_block_can_link (GumExecBlock * block)
+{
+  GumExecCtx * ctx = block->ctx;
+
+  return !ctx->is_shared &&
+      ctx->state == GUM_EXEC_CTX_ACTIVE &&
+      block->recycle_count >= ctx->stalker->priv->trust_threshold;
+}
+
+static void
+gum_exec_block_backpatch_call (GumExecBlock * block,
+                               gpointer code_start,
+                               GumPrologType opened_prolog,
+                               gpointer target_address,
+                               gpointer ret_real_address,
+                               gpointer ret_code_address)
+{
+  if (gum_exec_block_can_link (block))
   {
-    gum_x86_writer_put_mov_reg_reg_offset_ptr (cw, target_register,
-        GUM_REG_XBX, gc->state_preserve_stack_offset +
-        STATE_PRESERVE_TOPMOST_REGISTER_INDEX * sizeof (gpointer) -
-        ((source_meta - 2 - GUM_REG_XAX) * sizeof (gpointer)));
+    gum_exec_block_link_call (block, block->ctx->hot->current_block,
+        code_start, opened_prolog, target_address, ret_real_address,
+        ret_code_address);
   }
-  else if (source_meta >= GUM_REG_R8 && source_meta <= GUM_REG_R11)
+}
+
+static void
+gum_exec_block_backpatch_jmp (GumExecBlock * block,
+                              gpointer code_start,
+                              GumPrologType opened_prolog,
+                              gpointer target_address)
+{
+  if (gum_exec_block_can_link (block))
   {
-    gum_x86_writer_put_mov_reg_reg_offset_ptr (cw, target_register,
-        GUM_REG_XBX, gc->state_preserve_stack_offset +
-        STATE_PRESERVE_TOPMOST_REGISTER_INDEX * sizeof (gpointer) -
-        ((source_meta - 2 - GUM_REG_RAX) * sizeof (gpointer)));
+    gum_exec_block_link_jmp (block, block->ctx->hot->current_block,
+        code_start, opened_prolog, target_address);
   }
-#endif
-  else if (source_meta == GUM_REG_XSP)
+}
+
+static void
+gum_exec_block_backpatch_ret (GumExecBlock * block,
+                              gpointer code_start,
+                              GumExecBlock * target_block,
+                              gpointer target_address)
+{
+  if (target_block != NULL && /* when we just unfollowed */
+      gum_exec_block_can_link (target_block))
   {
-    gum_x86_writer_put_mov_reg_near_ptr (cw, target_register,
-        GUM_ADDRESS (&ctx->app_stack));
-    gum_x86_writer_put_lea_reg_reg_offset (cw, target_register,
-        target_register, gc->accumulated_stack_delta);
+    GumExecBlockLink * link;
+    GumX86Writer * cw;
+
+    link = gum_exec_block_link_new (block, target_block, code_start);
+    if (link == NULL)
+      return;
+    cw = &block->ctx->code_writer;
+
+    gum_x86_writer_reset (cw, code_start);
+    gum_x86_writer_put_jmp (cw, target_address);
+    gum_x86_writer_flush (cw);
+
+    gum_exec_block_link_commit (link, cw);
   }
-  else if (source_meta == GUM_REG_XIP)
+}
+
+static void
+gum_exec_block_link_call (GumExecBlock * block,
+                          GumExecBlock * target_block,
+                          gpointer code_start,
+                          GumPrologType opened_prolog,
+                          gpointer target_address,
+                          gpointer ret_real_address,
+                          gpointer ret_code_address)
+{
+  GumExecCtx * ctx = block->ctx;
+  GumExecBlockLink * link;
+  GumX86Writer * cw = &ctx->code_writer;
+  gconstpointer beach_label = cw->code + 1;
+
+  link = gum_exec_block_link_new (block, target_block, code_start);
+  if (link == NULL)
+    return;
+
+  gum_x86_writer_reset (cw, code_start);
+
+  if (opened_prolog == GUM_PROLOG_NONE)
   {
-    gum_x86_writer_put_mov_reg_address (cw, target_register,
-        GUM_ADDRESS (ip));
+    gum_x86_writer_put_pushfx (cw);
+    gum_x86_writer_put_push_reg (cw, GUM_REG_XAX);
+    gum_x86_writer_put_push_reg (cw, GUM_REG_XCX);
   }
-  else if (source_meta == GUM_REG_NONE)
+
+  gum_exec_ctx_write_mov_reg_hot_ptr (ctx, GUM_REG_XCX,
+      GUM_EXEC_HOT_OFFSET (current_frame), cw);
+  gum_x86_writer_put_test_reg_u32 (cw, GUM_REG_XCX,
+      ctx->stalker->priv->page_size - 1);
+  gum_x86_writer_put_jcc_short_label (cw, GUM_X86_JZ, beach_label,
+      GUM_UNLIKELY);
+
+  gum_x86_writer_put_sub_reg_imm (cw, GUM_REG_XCX, sizeof (GumExecFrame));
+  gum_exec_ctx_write_mov_hot_ptr_reg (ctx,
+      GUM_EXEC_HOT_OFFSET (current_frame), GUM_REG_XCX, cw);
+
+  gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XAX,
+      GUM_ADDRESS (ret_real_address));
+  gum_x86_writer_put_mov_reg_ptr_reg (cw, GUM_REG_XCX, GUM_REG_XAX);
+  gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XAX,
+      GUM_ADDRESS (ret_code_address));
+  gum_x86_writer_put_mov_reg_offset_ptr_reg (cw,
+      GUM_REG_XCX, G_STRUCT_OFFSET (GumExecFrame, code_address), GUM_REG_XAX);
+
+  gum_x86_writer_put_label (cw, beach_label);
+  if (opened_prolog == GUM_PROLOG_NONE)
   {
-    gum_x86_writer_put_xor_reg_reg (cw, target_register, target_register);
+    gum_x86_writer_put_pop_reg (cw, GUM_REG_XCX);
+    gum_x86_writer_put_pop_reg (cw, GUM_REG_XAX);
+    gum_x86_writer_put_popfx (cw);
   }
   else
   {
-    gum_x86_writer_put_mov_reg_reg (cw, target_register, source_register);
+    gum_exec_ctx_write_epilog (ctx, opened_prolog, cw);
   }
-}
-
-static int
-gum_address_mapping_compare (const void * a,
-                             const void * b)
-{
-  const GumAddressMapping * mapping_a = (const GumAddressMapping *) a;
-  const GumAddressMapping * mapping_b = (const GumAddressMapping *) b;
-
-  if (mapping_a->real_address < mapping_b->real_address)
-    return -1;
-  else if (mapping_a->real_address > mapping_b->real_address)
-    return 1;
-  else
-    return 0;
-}
 
-static GumExecBlock *
-gum_exec_block_new (GumExecCtx * ctx)
-{
-  GumSlab * slab;
+  gum_x86_writer_put_push_reg (cw, GUM_REG_XAX);
+  gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XAX,
+      GUM_ADDRESS (ret_real_address));
+  gum_x86_writer_put_xchg_reg_reg_ptr (cw, GUM_REG_XAX, GUM_REG_XSP);
 
-  for (slab = &ctx->code_slab; slab != NULL; slab = slab->next)
-  {
-    if (slab->size - slab->offset >= GUM_EXEC_BLOCK_MIN_SIZE)
-    {
-      GumExecBlock * block = (GumExecBlock *) (slab->data + slab->offset);
+  gum_x86_writer_put_jmp (cw, target_address);
 
-      block->ctx = ctx;
-      block->slab = slab;
+  gum_x86_writer_flush (cw);
 
-      block->code_begin = GSIZE_TO_POINTER (GPOINTER_TO_SIZE (slab->data +
-            slab->offset + sizeof (GumExecBlock) + GUM_CODE_ALIGNMENT - 1)
-          & ~(GUM_CODE_ALIGNMENT - 1));
-      block->code_end = block->code_begin;
+  gum_exec_block_link_commit (link, cw);
+}
 
-      block->state = GUM_EXEC_NORMAL;
-      block->recycle_count = 0;
-      block->has_call_to_excluded_range = FALSE;
+static void
+gum_exec_block_link_jmp (GumExecBlock * block,
+                         GumExecBlock * target_block,
+                         gpointer code_start,
+                         GumPrologType opened_prolog,
+                         gpointer target_address)
+{
+  GumExecBlockLink * link;
+  GumX86Writer * cw = &block->ctx->code_writer;
 
-      slab->offset += block->code_begin - (slab->data + slab->offset);
+  link = gum_exec_block_link_new (block, target_block, code_start);
+  if (link == NULL)
+    return;
 
-      return block;
-    }
-  }
+  gum_x86_writer_reset (cw, code_start);
 
-  if (ctx->stalker->priv->trust_threshold < 0)
+  if (opened_prolog != GUM_PROLOG_NONE)
   {
-    ctx->code_slab.offset = 0;
-
-    return gum_exec_block_new (ctx);
+    gum_exec_ctx_write_epilog (block->ctx, opened_prolog, cw);
   }
 
-  return NULL;
+  gum_x86_writer_put_jmp (cw, target_address);
+  gum_x86_writer_flush (cw);
+
+  gum_exec_block_link_commit (link, cw);
 }
 
-static GumExecBlock *
-gum_exec_block_obtain (GumExecCtx * ctx,
-                       gpointer real_address,
-                       gpointer * code_address)
+static void
+gum_exec_block_link_pending_sites (GumExecBlock * block,
+                                   GumGeneratorContext * gc)
 {
-  GumAddressMapping mapping;
-  GumSlab * slab;
+  GumExecCtx * ctx = block->ctx;
+  guint i;
 
-  mapping.real_address = real_address;
-  mapping.code_address = NULL;
-  mapping.block = NULL;
+  if (ctx->stalker->priv->trust_threshold < 0 ||
+      !gum_exec_block_can_link (block))
+  {
+    return;
+  }
 
-  for (slab = &ctx->mapping_slab; slab != NULL; slab = slab->next)
+  for (i = 0; i != gc->n_link_sites; i++)
   {
-    GumAddressMapping * match;
+    GumExecBlockLinkSite * site = &gc->link_sites[i];
+    GumExecBlock * target_block;
+    gpointer target_code;
+
+    target_block = gum_exec_block_obtain (ctx, site->target_address,
+        &target_code);
+    if (target_block == NULL ||
+        target_block->recycle_count < ctx->stalker->priv->trust_threshold)
+    {
+      continue;
+    }
 
-    match = bsearch (&mapping, slab->data,
-        slab->offset / sizeof (GumAddressMapping), sizeof (GumAddressMapping),
-        gum_address_mapping_compare);
-    if (match != NULL)
+    if (site->ret_real_address != NULL)
+    {
+      gum_exec_block_link_call (block, target_block, site->code_start,
+          site->opened_prolog, target_code, site->ret_real_address,
+          site->ret_code_address);
+    }
+    else
     {
-      *code_address = match->code_address;
-      return match->block;
+      gum_exec_block_link_jmp (block, target_block, site->code_start,
+          site->opened_prolog, target_code);
     }
   }
+}
 
-  return NULL;
+static void
+gum_exec_block_add_pending_link_site (GumExecBlock * block,
+                                      GumGeneratorContext * gc,
+                                      gpointer code_start,
+                                      GumPrologType opened_prolog,
+                                      gpointer target_address,
+                                      gpointer ret_real_address,
+                                      gpointer ret_code_address)
+{
+  GumExecBlockLinkSite * site;
+
+  (void) block;
+
+  if (gc->n_link_sites == G_N_ELEMENTS (gc->link_sites))
+    return;
+
+  site = &gc->link_sites[gc->n_link_sites++];
+  site->code_start = code_start;
+  site->opened_prolog = opened_prolog;
+  site->target_address = target_address;
+  site->ret_real_address = ret_real_address;
+  site->ret_code_address = ret_code_address;
 }
 
-static gboolean
-gum_exec_block_is_full (GumExecBlock * block)
+static GumExecBlockLink *
+gum_exec_block_link_new (GumExecBlock * block,
+                         GumExecBlock * target_block,
+                         gpointer code_start)
 {
-  guint8 * slab_end = block->slab->data + block->slab->size;
-  return slab_end - block->code_end < GUM_EXEC_BLOCK_MIN_SIZE;
+  GumExecCtx * ctx = block->ctx;
+  GumExecBlockLink * link;
+  guint saved_size;
+
+  /* Links into other contexts' blocks can't be undone safely */
+  if (target_block == NULL || target_block->ctx != ctx)
+    return NULL;
+
+  /* Evicted code is only still running on its way out */
+  if (block->slab->retired || target_block->slab->retired)
+    return NULL;
+
+  saved_size = MIN (GUM_EXEC_BLOCK_LINK_MAX_SIZE,
+      block->code_end - (guint8 *) code_start);
+
+  link = (GumExecBlockLink *) g_malloc (sizeof (GumExecBlockLink) +
+      saved_size);
+  link->target = target_block;
+  link->code_start = (guint8 *) code_start;
+  link->code_size = saved_size;
+  link->original_code = (guint8 *) (link + 1);
+  memcpy (link->original_code, code_start, saved_size);
+
+  link->next_incoming = target_block->incoming_links;
+  target_block->incoming_links = link;
+
+  link->prev = NULL;
+  link->next = ctx->links;
+  if (ctx->links != NULL)
+    ctx->links->prev = link;
+  ctx->links = link;
+
+  return link;
 }
 
 static void
-gum_exec_block_commit (GumExecBlock * block)
+gum_exec_block_link_commit (GumExecBlockLink * link,
+                            GumX86Writer * cw)
 {
-  guint real_size;
-  guint8 * aligned_end;
+  guint patch_size = cw->code - link->code_start;
 
-  real_size = block->real_end - block->real_begin;
-  block->real_snapshot = block->code_end;
-  memcpy (block->real_snapshot, block->real_begin, real_size);
-  block->slab->offset += real_size;
+  g_assert_cmpuint (patch_size, <=, link->code_size);
 
-  aligned_end = GSIZE_TO_POINTER (GPOINTER_TO_SIZE (block->real_snapshot +
-        real_size + GUM_DATA_ALIGNMENT - 1) & ~(GUM_DATA_ALIGNMENT - 1));
-  block->slab->offset += aligned_end - block->code_begin;
+  /* Only the bytes we overwrote need to be put back */
+  link->code_size = patch_size;
+
+  link->target->ctx->stats.backpatches++;
 }
 
 static void
-gum_exec_block_backpatch_call (GumExecBlock * block,
-                               gpointer code_start,
-                               GumPrologType opened_prolog,
-                               gpointer target_address,
-                               gpointer ret_real_address,
-                               gpointer ret_code_address)
+gum_exec_block_unlink_incoming (GumExecBlock * block)
 {
   GumExecCtx * ctx = block->ctx;
+  GumExecBlockLink * link, * next;
 
-  if (ctx->state == GUM_EXEC_CTX_ACTIVE &&
-      block->recycle_count >= ctx->stalker->priv->trust_threshold)
+  for (link = block->incoming_links; link != NULL; link = next)
   {
-    GumX86Writer * cw = &ctx->code_writer;
-    gconstpointer beach_label = cw->code + 1;
-
-    gum_x86_writer_reset (cw, code_start);
+    next = link->next_incoming;
 
-    if (opened_prolog == GUM_PROLOG_NONE)
-    {
-      gum_x86_writer_put_pushfx (cw);
-      gum_x86_writer_put_push_reg (cw, GUM_REG_XAX);
-      gum_x86_writer_put_push_reg (cw, GUM_REG_XCX);
-    }
+    memcpy (link->code_start, link->original_code, link->code_size);
 
-    gum_x86_writer_put_mov_reg_near_ptr (cw, GUM_REG_XCX,
-        GUM_ADDRESS (&block->ctx->current_frame));
-    gum_x86_writer_put_test_reg_u32 (cw, GUM_REG_XCX,
-        block->ctx->stalker->priv->page_size - 1);
-    gum_x86_writer_put_jcc_short_label (cw, GUM_X86_JZ, beach_label,
-        GUM_UNLIKELY);
+    if (link->prev != NULL)
+      link->prev->next = link->next;
+    else
+      ctx->links = link->next;
+    if (link->next != NULL)
+      link->next->prev = link->prev;
 
-    gum_x86_writer_put_sub_reg_imm (cw, GUM_REG_XCX, sizeof (GumExecFrame));
-    gum_x86_writer_put_mov_near_ptr_reg (cw,
-        GUM_ADDRESS (&block->ctx->current_frame), GUM_REG_XCX);
+    g_free (link);
+  }
 
-    gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XAX,
-        GUM_ADDRESS (ret_real_address));
-    gum_x86_writer_put_mov_reg_ptr_reg (cw, GUM_REG_XCX, GUM_REG_XAX);
-    gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XAX,
-        GUM_ADDRESS (ret_code_address));
-    gum_x86_writer_put_mov_reg_offset_ptr_reg (cw,
-        GUM_REG_XCX, G_STRUCT_OFFSET (GumExecFrame, code_address), GUM_REG_XAX);
+  block->incoming_links = NULL;
+}
 
-    gum_x86_writer_put_label (cw, beach_label);
-    if (opened_prolog == GUM_PROLOG_NONE)
-    {
-      gum_x86_writer_put_pop_reg (cw, GUM_REG_XCX);
-      gum_x86_writer_put_pop_reg (cw, GUM_REG_XAX);
-      gum_x86_writer_put_popfx (cw);
-    }
-    else
-    {
-      gum_exec_ctx_write_epilog (block->ctx, opened_prolog, cw);
-    }
+static void
+gum_exec_ctx_unlink_all_blocks (GumExecCtx * ctx,
+                                gboolean restore_code)
+{
+  GumExecBlockLink * link, * next;
 
-    gum_x86_writer_put_push_reg (cw, GUM_REG_XAX);
-    gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XAX,
-        GUM_ADDRESS (ret_real_address));
-    gum_x86_writer_put_xchg_reg_reg_ptr (cw, GUM_REG_XAX, GUM_REG_XSP);
+  for (link = ctx->links; link != NULL; link = next)
+  {
+    next = link->next;
 
-    gum_x86_writer_put_jmp (cw, target_address);
+    if (restore_code)
+      memcpy (link->code_start, link->original_code, link->code_size);
+    link->target->incoming_links = NULL;
 
-    gum_x86_writer_flush (cw);
+    g_free (link);
   }
+
+  ctx->links = NULL;
 }
 
 static void
-gum_exec_block_backpatch_jmp (GumExecBlock * block,
-                              gpointer code_start,
-                              GumPrologType opened_prolog,
-                              gpointer target_address)
+gum_exec_ctx_clear_inline_caches (GumExecCtx * ctx,
+                                  GumExecBlock * block)
 {
-  GumExecCtx * ctx = block->ctx;
+  GumExecInlineCache * ic;
 
-  if (ctx->state == GUM_EXEC_CTX_ACTIVE &&
-      block->recycle_count >= ctx->stalker->priv->trust_threshold)
+  for (ic = ctx->inline_caches; ic != NULL; ic = ic->next)
   {
-    GumX86Writer * cw = &ctx->code_writer;
-
-    gum_x86_writer_reset (cw, code_start);
+    guint i;
 
-    if (opened_prolog != GUM_PROLOG_NONE)
+    for (i = 0; i != GUM_EXEC_INLINE_CACHE_SIZE; i++)
     {
-      gum_exec_ctx_write_epilog (block->ctx, opened_prolog, cw);
-    }
+      GumExecInlineCacheEntry * entry = &ic->entries[i];
 
-    gum_x86_writer_put_jmp (cw, target_address);
-    gum_x86_writer_flush (cw);
+      if (block == NULL || entry->block == block)
+      {
+        entry->real_address = NULL;
+        entry->code_address = NULL;
+        entry->block = NULL;
+      }
+    }
   }
 }
 
 static void
-gum_exec_block_backpatch_ret (GumExecBlock * block,
-                              gpointer code_start,
-                              gpointer target_address)
+gum_exec_ctx_clear_ret_cache (GumExecCtx * ctx,
+                              GumExecBlock * block)
 {
-  if (block != NULL) /* when we just unfollowed */
+  guint i;
+
+  for (i = 0; i != GUM_EXEC_RET_CACHE_SIZE; i++)
   {
-    GumExecCtx * ctx = block->ctx;
+    GumExecFrame * entry = &ctx->ret_cache[i];
 
-    if (ctx->state == GUM_EXEC_CTX_ACTIVE &&
-        block->recycle_count >= ctx->stalker->priv->trust_threshold)
+    if (block == NULL || ((guint8 *) entry->code_address >= block->code_begin &&
+        (guint8 *) entry->code_address < block->code_end))
     {
-      GumX86Writer * cw = &ctx->code_writer;
-
-      gum_x86_writer_reset (cw, code_start);
-      gum_x86_writer_put_jmp (cw, target_address);
-      gum_x86_writer_flush (cw);
+      entry->real_address = NULL;
+      entry->code_address = NULL;
     }
   }
 }
@@ -1923,28 +5677,19 @@ gum_exec_block_virtualize_branch_insn (GumExecBlock * block,
 
     if ((block->ctx->sink_mask & GUM_CALL) != 0)
     {
-      gum_exec_block_write_call_event_code (block, &target, gc,
-          GUM_CODE_INTERRUPTIBLE);
+      gum_exec_block_write_call_event_code (block, &target, gc);
     }
 
+    if ((block->ctx->sink_mask & GUM_CALL_COUNT) != 0)
+      gum_exec_block_write_call_count_code (block, &target, gc);
+
     if (block->ctx->stalker->priv->any_probes_attached)
       gum_exec_block_write_call_probe_code (block, &target, gc);
 
     if (!target.is_indirect && target.base == UD_NONE)
     {
-      GArray * exclusions = block->ctx->stalker->priv->exclusions;
-      guint i;
-
-      for (i = 0; i != exclusions->len; i++)
-      {
-        GumMemoryRange * r = &g_array_index (exclusions, GumMemoryRange, i);
-        if (GUM_MEMORY_RANGE_INCLUDES (r,
-            GUM_ADDRESS (target.absolute_address)))
-        {
-          target_is_excluded = TRUE;
-          break;
-        }
-      }
+      target_is_excluded = gum_stalker_is_excluding (block->ctx->stalker,
+          target.absolute_address);
     }
 
     if (target_is_excluded)
@@ -1962,6 +5707,23 @@ gum_exec_block_virtualize_branch_insn (GumExecBlock * block,
 
     gum_x86_relocator_skip_one_no_label (gc->relocator);
 
+    if (is_conditional && gum_exec_block_can_extend_trace (block,
+        target.absolute_address, insn->end, gc))
+    {
+      gpointer * exit = &gc->trace_exits[gc->n_trace_exits++];
+
+      *exit = target.absolute_address;
+
+      gum_exec_block_close_prolog (block, gc);
+      gum_x86_writer_put_jcc_near_label (cw,
+          gum_jcc_insn_to_short_opcode (insn->begin), exit, GUM_UNLIKELY);
+
+      /* Carry on with the likely side as if there was no branch */
+      gc->relocator->eob = FALSE;
+
+      return GUM_REQUIRE_NOTHING;
+    }
+
     cond_false_lbl_id =
         GUINT_TO_POINTER ((GPOINTER_TO_UINT (insn->begin) << 16) | 0xbeef);
 
@@ -2002,7 +5764,7 @@ gum_exec_block_virtualize_ret_insn (GumExecBlock * block,
                                     GumGeneratorContext * gc)
 {
   if ((block->ctx->sink_mask & GUM_RET) != 0)
-    gum_exec_block_write_ret_event_code (block, gc, GUM_CODE_INTERRUPTIBLE);
+    gum_exec_block_write_ret_event_code (block, gc);
 
   gum_x86_relocator_skip_one_no_label (gc->relocator);
 
@@ -2041,7 +5803,7 @@ gum_exec_block_virtualize_sysenter_insn (GumExecBlock * block,
 
   if ((block->ctx->sink_mask & GUM_RET) != 0)
   {
-    gum_exec_block_write_ret_event_code (block, gc, GUM_CODE_UNINTERRUPTIBLE);
+    gum_exec_block_write_ret_event_code (block, gc);
     gum_exec_block_close_prolog (block, gc);
   }
 
@@ -2051,19 +5813,9 @@ gum_exec_block_virtualize_sysenter_insn (GumExecBlock * block,
   gum_x86_writer_put_pushfx (cw);
   gum_x86_writer_put_push_reg (cw, GUM_REG_EAX);
 
-  /* but first, check if we've been asked to unfollow,
-   * in which case we'll enter the Stalker so the unfollow can
-   * be completed... */
-  gum_x86_writer_put_mov_reg_near_ptr (cw, GUM_REG_EAX,
-      GUM_ADDRESS (&block->ctx->state));
-  gum_x86_writer_put_cmp_reg_i32 (cw, GUM_REG_EAX,
-      GUM_EXEC_CTX_UNFOLLOW_PENDING);
-  gum_x86_writer_put_jcc_short_label (cw, GUM_X86_JZ,
-      resolve_dynamically_label, GUM_UNLIKELY);
-
   /* check frame at the top of the stack */
-  gum_x86_writer_put_mov_reg_near_ptr (cw, GUM_REG_EAX,
-      GUM_ADDRESS (&block->ctx->current_frame));
+  gum_exec_ctx_write_mov_reg_hot_ptr (block->ctx, GUM_REG_EAX,
+      GUM_EXEC_HOT_OFFSET (current_frame), cw);
   gum_x86_writer_put_cmp_reg_offset_ptr_reg (cw,
       GUM_REG_EAX, G_STRUCT_OFFSET (GumExecFrame, real_address),
       GUM_REG_EDX);
@@ -2076,8 +5828,8 @@ gum_exec_block_virtualize_sysenter_insn (GumExecBlock * block,
 
   /* pop from our stack */
   gum_x86_writer_put_add_reg_imm (cw, GUM_REG_EAX, sizeof (GumExecFrame));
-  gum_x86_writer_put_mov_near_ptr_reg (cw,
-      GUM_ADDRESS (&block->ctx->current_frame), GUM_REG_EAX);
+  gum_exec_ctx_write_mov_hot_ptr_reg (block->ctx,
+      GUM_EXEC_HOT_OFFSET (current_frame), GUM_REG_EAX, cw);
 
   /* proceeed to block */
   gum_x86_writer_put_pop_reg (cw, GUM_REG_EAX);
@@ -2095,8 +5847,7 @@ gum_exec_block_virtualize_sysenter_insn (GumExecBlock * block,
 
   gum_x86_writer_put_mov_reg_near_ptr (cw, GUM_THUNK_REG_ARG1,
       GUM_ADDRESS (saved_edx));
-  gum_x86_writer_put_mov_reg_address (cw, GUM_THUNK_REG_ARG0,
-      GUM_ADDRESS (block->ctx));
+  gum_exec_ctx_write_mov_reg_ctx (block->ctx, GUM_THUNK_REG_ARG0, cw);
   gum_x86_writer_put_sub_reg_imm (cw, GUM_REG_ESP,
       GUM_THUNK_ARGLIST_STACK_RESERVE);
   gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XAX,
@@ -2106,7 +5857,8 @@ gum_exec_block_virtualize_sysenter_insn (GumExecBlock * block,
       GUM_THUNK_ARGLIST_STACK_RESERVE);
 
   gum_exec_block_close_prolog (block, gc);
-  gum_x86_writer_put_jmp_near_ptr (cw, GUM_ADDRESS (&block->ctx->resume_at));
+  gum_exec_ctx_write_jmp_hot_ptr (block->ctx,
+      GUM_EXEC_HOT_OFFSET (resume_at), cw);
 
   gum_x86_relocator_skip_one_no_label (gc->relocator);
 
@@ -2130,42 +5882,76 @@ gum_exec_block_write_call_invoke_code (GumExecBlock * block,
   GumPrologType opened_prolog;
   gconstpointer perform_stack_push = cw->code + 1;
   gconstpointer skip_stack_push = cw->code + 2;
+  gconstpointer run_natively = cw->code + 3;
+  gboolean can_run_natively;
+  GumPrologType invoke_prolog;
   gpointer ret_real_address;
   gpointer ret_code_address;
 
   call_code_start = cw->code;
   opened_prolog = gc->opened_prolog;
 
-  /* We can backpatch if we have some trust and the call's target is static */
+  /*
+   * Targets only known at runtime may turn out to be excluded, in which case
+   * the resolved address is the target itself and we call it natively
+   */
+  can_run_natively = (target->is_indirect || target->base != UD_NONE) &&
+      block->ctx->stalker->priv->exclusions->len != 0;
+
+  /*
+   * We can backpatch if we have some trust and the call's target is static,
+   * unless the code is shared as other threads may be executing it
+   */
   can_backpatch = (block->ctx->stalker->priv->trust_threshold >= 0 &&
+      !block->ctx->is_shared &&
       !target->is_indirect &&
       target->base == UD_NONE);
 
   gum_exec_block_open_prolog (block, GUM_PROLOG_MINIMAL, gc);
+  invoke_prolog = gc->opened_prolog;
 
   /* fill in placeholder with application's retaddr */
-  gum_x86_writer_put_mov_reg_near_ptr (cw, GUM_REG_XAX,
-      GUM_ADDRESS (&block->ctx->app_stack));
+  gum_exec_ctx_write_mov_reg_hot_ptr (block->ctx, GUM_REG_XAX,
+      GUM_EXEC_HOT_OFFSET (app_stack), cw);
   gum_x86_writer_put_sub_reg_imm (cw, GUM_REG_XAX, sizeof (gpointer));
   gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XCX,
       GUM_ADDRESS (gc->instruction->end));
   gum_x86_writer_put_mov_reg_ptr_reg (cw, GUM_REG_XAX, GUM_REG_XCX);
-  gum_x86_writer_put_mov_near_ptr_reg (cw,
-      GUM_ADDRESS (&block->ctx->app_stack), GUM_REG_XAX);
+  gum_exec_ctx_write_mov_hot_ptr_reg (block->ctx,
+      GUM_EXEC_HOT_OFFSET (app_stack), GUM_REG_XAX, cw);
   gc->accumulated_stack_delta += sizeof (gpointer);
 
   /* generate code for the target */
-  gum_exec_ctx_write_push_branch_target_address (block->ctx, target, gc);
-  gum_x86_writer_put_pop_reg (cw, GUM_THUNK_REG_ARG1);
-  gum_x86_writer_put_mov_reg_address (cw, GUM_THUNK_REG_ARG0,
-      GUM_ADDRESS (block->ctx));
-  gum_x86_writer_put_sub_reg_imm (cw, GUM_REG_XSP,
-      GUM_THUNK_ARGLIST_STACK_RESERVE);
-  gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XAX,
-      GUM_ADDRESS (gum_exec_ctx_replace_current_block_with));
-  gum_x86_writer_put_call_reg (cw, GUM_REG_XAX);
-  gum_x86_writer_put_add_reg_imm (cw, GUM_REG_XSP,
-      GUM_THUNK_ARGLIST_STACK_RESERVE);
+  if (gum_exec_block_can_cache_target (block, target))
+  {
+    gum_exec_block_write_inline_cache_code (block, target, can_run_natively,
+        gc);
+  }
+  else
+  {
+    gum_exec_ctx_write_push_branch_target_address (block->ctx, target, gc);
+    gum_x86_writer_put_pop_reg (cw, GUM_THUNK_REG_ARG1);
+    gum_exec_ctx_write_mov_reg_ctx (block->ctx, GUM_THUNK_REG_ARG0, cw);
+    gum_x86_writer_put_sub_reg_imm (cw, GUM_REG_XSP,
+        GUM_THUNK_ARGLIST_STACK_RESERVE);
+    gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XAX, GUM_ADDRESS (
+        can_run_natively
+            ? GUM_FUNCPTR_TO_POINTER (
+                gum_exec_ctx_replace_current_block_for_call)
+            : GUM_FUNCPTR_TO_POINTER (
+                gum_exec_ctx_replace_current_block_from_call)));
+    gum_x86_writer_put_call_reg (cw, GUM_REG_XAX);
+    gum_x86_writer_put_add_reg_imm (cw, GUM_REG_XSP,
+        GUM_THUNK_ARGLIST_STACK_RESERVE);
+  }
+  if (can_run_natively)
+  {
+    gum_exec_ctx_write_push_branch_target_address (block->ctx, target, gc);
+    gum_x86_writer_put_pop_reg (cw, GUM_REG_XCX);
+    gum_x86_writer_put_cmp_reg_reg (cw, GUM_REG_XAX, GUM_REG_XCX);
+    gum_x86_writer_put_jcc_near_label (cw, GUM_X86_JZ, run_natively,
+        GUM_UNLIKELY);
+  }
   gum_x86_writer_put_mov_reg_reg (cw, GUM_REG_XDX, GUM_REG_XAX);
   gum_x86_writer_put_jmp_near_label (cw, perform_stack_push);
 
@@ -2187,8 +5973,7 @@ gum_exec_block_write_call_invoke_code (GumExecBlock * block,
 
   gum_x86_writer_put_mov_reg_address (cw, GUM_THUNK_REG_ARG1,
       GUM_ADDRESS (ret_real_address));
-  gum_x86_writer_put_mov_reg_address (cw, GUM_THUNK_REG_ARG0,
-      GUM_ADDRESS (block->ctx));
+  gum_exec_ctx_write_mov_reg_ctx (block->ctx, GUM_THUNK_REG_ARG0, cw);
   gum_x86_writer_put_sub_reg_imm (cw, GUM_REG_XSP,
       GUM_THUNK_ARGLIST_STACK_RESERVE);
   gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XAX,
@@ -2198,29 +5983,31 @@ gum_exec_block_write_call_invoke_code (GumExecBlock * block,
       GUM_THUNK_ARGLIST_STACK_RESERVE);
   gum_x86_writer_put_mov_reg_reg (cw, GUM_REG_XDX, GUM_REG_XAX);
 
-  gum_x86_writer_put_mov_reg_near_ptr (cw, GUM_REG_XAX,
-      GUM_ADDRESS (&block->ctx->current_block));
+  gum_exec_ctx_write_mov_reg_hot_ptr (block->ctx, GUM_REG_XAX,
+      GUM_EXEC_HOT_OFFSET (current_block), cw);
   gum_x86_writer_put_call_with_arguments (cw,
-      GUM_FUNCPTR_TO_POINTER (gum_exec_block_backpatch_ret), 3,
-      GUM_ARG_REGISTER, GUM_REG_XAX,
+      GUM_FUNCPTR_TO_POINTER (gum_exec_block_backpatch_ret), 4,
+      GUM_ARG_POINTER, block,
       GUM_ARG_POINTER, ret_code_address,
+      GUM_ARG_REGISTER, GUM_REG_XAX,
       GUM_ARG_REGISTER, GUM_REG_XDX);
 
   gum_exec_ctx_write_epilog (block->ctx, GUM_PROLOG_MINIMAL, cw);
-  gum_x86_writer_put_jmp_near_ptr (cw, GUM_ADDRESS (&block->ctx->resume_at));
+  gum_exec_ctx_write_jmp_hot_ptr (block->ctx,
+      GUM_EXEC_HOT_OFFSET (resume_at), cw);
 
   /* push frame on stack */
   gum_x86_writer_put_label (cw, perform_stack_push);
-  gum_x86_writer_put_mov_reg_near_ptr (cw, GUM_REG_XCX,
-      GUM_ADDRESS (&block->ctx->current_frame));
+  gum_exec_ctx_write_mov_reg_hot_ptr (block->ctx, GUM_REG_XCX,
+      GUM_EXEC_HOT_OFFSET (current_frame), cw);
   gum_x86_writer_put_test_reg_u32 (cw, GUM_REG_XCX,
       block->ctx->stalker->priv->page_size - 1);
   gum_x86_writer_put_jcc_short_label (cw, GUM_X86_JZ, skip_stack_push,
       GUM_UNLIKELY);
 
   gum_x86_writer_put_sub_reg_imm (cw, GUM_REG_XCX, sizeof (GumExecFrame));
-  gum_x86_writer_put_mov_near_ptr_reg (cw,
-      GUM_ADDRESS (&block->ctx->current_frame), GUM_REG_XCX);
+  gum_exec_ctx_write_mov_hot_ptr_reg (block->ctx,
+      GUM_EXEC_HOT_OFFSET (current_frame), GUM_REG_XCX, cw);
 
   gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XAX,
       GUM_ADDRESS (ret_real_address));
@@ -2234,6 +6021,10 @@ gum_exec_block_write_call_invoke_code (GumExecBlock * block,
 
   if (can_backpatch)
   {
+    gum_exec_block_add_pending_link_site (block, gc, call_code_start,
+        opened_prolog, target->absolute_address, ret_real_address,
+        ret_code_address);
+
     gum_x86_writer_put_call_with_arguments (cw,
         GUM_FUNCPTR_TO_POINTER (gum_exec_block_backpatch_call), 6,
         GUM_ARG_POINTER, block,
@@ -2246,7 +6037,25 @@ gum_exec_block_write_call_invoke_code (GumExecBlock * block,
 
   /* execute the generated code */
   gum_exec_block_close_prolog (block, gc);
-  gum_x86_writer_put_jmp_near_ptr (cw, GUM_ADDRESS (&block->ctx->resume_at));
+  gum_exec_ctx_write_jmp_hot_ptr (block->ctx,
+      GUM_EXEC_HOT_OFFSET (resume_at), cw);
+
+  if (can_run_natively)
+  {
+    /*
+     * Swap the application's retaddr for the code handling the return, so
+     * that the excluded code comes back to us when it's done
+     */
+    gum_x86_writer_put_label (cw, run_natively);
+    gum_exec_ctx_write_mov_reg_hot_ptr (block->ctx, GUM_REG_XAX,
+        GUM_EXEC_HOT_OFFSET (app_stack), cw);
+    gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XCX,
+        GUM_ADDRESS (ret_code_address));
+    gum_x86_writer_put_mov_reg_ptr_reg (cw, GUM_REG_XAX, GUM_REG_XCX);
+    gum_exec_ctx_write_epilog (block->ctx, invoke_prolog, cw);
+    gum_exec_ctx_write_jmp_hot_ptr (block->ctx,
+        GUM_EXEC_HOT_OFFSET (resume_at), cw);
+  }
 }
 
 static void
@@ -2263,22 +6072,32 @@ gum_exec_block_write_jmp_transfer_code (GumExecBlock * block,
 
   gum_exec_block_open_prolog (block, GUM_PROLOG_MINIMAL, gc);
 
-  gum_exec_ctx_write_push_branch_target_address (block->ctx, target, gc);
-  gum_x86_writer_put_pop_reg (cw, GUM_THUNK_REG_ARG1);
-  gum_x86_writer_put_mov_reg_address (cw, GUM_THUNK_REG_ARG0,
-      GUM_ADDRESS (block->ctx));
-  gum_x86_writer_put_sub_reg_imm (cw, GUM_REG_XSP,
-      GUM_THUNK_ARGLIST_STACK_RESERVE);
-  gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XAX,
-      GUM_ADDRESS (gum_exec_ctx_replace_current_block_with));
-  gum_x86_writer_put_call_reg (cw, GUM_REG_XAX);
-  gum_x86_writer_put_add_reg_imm (cw, GUM_REG_XSP,
-      GUM_THUNK_ARGLIST_STACK_RESERVE);
+  if (gum_exec_block_can_cache_target (block, target))
+  {
+    gum_exec_block_write_inline_cache_code (block, target, FALSE, gc);
+  }
+  else
+  {
+    gum_exec_ctx_write_push_branch_target_address (block->ctx, target, gc);
+    gum_x86_writer_put_pop_reg (cw, GUM_THUNK_REG_ARG1);
+    gum_exec_ctx_write_mov_reg_ctx (block->ctx, GUM_THUNK_REG_ARG0, cw);
+    gum_x86_writer_put_sub_reg_imm (cw, GUM_REG_XSP,
+        GUM_THUNK_ARGLIST_STACK_RESERVE);
+    gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XAX,
+        GUM_ADDRESS (gum_exec_ctx_replace_current_block_from_jmp));
+    gum_x86_writer_put_call_reg (cw, GUM_REG_XAX);
+    gum_x86_writer_put_add_reg_imm (cw, GUM_REG_XSP,
+        GUM_THUNK_ARGLIST_STACK_RESERVE);
+  }
 
   if (block->ctx->stalker->priv->trust_threshold >= 0 &&
+      !block->ctx->is_shared &&
       !target->is_indirect &&
       target->base == UD_NONE)
   {
+    gum_exec_block_add_pending_link_site (block, gc, code_start,
+        opened_prolog, target->absolute_address, NULL, NULL);
+
     gum_x86_writer_put_call_with_arguments (cw,
         GUM_FUNCPTR_TO_POINTER (gum_exec_block_backpatch_jmp), 4,
         GUM_ARG_POINTER, block,
@@ -2288,7 +6107,8 @@ gum_exec_block_write_jmp_transfer_code (GumExecBlock * block,
   }
 
   gum_exec_block_close_prolog (block, gc);
-  gum_x86_writer_put_jmp_near_ptr (cw, GUM_ADDRESS (&block->ctx->resume_at));
+  gum_exec_ctx_write_jmp_hot_ptr (block->ctx,
+      GUM_EXEC_HOT_OFFSET (resume_at), cw);
 }
 
 static void
@@ -2296,7 +6116,10 @@ gum_exec_block_write_ret_transfer_code (GumExecBlock * block,
                                         GumGeneratorContext * gc)
 {
   GumX86Writer * cw = gc->code_writer;
-  gconstpointer resolve_dynamically_label = cw->code;
+  gconstpointer found_frame_label = cw->code + 1;
+  gconstpointer try_ret_cache_label = cw->code + 2;
+  gconstpointer resolve_dynamically_label = cw->code + 3;
+  guint i;
 
   gum_exec_block_close_prolog (block, gc);
 
@@ -2306,48 +6129,95 @@ gum_exec_block_write_ret_transfer_code (GumExecBlock * block,
   gum_x86_writer_put_pushfx (cw);
   gum_x86_writer_put_push_reg (cw, GUM_REG_XAX);
   gum_x86_writer_put_push_reg (cw, GUM_REG_XDX);
+  gum_x86_writer_put_push_reg (cw, GUM_REG_XCX);
 
   /* we want to jump to the origin ret instruction after modifying the
    * return address on the stack */
   gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XAX,
       GUM_ADDRESS (gc->instruction->begin));
-  gum_x86_writer_put_mov_near_ptr_reg (cw,
-      GUM_ADDRESS (&block->ctx->return_at), GUM_REG_XAX);
+  gum_exec_ctx_write_mov_hot_ptr_reg (block->ctx,
+      GUM_EXEC_HOT_OFFSET (return_at), GUM_REG_XAX, cw);
+
+  gum_x86_writer_put_mov_reg_reg_offset_ptr (cw, GUM_REG_XCX,
+      GUM_REG_XSP, 4 * sizeof (gpointer));
+
+  /* check the topmost frames, popping through any that were skipped by
+   * longjmp() or an exception unwinding the stack */
+  gum_exec_ctx_write_mov_reg_hot_ptr (block->ctx, GUM_REG_XDX,
+      GUM_EXEC_HOT_OFFSET (current_frame), cw);
+  gum_exec_ctx_write_mov_reg_hot_ptr (block->ctx, GUM_REG_XAX,
+      GUM_EXEC_HOT_OFFSET (first_frame), cw);
+  for (i = 0; i != GUM_EXEC_FRAME_SEARCH_DEPTH; i++)
+  {
+    gum_x86_writer_put_cmp_reg_reg (cw, GUM_REG_XDX, GUM_REG_XAX);
+    gum_x86_writer_put_jcc_near_label (cw, GUM_X86_JAE, try_ret_cache_label,
+        GUM_UNLIKELY);
+    gum_x86_writer_put_cmp_reg_offset_ptr_reg (cw,
+        GUM_REG_XDX, G_STRUCT_OFFSET (GumExecFrame, real_address),
+        GUM_REG_XCX);
+    gum_x86_writer_put_jcc_near_label (cw, GUM_X86_JZ, found_frame_label,
+        GUM_LIKELY);
+    gum_x86_writer_put_add_reg_imm (cw, GUM_REG_XDX, sizeof (GumExecFrame));
+  }
+  gum_x86_writer_put_jmp_near_label (cw, try_ret_cache_label);
 
-  /* check frame at the top of the stack */
-  gum_x86_writer_put_mov_reg_near_ptr (cw, GUM_REG_XDX,
-      GUM_ADDRESS (&block->ctx->current_frame));
-  gum_x86_writer_put_mov_reg_reg_ptr (cw, GUM_REG_XAX, GUM_REG_XDX);
-  gum_x86_writer_put_cmp_reg_offset_ptr_reg (cw,
-      GUM_REG_XSP, 3 * sizeof (gpointer),
-      GUM_REG_XAX);
-  gum_x86_writer_put_jcc_short_label (cw, GUM_X86_JNZ,
-      resolve_dynamically_label, GUM_UNLIKELY);
+  gum_x86_writer_put_label (cw, found_frame_label);
 
   /* replace return address */
-  gum_x86_writer_put_mov_reg_reg_offset_ptr (cw, GUM_REG_XAX,
+  gum_x86_writer_put_mov_reg_reg_offset_ptr (cw, GUM_REG_XCX,
       GUM_REG_XDX, G_STRUCT_OFFSET (GumExecFrame, code_address));
   gum_x86_writer_put_mov_reg_offset_ptr_reg (cw,
-      GUM_REG_XSP, 3 * sizeof (gpointer),
-      GUM_REG_XAX);
+      GUM_REG_XSP, 4 * sizeof (gpointer),
+      GUM_REG_XCX);
 
   /* pop from our stack */
   gum_x86_writer_put_add_reg_imm (cw, GUM_REG_XDX, sizeof (GumExecFrame));
-  gum_x86_writer_put_mov_near_ptr_reg (cw,
-      GUM_ADDRESS (&block->ctx->current_frame), GUM_REG_XDX);
+  gum_exec_ctx_write_mov_hot_ptr_reg (block->ctx,
+      GUM_EXEC_HOT_OFFSET (current_frame), GUM_REG_XDX, cw);
 
   /* proceeed to block */
+  gum_x86_writer_put_pop_reg (cw, GUM_REG_XCX);
   gum_x86_writer_put_pop_reg (cw, GUM_REG_XDX);
   gum_x86_writer_put_pop_reg (cw, GUM_REG_XAX);
   gum_x86_writer_put_popfx (cw);
-  gum_x86_writer_put_jmp_near_ptr (cw, GUM_ADDRESS (&block->ctx->return_at));
+  gum_exec_ctx_write_jmp_hot_ptr (block->ctx,
+      GUM_EXEC_HOT_OFFSET (return_at), cw);
 
-  gum_x86_writer_put_label (cw, resolve_dynamically_label);
+  gum_x86_writer_put_label (cw, try_ret_cache_label);
   /* clear our stack so we might resync later */
-  gum_x86_writer_put_mov_reg_near_ptr (cw, GUM_REG_XDX,
-      GUM_ADDRESS (&block->ctx->first_frame));
-  gum_x86_writer_put_mov_near_ptr_reg (cw,
-      GUM_ADDRESS (&block->ctx->current_frame), GUM_REG_XDX);
+  gum_exec_ctx_write_mov_hot_ptr_reg (block->ctx,
+      GUM_EXEC_HOT_OFFSET (current_frame), GUM_REG_XAX, cw);
+
+  /* fall back to the return addresses resolved so far */
+  gum_exec_ctx_write_mov_reg_hot_ptr (block->ctx, GUM_REG_XAX,
+      GUM_EXEC_HOT_OFFSET (ret_cache), cw);
+  gum_x86_writer_put_mov_reg_reg (cw, GUM_REG_XDX, GUM_REG_XCX);
+  gum_x86_writer_put_and_reg_u32 (cw, GUM_REG_XDX,
+      GUM_EXEC_RET_CACHE_SIZE - 1);
+  gum_x86_writer_put_shl_reg_u8 (cw, GUM_REG_XDX,
+      (sizeof (GumExecFrame) == 16) ? 4 : 3);
+  gum_x86_writer_put_add_reg_reg (cw, GUM_REG_XAX, GUM_REG_XDX);
+  gum_x86_writer_put_cmp_reg_offset_ptr_reg (cw,
+      GUM_REG_XAX, G_STRUCT_OFFSET (GumExecFrame, real_address),
+      GUM_REG_XCX);
+  gum_x86_writer_put_jcc_short_label (cw, GUM_X86_JNZ,
+      resolve_dynamically_label, GUM_UNLIKELY);
+
+  gum_x86_writer_put_mov_reg_reg_offset_ptr (cw, GUM_REG_XCX,
+      GUM_REG_XAX, G_STRUCT_OFFSET (GumExecFrame, code_address));
+  gum_x86_writer_put_mov_reg_offset_ptr_reg (cw,
+      GUM_REG_XSP, 4 * sizeof (gpointer),
+      GUM_REG_XCX);
+
+  gum_x86_writer_put_pop_reg (cw, GUM_REG_XCX);
+  gum_x86_writer_put_pop_reg (cw, GUM_REG_XDX);
+  gum_x86_writer_put_pop_reg (cw, GUM_REG_XAX);
+  gum_x86_writer_put_popfx (cw);
+  gum_exec_ctx_write_jmp_hot_ptr (block->ctx,
+      GUM_EXEC_HOT_OFFSET (return_at), cw);
+
+  gum_x86_writer_put_label (cw, resolve_dynamically_label);
+  gum_x86_writer_put_pop_reg (cw, GUM_REG_XCX);
   gum_x86_writer_put_pop_reg (cw, GUM_REG_XDX);
   gum_x86_writer_put_pop_reg (cw, GUM_REG_XAX);
   gum_x86_writer_put_popfx (cw);
@@ -2357,27 +6227,27 @@ gum_exec_block_write_ret_transfer_code (GumExecBlock * block,
    */
   gum_exec_block_open_prolog (block, GUM_PROLOG_MINIMAL, gc);
 
-  gum_x86_writer_put_mov_reg_near_ptr (cw, GUM_REG_XAX,
-      GUM_ADDRESS (&block->ctx->app_stack));
+  gum_exec_ctx_write_mov_reg_hot_ptr (block->ctx, GUM_REG_XAX,
+      GUM_EXEC_HOT_OFFSET (app_stack), cw);
   gum_x86_writer_put_mov_reg_reg_ptr (cw, GUM_THUNK_REG_ARG1, GUM_REG_XAX);
-  gum_x86_writer_put_mov_reg_address (cw, GUM_THUNK_REG_ARG0,
-      GUM_ADDRESS (block->ctx));
+  gum_exec_ctx_write_mov_reg_ctx (block->ctx, GUM_THUNK_REG_ARG0, cw);
   gum_x86_writer_put_sub_reg_imm (cw, GUM_REG_XSP,
       GUM_THUNK_ARGLIST_STACK_RESERVE);
 
   gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XAX,
-      GUM_ADDRESS (gum_exec_ctx_replace_current_block_with));
+      GUM_ADDRESS (gum_exec_ctx_replace_current_block_from_ret));
   gum_x86_writer_put_call_reg (cw, GUM_REG_XAX);
 
   gum_x86_writer_put_add_reg_imm (cw, GUM_REG_XSP,
       GUM_THUNK_ARGLIST_STACK_RESERVE);
-  gum_x86_writer_put_mov_reg_near_ptr (cw, GUM_REG_XAX,
-      GUM_ADDRESS (&block->ctx->app_stack));
-  gum_x86_writer_put_mov_reg_near_ptr (cw, GUM_REG_XCX,
-      GUM_ADDRESS (&block->ctx->resume_at));
+  gum_exec_ctx_write_mov_reg_hot_ptr (block->ctx, GUM_REG_XAX,
+      GUM_EXEC_HOT_OFFSET (app_stack), cw);
+  gum_exec_ctx_write_mov_reg_hot_ptr (block->ctx, GUM_REG_XCX,
+      GUM_EXEC_HOT_OFFSET (resume_at), cw);
   gum_x86_writer_put_mov_reg_ptr_reg (cw, GUM_REG_XAX, GUM_REG_XCX);
   gum_exec_block_close_prolog (block, gc);
-  gum_x86_writer_put_jmp_near_ptr (cw, GUM_ADDRESS (&block->ctx->return_at));
+  gum_exec_ctx_write_jmp_hot_ptr (block->ctx,
+      GUM_EXEC_HOT_OFFSET (return_at), cw);
 }
 
 static void
@@ -2397,11 +6267,102 @@ gum_exec_block_write_single_step_transfer_code (GumExecBlock * block,
   gum_x86_writer_put_jmp (gc->code_writer, gc->instruction->begin);
 }
 
+static gboolean
+gum_exec_block_can_cache_target (GumExecBlock * block,
+                                 const GumBranchTarget * target)
+{
+  GumExecCtx * ctx = block->ctx;
+
+  /*
+   * Only worth it for targets computed at runtime, and like backpatching it
+   * requires trust and a block that no other thread is executing
+   */
+  return (target->is_indirect || target->base != UD_NONE) &&
+      ctx->stalker->priv->trust_threshold >= 0 &&
+      !ctx->is_shared;
+}
+
+/*
+ * Resolves the branch target with the prolog open, leaving the address to
+ * resume at in XAX and the hot state updated as if the slow path was taken.
+ */
+static void
+gum_exec_block_write_inline_cache_code (GumExecBlock * block,
+                                        const GumBranchTarget * target,
+                                        gboolean can_run_natively,
+                                        GumGeneratorContext * gc)
+{
+  GumExecCtx * ctx = block->ctx;
+  GumX86Writer * cw = gc->code_writer;
+  gconstpointer cache_end_label = cw->code + 1;
+  gconstpointer hit_label = cw->code + 2;
+  gconstpointer resolved_label = cw->code + 3;
+  GumExecInlineCache * ic;
+  guint i;
+
+  gum_x86_writer_put_jmp_near_label (cw, cache_end_label);
+  while (GPOINTER_TO_SIZE (cw->code) % GUM_DATA_ALIGNMENT != 0)
+    gum_x86_writer_put_int3 (cw);
+  ic = (GumExecInlineCache *) cw->code;
+  gum_x86_writer_put_padding (cw, sizeof (GumExecInlineCache));
+  gum_x86_writer_put_label (cw, cache_end_label);
+
+  memset (ic, 0, sizeof (GumExecInlineCache));
+  ic->ctx = ctx;
+  ic->block = block;
+  ic->real_address = gc->instruction->begin;
+  ic->can_run_natively = can_run_natively;
+  ic->next = ctx->inline_caches;
+  ctx->inline_caches = ic;
+
+  gum_exec_ctx_write_push_branch_target_address (ctx, target, gc);
+  gum_x86_writer_put_pop_reg (cw, GUM_REG_XDX);
+
+  gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XAX,
+      GUM_ADDRESS (&ic->entries[0]));
+  for (i = 0; i != GUM_EXEC_INLINE_CACHE_SIZE; i++)
+  {
+    if (i != 0)
+    {
+      gum_x86_writer_put_add_reg_imm (cw, GUM_REG_XAX,
+          sizeof (GumExecInlineCacheEntry));
+    }
+    gum_x86_writer_put_cmp_reg_offset_ptr_reg (cw, GUM_REG_XAX,
+        G_STRUCT_OFFSET (GumExecInlineCacheEntry, real_address), GUM_REG_XDX);
+    gum_x86_writer_put_jcc_near_label (cw, GUM_X86_JZ, hit_label,
+        GUM_NO_HINT);
+  }
+
+  gum_x86_writer_put_sub_reg_imm (cw, GUM_REG_XSP,
+      GUM_THUNK_ARGLIST_STACK_RESERVE);
+  gum_x86_writer_put_call_with_arguments (cw,
+      GUM_FUNCPTR_TO_POINTER (gum_exec_ctx_replace_current_block_from_cache),
+      2,
+      GUM_ARG_POINTER, ic,
+      GUM_ARG_REGISTER, GUM_REG_XDX);
+  gum_x86_writer_put_add_reg_imm (cw, GUM_REG_XSP,
+      GUM_THUNK_ARGLIST_STACK_RESERVE);
+  gum_x86_writer_put_jmp_short_label (cw, resolved_label);
+
+  gum_x86_writer_put_label (cw, hit_label);
+  gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XCX, GUM_ADDRESS (ic));
+  gum_x86_writer_put_inc_reg_ptr (cw, GUM_PTR_DWORD, GUM_REG_XCX);
+  gum_x86_writer_put_mov_reg_reg_offset_ptr (cw, GUM_REG_XCX,
+      GUM_REG_XAX, G_STRUCT_OFFSET (GumExecInlineCacheEntry, block));
+  gum_exec_ctx_write_mov_hot_ptr_reg (ctx,
+      GUM_EXEC_HOT_OFFSET (current_block), GUM_REG_XCX, cw);
+  gum_x86_writer_put_mov_reg_reg_offset_ptr (cw, GUM_REG_XAX,
+      GUM_REG_XAX, G_STRUCT_OFFSET (GumExecInlineCacheEntry, code_address));
+  gum_exec_ctx_write_mov_hot_ptr_reg (ctx,
+      GUM_EXEC_HOT_OFFSET (resume_at), GUM_REG_XAX, cw);
+
+  gum_x86_writer_put_label (cw, resolved_label);
+}
+
 static void
 gum_exec_block_write_call_event_code (GumExecBlock * block,
                                       const GumBranchTarget * target,
-                                      GumGeneratorContext * gc,
-                                      GumCodeContext cc)
+                                      GumGeneratorContext * gc)
 {
   GumX86Writer * cw = gc->code_writer;
 
@@ -2420,10 +6381,11 @@ gum_exec_block_write_call_event_code (GumExecBlock * block,
       GUM_REG_XAX, G_STRUCT_OFFSET (GumCallEvent, target),
       GUM_REG_XCX);
 
-  gum_x86_writer_put_mov_reg_near_ptr (cw, GUM_REG_XCX,
-      GUM_ADDRESS (&block->ctx->first_frame));
-  gum_x86_writer_put_sub_reg_near_ptr (cw, GUM_REG_XCX,
-      GUM_ADDRESS (&block->ctx->current_frame));
+  gum_exec_ctx_write_mov_reg_hot_ptr (block->ctx, GUM_REG_XCX,
+      GUM_EXEC_HOT_OFFSET (first_frame), cw);
+  gum_exec_ctx_write_mov_reg_hot_ptr (block->ctx, GUM_REG_XDX,
+      GUM_EXEC_HOT_OFFSET (current_frame), cw);
+  gum_x86_writer_put_sub_reg_reg (cw, GUM_REG_XCX, GUM_REG_XDX);
 #if GLIB_SIZEOF_VOID_P == 4
   gum_x86_writer_put_shr_reg_u8 (cw, GUM_REG_XCX, 3);
 #else
@@ -2433,65 +6395,268 @@ gum_exec_block_write_call_event_code (GumExecBlock * block,
       GUM_REG_XAX, G_STRUCT_OFFSET (GumCallEvent, depth),
       GUM_REG_XCX);
 
-  gum_exec_block_write_event_submit_code (block, gc, cc);
+  gum_exec_block_write_event_submit_code (block, gc);
+}
+
+/*
+ * Direct calls bump a counter set aside for their target while compiling,
+ * through RAX and with moffs addressing so that the flags are left alone
+ * and the counter may live anywhere. Indirect calls look theirs up.
+ */
+static void
+gum_exec_block_write_call_count_code (GumExecBlock * block,
+                                      const GumBranchTarget * target,
+                                      GumGeneratorContext * gc)
+{
+  GumExecCtx * ctx = block->ctx;
+  GumX86Writer * cw = gc->code_writer;
+#if GLIB_SIZEOF_VOID_P == 4
+  guint align_correction = 8;
+#endif
+
+  if (!target->is_indirect && target->base == UD_NONE)
+  {
+    GumCallCounter * counter;
+    /* mov xax, [counter]; mov [counter], xax */
+#if GLIB_SIZEOF_VOID_P == 8
+    guint8 load[] = { 0x48, 0xa1, 0, 0, 0, 0, 0, 0, 0, 0 };
+    guint8 store[] = { 0x48, 0xa3, 0, 0, 0, 0, 0, 0, 0, 0 };
+#else
+    guint8 load[] = { 0xa1, 0, 0, 0, 0 };
+    guint8 store[] = { 0xa3, 0, 0, 0, 0 };
+#endif
+    gsize count_address;
+
+    counter = gum_exec_ctx_obtain_call_counter (ctx,
+        target->absolute_address);
+    count_address = GPOINTER_TO_SIZE (&counter->count);
+    memcpy (load + sizeof (load) - sizeof (gsize), &count_address,
+        sizeof (gsize));
+    memcpy (store + sizeof (store) - sizeof (gsize), &count_address,
+        sizeof (gsize));
+
+    gum_exec_block_close_prolog (block, gc);
+
+    gum_x86_writer_put_lea_reg_reg_offset (cw, GUM_REG_XSP,
+        GUM_REG_XSP, -GUM_RED_ZONE_MAX_SIZE);
+    gum_x86_writer_put_push_reg (cw, GUM_REG_XAX);
+    gum_x86_writer_put_bytes (cw, load, sizeof (load));
+    gum_x86_writer_put_lea_reg_reg_offset (cw, GUM_REG_XAX, GUM_REG_XAX, 1);
+    gum_x86_writer_put_bytes (cw, store, sizeof (store));
+    gum_x86_writer_put_pop_reg (cw, GUM_REG_XAX);
+    gum_x86_writer_put_lea_reg_reg_offset (cw, GUM_REG_XSP,
+        GUM_REG_XSP, GUM_RED_ZONE_MAX_SIZE);
+
+    return;
+  }
+
+  gum_exec_block_open_prolog (block, GUM_PROLOG_MINIMAL, gc);
+
+  gum_exec_ctx_write_push_branch_target_address (ctx, target, gc);
+  gum_x86_writer_put_pop_reg (cw, GUM_REG_XCX);
+
+#if GLIB_SIZEOF_VOID_P == 4
+  gum_x86_writer_put_sub_reg_imm (cw, GUM_REG_XSP, align_correction);
+#endif
+  gum_x86_writer_put_call_with_arguments (cw,
+      GUM_FUNCPTR_TO_POINTER (gum_exec_ctx_count_indirect_call), 2,
+      GUM_ARG_POINTER, ctx,
+      GUM_ARG_REGISTER, GUM_REG_XCX);
+#if GLIB_SIZEOF_VOID_P == 4
+  gum_x86_writer_put_add_reg_imm (cw, GUM_REG_XSP, align_correction);
+#endif
+}
+
+static void
+gum_exec_block_write_ret_event_code (GumExecBlock * block,
+                                     GumGeneratorContext * gc)
+{
+  GumX86Writer * cw = gc->code_writer;
+
+  gum_exec_block_open_prolog (block, GUM_PROLOG_MINIMAL, gc);
+
+  gum_exec_block_write_event_init_code (block, GUM_RET, gc);
+  gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XCX,
+      GUM_ADDRESS (gc->instruction->begin));
+  gum_x86_writer_put_mov_reg_offset_ptr_reg (cw,
+      GUM_REG_XAX, G_STRUCT_OFFSET (GumRetEvent, location),
+      GUM_REG_XCX);
+
+  gum_exec_ctx_write_mov_reg_hot_ptr (block->ctx, GUM_REG_XDX,
+      GUM_EXEC_HOT_OFFSET (app_stack), cw);
+  gum_x86_writer_put_mov_reg_reg_ptr (cw, GUM_REG_XDX, GUM_REG_XDX);
+  gum_x86_writer_put_mov_reg_offset_ptr_reg (cw,
+      GUM_REG_XAX, G_STRUCT_OFFSET (GumRetEvent, target),
+      GUM_REG_XDX);
+
+  gum_exec_ctx_write_mov_reg_hot_ptr (block->ctx, GUM_REG_XCX,
+      GUM_EXEC_HOT_OFFSET (first_frame), cw);
+  gum_exec_ctx_write_mov_reg_hot_ptr (block->ctx, GUM_REG_XDX,
+      GUM_EXEC_HOT_OFFSET (current_frame), cw);
+  gum_x86_writer_put_sub_reg_reg (cw, GUM_REG_XCX, GUM_REG_XDX);
+#if GLIB_SIZEOF_VOID_P == 4
+  gum_x86_writer_put_shr_reg_u8 (cw, GUM_REG_XCX, 3);
+#else
+  gum_x86_writer_put_shr_reg_u8 (cw, GUM_REG_XCX, 4);
+#endif
+  gum_x86_writer_put_mov_reg_offset_ptr_reg (cw,
+      GUM_REG_XAX, G_STRUCT_OFFSET (GumCallEvent, depth),
+      GUM_REG_ECX);
+
+  gum_exec_block_write_event_submit_code (block, gc);
+}
+
+static void
+gum_exec_block_write_exec_event_code (GumExecBlock * block,
+                                      GumGeneratorContext * gc)
+{
+  GumX86Writer * cw = gc->code_writer;
+  gboolean lightweight;
+
+  lightweight = gum_exec_block_open_event_frame (block, gc);
+
+  gum_exec_block_write_event_init_code (block, GUM_EXEC, gc);
+  gum_x86_writer_put_mov_reg_address (cw, gc->scratch_reg,
+      GUM_ADDRESS (gc->instruction->begin));
+  gum_x86_writer_put_mov_reg_offset_ptr_reg (cw,
+      gc->event_reg, G_STRUCT_OFFSET (GumExecEvent, location),
+      gc->scratch_reg);
+
+  gum_exec_block_close_event_frame (block, lightweight, gc);
+}
+
+static void
+gum_exec_block_write_block_exec_event_code (GumExecBlock * block,
+                                            gpointer real_address,
+                                            GumGeneratorContext * gc)
+{
+  GumX86Writer * cw = gc->code_writer;
+  gboolean lightweight;
+
+  lightweight = gum_exec_block_open_event_frame (block, gc);
+
+  gum_exec_block_write_event_init_code (block, GUM_BLOCK_EXEC, gc);
+  gum_x86_writer_put_mov_reg_address (cw, gc->scratch_reg,
+      GUM_ADDRESS (real_address));
+  gum_x86_writer_put_mov_reg_offset_ptr_reg (cw,
+      gc->event_reg, G_STRUCT_OFFSET (GumBlockEvent, begin),
+      gc->scratch_reg);
+  /* the end isn't known until the block is compiled, so patch it in then */
+  gum_x86_writer_put_mov_reg_address (cw, gc->scratch_reg, 0);
+  gc->block_end_slot = (gpointer *) (gum_x86_writer_cur (cw) -
+      sizeof (gpointer));
+  gum_x86_writer_put_mov_reg_offset_ptr_reg (cw,
+      gc->event_reg, G_STRUCT_OFFSET (GumBlockEvent, end),
+      gc->scratch_reg);
+
+  gum_exec_block_close_event_frame (block, lightweight, gc);
+  gum_exec_block_close_prolog (block, gc);
+}
+
+/*
+ * Events are written through one register, with another as scratch.
+ * Appending to a batch buffer needs nothing else, so unless a prolog is
+ * already open we pick two the application is done with, and save only
+ * those of them and the flags that it still needs.
+ */
+static gboolean
+gum_exec_block_open_event_frame (GumExecBlock * block,
+                                 GumGeneratorContext * gc)
+{
+  const guint n = G_N_ELEMENTS (gum_event_frame_regs);
+  GumX86Writer * cw = gc->code_writer;
+  guint32 live;
+  guint i;
+
+  if (block->ctx->event_buffer == NULL ||
+      gc->opened_prolog != GUM_PROLOG_NONE)
+  {
+    gum_exec_block_open_prolog (block, GUM_PROLOG_MINIMAL, gc);
+    return FALSE;
+  }
+
+  live = gum_generator_context_get_live_regs (gc);
+
+  gc->event_reg = GUM_REG_NONE;
+  gc->scratch_reg = GUM_REG_NONE;
+  for (i = 0; i != n; i++)
+  {
+    if ((live & (1 << gum_event_frame_regs[i].index)) != 0)
+      continue;
+
+    if (gc->event_reg == GUM_REG_NONE)
+    {
+      gc->event_reg = gum_event_frame_regs[i].reg;
+    }
+    else
+    {
+      gc->scratch_reg = gum_event_frame_regs[i].reg;
+      break;
+    }
+  }
+  if (gc->event_reg == GUM_REG_NONE)
+    gc->event_reg = GUM_REG_XAX;
+  if (gc->scratch_reg == GUM_REG_NONE)
+  {
+    gc->scratch_reg =
+        (gc->event_reg != GUM_REG_XCX) ? GUM_REG_XCX : GUM_REG_XAX;
+  }
+
+  gum_x86_writer_put_lea_reg_reg_offset (cw, GUM_REG_XSP,
+      GUM_REG_XSP, -GUM_RED_ZONE_MAX_SIZE);
+  if ((live & GUM_LIVE_FLAGS) != 0)
+    gum_x86_writer_put_pushfx (cw);
+  for (i = 0; i != n; i++)
+  {
+    if (gum_event_frame_reg_needs_saving (i, live, gc))
+      gum_x86_writer_put_push_reg (cw, gum_event_frame_regs[i].reg);
+  }
+
+  return TRUE;
 }
 
 static void
-gum_exec_block_write_ret_event_code (GumExecBlock * block,
-                                     GumGeneratorContext * gc,
-                                     GumCodeContext cc)
+gum_exec_block_close_event_frame (GumExecBlock * block,
+                                  gboolean lightweight,
+                                  GumGeneratorContext * gc)
 {
   GumX86Writer * cw = gc->code_writer;
+  guint32 live;
+  guint i;
 
-  gum_exec_block_open_prolog (block, GUM_PROLOG_MINIMAL, gc);
+  if (!lightweight)
+  {
+    gum_exec_block_write_event_submit_code (block, gc);
+    return;
+  }
 
-  gum_exec_block_write_event_init_code (block, GUM_RET, gc);
-  gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XCX,
-      GUM_ADDRESS (gc->instruction->begin));
-  gum_x86_writer_put_mov_reg_offset_ptr_reg (cw,
-      GUM_REG_XAX, G_STRUCT_OFFSET (GumRetEvent, location),
-      GUM_REG_XCX);
+  gum_exec_block_write_event_append_code (block, gc);
 
-  gum_x86_writer_put_mov_reg_near_ptr (cw, GUM_REG_XDX,
-      GUM_ADDRESS (&block->ctx->app_stack));
-  gum_x86_writer_put_mov_reg_reg_ptr (cw, GUM_REG_XDX, GUM_REG_XDX);
-  gum_x86_writer_put_mov_reg_offset_ptr_reg (cw,
-      GUM_REG_XAX, G_STRUCT_OFFSET (GumRetEvent, target),
-      GUM_REG_XDX);
+  live = gum_generator_context_get_live_regs (gc);
 
-  gum_x86_writer_put_mov_reg_near_ptr (cw, GUM_REG_XCX,
-      GUM_ADDRESS (&block->ctx->first_frame));
-  gum_x86_writer_put_sub_reg_near_ptr (cw, GUM_REG_XCX,
-      GUM_ADDRESS (&block->ctx->current_frame));
-#if GLIB_SIZEOF_VOID_P == 4
-  gum_x86_writer_put_shr_reg_u8 (cw, GUM_REG_XCX, 3);
-#else
-  gum_x86_writer_put_shr_reg_u8 (cw, GUM_REG_XCX, 4);
-#endif
-  gum_x86_writer_put_mov_reg_offset_ptr_reg (cw,
-      GUM_REG_XAX, G_STRUCT_OFFSET (GumCallEvent, depth),
-      GUM_REG_ECX);
+  for (i = G_N_ELEMENTS (gum_event_frame_regs); i-- != 0;)
+  {
+    if (gum_event_frame_reg_needs_saving (i, live, gc))
+      gum_x86_writer_put_pop_reg (cw, gum_event_frame_regs[i].reg);
+  }
+  if ((live & GUM_LIVE_FLAGS) != 0)
+    gum_x86_writer_put_popfx (cw);
+  gum_x86_writer_put_lea_reg_reg_offset (cw, GUM_REG_XSP,
+      GUM_REG_XSP, GUM_RED_ZONE_MAX_SIZE);
 
-  gum_exec_block_write_event_submit_code (block, gc, cc);
+  gc->event_reg = GUM_REG_XAX;
+  gc->scratch_reg = GUM_REG_XCX;
 }
 
-static void
-gum_exec_block_write_exec_event_code (GumExecBlock * block,
-                                      GumGeneratorContext * gc,
-                                      GumCodeContext cc)
+static gboolean
+gum_event_frame_reg_needs_saving (guint i,
+                                  guint32 live,
+                                  GumGeneratorContext * gc)
 {
-  GumX86Writer * cw = gc->code_writer;
-
-  gum_exec_block_open_prolog (block, GUM_PROLOG_MINIMAL, gc);
-
-  gum_exec_block_write_event_init_code (block, GUM_EXEC, gc);
-  gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XCX,
-      GUM_ADDRESS (gc->instruction->begin));
-  gum_x86_writer_put_mov_reg_offset_ptr_reg (cw,
-      GUM_REG_XAX, G_STRUCT_OFFSET (GumExecEvent, location),
-      GUM_REG_XCX);
+  GumCpuReg reg = gum_event_frame_regs[i].reg;
 
-  gum_exec_block_write_event_submit_code (block, gc, cc);
+  return (reg == gc->event_reg || reg == gc->scratch_reg) &&
+      (live & (1 << gum_event_frame_regs[i].index)) != 0;
 }
 
 static void
@@ -2500,86 +6665,180 @@ gum_exec_block_write_event_init_code (GumExecBlock * block,
                                       GumGeneratorContext * gc)
 {
   GumX86Writer * cw = gc->code_writer;
-  gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XAX,
-      GUM_ADDRESS (&block->ctx->tmp_event));
+
+  if (block->ctx->event_buffer != NULL)
+  {
+    gum_x86_writer_put_mov_reg_near_ptr (cw, gc->event_reg,
+        GUM_ADDRESS (&block->ctx->event_cursor));
+  }
+  else
+  {
+    gum_x86_writer_put_mov_reg_address (cw, gc->event_reg,
+        GUM_ADDRESS (&block->ctx->tmp_event));
+  }
   gum_x86_writer_put_mov_reg_offset_ptr_u32 (cw,
-      GUM_REG_XAX, G_STRUCT_OFFSET (GumAnyEvent, type),
+      gc->event_reg, G_STRUCT_OFFSET (GumAnyEvent, type),
       type);
 }
 
 static void
 gum_exec_block_write_event_submit_code (GumExecBlock * block,
-                                        GumGeneratorContext * gc,
-                                        GumCodeContext cc)
+                                        GumGeneratorContext * gc)
 {
-  GumExecCtx * ctx = block->ctx;
   GumX86Writer * cw = gc->code_writer;
-  gconstpointer beach_label = cw->code + 1;
-  GumPrologType opened_prolog;
 
+  if (block->ctx->event_buffer != NULL)
+  {
+    gum_exec_block_write_event_append_code (block, gc);
+  }
+  else
+  {
 #if GLIB_SIZEOF_VOID_P == 4
-  guint align_correction = 8;
-  gum_x86_writer_put_sub_reg_imm (cw, GUM_REG_XSP, align_correction);
+    guint align_correction = 8;
+    gum_x86_writer_put_sub_reg_imm (cw, GUM_REG_XSP, align_correction);
 #endif
-  gum_x86_writer_put_call_with_arguments (cw,
-      block->ctx->sink_process_impl, 2,
-      GUM_ARG_POINTER, block->ctx->sink,
-      GUM_ARG_REGISTER, GUM_REG_XAX);
+    gum_x86_writer_put_call_with_arguments (cw,
+        block->ctx->sink_process_impl, 2,
+        GUM_ARG_POINTER, block->ctx->sink,
+        GUM_ARG_REGISTER, GUM_REG_XAX);
 #if GLIB_SIZEOF_VOID_P == 4
-  gum_x86_writer_put_add_reg_imm (cw, GUM_REG_XSP, align_correction);
+    gum_x86_writer_put_add_reg_imm (cw, GUM_REG_XSP, align_correction);
 #endif
+  }
+}
+
+/*
+ * Commits the event the event register points into the buffer, clobbering
+ * the scratch register and the flags, and hands the buffer over to the
+ * sink once it's full.
+ */
+static void
+gum_exec_block_write_event_append_code (GumExecBlock * block,
+                                        GumGeneratorContext * gc)
+{
+  GumExecCtx * ctx = block->ctx;
+  GumX86Writer * cw = gc->code_writer;
+  gconstpointer not_full_label = cw->code + 1;
 
-  if (cc == GUM_CODE_INTERRUPTIBLE)
+  gum_x86_writer_put_add_reg_imm (cw, gc->event_reg, sizeof (GumEvent));
+  gum_x86_writer_put_mov_near_ptr_reg (cw,
+      GUM_ADDRESS (&ctx->event_cursor), gc->event_reg);
+  gum_x86_writer_put_mov_reg_address (cw, gc->scratch_reg,
+      GUM_ADDRESS (ctx->event_buffer_end));
+  gum_x86_writer_put_cmp_reg_reg (cw, gc->event_reg, gc->scratch_reg);
+  gum_x86_writer_put_jcc_short_label (cw, GUM_X86_JB, not_full_label,
+      GUM_LIKELY);
+
+  if (gc->opened_prolog != GUM_PROLOG_NONE)
   {
-    /* check if we've been asked to unfollow */
-    gum_x86_writer_put_mov_reg_near_ptr (cw, GUM_REG_EAX,
-        GUM_ADDRESS (&ctx->state));
-    gum_x86_writer_put_cmp_reg_i32 (cw, GUM_REG_EAX,
-        GUM_EXEC_CTX_UNFOLLOW_PENDING);
-    gum_x86_writer_put_jcc_short_label (cw, GUM_X86_JNZ, beach_label, GUM_LIKELY);
+#if GLIB_SIZEOF_VOID_P == 4
+    gum_x86_writer_put_sub_reg_imm (cw, GUM_REG_XSP, 12);
+#endif
     gum_x86_writer_put_call_with_arguments (cw,
-        GUM_FUNCPTR_TO_POINTER (gum_exec_ctx_unfollow), 2,
-        GUM_ARG_POINTER, ctx,
-        GUM_ARG_POINTER, gc->instruction->begin);
-    opened_prolog = gc->opened_prolog;
-    gum_exec_block_close_prolog (block, gc);
-    gc->opened_prolog = opened_prolog;
-    gum_x86_writer_put_jmp_near_ptr (cw, GUM_ADDRESS (&ctx->resume_at));
+        GUM_FUNCPTR_TO_POINTER (gum_exec_ctx_flush_events), 1,
+        GUM_ARG_POINTER, ctx);
+#if GLIB_SIZEOF_VOID_P == 4
+    gum_x86_writer_put_add_reg_imm (cw, GUM_REG_XSP, 12);
+#endif
+  }
+  else
+  {
+    gum_x86_writer_put_call (cw, ctx->flush_events_thunk);
+  }
+
+  gum_x86_writer_put_label (cw, not_full_label);
+}
+
+/*
+ * FPU state is normally saved by the probe code before it calls into C. We
+ * only do it here for a probe that was added after the block was compiled,
+ * in the moment before the block is thrown away.
+ */
+static void
+gum_exec_block_dispatch_call_probes (GumExecBlock * block,
+                                     GumExecCtx * ctx,
+                                     const GumCallProbeArray * probes,
+                                     GumCpuContext * cpu_context,
+                                     gboolean fp_state_saved)
+{
+  GumStalkerPrivate * priv = ctx->stalker->priv;
+  GumCallSite call_site;
+  gboolean fp_state_saved_here = FALSE;
+  guint i;
+
+  call_site.block_address = block->real_begin;
+  call_site.stack_data = ctx->hot->app_stack;
+  call_site.cpu_context = cpu_context;
+
+  for (i = 0; i != probes->len; i++)
+  {
+    const GumCallProbe * probe = &probes->probes[i];
+
+    /* The prolog was emitted by the block's ctx, which may be shared */
+    if ((probe->flags & GUM_CALL_PROBE_NEEDS_FPU) != 0 &&
+        block->ctx->lazy_fp_save && !fp_state_saved)
+    {
+      priv->save_fp_state (ctx->fp_save_area);
+      fp_state_saved = TRUE;
+      fp_state_saved_here = TRUE;
+    }
 
-    gum_x86_writer_put_label (cw, beach_label);
+    probe->callback (&call_site, probe->user_data);
   }
+
+  if (fp_state_saved_here)
+    priv->restore_fp_state (ctx->fp_save_area);
 }
 
 static void
-gum_exec_block_invoke_call_probes_for_target (GumExecBlock * block,
-                                              gpointer target_address,
-                                              GumCpuContext * cpu_context)
+gum_exec_block_invoke_call_probes (GumExecBlock * block,
+                                   GumCallProbeSlot * slot,
+                                   GumCpuContext * cpu_context,
+                                   gboolean fp_state_saved)
 {
-  GumStalkerPrivate * priv = block->ctx->stalker->priv;
-  GArray * probes;
+  GumExecCtx * ctx = gum_exec_block_get_thread_ctx (block);
+  GumCallProbeArray * probes;
 
-  gum_spinlock_acquire (&priv->probe_lock);
+  g_atomic_int_inc (&ctx->probe_epoch);
 
-  probes = (GArray *)
-      g_hash_table_lookup (priv->probe_array_by_address, target_address);
+  probes = (GumCallProbeArray *) g_atomic_pointer_get (&slot->probes);
   if (probes != NULL)
   {
-    GumCallSite call_site;
-    guint i;
+    gum_exec_block_dispatch_call_probes (block, ctx, probes, cpu_context,
+        fp_state_saved);
+  }
 
-    call_site.block_address = block->real_begin;
-    call_site.stack_data = block->ctx->app_stack;
-    call_site.cpu_context = cpu_context;
+  g_atomic_int_inc (&ctx->probe_epoch);
+}
 
-    for (i = 0; i != probes->len; i++)
-    {
-      GumCallProbe * probe = &g_array_index (probes, GumCallProbe, i);
+static void
+gum_exec_block_invoke_call_probes_for_target (GumExecBlock * block,
+                                              gpointer target_address,
+                                              GumCpuContext * cpu_context,
+                                              gboolean fp_state_saved)
+{
+  GumExecCtx * ctx = gum_exec_block_get_thread_ctx (block);
+  GHashTable * index;
+  GumCallProbeSlot * slot;
+
+  g_atomic_int_inc (&ctx->probe_epoch);
+
+  index = (GHashTable *) g_atomic_pointer_get (
+      &block->ctx->stalker->priv->probe_index);
+  slot = (GumCallProbeSlot *) g_hash_table_lookup (index, target_address);
+  if (slot != NULL)
+  {
+    GumCallProbeArray * probes;
 
-      probe->callback (&call_site, probe->user_data);
+    probes = (GumCallProbeArray *) g_atomic_pointer_get (&slot->probes);
+    if (probes != NULL)
+    {
+      gum_exec_block_dispatch_call_probes (block, ctx, probes, cpu_context,
+          fp_state_saved);
     }
   }
 
-  gum_spinlock_release (&priv->probe_lock);
+  g_atomic_int_inc (&ctx->probe_epoch);
 }
 
 static void
@@ -2588,42 +6847,95 @@ gum_exec_block_write_call_probe_code (GumExecBlock * block,
                                       GumGeneratorContext * gc)
 {
   GumX86Writer * cw = gc->code_writer;
-  gboolean skip_probing = FALSE;
+  GumStalkerPrivate * priv = block->ctx->stalker->priv;
+  gboolean is_direct, save_fp_state = FALSE;
+  GumCallProbeSlot * slot = NULL;
 
-  if (!target->is_indirect && target->base == UD_NONE)
+  is_direct = !target->is_indirect && target->base == UD_NONE;
+  if (is_direct)
   {
-    GumStalkerPrivate * priv = block->ctx->stalker->priv;
+    GumExecCtx * ctx = gum_exec_block_get_thread_ctx (block);
+    GHashTable * index;
+
+    g_atomic_int_inc (&ctx->probe_epoch);
+    index = (GHashTable *) g_atomic_pointer_get (
+        &block->ctx->stalker->priv->probe_index);
+    slot = (GumCallProbeSlot *)
+        g_hash_table_lookup (index, target->absolute_address);
+    if (slot != NULL && block->ctx->lazy_fp_save)
+    {
+      GumCallProbeArray * probes;
 
-    gum_spinlock_acquire (&priv->probe_lock);
-    skip_probing = g_hash_table_lookup (priv->probe_array_by_address,
-        target->absolute_address) == NULL;
-    gum_spinlock_release (&priv->probe_lock);
-  }
+      probes = (GumCallProbeArray *) g_atomic_pointer_get (&slot->probes);
+      if (probes != NULL)
+      {
+        guint i;
+
+        for (i = 0; i != probes->len && !save_fp_state; i++)
+        {
+          save_fp_state =
+              (probes->probes[i].flags & GUM_CALL_PROBE_NEEDS_FPU) != 0;
+        }
+      }
+    }
+    g_atomic_int_inc (&ctx->probe_epoch);
 
-  if (!skip_probing)
+    if (slot == NULL || g_atomic_pointer_get (&slot->probes) == NULL)
+      return;
+  }
+  else if (block->ctx->lazy_fp_save)
   {
-#if GLIB_SIZEOF_VOID_P == 4
-    guint align_correction = 4;
-#endif
+    save_fp_state = g_atomic_int_get (&priv->fpu_probe_count) != 0;
+  }
 
-    if (gc->opened_prolog != GUM_PROLOG_NONE)
-      gum_exec_block_close_prolog (block, gc);
-    gum_exec_block_open_prolog (block, GUM_PROLOG_FULL, gc);
+  if (gc->opened_prolog != GUM_PROLOG_NONE)
+    gum_exec_block_close_prolog (block, gc);
+  gum_exec_block_open_prolog (block, GUM_PROLOG_FULL, gc);
+
+  /*
+   * Lazy mode leaves FPU state alone in the full prolog, but a probe that
+   * needs it must get it before any of our own C code gets to touch it.
+   * This also has to happen before XAX is loaded, as XSAVE clobbers it.
+   */
+  if (save_fp_state)
+  {
+    gum_exec_ctx_write_mov_fp_save_area (block->ctx, GUM_REG_XCX, cw);
+    gum_stalker_write_fp_save (block->ctx->stalker, priv->fp_save_mask, cw);
+  }
 
+  if (!is_direct)
+  {
     gum_exec_ctx_write_push_branch_target_address (block->ctx, target, gc);
     gum_x86_writer_put_pop_reg (cw, GUM_REG_XAX);
+  }
 
-#if GLIB_SIZEOF_VOID_P == 4
-    gum_x86_writer_put_sub_reg_imm (cw, GUM_REG_XSP, align_correction);
-#endif
+  /* Four arguments keep the stack 16 byte aligned on IA-32 too */
+  if (is_direct)
+  {
+    /* The slot outlives us, so we bake it in and skip the lookup */
+    gum_x86_writer_put_call_with_arguments (cw,
+        GUM_FUNCPTR_TO_POINTER (gum_exec_block_invoke_call_probes), 4,
+        GUM_ARG_POINTER, block,
+        GUM_ARG_POINTER, slot,
+        GUM_ARG_REGISTER, GUM_REG_XBX,
+        GUM_ARG_POINTER, GSIZE_TO_POINTER (save_fp_state));
+  }
+  else
+  {
     gum_x86_writer_put_call_with_arguments (cw,
-        GUM_FUNCPTR_TO_POINTER (gum_exec_block_invoke_call_probes_for_target), 3,
+        GUM_FUNCPTR_TO_POINTER (gum_exec_block_invoke_call_probes_for_target),
+        4,
         GUM_ARG_POINTER, block,
         GUM_ARG_REGISTER, GUM_REG_XAX,
-        GUM_ARG_REGISTER, GUM_REG_XBX);
-#if GLIB_SIZEOF_VOID_P == 4
-    gum_x86_writer_put_add_reg_imm (cw, GUM_REG_XSP, align_correction);
-#endif
+        GUM_ARG_REGISTER, GUM_REG_XBX,
+        GUM_ARG_POINTER, GSIZE_TO_POINTER (save_fp_state));
+  }
+
+  if (save_fp_state)
+  {
+    gum_exec_ctx_write_mov_fp_save_area (block->ctx, GUM_REG_XCX, cw);
+    gum_stalker_write_fp_restore (block->ctx->stalker, priv->fp_save_mask,
+        cw);
   }
 }
 
@@ -2671,6 +6983,238 @@ gum_exec_block_close_prolog (GumExecBlock * block,
   gc->opened_prolog = GUM_PROLOG_NONE;
 }
 
+/*
+ * Decodes ahead up to the first branch and works backwards to find out
+ * which registers and flags each instruction may still read. Anything we
+ * don't know the semantics of is assumed to read everything, as is the
+ * code following the analyzed stretch.
+ */
+static void
+gum_exec_block_analyze_liveness (gconstpointer real_address,
+                                 GumGeneratorContext * gc)
+{
+  guint32 use[GUM_LIVENESS_MAX_INSNS], def[GUM_LIVENESS_MAX_INSNS];
+  const guint8 * cur = real_address;
+  gboolean end_of_block = FALSE;
+  guint32 live;
+  guint n = 0;
+
+  while (n != GUM_LIVENESS_MAX_INSNS && !end_of_block)
+  {
+    ud_t ud_obj;
+
+    ud_init (&ud_obj);
+    ud_set_mode (&ud_obj, GUM_CPU_MODE);
+    ud_set_pc (&ud_obj, GPOINTER_TO_SIZE (cur));
+    ud_set_input_buffer (&ud_obj, (guint8 *) cur, 16);
+
+    if (ud_disassemble (&ud_obj) == 0)
+      break;
+
+    gum_x86_insn_describe_liveness (&ud_obj, &use[n], &def[n]);
+    n++;
+    cur += ud_insn_len (&ud_obj);
+
+    switch (ud_obj.mnemonic)
+    {
+      case UD_Icall:
+      case UD_Ijmp:
+      case UD_Iret:
+      case UD_Iretf:
+      case UD_Ijcxz:
+      case UD_Ijecxz:
+      case UD_Ijrcxz:
+      case UD_Iloop:
+      case UD_Isysenter:
+      case UD_Isyscall:
+      case UD_Iint:
+      case UD_Iint3:
+      case UD_Ihlt:
+      case UD_Iinvalid:
+        end_of_block = TRUE;
+        break;
+      default:
+        end_of_block = gum_mnemonic_is_jcc (ud_obj.mnemonic);
+        break;
+    }
+  }
+
+  live = GUM_LIVE_ALL;
+  gc->n_analyzed_insns = n;
+  while (n-- != 0)
+  {
+    live = use[n] | (live & ~def[n]);
+    gc->live_in[n] = live;
+  }
+}
+
+static guint32
+gum_generator_context_get_live_regs (GumGeneratorContext * gc)
+{
+  if (gc->insn_index >= gc->n_analyzed_insns)
+    return GUM_LIVE_ALL;
+
+  return gc->live_in[gc->insn_index];
+}
+
+/*
+ * Only a handful of common instructions are described precisely: those
+ * without implicit register operands, where we know whether the first
+ * operand is read and how the flags are affected.
+ */
+static void
+gum_x86_insn_describe_liveness (const ud_t * insn,
+                                guint32 * use,
+                                guint32 * def)
+{
+  gboolean writes_dst = FALSE;
+  guint i;
+
+  *use = 0;
+  *def = 0;
+
+  switch (insn->mnemonic)
+  {
+    case UD_Imov:
+    case UD_Imovzx:
+    case UD_Imovsx:
+    case UD_Imovsxd:
+    case UD_Ilea:
+    case UD_Ipop:
+      writes_dst = TRUE;
+      break;
+    case UD_Ixor:
+    case UD_Isub:
+    {
+      const ud_operand_t * dst = &insn->operand[0];
+      const ud_operand_t * src = &insn->operand[1];
+
+      if (dst->type == UD_OP_REG && src->type == UD_OP_REG &&
+          dst->base == src->base)
+      {
+        guint width;
+        gint index;
+
+        /* Zeroing idiom, doesn't depend on the previous value */
+        index = gum_liveness_index_from_ud (dst->base, &width);
+        if (index >= 0 && width >= 32)
+        {
+          *def = (1 << index) | GUM_LIVE_FLAGS;
+          return;
+        }
+      }
+
+      *def = GUM_LIVE_FLAGS;
+      break;
+    }
+    case UD_Iadd:
+    case UD_Iand:
+    case UD_Ior:
+    case UD_Icmp:
+    case UD_Itest:
+    case UD_Ineg:
+      *def = GUM_LIVE_FLAGS;
+      break;
+    case UD_Iadc:
+    case UD_Isbb:
+      *use = GUM_LIVE_FLAGS;
+      break;
+    case UD_Iimul:
+      /* The one-operand form implicitly uses XAX and XDX */
+      if (insn->operand[1].type == UD_NONE)
+      {
+        *use = GUM_LIVE_ALL;
+        return;
+      }
+      writes_dst = insn->operand[2].type != UD_NONE;
+      break;
+    /* Flags are either left alone or only partially written */
+    case UD_Iinc:
+    case UD_Idec:
+    case UD_Inot:
+    case UD_Ishl:
+    case UD_Ishr:
+    case UD_Isar:
+    case UD_Irol:
+    case UD_Iror:
+    case UD_Ixchg:
+    case UD_Ibswap:
+    case UD_Ipush:
+    case UD_Inop:
+      break;
+    default:
+      *use = GUM_LIVE_ALL;
+      return;
+  }
+
+  for (i = 0; i != G_N_ELEMENTS (insn->operand); i++)
+  {
+    const ud_operand_t * op = &insn->operand[i];
+    guint width;
+    gint index;
+
+    if (op->type == UD_OP_REG)
+    {
+      index = gum_liveness_index_from_ud (op->base, &width);
+      if (index < 0)
+        continue;
+
+      /* Writes to 8 and 16 bit registers merge with the old value */
+      if (i == 0 && writes_dst && width >= 32)
+        *def |= 1 << index;
+      else
+        *use |= 1 << index;
+    }
+    else if (op->type == UD_OP_MEM)
+    {
+      index = gum_liveness_index_from_ud (op->base, &width);
+      if (index >= 0)
+        *use |= 1 << index;
+      index = gum_liveness_index_from_ud (op->index, &width);
+      if (index >= 0)
+        *use |= 1 << index;
+    }
+  }
+}
+
+static gint
+gum_liveness_index_from_ud (enum ud_type reg,
+                            guint * width)
+{
+  if (reg >= UD_R_AL && reg <= UD_R_BL)
+  {
+    *width = 8;
+    return reg - UD_R_AL;
+  }
+  else if (reg >= UD_R_AH && reg <= UD_R_BH)
+  {
+    *width = 8;
+    return reg - UD_R_AH;
+  }
+  else if (reg >= UD_R_SPL && reg <= UD_R_R15B)
+  {
+    *width = 8;
+    return 4 + (reg - UD_R_SPL);
+  }
+  else if (reg >= UD_R_AX && reg <= UD_R_R15W)
+  {
+    *width = 16;
+    return reg - UD_R_AX;
+  }
+  else if (reg >= UD_R_EAX && reg <= UD_R_R15D)
+  {
+    *width = 32;
+    return reg - UD_R_EAX;
+  }
+  else if (reg >= UD_R_RAX && reg <= UD_R_R15)
+  {
+    *width = 64;
+    return reg - UD_R_RAX;
+  }
+
+  return -1;
+}
+
 static void
 gum_write_segment_prefix (uint8_t segment,
                           GumX86Writer * cw)
@@ -2723,13 +7267,6 @@ gum_cpu_reg_from_ud (enum ud_type reg)
     g_assert_not_reached ();
 }
 
-static void
-gum_tls_key_set (GumTlsKey key,
-                 gpointer data)
-{
-  GUM_TLS_KEY_SET_VALUE (key, data);
-}
-
 #ifdef G_OS_WIN32
 
 #ifdef _M_IX86
@@ -2800,7 +7337,7 @@ gum_stalker_handle_exception (EXCEPTION_RECORD * exception_record,
   if (ctx == NULL)
     return FALSE;
 
-  block = ctx->current_block;
+  block = ctx->hot->current_block;
 
 #ifdef _M_IX86
   /*printf ("gum_stalker_handle_exception state=%u %p %08x\n",
@@ -2848,7 +7385,7 @@ gum_stalker_handle_exception (EXCEPTION_RECORD * exception_record,
 
       gum_exec_ctx_replace_current_block_with (ctx,
           GSIZE_TO_POINTER (context->Eip));
-      context->Eip = (DWORD) ctx->resume_at;
+      context->Eip = (DWORD) ctx->hot->resume_at;
 
       block->state = GUM_EXEC_NORMAL;
 
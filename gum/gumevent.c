@@ -0,0 +1,320 @@
+/*
+ * Copyright (C) 2009 Ole Andr Vadla Ravns <ole.andre.ravnas@tandberg.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "gumevent.h"
+
+#include <string.h>
+
+/*
+ * Every event starts with a tag byte whose two low bits tell its kind:
+ *
+ *   EXEC_NEAR:  the upper six bits hold how far the location is from where
+ *               the previous event left off, or GUM_EXEC_NEAR_ESCAPE
+ *               followed by a varint when it doesn't fit.
+ *   EXEC_BLOCK: the upper six bits index the table of recently escaped
+ *               locations, which is where blocks usually start.
+ *   BRANCH:     a call, or a ret if the upper bits are 1, followed by
+ *               varints for the location delta, the target relative to the
+ *               location, and the depth delta.
+ *   BLOCK:      a block, or a block exec if the upper bits are 1, followed
+ *               by varints for the begin delta and the block's size.
+ *
+ * Deltas are zigzag-encoded so that small negative values stay short. A
+ * call or ret leaves off at its target, and a block at its beginning, as
+ * that's where the next exec event will be.
+ */
+
+#define GUM_EVENT_TAG_EXEC_NEAR  0
+#define GUM_EVENT_TAG_EXEC_BLOCK 1
+#define GUM_EVENT_TAG_BRANCH     2
+#define GUM_EVENT_TAG_BLOCK      3
+#define GUM_EVENT_TAG_KIND_MASK  3
+
+#define GUM_EXEC_NEAR_ESCAPE     63
+
+#define GUM_EVENT_BLOCK_SLOT(l) \
+    (((GPOINTER_TO_SIZE (l) >> 4) ^ GPOINTER_TO_SIZE (l)) & \
+     (GUM_EVENT_CODEC_BLOCK_TABLE_SIZE - 1))
+
+static guint8 * gum_put_varint (guint8 * p, guint64 value);
+static const guint8 * gum_get_varint (const guint8 * p, const guint8 * end,
+    guint64 * value);
+
+static guint64 gum_zigzag_encode (gint64 value);
+static gint64 gum_zigzag_decode (guint64 value);
+
+void
+gum_event_encoder_init (GumEventEncoder * encoder)
+{
+  memset (encoder, 0, sizeof (GumEventEncoder));
+}
+
+gsize
+gum_event_encoder_encode (GumEventEncoder * encoder,
+                          const GumEvent * events,
+                          guint n_events,
+                          guint8 * data)
+{
+  guint8 * p = data;
+  guint i;
+
+  for (i = 0; i != n_events; i++)
+  {
+    const GumEvent * ev = &events[i];
+
+    switch (ev->type)
+    {
+      case GUM_EXEC:
+      {
+        gpointer location = ev->exec.location;
+        gsize delta = GPOINTER_TO_SIZE (location) -
+            GPOINTER_TO_SIZE (encoder->previous_location);
+        guint slot = GUM_EVENT_BLOCK_SLOT (location);
+
+        if (delta < GUM_EXEC_NEAR_ESCAPE)
+        {
+          *p++ = (delta << 2) | GUM_EVENT_TAG_EXEC_NEAR;
+        }
+        else if (encoder->blocks[slot] == location)
+        {
+          *p++ = (slot << 2) | GUM_EVENT_TAG_EXEC_BLOCK;
+        }
+        else
+        {
+          *p++ = (GUM_EXEC_NEAR_ESCAPE << 2) | GUM_EVENT_TAG_EXEC_NEAR;
+          p = gum_put_varint (p, gum_zigzag_encode ((gssize) delta));
+          encoder->blocks[slot] = location;
+        }
+
+        encoder->previous_location = location;
+        break;
+      }
+      case GUM_CALL:
+      case GUM_RET:
+      {
+        const GumCallEvent * call = &ev->call;
+
+        *p++ = ((ev->type == GUM_RET) << 2) | GUM_EVENT_TAG_BRANCH;
+        p = gum_put_varint (p, gum_zigzag_encode (
+            (gssize) (GPOINTER_TO_SIZE (call->location) -
+            GPOINTER_TO_SIZE (encoder->previous_location))));
+        p = gum_put_varint (p, gum_zigzag_encode (
+            (gssize) (GPOINTER_TO_SIZE (call->target) -
+            GPOINTER_TO_SIZE (call->location))));
+        p = gum_put_varint (p,
+            gum_zigzag_encode (call->depth - encoder->previous_depth));
+
+        encoder->previous_location = call->target;
+        encoder->previous_depth = call->depth;
+        break;
+      }
+      case GUM_BLOCK:
+      case GUM_BLOCK_EXEC:
+      {
+        const GumBlockEvent * block = &ev->block;
+
+        *p++ = ((ev->type == GUM_BLOCK_EXEC) << 2) | GUM_EVENT_TAG_BLOCK;
+        p = gum_put_varint (p, gum_zigzag_encode (
+            (gssize) (GPOINTER_TO_SIZE (block->begin) -
+            GPOINTER_TO_SIZE (encoder->previous_location))));
+        p = gum_put_varint (p, GPOINTER_TO_SIZE (block->end) -
+            GPOINTER_TO_SIZE (block->begin));
+
+        encoder->previous_location = block->begin;
+        break;
+      }
+      default:
+        g_assert_not_reached ();
+    }
+  }
+
+  return p - data;
+}
+
+void
+gum_event_decoder_init (GumEventDecoder * decoder)
+{
+  memset (decoder, 0, sizeof (GumEventDecoder));
+}
+
+guint
+gum_event_decoder_decode (GumEventDecoder * decoder,
+                          const guint8 * data,
+                          gsize size,
+                          GumEvent * events,
+                          guint max_events,
+                          gsize * bytes_consumed)
+{
+  const guint8 * p = data;
+  const guint8 * end = data + size;
+  guint n = 0;
+
+  while (p != end && n != max_events)
+  {
+    const guint8 * start = p;
+    GumEvent * ev = &events[n];
+    guint8 tag = *p++;
+    guint kind = tag & GUM_EVENT_TAG_KIND_MASK;
+
+    if (kind == GUM_EVENT_TAG_EXEC_NEAR || kind == GUM_EVENT_TAG_EXEC_BLOCK)
+    {
+      guint value = tag >> 2;
+      gpointer location;
+
+      if (kind == GUM_EVENT_TAG_EXEC_BLOCK)
+      {
+        location = decoder->blocks[value];
+      }
+      else if (value != GUM_EXEC_NEAR_ESCAPE)
+      {
+        location = GSIZE_TO_POINTER (
+            GPOINTER_TO_SIZE (decoder->previous_location) + value);
+      }
+      else
+      {
+        guint64 delta;
+
+        p = gum_get_varint (p, end, &delta);
+        if (p == NULL)
+        {
+          p = start;
+          break;
+        }
+
+        location = GSIZE_TO_POINTER (
+            GPOINTER_TO_SIZE (decoder->previous_location) +
+            (gssize) gum_zigzag_decode (delta));
+        decoder->blocks[GUM_EVENT_BLOCK_SLOT (location)] = location;
+      }
+
+      ev->exec.type = GUM_EXEC;
+      ev->exec.location = location;
+
+      decoder->previous_location = location;
+    }
+    else if (kind == GUM_EVENT_TAG_BRANCH)
+    {
+      guint64 location_delta, target_delta, depth_delta;
+      GumCallEvent * call = &ev->call;
+
+      p = gum_get_varint (p, end, &location_delta);
+      if (p != NULL)
+        p = gum_get_varint (p, end, &target_delta);
+      if (p != NULL)
+        p = gum_get_varint (p, end, &depth_delta);
+      if (p == NULL)
+      {
+        p = start;
+        break;
+      }
+
+      call->type = ((tag >> 2) == 0) ? GUM_CALL : GUM_RET;
+      call->location = GSIZE_TO_POINTER (
+          GPOINTER_TO_SIZE (decoder->previous_location) +
+          (gssize) gum_zigzag_decode (location_delta));
+      call->target = GSIZE_TO_POINTER (GPOINTER_TO_SIZE (call->location) +
+          (gssize) gum_zigzag_decode (target_delta));
+      call->depth = decoder->previous_depth +
+          (gint) gum_zigzag_decode (depth_delta);
+
+      decoder->previous_location = call->target;
+      decoder->previous_depth = call->depth;
+    }
+    else
+    {
+      guint64 begin_delta, size;
+      GumBlockEvent * block = &ev->block;
+
+      p = gum_get_varint (p, end, &begin_delta);
+      if (p != NULL)
+        p = gum_get_varint (p, end, &size);
+      if (p == NULL)
+      {
+        p = start;
+        break;
+      }
+
+      block->type = ((tag >> 2) == 0) ? GUM_BLOCK : GUM_BLOCK_EXEC;
+      block->begin = GSIZE_TO_POINTER (
+          GPOINTER_TO_SIZE (decoder->previous_location) +
+          (gssize) gum_zigzag_decode (begin_delta));
+      block->end = GSIZE_TO_POINTER (GPOINTER_TO_SIZE (block->begin) + size);
+
+      decoder->previous_location = block->begin;
+    }
+
+    n++;
+  }
+
+  if (bytes_consumed != NULL)
+    *bytes_consumed = p - data;
+
+  return n;
+}
+
+static guint8 *
+gum_put_varint (guint8 * p,
+                guint64 value)
+{
+  while (value >= 0x80)
+  {
+    *p++ = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  *p++ = value;
+
+  return p;
+}
+
+static const guint8 *
+gum_get_varint (const guint8 * p,
+                const guint8 * end,
+                guint64 * value)
+{
+  guint64 result = 0;
+  guint shift = 0;
+
+  while (p != end)
+  {
+    guint8 b = *p++;
+
+    result |= (guint64) (b & 0x7f) << shift;
+    if ((b & 0x80) == 0)
+    {
+      *value = result;
+      return p;
+    }
+
+    shift += 7;
+  }
+
+  return NULL;
+}
+
+static guint64
+gum_zigzag_encode (gint64 value)
+{
+  return ((guint64) value << 1) ^ (guint64) (value >> 63);
+}
+
+static gint64
+gum_zigzag_decode (guint64 value)
+{
+  return (gint64) (value >> 1) ^ -(gint64) (value & 1);
+}
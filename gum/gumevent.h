@@ -33,6 +33,10 @@ typedef struct _GumAnyEvent   GumAnyEvent;
 typedef struct _GumCallEvent  GumCallEvent;
 typedef struct _GumRetEvent   GumRetEvent;
 typedef struct _GumExecEvent  GumExecEvent;
+typedef struct _GumBlockEvent GumBlockEvent;
+
+typedef struct _GumEventEncoder GumEventEncoder;
+typedef struct _GumEventDecoder GumEventDecoder;
 
 enum _GumEventType
 {
@@ -40,6 +44,9 @@ enum _GumEventType
   GUM_CALL        = 1 << 0,
   GUM_RET         = 1 << 1,
   GUM_EXEC        = 1 << 2,
+  GUM_BLOCK       = 1 << 3, /* once per compilation, so again on recompile */
+  GUM_BLOCK_EXEC  = 1 << 4, /* every time a block is entered */
+  GUM_CALL_COUNT  = 1 << 5, /* calls per target, see the stalker's drain */
 };
 
 struct _GumAnyEvent
@@ -72,6 +79,14 @@ struct _GumExecEvent
   gpointer location;
 };
 
+struct _GumBlockEvent
+{
+  GumEventType type;
+
+  gpointer begin;
+  gpointer end;
+};
+
 union _GumEvent
 {
   GumEventType type;
@@ -80,8 +95,42 @@ union _GumEvent
   GumCallEvent call;
   GumRetEvent ret;
   GumExecEvent exec;
+  GumBlockEvent block;
+};
+
+/*
+ * Compact trace format: a variable-length encoding where each location is
+ * either a small delta from where the previous event left off, or a
+ * reference to a recently seen block. Encoder and decoder are stateful, so
+ * a stream must be decoded in the same order it was encoded.
+ */
+
+#define GUM_EVENT_ENCODED_MAX_SIZE         (1 + (3 * 10))
+#define GUM_EVENT_CODEC_BLOCK_TABLE_SIZE   64
+
+struct _GumEventEncoder
+{
+  gpointer previous_location;
+  gint previous_depth;
+  gpointer blocks[GUM_EVENT_CODEC_BLOCK_TABLE_SIZE];
 };
 
+struct _GumEventDecoder
+{
+  gpointer previous_location;
+  gint previous_depth;
+  gpointer blocks[GUM_EVENT_CODEC_BLOCK_TABLE_SIZE];
+};
+
+GUM_API void gum_event_encoder_init (GumEventEncoder * encoder);
+GUM_API gsize gum_event_encoder_encode (GumEventEncoder * encoder,
+    const GumEvent * events, guint n_events, guint8 * data);
+
+GUM_API void gum_event_decoder_init (GumEventDecoder * decoder);
+GUM_API guint gum_event_decoder_decode (GumEventDecoder * decoder,
+    const guint8 * data, gsize size, GumEvent * events, guint max_events,
+    gsize * bytes_consumed);
+
 G_END_DECLS
 
 #endif
@@ -63,6 +63,72 @@ gum_event_sink_process (GumEventSink * self,
   iface->process (self, ev);
 }
 
+void
+gum_event_sink_process_batch (GumEventSink * self,
+                              const GumEvent * events,
+                              guint n_events)
+{
+  GumEventSinkIface * iface = GUM_EVENT_SINK_GET_INTERFACE (self);
+
+  if (iface->process_batch != NULL)
+  {
+    iface->process_batch (self, events, n_events);
+  }
+  else
+  {
+    guint i;
+
+    g_assert (iface->process != NULL);
+    for (i = 0; i != n_events; i++)
+      iface->process (self, &events[i]);
+  }
+}
+
+void
+gum_event_sink_process_encoded (GumEventSink * self,
+                                GumEventDecoder * decoder,
+                                const guint8 * data,
+                                gsize size)
+{
+  GumEvent events[64];
+
+  while (size != 0)
+  {
+    guint n;
+    gsize consumed;
+
+    n = gum_event_decoder_decode (decoder, data, size, events,
+        G_N_ELEMENTS (events), &consumed);
+    if (n == 0)
+      break;
+
+    gum_event_sink_process_batch (self, events, n);
+
+    data += consumed;
+    size -= consumed;
+  }
+}
+
+void
+gum_event_sink_process_compact (GumEventSink * self,
+                                const guint8 * data,
+                                gsize size)
+{
+  GumEventSinkIface * iface = GUM_EVENT_SINK_GET_INTERFACE (self);
+
+  if (iface->process_compact != NULL)
+  {
+    iface->process_compact (self, data, size);
+  }
+  else
+  {
+    GumEventDecoder decoder;
+
+    gum_event_decoder_init (&decoder);
+    gum_event_sink_process_encoded (self, &decoder, data, size);
+  }
+}
+
 void
 gum_event_sink_stop (GumEventSink * self)
 {
@@ -29,6 +29,7 @@
 #include "gumtls.h"
 
 typedef struct _FunctionContext          FunctionContext;
+typedef struct _ListenerEntrySet         ListenerEntrySet;
 
 struct _FunctionContext
 {
@@ -46,7 +47,7 @@ struct _FunctionContext
 
   gpointer on_leave_trampoline;
 
-  GumArray * listener_entries;
+  ListenerEntrySet * volatile listener_entries;
 
   gpointer replacement_function_data;
 };
@@ -32,7 +32,8 @@
 #endif
 #include <string.h>
 
-#define GUM_INTERCEPTOR_CODE_SLICE_SIZE     450
+#define GUM_INTERCEPTOR_CODE_SLICE_SIZE       450
+#define GUM_INTERCEPTOR_INLINE_LISTENER_DATA    2
 
 G_DEFINE_TYPE (GumInterceptor, gum_interceptor, G_TYPE_OBJECT);
 
@@ -40,10 +41,12 @@ G_DEFINE_TYPE (GumInterceptor, gum_interceptor, G_TYPE_OBJECT);
 #define GUM_INTERCEPTOR_UNLOCK() (g_mutex_unlock (priv->mutex))
 
 typedef struct _ListenerEntry            ListenerEntry;
+typedef struct _ListenerRegistration     ListenerRegistration;
 typedef struct _InterceptorThreadContext InterceptorThreadContext;
 typedef struct _GumInvocationStackEntry  GumInvocationStackEntry;
 typedef struct _ListenerDataSlot         ListenerDataSlot;
 typedef struct _ListenerInvocationState  ListenerInvocationState;
+typedef struct _PendingInvocation        PendingInvocation;
 
 struct _GumInterceptorPrivate
 {
@@ -51,9 +54,15 @@ struct _GumInterceptorPrivate
 
   GumHashTable * monitored_function_by_address;
   GumHashTable * replaced_function_by_address;
+  GumHashTable * registration_by_listener;
 
   GumCodeAllocator allocator;
 
+  guint transaction_level;
+  GumHashTable * writable_prologue_pages;
+
+  GumList * retired_listener_entries;
+
   volatile guint selected_thread_id;
 };
 
@@ -61,7 +70,35 @@ struct _ListenerEntry
 {
   GumInvocationListenerIface * listener_interface;
   GumInvocationListener * listener_instance;
+  ListenerRegistration * registration;
   gpointer function_data;
+  GumListenerFlags flags;
+};
+
+struct _ListenerEntrySet
+{
+  volatile gint ref_count;
+  gint retire_epoch;
+
+  guint leave_listener_count;
+
+  guint len;
+  ListenerEntry entries[1];
+};
+
+struct _ListenerRegistration
+{
+  volatile gint ref_count;
+  volatile gint detached;
+
+  GumInvocationListener * listener;
+  GumList * function_contexts;
+};
+
+struct _PendingInvocation
+{
+  FunctionContext * function_ctx;
+  ListenerEntrySet * listener_entries;
 };
 
 struct _InterceptorThreadContext
@@ -74,6 +111,12 @@ struct _InterceptorThreadContext
   GumInvocationStack * stack;
 
   GumArray * listener_data_slots;
+  gint detach_generation;
+
+  volatile gint active_epoch;
+
+  PendingInvocation pending_invocations[GUM_MAX_CALL_DEPTH];
+  volatile gint n_pending_invocations;
 };
 
 struct _GumInvocationStackEntry
@@ -82,12 +125,16 @@ struct _GumInvocationStackEntry
   gpointer caller_ret_addr;
   GumInvocationContext invocation_context;
   GumCpuContext cpu_context;
-  guint8 listener_invocation_data[GUM_MAX_LISTENERS_PER_FUNCTION][GUM_MAX_LISTENER_DATA];
+  ListenerEntrySet * listener_entries;
+  gboolean holds_reference;
+  guint8 listener_invocation_data[GUM_INTERCEPTOR_INLINE_LISTENER_DATA]
+      [GUM_MAX_LISTENER_DATA];
+  guint8 * extra_listener_invocation_data;
 };
 
 struct _ListenerDataSlot
 {
-  GumInvocationListener * owner;
+  ListenerRegistration * owner;
   guint8 data[GUM_MAX_LISTENER_DATA];
 };
 
@@ -96,7 +143,8 @@ struct _ListenerInvocationState
   GumPointCut point_cut;
   ListenerEntry * entry;
   InterceptorThreadContext * interceptor_ctx;
-  guint8 * invocation_data;
+  GumInvocationStackEntry * stack_entry;
+  guint entry_index;
 };
 
 #define GUM_INTERCEPTOR_GET_PRIVATE(o) ((o)->priv)
@@ -113,39 +161,79 @@ static void replace_function_at (GumInterceptor * self,
     gpointer user_data);
 static void revert_function_at (GumInterceptor * self,
     gpointer function_address);
-static void detach_if_matching_listener (gpointer key, gpointer value,
-    gpointer user_data);
 static FunctionContext * function_context_new (GumInterceptor * interceptor,
     gpointer function_address, GumCodeAllocator * allocator);
 static void function_context_destroy (FunctionContext * function_ctx);
 static void function_context_add_listener (FunctionContext * function_ctx,
-    GumInvocationListener * listener, gpointer function_data);
+    ListenerRegistration * registration, gpointer function_data,
+    GumListenerFlags flags);
 static void function_context_remove_listener (FunctionContext * function_ctx,
     GumInvocationListener * listener);
 static gboolean function_context_has_listener (FunctionContext * function_ctx,
     GumInvocationListener * listener);
 static ListenerEntry * function_context_find_listener_entry (
     FunctionContext * function_ctx, GumInvocationListener * listener);
+static void function_context_publish_listener_entries (
+    FunctionContext * function_ctx, ListenerEntrySet * entries);
+
+static ListenerEntrySet * listener_entry_set_new (guint len);
+static void listener_entry_set_ref (ListenerEntrySet * set);
+static void listener_entry_set_unref (ListenerEntrySet * set);
+
+static void gum_interceptor_retire_listener_entries (GumInterceptor * self,
+    ListenerEntrySet * set);
+static void gum_interceptor_reclaim_listener_entries (GumInterceptor * self,
+    gboolean force);
+static gint gum_interceptor_oldest_active_epoch (void);
+static void gum_interceptor_wait_for_readers (void);
+static gboolean gum_interceptor_has_pending_invocations (
+    FunctionContext * function_ctx, ListenerEntrySet * entries);
+
+static ListenerRegistration * listener_registration_new (
+    GumInvocationListener * listener);
+static void listener_registration_ref (ListenerRegistration * registration);
+static void listener_registration_unref (ListenerRegistration * registration);
 
 static InterceptorThreadContext * get_interceptor_thread_context (void);
 static InterceptorThreadContext * interceptor_thread_context_new (void);
 static void interceptor_thread_context_destroy (
     InterceptorThreadContext * context);
 static gpointer interceptor_thread_context_get_listener_data (
-    InterceptorThreadContext * self, GumInvocationListener * listener,
+    InterceptorThreadContext * self, ListenerRegistration * registration,
     gsize required_size);
-static void interceptor_thread_context_forget_listener_data (
-    InterceptorThreadContext * self, GumInvocationListener * listener);
+static void interceptor_thread_context_reclaim_listener_data (
+    InterceptorThreadContext * self);
+static gboolean interceptor_thread_context_enter_epoch (
+    InterceptorThreadContext * self);
+static void interceptor_thread_context_leave_epoch (
+    InterceptorThreadContext * self);
+static PendingInvocation * interceptor_thread_context_track_invocation (
+    InterceptorThreadContext * self, FunctionContext * function_ctx);
+static void interceptor_thread_context_untrack_invocation (
+    InterceptorThreadContext * self);
 static GumInvocationStackEntry * gum_invocation_stack_push (
     GumInvocationStack * stack, FunctionContext * function_ctx,
     gpointer caller_ret_addr, const GumCpuContext * cpu_context);
+static void gum_invocation_stack_entry_init (GumInvocationStackEntry * entry,
+    FunctionContext * function_ctx, gpointer caller_ret_addr,
+    const GumCpuContext * cpu_context);
 static gpointer gum_invocation_stack_pop (GumInvocationStack * stack);
+static void gum_invocation_stack_entry_finalize (
+    GumInvocationStackEntry * entry);
+static guint8 * gum_invocation_stack_entry_get_listener_data (
+    GumInvocationStackEntry * entry, guint index);
 static GumInvocationStackEntry * gum_invocation_stack_peek_top (
     GumInvocationStack * stack);
 
-static void make_function_prologue_at_least_read_write (
+static void gum_interceptor_transaction_begin (GumInterceptor * self);
+static void gum_interceptor_transaction_end (GumInterceptor * self);
+static gboolean gum_interceptor_is_deferring_protection (GumInterceptor * self);
+static void gum_interceptor_flush_instruction_cache (GumInterceptor * self);
+
+static void make_function_prologue_at_least_read_write (GumInterceptor * self,
+    gpointer prologue_address);
+static void make_function_prologue_read_execute (GumInterceptor * self,
     gpointer prologue_address);
-static void make_function_prologue_read_execute (gpointer prologue_address);
 static gpointer maybe_follow_redirect_at (GumInterceptor * self,
     gpointer address);
 
@@ -172,6 +260,9 @@ static GumTlsKey _gum_interceptor_tid_key;
 static volatile gint _gum_interceptor_tid_counter = 0;
 #endif
 
+static volatile gint _gum_interceptor_detach_generation = 0;
+static volatile gint _gum_interceptor_epoch = 1;
+
 static GumInvocationStack _gum_interceptor_empty_stack = { NULL, 0 };
 
 static void
@@ -240,6 +331,11 @@ gum_interceptor_init (GumInterceptor * self)
       g_direct_equal, NULL, NULL);
   priv->replaced_function_by_address = gum_hash_table_new_full (g_direct_hash,
       g_direct_equal, NULL, NULL);
+  priv->registration_by_listener = gum_hash_table_new_full (g_direct_hash,
+      g_direct_equal, NULL, NULL);
+
+  priv->writable_prologue_pages = gum_hash_table_new_full (g_direct_hash,
+      g_direct_equal, NULL, NULL);
 
   gum_code_allocator_init (&priv->allocator, GUM_INTERCEPTOR_CODE_SLICE_SIZE);
 }
@@ -250,10 +346,14 @@ gum_interceptor_finalize (GObject * object)
   GumInterceptor * self = GUM_INTERCEPTOR (object);
   GumInterceptorPrivate * priv = GUM_INTERCEPTOR_GET_PRIVATE (self);
 
+  gum_interceptor_reclaim_listener_entries (self, TRUE);
+
   g_mutex_free (priv->mutex);
 
   gum_hash_table_unref (priv->monitored_function_by_address);
   gum_hash_table_unref (priv->replaced_function_by_address);
+  gum_hash_table_unref (priv->registration_by_listener);
+  gum_hash_table_unref (priv->writable_prologue_pages);
 
   gum_code_allocator_free (&priv->allocator);
 
@@ -305,11 +405,23 @@ gum_interceptor_attach_listener (GumInterceptor * self,
                                  gpointer function_address,
                                  GumInvocationListener * listener,
                                  gpointer listener_function_data)
+{
+  return gum_interceptor_attach_listener_full (self, function_address,
+      listener, listener_function_data, GUM_LISTENER_DEFAULT);
+}
+
+GumAttachReturn
+gum_interceptor_attach_listener_full (GumInterceptor * self,
+                                      gpointer function_address,
+                                      GumInvocationListener * listener,
+                                      gpointer listener_function_data,
+                                      GumListenerFlags flags)
 {
   GumInterceptorPrivate * priv = GUM_INTERCEPTOR_GET_PRIVATE (self);
   GumAttachReturn result = GUM_ATTACH_OK;
   gpointer next_hop;
   FunctionContext * function_ctx;
+  ListenerRegistration * registration;
 
   gum_interceptor_ignore_current_thread (self);
   GUM_INTERCEPTOR_LOCK ();
@@ -334,9 +446,9 @@ gum_interceptor_attach_listener (GumInterceptor * self,
       goto beach;
     }
 
-    make_function_prologue_at_least_read_write (function_address);
+    make_function_prologue_at_least_read_write (self, function_address);
     function_ctx = intercept_function_at (self, function_address);
-    make_function_prologue_read_execute (function_address);
+    make_function_prologue_read_execute (self, function_address);
 
     gum_hash_table_insert (priv->monitored_function_by_address,
         function_address, function_ctx);
@@ -350,8 +462,19 @@ gum_interceptor_attach_listener (GumInterceptor * self,
     }
   }
 
-  function_context_add_listener (function_ctx, listener,
-      listener_function_data);
+  registration = (ListenerRegistration *) gum_hash_table_lookup (
+      priv->registration_by_listener, listener);
+  if (registration == NULL)
+  {
+    registration = listener_registration_new (listener);
+    gum_hash_table_insert (priv->registration_by_listener, listener,
+        registration);
+  }
+
+  function_context_add_listener (function_ctx, registration,
+      listener_function_data, flags);
+  registration->function_contexts =
+      gum_list_prepend (registration->function_contexts, function_ctx);
 
 beach:
   GUM_INTERCEPTOR_UNLOCK ();
@@ -360,55 +483,68 @@ beach:
   return result;
 }
 
-typedef struct {
-  GumInterceptor * self;
-  GumInvocationListener * listener;
-  GList * pending_removals;
-} DetachContext;
-
 void
 gum_interceptor_detach_listener (GumInterceptor * self,
                                  GumInvocationListener * listener)
 {
   GumInterceptorPrivate * priv = GUM_INTERCEPTOR_GET_PRIVATE (self);
-  DetachContext ctx;
-  GList * walk;
-  guint i;
+  ListenerRegistration * registration;
+  GumList * walk;
 
   gum_interceptor_ignore_current_thread (self);
   GUM_INTERCEPTOR_LOCK ();
 
-  ctx.self = self;
-  ctx.listener = listener;
-  ctx.pending_removals = NULL;
+  registration = (ListenerRegistration *) gum_hash_table_lookup (
+      priv->registration_by_listener, listener);
+  if (registration == NULL)
+    goto beach;
+  gum_hash_table_remove (priv->registration_by_listener, listener);
 
-  gum_hash_table_foreach (priv->monitored_function_by_address,
-      detach_if_matching_listener, &ctx);
+  gum_interceptor_transaction_begin (self);
 
-  while ((walk = ctx.pending_removals) != NULL)
+  for (walk = registration->function_contexts; walk != NULL; walk = walk->next)
   {
-    gpointer function_address = walk->data;
-    gum_hash_table_remove (priv->monitored_function_by_address,
-        function_address);
-    ctx.pending_removals =
-        g_list_remove_all (ctx.pending_removals, function_address);
+    FunctionContext * function_ctx = (FunctionContext *) walk->data;
+    gpointer function_address = function_ctx->function_address;
+
+    function_context_remove_listener (function_ctx, listener);
+
+    if (function_ctx->listener_entries->len == 0)
+    {
+      make_function_prologue_at_least_read_write (self, function_address);
+      function_context_destroy (function_ctx);
+      make_function_prologue_read_execute (self, function_address);
+
+      gum_hash_table_remove (priv->monitored_function_by_address,
+          function_address);
+    }
   }
 
+  gum_interceptor_transaction_end (self);
+
+  gum_list_free (registration->function_contexts);
+  registration->function_contexts = NULL;
+
   /*
-   * We don't do any locking here because this array is grow-only, so we won't
-   * do anything else than just mark the slot as available.
+   * Threads notice the new generation the next time they look up listener
+   * data, and only then release the slots owned by this registration.
    */
-  for (i = 0; i != _gum_interceptor_thread_contexts->len; i++)
-  {
-    InterceptorThreadContext * interceptor_ctx;
-
-    interceptor_ctx = (InterceptorThreadContext *) gum_array_index (
-        _gum_interceptor_thread_contexts, InterceptorThreadContext *, i);
-    interceptor_thread_context_forget_listener_data (interceptor_ctx,
-        listener);
-  }
+  g_atomic_int_set (&registration->detached, TRUE);
+  g_atomic_int_inc (&_gum_interceptor_detach_generation);
+  listener_registration_unref (registration);
 
+beach:
   GUM_INTERCEPTOR_UNLOCK ();
+
+  /*
+   * Callbacks are only invoked from within an epoch, after checking that
+   * the registration is still attached. Once every thread has left the
+   * epochs that were active up until now, none of them can still be about
+   * to call into the listener, and the caller is free to destroy it.
+   */
+  if (registration != NULL)
+    gum_interceptor_wait_for_readers ();
+
   gum_interceptor_unignore_current_thread (self);
 }
 
@@ -424,10 +560,10 @@ gum_interceptor_replace_function (GumInterceptor * self,
 
   function_address = maybe_follow_redirect_at (self, function_address);
 
-  make_function_prologue_at_least_read_write (function_address);
+  make_function_prologue_at_least_read_write (self, function_address);
   replace_function_at (self, function_address, replacement_function,
       replacement_function_data);
-  make_function_prologue_read_execute (function_address);
+  make_function_prologue_read_execute (self, function_address);
 
   GUM_INTERCEPTOR_UNLOCK ();
 }
@@ -442,10 +578,30 @@ gum_interceptor_revert_function (GumInterceptor * self,
 
   function_address = maybe_follow_redirect_at (self, function_address);
 
-  make_function_prologue_at_least_read_write (function_address);
+  make_function_prologue_at_least_read_write (self, function_address);
   revert_function_at (self, function_address);
-  make_function_prologue_read_execute (function_address);
+  make_function_prologue_read_execute (self, function_address);
+
+  GUM_INTERCEPTOR_UNLOCK ();
+}
+
+void
+gum_interceptor_begin_transaction (GumInterceptor * self)
+{
+  GumInterceptorPrivate * priv = GUM_INTERCEPTOR_GET_PRIVATE (self);
+
+  GUM_INTERCEPTOR_LOCK ();
+  gum_interceptor_transaction_begin (self);
+  GUM_INTERCEPTOR_UNLOCK ();
+}
+
+void
+gum_interceptor_end_transaction (GumInterceptor * self)
+{
+  GumInterceptorPrivate * priv = GUM_INTERCEPTOR_GET_PRIVATE (self);
 
+  GUM_INTERCEPTOR_LOCK ();
+  gum_interceptor_transaction_end (self);
   GUM_INTERCEPTOR_UNLOCK ();
 }
 
@@ -540,15 +696,12 @@ intercept_function_at (GumInterceptor * self,
 
   ctx = function_context_new (self, function_address, &self->priv->allocator);
 
-  ctx->listener_entries =
-      gum_array_sized_new (FALSE, FALSE, sizeof (gpointer), 2);
+  ctx->listener_entries = listener_entry_set_new (0);
 
   _gum_function_context_make_monitor_trampoline (ctx);
   _gum_function_context_activate_trampoline (ctx);
 
-#ifdef G_OS_WIN32
-  FlushInstructionCache (GetCurrentProcess (), NULL, 0);
-#endif
+  gum_interceptor_flush_instruction_cache (self);
 
   return ctx;
 }
@@ -572,9 +725,7 @@ replace_function_at (GumInterceptor * self,
   gum_hash_table_insert (priv->replaced_function_by_address, function_address,
       ctx);
 
-#ifdef G_OS_WIN32
-  FlushInstructionCache (GetCurrentProcess (), NULL, 0);
-#endif
+  gum_interceptor_flush_instruction_cache (self);
 }
 
 static void
@@ -592,34 +743,7 @@ revert_function_at (GumInterceptor * self,
 
   function_context_destroy (ctx);
 
-#ifdef G_OS_WIN32
-  FlushInstructionCache (GetCurrentProcess (), NULL, 0);
-#endif
-}
-
-static void
-detach_if_matching_listener (gpointer key,
-                             gpointer value,
-                             gpointer user_data)
-{
-  gpointer function_address = key;
-  FunctionContext * function_ctx = (FunctionContext *) value;
-  DetachContext * detach_ctx = (DetachContext *) user_data;
-
-  if (function_context_has_listener (function_ctx, detach_ctx->listener))
-  {
-    function_context_remove_listener (function_ctx, detach_ctx->listener);
-
-    if (function_ctx->listener_entries->len == 0)
-    {
-      make_function_prologue_at_least_read_write (function_address);
-      function_context_destroy (function_ctx);
-      make_function_prologue_read_execute (function_address);
-
-      detach_ctx->pending_removals =
-          g_list_prepend (detach_ctx->pending_removals, function_address);
-    }
-  }
+  gum_interceptor_flush_instruction_cache (self);
 }
 
 static FunctionContext *
@@ -649,48 +773,73 @@ function_context_destroy (FunctionContext * function_ctx)
   }
 
   if (function_ctx->listener_entries != NULL)
-    gum_array_free (function_ctx->listener_entries, TRUE);
+  {
+    gum_interceptor_retire_listener_entries (function_ctx->interceptor,
+        function_ctx->listener_entries);
+  }
 
   gum_free (function_ctx);
 }
 
 static void
 function_context_add_listener (FunctionContext * function_ctx,
-                               GumInvocationListener * listener,
-                               gpointer function_data)
+                               ListenerRegistration * registration,
+                               gpointer function_data,
+                               GumListenerFlags flags)
 {
+  GumInvocationListener * listener = registration->listener;
+  ListenerEntrySet * old_set = function_ctx->listener_entries;
+  ListenerEntrySet * new_set;
   ListenerEntry * entry;
+  guint i;
 
-  entry = gum_new (ListenerEntry, 1);
+  new_set = listener_entry_set_new (old_set->len + 1);
+  memcpy (new_set->entries, old_set->entries,
+      old_set->len * sizeof (ListenerEntry));
+  new_set->leave_listener_count = old_set->leave_listener_count;
+
+  entry = &new_set->entries[old_set->len];
   entry->listener_interface = GUM_INVOCATION_LISTENER_GET_INTERFACE (listener);
   entry->listener_instance = listener;
+  entry->registration = registration;
   entry->function_data = function_data;
+  entry->flags = flags;
+
+  if ((flags & GUM_LISTENER_ENTER_ONLY) == 0)
+    new_set->leave_listener_count++;
+
+  for (i = 0; i != new_set->len; i++)
+    listener_registration_ref (new_set->entries[i].registration);
 
-  gum_array_append_val (function_ctx->listener_entries, entry);
+  function_context_publish_listener_entries (function_ctx, new_set);
 }
 
 static void
 function_context_remove_listener (FunctionContext * function_ctx,
                                   GumInvocationListener * listener)
 {
-  ListenerEntry * entry;
+  ListenerEntrySet * old_set = function_ctx->listener_entries;
+  ListenerEntrySet * new_set;
   guint i;
 
-  entry = function_context_find_listener_entry (function_ctx, listener);
-  g_assert (entry != NULL);
+  g_assert (function_context_has_listener (function_ctx, listener));
+
+  new_set = listener_entry_set_new (old_set->len - 1);
 
-  for (i = 0; i < function_ctx->listener_entries->len; i++)
+  for (i = 0; i != old_set->len; i++)
   {
-    ListenerEntry * cur =
-        gum_array_index (function_ctx->listener_entries, ListenerEntry *, i);
-    if (cur == entry)
-    {
-      gum_array_remove_index (function_ctx->listener_entries, i);
-      break;
-    }
+    ListenerEntry * entry = &old_set->entries[i];
+
+    if (entry->listener_instance == listener)
+      continue;
+
+    new_set->entries[new_set->len++] = *entry;
+    listener_registration_ref (entry->registration);
+    if ((entry->flags & GUM_LISTENER_ENTER_ONLY) == 0)
+      new_set->leave_listener_count++;
   }
 
-  gum_free (entry);
+  function_context_publish_listener_entries (function_ctx, new_set);
 }
 
 static gboolean
@@ -704,12 +853,12 @@ static ListenerEntry *
 function_context_find_listener_entry (FunctionContext * function_ctx,
                                       GumInvocationListener * listener)
 {
+  ListenerEntrySet * set = function_ctx->listener_entries;
   guint i;
 
-  for (i = 0; i < function_ctx->listener_entries->len; i++)
+  for (i = 0; i != set->len; i++)
   {
-    ListenerEntry * entry =
-        gum_array_index (function_ctx->listener_entries, ListenerEntry *, i);
+    ListenerEntry * entry = &set->entries[i];
 
     if (entry->listener_instance == listener)
       return entry;
@@ -718,6 +867,214 @@ function_context_find_listener_entry (FunctionContext * function_ctx,
   return NULL;
 }
 
+/*
+ * The listener entries of a function are never modified in place. Writers
+ * publish a new set with a single pointer store, and retire the previous one
+ * until every thread that might still be reading it has left its epoch.
+ * Invocations that need on_leave hold a reference on the set they entered
+ * with, so their listener data lines up even if the set changes meanwhile.
+ */
+static void
+function_context_publish_listener_entries (FunctionContext * function_ctx,
+                                           ListenerEntrySet * entries)
+{
+  ListenerEntrySet * old_entries = function_ctx->listener_entries;
+
+  g_atomic_pointer_set (&function_ctx->listener_entries, entries);
+
+  gum_interceptor_retire_listener_entries (function_ctx->interceptor,
+      old_entries);
+}
+
+static ListenerEntrySet *
+listener_entry_set_new (guint len)
+{
+  ListenerEntrySet * set;
+
+  set = (ListenerEntrySet *) gum_malloc0 (
+      sizeof (ListenerEntrySet) + (MAX (len, 1) - 1) * sizeof (ListenerEntry));
+  set->ref_count = 1;
+  set->len = len;
+
+  return set;
+}
+
+static void
+listener_entry_set_ref (ListenerEntrySet * set)
+{
+  g_atomic_int_inc (&set->ref_count);
+}
+
+static void
+listener_entry_set_unref (ListenerEntrySet * set)
+{
+  guint i;
+
+  if (!g_atomic_int_dec_and_test (&set->ref_count))
+    return;
+
+  for (i = 0; i != set->len; i++)
+    listener_registration_unref (set->entries[i].registration);
+
+  gum_free (set);
+}
+
+static void
+gum_interceptor_retire_listener_entries (GumInterceptor * self,
+                                         ListenerEntrySet * set)
+{
+  GumInterceptorPrivate * priv = self->priv;
+
+  set->retire_epoch =
+      g_atomic_int_exchange_and_add (&_gum_interceptor_epoch, 1) + 1;
+  priv->retired_listener_entries =
+      gum_list_prepend (priv->retired_listener_entries, set);
+
+  gum_interceptor_reclaim_listener_entries (self, FALSE);
+}
+
+static void
+gum_interceptor_reclaim_listener_entries (GumInterceptor * self,
+                                          gboolean force)
+{
+  GumInterceptorPrivate * priv = self->priv;
+  gint oldest_epoch;
+  GumList * walk;
+
+  oldest_epoch = force ? G_MAXINT : gum_interceptor_oldest_active_epoch ();
+
+  walk = priv->retired_listener_entries;
+  while (walk != NULL)
+  {
+    ListenerEntrySet * set = (ListenerEntrySet *) walk->data;
+    GumList * next = walk->next;
+
+    if (set->retire_epoch <= oldest_epoch &&
+        (force || !gum_interceptor_has_pending_invocations (NULL, set)))
+    {
+      priv->retired_listener_entries =
+          gum_list_delete_link (priv->retired_listener_entries, walk);
+      listener_entry_set_unref (set);
+    }
+
+    walk = next;
+  }
+}
+
+static gint
+gum_interceptor_oldest_active_epoch (void)
+{
+  gint oldest_epoch = G_MAXINT;
+  guint i;
+
+  gum_spinlock_acquire (&_gum_interceptor_thread_context_lock);
+
+  for (i = 0; i != _gum_interceptor_thread_contexts->len; i++)
+  {
+    InterceptorThreadContext * thread_ctx;
+    gint epoch;
+
+    thread_ctx = gum_array_index (_gum_interceptor_thread_contexts,
+        InterceptorThreadContext *, i);
+    epoch = g_atomic_int_get (&thread_ctx->active_epoch);
+    if (epoch != 0 && epoch < oldest_epoch)
+      oldest_epoch = epoch;
+  }
+
+  gum_spinlock_release (&_gum_interceptor_thread_context_lock);
+
+  return oldest_epoch;
+}
+
+static void
+gum_interceptor_wait_for_readers (void)
+{
+  InterceptorThreadContext * interceptor_ctx;
+  gint previous_epoch = 0;
+  gint epoch;
+
+  /*
+   * We might be called from within a callback, so we step out of our own
+   * epoch while waiting. The entries we are walking are kept alive by our
+   * pending invocation, and we check each registration again on return.
+   */
+  interceptor_ctx = (InterceptorThreadContext *)
+      GUM_TLS_KEY_GET_VALUE (_gum_interceptor_context_key);
+  if (interceptor_ctx != NULL)
+  {
+    previous_epoch = g_atomic_int_get (&interceptor_ctx->active_epoch);
+    g_atomic_int_set (&interceptor_ctx->active_epoch, 0);
+  }
+
+  epoch = g_atomic_int_exchange_and_add (&_gum_interceptor_epoch, 1) + 1;
+
+  while (gum_interceptor_oldest_active_epoch () < epoch)
+    g_thread_yield ();
+
+  if (previous_epoch != 0)
+  {
+    g_atomic_int_set (&interceptor_ctx->active_epoch,
+        g_atomic_int_get (&_gum_interceptor_epoch));
+  }
+}
+
+static gboolean
+gum_interceptor_has_pending_invocations (FunctionContext * function_ctx,
+                                         ListenerEntrySet * entries)
+{
+  gboolean found = FALSE;
+  guint i;
+
+  gum_spinlock_acquire (&_gum_interceptor_thread_context_lock);
+
+  for (i = 0; i != _gum_interceptor_thread_contexts->len && !found; i++)
+  {
+    InterceptorThreadContext * thread_ctx;
+    gint n, j;
+
+    thread_ctx = gum_array_index (_gum_interceptor_thread_contexts,
+        InterceptorThreadContext *, i);
+
+    n = g_atomic_int_get (&thread_ctx->n_pending_invocations);
+    for (j = 0; j != n && !found; j++)
+    {
+      PendingInvocation * pending = &thread_ctx->pending_invocations[j];
+
+      found = (function_ctx != NULL && pending->function_ctx == function_ctx) ||
+          (entries != NULL && pending->listener_entries == entries);
+    }
+  }
+
+  gum_spinlock_release (&_gum_interceptor_thread_context_lock);
+
+  return found;
+}
+
+static ListenerRegistration *
+listener_registration_new (GumInvocationListener * listener)
+{
+  ListenerRegistration * registration;
+
+  registration = gum_new0 (ListenerRegistration, 1);
+  registration->ref_count = 1;
+  registration->listener = listener;
+
+  return registration;
+}
+
+static void
+listener_registration_ref (ListenerRegistration * registration)
+{
+  g_atomic_int_inc (&registration->ref_count);
+}
+
+static void
+listener_registration_unref (ListenerRegistration * registration)
+{
+  if (g_atomic_int_dec_and_test (&registration->ref_count))
+    gum_free (registration);
+}
+
 gboolean
 _gum_function_context_on_enter (FunctionContext * function_ctx,
                                 GumCpuContext * cpu_context,
@@ -727,25 +1084,46 @@ _gum_function_context_on_enter (FunctionContext * function_ctx,
   GumInterceptorPrivate * priv = self->priv;
   gboolean invoke_listeners = TRUE;
   gboolean will_trap_on_leave = FALSE;
-  InterceptorThreadContext * interceptor_ctx = NULL;
+  InterceptorThreadContext * interceptor_ctx;
+  PendingInvocation * pending = NULL;
 #ifdef G_OS_WIN32
   DWORD previous_last_error;
 #else
   gint previous_errno;
 #endif
 
-#ifdef HAVE_LINUX
-  if (GUM_TLS_KEY_GET_VALUE (_gum_interceptor_guard_key) == self)
-    return FALSE;
-  GUM_TLS_KEY_SET_VALUE (_gum_interceptor_guard_key, self);
-#endif
-
 #ifdef G_OS_WIN32
   previous_last_error = GetLastError ();
 #else
   previous_errno = errno;
 #endif
 
+  /*
+   * The invocation is pending from here until we return, or until on_leave
+   * if we trap, so we start tracking before any early return. This is only
+   * recorded in this thread's own context. Before that has been created,
+   * and past GUM_MAX_CALL_DEPTH, the stack entry holds a reference on the
+   * listener entries instead. The trampoline code itself is covered by the
+   * usage counter that the backend maintains around the whole trampoline.
+   */
+  interceptor_ctx = (InterceptorThreadContext *)
+      GUM_TLS_KEY_GET_VALUE (_gum_interceptor_context_key);
+  if (interceptor_ctx != NULL)
+  {
+    pending = interceptor_thread_context_track_invocation (interceptor_ctx,
+        function_ctx);
+  }
+
+#ifdef HAVE_LINUX
+  if (GUM_TLS_KEY_GET_VALUE (_gum_interceptor_guard_key) == self)
+  {
+    if (pending != NULL)
+      interceptor_thread_context_untrack_invocation (interceptor_ctx);
+    return FALSE;
+  }
+  GUM_TLS_KEY_SET_VALUE (_gum_interceptor_guard_key, self);
+#endif
+
   if (G_UNLIKELY (priv->selected_thread_id != 0))
   {
     invoke_listeners = gum_get_current_thread_id () == priv->selected_thread_id;
@@ -753,12 +1131,16 @@ _gum_function_context_on_enter (FunctionContext * function_ctx,
 
   if (G_LIKELY (invoke_listeners))
   {
-    interceptor_ctx = get_interceptor_thread_context ();
+    if (G_UNLIKELY (interceptor_ctx == NULL))
+      interceptor_ctx = get_interceptor_thread_context ();
     invoke_listeners = (interceptor_ctx->ignore_level == 0);
   }
 
   if (G_LIKELY (invoke_listeners))
   {
+    gboolean entered_epoch;
+    ListenerEntrySet * entries;
+    gboolean needs_leave;
     GumInvocationStackEntry * stack_entry;
     GumInvocationContext * invocation_ctx;
     guint i;
@@ -775,35 +1157,70 @@ _gum_function_context_on_enter (FunctionContext * function_ctx,
 # error Unsupported architecture
 #endif
 
+    entered_epoch = interceptor_thread_context_enter_epoch (interceptor_ctx);
+    entries = (ListenerEntrySet *)
+        g_atomic_pointer_get (&function_ctx->listener_entries);
+    if (pending != NULL)
+      pending->listener_entries = entries;
+
+    /*
+     * When every listener is enter-only we don't hijack the return address,
+     * so the function returns straight to its caller. The entry is still
+     * pushed for the duration of on_enter, so that listeners can find it
+     * through gum_interceptor_get_current_invocation ().
+     */
+    needs_leave = entries->leave_listener_count != 0;
     stack_entry = gum_invocation_stack_push (interceptor_ctx->stack,
         function_ctx, *caller_ret_addr, NULL);
+    if (pending == NULL)
+    {
+      listener_entry_set_ref (entries);
+      stack_entry->holds_reference = TRUE;
+    }
+    stack_entry->listener_entries = entries;
 
     invocation_ctx = &stack_entry->invocation_context;
     invocation_ctx->cpu_context = cpu_context;
     invocation_ctx->backend = &interceptor_ctx->listener_backend;
 
-    for (i = 0; i != function_ctx->listener_entries->len; i++)
+    for (i = 0; i != entries->len; i++)
     {
-      ListenerEntry * entry;
+      ListenerEntry * entry = &entries->entries[i];
       ListenerInvocationState state;
 
-      entry =
-          gum_array_index (function_ctx->listener_entries, ListenerEntry *, i);
+      if ((entry->flags & GUM_LISTENER_LEAVE_ONLY) != 0)
+        continue;
+      if (g_atomic_int_get (&entry->registration->detached))
+        continue;
 
       state.point_cut = GUM_POINT_ENTER;
       state.entry = entry;
       state.interceptor_ctx = interceptor_ctx;
-      state.invocation_data = stack_entry->listener_invocation_data[i];
+      state.stack_entry = stack_entry;
+      state.entry_index = i;
       invocation_ctx->backend->data = &state;
 
       entry->listener_interface->on_enter (entry->listener_instance,
           invocation_ctx);
     }
 
-    *caller_ret_addr = function_ctx->on_leave_trampoline;
-    will_trap_on_leave = TRUE;
+    if (needs_leave)
+    {
+      *caller_ret_addr = function_ctx->on_leave_trampoline;
+      will_trap_on_leave = TRUE;
+    }
+    else
+    {
+      gum_invocation_stack_pop (interceptor_ctx->stack);
+    }
+
+    if (entered_epoch)
+      interceptor_thread_context_leave_epoch (interceptor_ctx);
   }
 
+  if (!will_trap_on_leave && pending != NULL)
+    interceptor_thread_context_untrack_invocation (interceptor_ctx);
+
 #ifdef G_OS_WIN32
   SetLastError (previous_last_error);
 #else
@@ -824,6 +1241,8 @@ _gum_function_context_on_leave (FunctionContext * function_ctx,
 {
   InterceptorThreadContext * interceptor_ctx;
   GumInvocationStackEntry * stack_entry;
+  gboolean entered_epoch;
+  ListenerEntrySet * entries;
   GumInvocationContext * invocation_ctx;
   guint i;
 #ifdef G_OS_WIN32
@@ -846,6 +1265,7 @@ _gum_function_context_on_leave (FunctionContext * function_ctx,
 
   stack_entry = gum_invocation_stack_peek_top (interceptor_ctx->stack);
   *caller_ret_addr = stack_entry->caller_ret_addr;
+  entries = stack_entry->listener_entries;
 
   invocation_ctx = &stack_entry->invocation_context;
   invocation_ctx->cpu_context = cpu_context;
@@ -863,24 +1283,40 @@ _gum_function_context_on_leave (FunctionContext * function_ctx,
 # error Unsupported architecture
 #endif
 
-  for (i = 0; i != function_ctx->listener_entries->len; i++)
+  entered_epoch = interceptor_thread_context_enter_epoch (interceptor_ctx);
+
+  for (i = 0; i != entries->len; i++)
   {
-    ListenerEntry * entry;
+    ListenerEntry * entry = &entries->entries[i];
     ListenerInvocationState state;
 
-    entry =
-        gum_array_index (function_ctx->listener_entries, ListenerEntry *, i);
+    if ((entry->flags & GUM_LISTENER_ENTER_ONLY) != 0)
+      continue;
+
+    /*
+     * The set we entered with keeps the registration alive, but not the
+     * listener, which its owner is free to destroy once detach returns.
+     */
+    if (g_atomic_int_get (&entry->registration->detached))
+      continue;
 
     state.point_cut = GUM_POINT_LEAVE;
     state.entry = entry;
     state.interceptor_ctx = interceptor_ctx;
-    state.invocation_data = stack_entry->listener_invocation_data[i];
+    state.stack_entry = stack_entry;
+    state.entry_index = i;
     invocation_ctx->backend->data = &state;
 
     entry->listener_interface->on_leave (entry->listener_instance,
         invocation_ctx);
   }
 
+  if (entered_epoch)
+    interceptor_thread_context_leave_epoch (interceptor_ctx);
+
+  if (!stack_entry->holds_reference)
+    interceptor_thread_context_untrack_invocation (interceptor_ctx);
+
   gum_invocation_stack_pop (interceptor_ctx->stack);
 
 #ifdef G_OS_WIN32
@@ -983,7 +1419,7 @@ gum_interceptor_invocation_get_listener_thread_data (
       (ListenerInvocationState *) context->backend->data;
 
   return interceptor_thread_context_get_listener_data (data->interceptor_ctx,
-      data->entry->listener_instance, required_size);
+      data->entry->registration, required_size);
 }
 
 static gpointer
@@ -1006,7 +1442,8 @@ gum_interceptor_invocation_get_listener_function_invocation_data (
   if (required_size > GUM_MAX_LISTENER_DATA)
     return NULL;
 
-  return data->invocation_data;
+  return gum_invocation_stack_entry_get_listener_data (data->stack_entry,
+      data->entry_index);
 }
 
 static gpointer
@@ -1074,7 +1511,9 @@ interceptor_thread_context_new (void)
       sizeof (GumInvocationStackEntry), GUM_MAX_CALL_DEPTH);
 
   context->listener_data_slots = gum_array_sized_new (FALSE, TRUE,
-      sizeof (ListenerDataSlot), GUM_MAX_LISTENERS_PER_FUNCTION);
+      sizeof (ListenerDataSlot), GUM_INTERCEPTOR_INLINE_LISTENER_DATA);
+  context->detach_generation =
+      g_atomic_int_get (&_gum_interceptor_detach_generation);
 
   return context;
 }
@@ -1082,6 +1521,16 @@ interceptor_thread_context_new (void)
 static void
 interceptor_thread_context_destroy (InterceptorThreadContext * context)
 {
+  guint i;
+
+  for (i = 0; i != context->listener_data_slots->len; i++)
+  {
+    ListenerDataSlot * slot;
+
+    slot = &gum_array_index (context->listener_data_slots, ListenerDataSlot, i);
+    if (slot->owner != NULL)
+      listener_registration_unref (slot->owner);
+  }
   gum_array_free (context->listener_data_slots, TRUE);
 
   gum_array_free (context->stack, TRUE);
@@ -1090,22 +1539,31 @@ interceptor_thread_context_destroy (InterceptorThreadContext * context)
 }
 
 static gpointer
-interceptor_thread_context_get_listener_data (InterceptorThreadContext * self,
-                                              GumInvocationListener * listener,
-                                              gsize required_size)
+interceptor_thread_context_get_listener_data (
+    InterceptorThreadContext * self,
+    ListenerRegistration * registration,
+    gsize required_size)
 {
+  gint generation;
   guint i;
   ListenerDataSlot * available_slot = NULL;
 
   if (required_size > GUM_MAX_LISTENER_DATA)
     return NULL;
 
+  generation = g_atomic_int_get (&_gum_interceptor_detach_generation);
+  if (G_UNLIKELY (generation != self->detach_generation))
+  {
+    interceptor_thread_context_reclaim_listener_data (self);
+    self->detach_generation = generation;
+  }
+
   for (i = 0; i != self->listener_data_slots->len; i++)
   {
     ListenerDataSlot * slot;
 
     slot = &gum_array_index (self->listener_data_slots, ListenerDataSlot, i);
-    if (slot->owner == listener)
+    if (slot->owner == registration)
       return slot->data;
     else if (slot->owner == NULL)
       available_slot = slot;
@@ -1123,15 +1581,15 @@ interceptor_thread_context_get_listener_data (InterceptorThreadContext * self,
     memset (available_slot->data, 0, sizeof (available_slot->data));
   }
 
-  available_slot->owner = listener;
+  listener_registration_ref (registration);
+  available_slot->owner = registration;
 
   return available_slot->data;
 }
 
 static void
-interceptor_thread_context_forget_listener_data (
-    InterceptorThreadContext * self,
-    GumInvocationListener * listener)
+interceptor_thread_context_reclaim_listener_data (
+    InterceptorThreadContext * self)
 {
   guint i;
 
@@ -1140,14 +1598,57 @@ interceptor_thread_context_forget_listener_data (
     ListenerDataSlot * slot;
 
     slot = &gum_array_index (self->listener_data_slots, ListenerDataSlot, i);
-    if (slot->owner == listener)
+    if (slot->owner != NULL && g_atomic_int_get (&slot->owner->detached))
     {
+      listener_registration_unref (slot->owner);
       slot->owner = NULL;
-      return;
     }
   }
 }
 
+static gboolean
+interceptor_thread_context_enter_epoch (InterceptorThreadContext * self)
+{
+  if (self->active_epoch != 0)
+    return FALSE;
+
+  g_atomic_int_compare_and_exchange (&self->active_epoch, 0,
+      g_atomic_int_get (&_gum_interceptor_epoch));
+
+  return TRUE;
+}
+
+static void
+interceptor_thread_context_leave_epoch (InterceptorThreadContext * self)
+{
+  g_atomic_int_set (&self->active_epoch, 0);
+}
+
+static PendingInvocation *
+interceptor_thread_context_track_invocation (InterceptorThreadContext * self,
+                                             FunctionContext * function_ctx)
+{
+  gint n = self->n_pending_invocations;
+  PendingInvocation * pending;
+
+  if ((guint) n == G_N_ELEMENTS (self->pending_invocations))
+    return NULL;
+
+  pending = &self->pending_invocations[n];
+  pending->function_ctx = function_ctx;
+  pending->listener_entries = NULL;
+  g_atomic_int_set (&self->n_pending_invocations, n + 1);
+
+  return pending;
+}
+
+static void
+interceptor_thread_context_untrack_invocation (InterceptorThreadContext * self)
+{
+  g_atomic_int_set (&self->n_pending_invocations,
+      self->n_pending_invocations - 1);
+}
+
 static GumInvocationStackEntry *
 gum_invocation_stack_push (GumInvocationStack * stack,
                            FunctionContext * function_ctx,
@@ -1155,13 +1656,29 @@ gum_invocation_stack_push (GumInvocationStack * stack,
                            const GumCpuContext * cpu_context)
 {
   GumInvocationStackEntry * entry;
-  GumInvocationContext * ctx;
 
   gum_array_set_size (stack, stack->len + 1);
   entry = (GumInvocationStackEntry *)
       &gum_array_index (stack, GumInvocationStackEntry, stack->len - 1);
+  gum_invocation_stack_entry_init (entry, function_ctx, caller_ret_addr,
+      cpu_context);
+
+  return entry;
+}
+
+static void
+gum_invocation_stack_entry_init (GumInvocationStackEntry * entry,
+                                 FunctionContext * function_ctx,
+                                 gpointer caller_ret_addr,
+                                 const GumCpuContext * cpu_context)
+{
+  GumInvocationContext * ctx;
+
   entry->trampoline_ret_addr = function_ctx->on_leave_trampoline;
   entry->caller_ret_addr = caller_ret_addr;
+  entry->listener_entries = NULL;
+  entry->holds_reference = FALSE;
+  entry->extra_listener_invocation_data = NULL;
 
   ctx = &entry->invocation_context;
   ctx->function =
@@ -1174,8 +1691,6 @@ gum_invocation_stack_push (GumInvocationStack * stack,
     entry->cpu_context = *cpu_context;
     ctx->cpu_context = &entry->cpu_context;
   }
-
-  return entry;
 }
 
 static gpointer
@@ -1187,11 +1702,44 @@ gum_invocation_stack_pop (GumInvocationStack * stack)
   entry = (GumInvocationStackEntry *)
       &gum_array_index (stack, GumInvocationStackEntry, stack->len - 1);
   caller_ret_addr = entry->caller_ret_addr;
+  gum_invocation_stack_entry_finalize (entry);
   gum_array_set_size (stack, stack->len - 1);
 
   return caller_ret_addr;
 }
 
+static void
+gum_invocation_stack_entry_finalize (GumInvocationStackEntry * entry)
+{
+  if (entry->holds_reference)
+    listener_entry_set_unref (entry->listener_entries);
+
+  if (entry->extra_listener_invocation_data != NULL)
+    gum_free (entry->extra_listener_invocation_data);
+}
+
+static guint8 *
+gum_invocation_stack_entry_get_listener_data (GumInvocationStackEntry * entry,
+                                              guint index)
+{
+  guint extra_index;
+
+  if (index < GUM_INTERCEPTOR_INLINE_LISTENER_DATA)
+    return entry->listener_invocation_data[index];
+
+  if (entry->extra_listener_invocation_data == NULL)
+  {
+    entry->extra_listener_invocation_data = (guint8 *) gum_malloc0 (
+        (entry->listener_entries->len - GUM_INTERCEPTOR_INLINE_LISTENER_DATA) *
+        GUM_MAX_LISTENER_DATA);
+  }
+
+  extra_index = index - GUM_INTERCEPTOR_INLINE_LISTENER_DATA;
+
+  return entry->extra_listener_invocation_data +
+      (extra_index * GUM_MAX_LISTENER_DATA);
+}
+
 static GumInvocationStackEntry *
 gum_invocation_stack_peek_top (GumInvocationStack * stack)
 {
@@ -1202,9 +1750,67 @@ gum_invocation_stack_peek_top (GumInvocationStack * stack)
 }
 
 static void
-make_function_prologue_at_least_read_write (gpointer prologue_address)
+gum_interceptor_transaction_begin (GumInterceptor * self)
+{
+  self->priv->transaction_level++;
+}
+
+static void
+gum_interceptor_transaction_end (GumInterceptor * self)
+{
+  GumInterceptorPrivate * priv = self->priv;
+  GumHashTableIter iter;
+  gpointer page;
+  guint page_size;
+
+  g_assert (priv->transaction_level != 0);
+  if (--priv->transaction_level != 0)
+    return;
+
+  page_size = gum_query_page_size ();
+
+  gum_hash_table_iter_init (&iter, priv->writable_prologue_pages);
+  while (gum_hash_table_iter_next (&iter, &page, NULL))
+    gum_mprotect (page, page_size, GUM_PAGE_READ | GUM_PAGE_EXECUTE);
+  gum_hash_table_remove_all (priv->writable_prologue_pages);
+
+  gum_interceptor_flush_instruction_cache (self);
+}
+
+static gboolean
+gum_interceptor_is_deferring_protection (GumInterceptor * self)
+{
+#if defined (HAVE_DARWIN) && defined (HAVE_ARM)
+  /*
+   * Writable pages are not executable here, so keeping them writable for the
+   * whole transaction could fault on code sharing a page with a prologue.
+   */
+  (void) self;
+
+  return FALSE;
+#else
+  return self->priv->transaction_level != 0;
+#endif
+}
+
+static void
+gum_interceptor_flush_instruction_cache (GumInterceptor * self)
+{
+#ifdef G_OS_WIN32
+  if (self->priv->transaction_level == 0)
+    FlushInstructionCache (GetCurrentProcess (), NULL, 0);
+#else
+  (void) self;
+#endif
+}
+
+static void
+make_function_prologue_at_least_read_write (GumInterceptor * self,
+                                            gpointer prologue_address)
 {
   GumPageProtection prot;
+  guint page_size;
+  guint8 * first_page, * last_page, * page;
 
 #if defined (HAVE_DARWIN) && defined (HAVE_ARM)
   prot = GUM_PAGE_READ | GUM_PAGE_WRITE; /* RWX is not allowed */
@@ -1212,12 +1818,36 @@ make_function_prologue_at_least_read_write (gpointer prologue_address)
   prot = GUM_PAGE_RWX;
 #endif
 
-  gum_mprotect (prologue_address, 16, prot);
+  if (!gum_interceptor_is_deferring_protection (self))
+  {
+    gum_mprotect (prologue_address, 16, prot);
+    return;
+  }
+
+  page_size = gum_query_page_size ();
+  first_page = GSIZE_TO_POINTER (
+      GPOINTER_TO_SIZE (prologue_address) & ~(page_size - 1));
+  last_page = GSIZE_TO_POINTER (
+      (GPOINTER_TO_SIZE (prologue_address) + 16 - 1) & ~(page_size - 1));
+
+  for (page = first_page; page <= last_page; page += page_size)
+  {
+    if (gum_hash_table_lookup (self->priv->writable_prologue_pages,
+        page) == NULL)
+    {
+      gum_mprotect (page, page_size, prot);
+      gum_hash_table_insert (self->priv->writable_prologue_pages, page, page);
+    }
+  }
 }
 
 static void
-make_function_prologue_read_execute (gpointer prologue_address)
+make_function_prologue_read_execute (GumInterceptor * self,
+                                     gpointer prologue_address)
 {
+  if (gum_interceptor_is_deferring_protection (self))
+    return;
+
   gum_mprotect (prologue_address, 16, GUM_PAGE_READ | GUM_PAGE_EXECUTE);
 }
 
@@ -1281,10 +1911,19 @@ gum_get_current_thread_id (void)
 static void
 gum_function_context_wait_for_idle_trampoline (FunctionContext * ctx)
 {
-  if (ctx->trampoline_usage_counter == NULL)
+  if (ctx->listener_entries == NULL)
     return;
 
-  while (*ctx->trampoline_usage_counter != 0)
+  /*
+   * The backend's usage counter spans the generated code around the calls
+   * into C, from just after saving the flags until just before restoring
+   * them. Pending invocations are all we have on backends without one.
+   */
+  while ((ctx->trampoline_usage_counter != NULL &&
+      g_atomic_int_get (ctx->trampoline_usage_counter) != 0) ||
+      gum_interceptor_has_pending_invocations (ctx, NULL))
+  {
     g_thread_yield ();
+  }
   g_thread_yield ();
 }
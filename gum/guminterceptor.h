@@ -52,6 +52,13 @@ typedef enum
   GUM_ATTACH_ALREADY_ATTACHED = -2
 } GumAttachReturn;
 
+typedef enum
+{
+  GUM_LISTENER_DEFAULT    = 0,
+  GUM_LISTENER_ENTER_ONLY = (1 << 0),
+  GUM_LISTENER_LEAVE_ONLY = (1 << 1)
+} GumListenerFlags;
+
 struct _GumInterceptor
 {
   GObject parent;
@@ -73,6 +80,10 @@ GUM_API GumInterceptor * gum_interceptor_obtain (void);
 GUM_API GumAttachReturn gum_interceptor_attach_listener (GumInterceptor * self,
     gpointer function_address, GumInvocationListener * listener,
     gpointer listener_function_data);
+GUM_API GumAttachReturn gum_interceptor_attach_listener_full (
+    GumInterceptor * self, gpointer function_address,
+    GumInvocationListener * listener, gpointer listener_function_data,
+    GumListenerFlags flags);
 GUM_API void gum_interceptor_detach_listener (GumInterceptor * self,
     GumInvocationListener * listener);
 
@@ -82,6 +93,9 @@ GUM_API void gum_interceptor_replace_function (GumInterceptor * self,
 GUM_API void gum_interceptor_revert_function (GumInterceptor * self,
     gpointer function_address);
 
+GUM_API void gum_interceptor_begin_transaction (GumInterceptor * self);
+GUM_API void gum_interceptor_end_transaction (GumInterceptor * self);
+
 GUM_API GumInvocationContext * gum_interceptor_get_current_invocation (void);
 GUM_API GumInvocationStack * gum_interceptor_get_current_stack (void);
 
@@ -33,9 +33,15 @@ static GumEventType gum_script_event_sink_query_mask (GumEventSink * sink);
 static void gum_script_event_sink_start (GumEventSink * sink);
 static void gum_script_event_sink_process (GumEventSink * sink,
     const GumEvent * ev);
+static void gum_script_event_sink_process_batch (GumEventSink * sink,
+    const GumEvent * events, guint n_events);
 static void gum_script_event_sink_stop (GumEventSink * sink);
 static gboolean gum_script_event_sink_stop_idle (gpointer user_data);
 static gboolean gum_script_event_sink_drain (gpointer user_data);
+static void gum_script_event_sink_add_call_count (const GumCallCount * count,
+    gpointer user_data);
+static void gum_script_event_sink_add_frequency (GHashTable * frequencies,
+    gpointer target, guint64 count);
 static void gum_script_event_sink_data_free (Persistent<Value> object,
     void * buffer);
 
@@ -66,6 +72,7 @@ gum_script_event_sink_iface_init (gpointer g_iface,
   iface->query_mask = gum_script_event_sink_query_mask;
   iface->start = gum_script_event_sink_start;
   iface->process = gum_script_event_sink_process;
+  iface->process_batch = gum_script_event_sink_process_batch;
   iface->stop = gum_script_event_sink_stop;
 }
 
@@ -112,6 +119,8 @@ gum_script_event_sink_finalize (GObject * obj)
   gum_spinlock_free (&self->lock);
   g_array_free (self->queue, TRUE);
 
+  g_object_unref (self->stalker);
+
   G_OBJECT_CLASS (gum_script_event_sink_parent_class)->finalize (obj);
 }
 
@@ -130,6 +139,7 @@ gum_script_event_sink_new (const GumScriptEventSinkOptions * options)
   g_object_ref (options->core->script);
   sink->core = options->core;
   sink->main_context = options->main_context;
+  sink->stalker = GUM_STALKER (g_object_ref (options->stalker));
   sink->event_mask = options->event_mask;
   sink->on_receive = Persistent<Function>::New (options->on_receive);
   sink->on_call_summary = Persistent<Function>::New (options->on_call_summary);
@@ -164,6 +174,20 @@ gum_script_event_sink_process (GumEventSink * sink,
   gum_spinlock_release (&self->lock);
 }
 
+static void
+gum_script_event_sink_process_batch (GumEventSink * sink,
+                                     const GumEvent * events,
+                                     guint n_events)
+{
+  GumScriptEventSink * self = GUM_SCRIPT_EVENT_SINK_CAST (sink);
+  guint n;
+
+  gum_spinlock_acquire (&self->lock);
+  n = MIN (n_events, self->queue_capacity - self->queue->len);
+  g_array_append_vals (self->queue, events, n);
+  gum_spinlock_release (&self->lock);
+}
+
 static void
 gum_script_event_sink_stop (GumEventSink * sink)
 {
@@ -222,23 +246,31 @@ gum_script_event_sink_drain (gpointer user_data)
     gum_spinlock_release (&self->lock);
   }
 
-  if (buffer != NULL)
+  /* Counted by the stalker instead of being reported call by call */
+  GHashTable * frequencies = NULL;
+  if ((self->event_mask & GUM_CALL_COUNT) != 0)
   {
-    GHashTable * frequencies = NULL;
-    if (!self->on_call_summary.IsEmpty ())
+    frequencies = g_hash_table_new_full (NULL, NULL, NULL, g_free);
+    gum_stalker_drain_call_counts (self->stalker, GUM_EVENT_SINK (self),
+        gum_script_event_sink_add_call_count, frequencies);
+    if (g_hash_table_size (frequencies) == 0)
     {
-      frequencies = g_hash_table_new (NULL, NULL);
+      g_hash_table_unref (frequencies);
+      frequencies = NULL;
+    }
+  }
+
+  if (buffer != NULL || frequencies != NULL)
+  {
+    if (buffer != NULL && !self->on_call_summary.IsEmpty ())
+    {
+      if (frequencies == NULL)
+        frequencies = g_hash_table_new_full (NULL, NULL, NULL, g_free);
       GumCallEvent * ev = static_cast<GumCallEvent *> (buffer);
       for (guint i = 0; i != len; i++)
       {
         if (ev->type == GUM_CALL)
-        {
-          gsize count = GPOINTER_TO_SIZE (
-              g_hash_table_lookup (frequencies, ev->target));
-          count++;
-          g_hash_table_insert (frequencies,
-              ev->target, GSIZE_TO_POINTER (count));
-        }
+          gum_script_event_sink_add_frequency (frequencies, ev->target, 1);
 
         ev++;
       }
@@ -256,7 +288,8 @@ gum_script_event_sink_drain (gpointer user_data)
       while (g_hash_table_iter_next (&iter, &target, &count))
       {
         summary->Set (_gum_script_pointer_new (self->core, target),
-            Number::New (GPOINTER_TO_SIZE (count)), ReadOnly);
+            Number::New (static_cast<double> (
+                *static_cast<guint64 *> (count))), ReadOnly);
       }
 
       g_hash_table_unref (frequencies);
@@ -265,6 +298,9 @@ gum_script_event_sink_drain (gpointer user_data)
       self->on_call_summary->Call (self->on_call_summary, 1, argv);
     }
 
+    if (buffer == NULL)
+      return TRUE;
+
     if (!self->on_receive.IsEmpty ())
     {
       V8::AdjustAmountOfExternalAllocatedMemory (size);
@@ -289,6 +325,31 @@ gum_script_event_sink_drain (gpointer user_data)
   return TRUE;
 }
 
+static void
+gum_script_event_sink_add_call_count (const GumCallCount * count,
+                                      gpointer user_data)
+{
+  GHashTable * frequencies = static_cast<GHashTable *> (user_data);
+
+  gum_script_event_sink_add_frequency (frequencies, count->target,
+      count->count);
+}
+
+static void
+gum_script_event_sink_add_frequency (GHashTable * frequencies,
+                                     gpointer target,
+                                     guint64 count)
+{
+  guint64 * total = static_cast<guint64 *> (
+      g_hash_table_lookup (frequencies, target));
+  if (total == NULL)
+  {
+    total = g_new0 (guint64, 1);
+    g_hash_table_insert (frequencies, target, total);
+  }
+  *total += count;
+}
+
 static void
 gum_script_event_sink_data_free (Persistent<Value> object,
                                  void * buffer)
@@ -23,6 +23,7 @@
 #include "gumeventsink.h"
 #include "gumscriptcore.h"
 #include "gumspinlock.h"
+#include "gumstalker.h"
 
 #include <glib-object.h>
 #include <v8.h>
@@ -54,6 +55,7 @@ struct _GumScriptEventSink
 
   GumScriptCore * core;
   GMainContext * main_context;
+  GumStalker * stalker;
   GumEventType event_mask;
   v8::Persistent<v8::Function> on_receive;
   v8::Persistent<v8::Function> on_call_summary;
@@ -69,6 +71,7 @@ struct _GumScriptEventSinkOptions
 {
   GumScriptCore * core;
   GMainContext * main_context;
+  GumStalker * stalker;
   GumEventType event_mask;
   guint queue_capacity;
   guint queue_drain_interval;
@@ -48,6 +48,7 @@ static void gum_script_stalker_on_set_queue_drain_interval (
     Local<String> property, Local<Value> value, const AccessorInfo & info);
 static Handle<Value> gum_script_stalker_on_garbage_collect (
     const Arguments & args);
+static Handle<Value> gum_script_stalker_on_get_stats (const Arguments & args);
 static Handle<Value> gum_script_stalker_on_follow (const Arguments & args);
 static Handle<Value> gum_script_stalker_on_unfollow (const Arguments & args);
 static Handle<Value> gum_script_stalker_on_add_call_probe (
@@ -91,6 +92,9 @@ _gum_script_stalker_init (GumScriptStalker * self,
   stalker->Set (String::New ("garbageCollect"),
       FunctionTemplate::New (gum_script_stalker_on_garbage_collect,
           External::Wrap (self)));
+  stalker->Set (String::New ("getStats"),
+      FunctionTemplate::New (gum_script_stalker_on_get_stats,
+          External::Wrap (self)));
   stalker->Set (String::New ("follow"),
       FunctionTemplate::New (gum_script_stalker_on_follow,
           External::Wrap (self)));
@@ -248,6 +252,68 @@ gum_script_stalker_on_garbage_collect (const Arguments & args)
   return Undefined ();
 }
 
+static Handle<Value>
+gum_script_stalker_on_get_stats (const Arguments & args)
+{
+  GumScriptStalker * self = static_cast<GumScriptStalker *> (
+      External::Unwrap (args.Data ()));
+  GumStalker * stalker;
+  GumStalkerStats stats;
+
+  stalker = _gum_script_stalker_get (self);
+
+  if (args.Length () > 0)
+  {
+    if (!gum_stalker_get_thread_stats (stalker, args[0]->IntegerValue (),
+        &stats))
+      return Null ();
+  }
+  else
+  {
+    gum_stalker_get_stats (stalker, &stats);
+  }
+
+  Local<Object> result (Object::New ());
+  result->Set (String::New ("blocksCompiled"),
+      Number::New (stats.blocks_compiled), ReadOnly);
+  result->Set (String::New ("blocksRecompiled"),
+      Number::New (stats.blocks_recompiled), ReadOnly);
+  result->Set (String::New ("tracesCompiled"),
+      Number::New (stats.traces_compiled), ReadOnly);
+  result->Set (String::New ("bytesEmitted"),
+      Number::New (stats.bytes_emitted), ReadOnly);
+  result->Set (String::New ("backpatches"),
+      Number::New (stats.backpatches), ReadOnly);
+  result->Set (String::New ("invalidations"),
+      Number::New (stats.invalidations), ReadOnly);
+  result->Set (String::New ("evictions"),
+      Number::New (stats.evictions), ReadOnly);
+  result->Set (String::New ("slowPaths"),
+      Number::New (stats.slow_paths), ReadOnly);
+  result->Set (String::New ("callSlowPaths"),
+      Number::New (stats.call_slow_paths), ReadOnly);
+  result->Set (String::New ("jmpSlowPaths"),
+      Number::New (stats.jmp_slow_paths), ReadOnly);
+  result->Set (String::New ("retSlowPaths"),
+      Number::New (stats.ret_slow_paths), ReadOnly);
+  result->Set (String::New ("inlineCacheMisses"),
+      Number::New (stats.inline_cache_misses), ReadOnly);
+  result->Set (String::New ("totalCycles"),
+      Number::New (stats.total_cycles), ReadOnly);
+  result->Set (String::New ("obtainCycles"),
+      Number::New (stats.obtain_cycles), ReadOnly);
+  result->Set (String::New ("codeSlabSize"),
+      Number::New (stats.code_slab_size), ReadOnly);
+  result->Set (String::New ("codeSlabUsed"),
+      Number::New (stats.code_slab_used), ReadOnly);
+  result->Set (String::New ("mappingCount"),
+      Number::New (stats.mapping_count), ReadOnly);
+  result->Set (String::New ("mappingCapacity"),
+      Number::New (stats.mapping_capacity), ReadOnly);
+
+  return result;
+}
+
 static Handle<Value>
 gum_script_stalker_on_follow (const Arguments & args)
 {
@@ -281,6 +347,7 @@ gum_script_stalker_on_follow (const Arguments & args)
   GumScriptEventSinkOptions so;
   so.core = self->core;
   so.main_context = self->core->main_context;
+  so.stalker = _gum_script_stalker_get (self);
   so.event_mask = GUM_NOTHING;
   so.queue_capacity = self->queue_capacity;
   so.queue_drain_interval = self->queue_drain_interval;
@@ -317,6 +384,12 @@ gum_script_stalker_on_follow (const Arguments & args)
 
       if (gum_script_flags_get (events, "exec"))
         so.event_mask |= GUM_EXEC;
+
+      if (gum_script_flags_get (events, "compile"))
+        so.event_mask |= GUM_BLOCK;
+
+      if (gum_script_flags_get (events, "block"))
+        so.event_mask |= GUM_BLOCK_EXEC;
     }
 
     if (so.event_mask != GUM_NOTHING &&
@@ -330,6 +403,13 @@ gum_script_stalker_on_follow (const Arguments & args)
       _gum_script_callbacks_get_opt (options, "onCallSummary",
           &so.on_call_summary);
     }
+
+    /* Only the summary is wanted, so let the stalker do the counting */
+    if (so.event_mask == GUM_CALL && so.on_receive.IsEmpty () &&
+        !so.on_call_summary.IsEmpty ())
+    {
+      so.event_mask = GUM_CALL_COUNT;
+    }
   }
 
   if (self->sink != NULL)
@@ -46,8 +46,30 @@ typedef struct _GumStalkerClass      GumStalkerClass;
 typedef struct _GumStalkerPrivate    GumStalkerPrivate;
 
 typedef guint GumProbeId;
+typedef guint GumCallProbeFlags;
 typedef struct _GumCallSite GumCallSite;
 typedef void (* GumCallProbeCallback) (GumCallSite * site, gpointer user_data);
+typedef struct _GumIndirectBranchStats GumIndirectBranchStats;
+typedef gboolean (* GumFoundIndirectBranchFunc) (
+    const GumIndirectBranchStats * stats, gpointer user_data);
+typedef struct _GumStalkerStats GumStalkerStats;
+typedef struct _GumBlockStats GumBlockStats;
+typedef gboolean (* GumFoundBlockStatsFunc) (const GumBlockStats * stats,
+    gpointer user_data);
+typedef struct _GumCallCount GumCallCount;
+typedef void (* GumFoundCallCountFunc) (const GumCallCount * count,
+    gpointer user_data);
+typedef struct _GumStalkerIterator GumStalkerIterator;
+typedef struct _GumStalkerInstruction GumStalkerInstruction;
+typedef union _GumStalkerWriter GumStalkerWriter;
+typedef void (* GumStalkerTransformerCallback) (GumStalkerIterator * iterator,
+    GumStalkerWriter * output, gpointer user_data);
+
+enum _GumCallProbeFlags
+{
+  GUM_CALL_PROBE_DEFAULT   = 0,
+  GUM_CALL_PROBE_NEEDS_FPU = 1 << 0  /* callback touches FPU/vector state */
+};
 
 struct _GumStalker
 {
@@ -61,6 +83,25 @@ struct _GumStalkerClass
   GObjectClass parent_class;
 };
 
+struct _GumCallCount
+{
+  gpointer target;
+  guint64 count;
+};
+
+struct _GumStalkerInstruction
+{
+  gpointer begin;
+  gpointer end;
+  const struct ud * ud; /* x86 only */
+};
+
+union _GumStalkerWriter
+{
+  gpointer instance;
+  struct _GumX86Writer * x86;
+};
+
 struct _GumCallSite
 {
   gpointer block_address;
@@ -68,6 +109,53 @@ struct _GumCallSite
   GumCpuContext * cpu_context;
 };
 
+struct _GumIndirectBranchStats
+{
+  GumThreadId thread_id;
+  gpointer address;
+  guint hits;
+  guint misses;
+};
+
+struct _GumStalkerStats
+{
+  GumThreadId thread_id;
+
+  guint64 blocks_compiled;
+  guint64 blocks_recompiled;
+  guint64 traces_compiled;
+  guint64 bytes_emitted;
+  guint64 backpatches;
+  guint64 invalidations;
+  guint64 evictions;
+
+  /* trips out of generated code, of which the kinds below are a subset */
+  guint64 slow_paths;
+  guint64 call_slow_paths;
+  guint64 jmp_slow_paths;
+  guint64 ret_slow_paths;
+  guint64 inline_cache_misses;
+
+  /* time stamp counter ticks since followed, and spent obtaining blocks */
+  guint64 total_cycles;
+  guint64 obtain_cycles;
+
+  guint64 code_slab_size;
+  guint64 code_slab_used;
+  guint mapping_count;
+  guint mapping_capacity;
+};
+
+struct _GumBlockStats
+{
+  GumThreadId thread_id;
+  gpointer address;
+  guint size;
+  guint code_size;
+  guint lookups;
+  guint recompilations;
+};
+
 GUM_API GType gum_stalker_get_type (void) G_GNUC_CONST;
 
 GUM_API GumStalker * gum_stalker_new (void);
@@ -78,6 +166,63 @@ GUM_API void gum_stalker_exclude (GumStalker * self,
 GUM_API gint gum_stalker_get_trust_threshold (GumStalker * self);
 GUM_API void gum_stalker_set_trust_threshold (GumStalker * self,
     gint trust_threshold);
+/*
+ * Number of times a block runs before it is translated again together with
+ * the blocks it most often falls through to, or -1 to never do so. Traces
+ * are not formed while block events are being collected.
+ */
+GUM_API gint gum_stalker_get_hot_trace_threshold (GumStalker * self);
+GUM_API void gum_stalker_set_hot_trace_threshold (GumStalker * self,
+    gint hot_trace_threshold);
+/*
+ * Soft limit on the memory used for translated code by all threads. A thread
+ * that runs into it throws away its own translations and starts over, but is
+ * still given a slab to continue in when other threads hold the rest of the
+ * budget. The shared cache is never thrown away and keeps growing past it.
+ */
+GUM_API gsize gum_stalker_get_code_budget (GumStalker * self);
+GUM_API void gum_stalker_set_code_budget (GumStalker * self,
+    gsize code_budget);
+GUM_API gboolean gum_stalker_get_shared_cache (GumStalker * self);
+GUM_API void gum_stalker_set_shared_cache (GumStalker * self,
+    gboolean enabled);
+/*
+ * Write-protects the writable source pages that blocks get compiled from
+ * instead of keeping snapshots of them, and throws away blocks once their
+ * pages get written to, reprotected or unmapped. Pages that weren't writable
+ * to begin with keep their snapshots. The kernel doesn't fault on our
+ * behalf, so a system call like read() into a protected page fails with
+ * EFAULT instead. Hooks munmap() and mprotect(), or VirtualFree(),
+ * UnmapViewOfFile() and VirtualProtect().
+ */
+GUM_API gboolean gum_stalker_get_write_tracking (GumStalker * self);
+GUM_API void gum_stalker_set_write_tracking (GumStalker * self,
+    gboolean enabled);
+/*
+ * Stops saving FPU and vector state around call probes, except for when a
+ * probe added with GUM_CALL_PROBE_NEEDS_FPU is about to be called. Only
+ * affects threads followed afterwards.
+ */
+GUM_API gboolean gum_stalker_get_lazy_fp_save (GumStalker * self);
+GUM_API void gum_stalker_set_lazy_fp_save (GumStalker * self,
+    gboolean enabled);
+
+/*
+ * Hands each block about to be compiled to the callback, which walks its
+ * instructions with gum_stalker_iterator_next() and decides for each one
+ * whether to gum_stalker_iterator_keep() it. Anything written to the output
+ * in between runs inline, with the thread's own registers and stack, so it
+ * has to preserve whatever it touches, including the flags and the red
+ * zone. Dropping a branch makes execution carry on past it. Only affects
+ * blocks compiled afterwards.
+ */
+GUM_API void gum_stalker_set_transformer (GumStalker * self,
+    GumStalkerTransformerCallback callback, gpointer data,
+    GDestroyNotify notify);
+
+GUM_API gboolean gum_stalker_iterator_next (GumStalkerIterator * self,
+    const GumStalkerInstruction ** insn);
+GUM_API void gum_stalker_iterator_keep (GumStalkerIterator * self);
 
 GUM_API void gum_stalker_stop (GumStalker * self);
 GUM_API gboolean gum_stalker_garbage_collect (GumStalker * self);
@@ -88,14 +233,38 @@ GUM_API gboolean gum_stalker_is_following_me (GumStalker * self);
 
 GUM_API void gum_stalker_follow (GumStalker * self, GumThreadId thread_id,
     GumEventSink * sink);
+GUM_API void gum_stalker_follow_threads (GumStalker * self,
+    const GumThreadId * thread_ids, guint n_thread_ids, GumEventSink * sink);
+GUM_API void gum_stalker_follow_all (GumStalker * self, GumEventSink * sink);
 GUM_API void gum_stalker_unfollow (GumStalker * self, GumThreadId thread_id);
 
 GUM_API GumProbeId gum_stalker_add_call_probe (GumStalker * self,
     gpointer target_address, GumCallProbeCallback callback, gpointer data,
     GDestroyNotify notify);
+GUM_API GumProbeId gum_stalker_add_call_probe_full (GumStalker * self,
+    gpointer target_address, GumCallProbeCallback callback, gpointer data,
+    GDestroyNotify notify, GumCallProbeFlags flags);
 GUM_API void gum_stalker_remove_call_probe (GumStalker * self,
     GumProbeId id);
 
+GUM_API void gum_stalker_enumerate_indirect_branches (GumStalker * self,
+    GumFoundIndirectBranchFunc func, gpointer user_data);
+
+GUM_API void gum_stalker_get_stats (GumStalker * self,
+    GumStalkerStats * stats);
+GUM_API gboolean gum_stalker_get_thread_stats (GumStalker * self,
+    GumThreadId thread_id, GumStalkerStats * stats);
+GUM_API void gum_stalker_enumerate_block_stats (GumStalker * self,
+    GumFoundBlockStatsFunc func, gpointer user_data);
+/*
+ * Reports how many times each target was called since the previous drain,
+ * summed over the threads followed with a sink whose mask includes
+ * GUM_CALL_COUNT. The counting happens in the generated code, so no call
+ * events are produced for it.
+ */
+GUM_API void gum_stalker_drain_call_counts (GumStalker * self,
+    GumEventSink * sink, GumFoundCallCountFunc func, gpointer user_data);
+
 G_END_DECLS
 
 #endif
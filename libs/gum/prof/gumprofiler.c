@@ -330,6 +330,8 @@ gum_profiler_instrument_functions_matching (GumProfiler * self,
 
   matches = gum_find_functions_matching (match_str);
 
+  gum_interceptor_begin_transaction (self->priv->interceptor);
+
   for (i = 0; i < matches->len; i++)
   {
     gpointer address = g_array_index (matches, gpointer, i);
@@ -348,6 +350,8 @@ gum_profiler_instrument_functions_matching (GumProfiler * self,
       gum_profiler_instrument_function (self, address, sampler);
   }
 
+  gum_interceptor_end_transaction (self->priv->interceptor);
+
   g_array_free (matches, TRUE);
 }
 
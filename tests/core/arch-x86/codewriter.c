@@ -37,6 +37,8 @@ TEST_LIST_BEGIN (codewriter)
   CODEWRITER_TESTENTRY (jmp_r8_ptr)
   CODEWRITER_TESTENTRY (jmp_near_ptr_for_ia32)
   CODEWRITER_TESTENTRY (jmp_near_ptr_for_amd64)
+  CODEWRITER_TESTENTRY (jmp_fs_u32_ptr)
+  CODEWRITER_TESTENTRY (jmp_gs_u32_ptr)
 
   CODEWRITER_TESTENTRY (add_eax_ecx)
   CODEWRITER_TESTENTRY (add_rax_rcx)
@@ -73,6 +75,9 @@ TEST_LIST_BEGIN (codewriter)
   CODEWRITER_TESTENTRY (test_eax_ecx)
   CODEWRITER_TESTENTRY (test_rax_rcx)
   CODEWRITER_TESTENTRY (test_rax_r9)
+  CODEWRITER_TESTENTRY (cmp_eax_ecx)
+  CODEWRITER_TESTENTRY (cmp_rax_rcx)
+  CODEWRITER_TESTENTRY (cmp_rax_r9)
   CODEWRITER_TESTENTRY (cmp_eax_i32)
   CODEWRITER_TESTENTRY (cmp_r9_i32)
 TEST_LIST_END ()
@@ -328,6 +333,22 @@ CODEWRITER_TESTCASE (jmp_near_ptr_for_amd64)
   assert_output_equals (expected_code);
 }
 
+CODEWRITER_TESTCASE (jmp_fs_u32_ptr)
+{
+  const guint8 expected_code[] = { 0x64, 0xff, 0x24, 0x25,
+      0x78, 0x56, 0x34, 0x12 };
+  gum_x86_writer_put_jmp_fs_u32_ptr (&fixture->cw, 0x12345678);
+  assert_output_equals (expected_code);
+}
+
+CODEWRITER_TESTCASE (jmp_gs_u32_ptr)
+{
+  const guint8 expected_code[] = { 0x65, 0xff, 0x24, 0x25,
+      0x78, 0x56, 0x34, 0x12 };
+  gum_x86_writer_put_jmp_gs_u32_ptr (&fixture->cw, 0x12345678);
+  assert_output_equals (expected_code);
+}
+
 CODEWRITER_TESTCASE (add_eax_ecx)
 {
   const guint8 expected_code[] = { 0x01, 0xc8 };
@@ -663,6 +684,27 @@ CODEWRITER_TESTCASE (test_rax_r9)
   assert_output_equals (expected_code);
 }
 
+CODEWRITER_TESTCASE (cmp_eax_ecx)
+{
+  const guint8 expected_code[] = { 0x39, 0xc8 };
+  gum_x86_writer_put_cmp_reg_reg (&fixture->cw, GUM_REG_EAX, GUM_REG_ECX);
+  assert_output_equals (expected_code);
+}
+
+CODEWRITER_TESTCASE (cmp_rax_rcx)
+{
+  const guint8 expected_code[] = { 0x48, 0x39, 0xc8 };
+  gum_x86_writer_put_cmp_reg_reg (&fixture->cw, GUM_REG_RAX, GUM_REG_RCX);
+  assert_output_equals (expected_code);
+}
+
+CODEWRITER_TESTCASE (cmp_rax_r9)
+{
+  const guint8 expected_code[] = { 0x4c, 0x39, 0xc8 };
+  gum_x86_writer_put_cmp_reg_reg (&fixture->cw, GUM_REG_RAX, GUM_REG_R9);
+  assert_output_equals (expected_code);
+}
+
 CODEWRITER_TESTCASE (cmp_eax_i32)
 {
   const guint8 expected_code[] = { 0x3d, 0xff, 0xff, 0xff, 0xff };
@@ -25,6 +25,7 @@
 #include "gummemory.h"
 #include "testutil.h"
 
+#include <setjmp.h>
 #include <stdlib.h>
 #include <string.h>
 #ifdef G_OS_WIN32
@@ -217,8 +218,37 @@ enum _StalkerVictimState
   STALKER_VICTIM_IS_SHUTDOWN
 };
 
+typedef struct _StalkerSpinnerContext StalkerSpinnerContext;
+
+struct _StalkerSpinnerContext
+{
+  TestStalkerFixture * fixture;
+  volatile GumThreadId thread_id;
+  volatile guint laps;
+  volatile gboolean stop;
+  gboolean followed_after_stop;
+};
+
+typedef struct _StalkerBatchContext StalkerBatchContext;
+
+struct _StalkerBatchContext
+{
+  TestStalkerFixture * fixture;
+  volatile GumThreadId thread_id;
+  volatile gboolean followed;
+  volatile gboolean stop;
+};
+
 static void pretend_workload (void);
+static StalkerTestFunc generate_block_chain (TestStalkerFixture * fixture,
+    guint n_blocks, guint iterations);
 static gpointer stalker_victim (gpointer data);
+static gpointer stalker_spinner (gpointer data);
+static gpointer stalker_batch_spinner (gpointer data);
+static gpointer shared_cache_worker (gpointer data);
+static guint collect_block_events (TestStalkerFixture * fixture,
+    GumEventType type, gsize code_size, const GumBlockEvent ** events,
+    guint max_events);
 static void invoke_follow_return_code (TestStalkerFixture * fixture);
 static void invoke_unfollow_deep_code (TestStalkerFixture * fixture);
 
@@ -25,8 +25,20 @@ TEST_LIST_BEGIN (stalker)
   STALKER_TESTENTRY (call)
   STALKER_TESTENTRY (ret)
   STALKER_TESTENTRY (exec)
+  STALKER_TESTENTRY (exec_batched)
+  STALKER_TESTENTRY (exec_batched_flushes_when_full)
+  STALKER_TESTENTRY (exec_batched_flushes_periodically)
+  STALKER_TESTENTRY (exec_batched_preserves_live_state)
+  STALKER_TESTENTRY (exec_compact)
+  STALKER_TESTENTRY (block)
+  STALKER_TESTENTRY (block_exec)
   STALKER_TESTENTRY (call_depth)
   STALKER_TESTENTRY (call_probe)
+  STALKER_TESTENTRY (call_probe_unlinks_chained_blocks)
+  STALKER_TESTENTRY (eager_chaining)
+  STALKER_TESTENTRY (call_probe_while_updating)
+  STALKER_TESTENTRY (call_probe_needing_fpu_when_lazy)
+  STALKER_TESTENTRY (transformer_replaces_instruction)
 
   STALKER_TESTENTRY (unconditional_jumps)
   STALKER_TESTENTRY (short_conditional_jump_true)
@@ -35,6 +47,9 @@ TEST_LIST_BEGIN (stalker)
   STALKER_TESTENTRY (follow_return)
   STALKER_TESTENTRY (follow_stdcall)
   STALKER_TESTENTRY (unfollow_deep)
+#ifndef G_OS_WIN32
+  STALKER_TESTENTRY (ret_after_longjmp)
+#endif
   STALKER_TESTENTRY (call_followed_by_junk)
   STALKER_TESTENTRY (indirect_call_with_immediate)
   STALKER_TESTENTRY (indirect_call_with_register_and_no_immediate)
@@ -46,6 +61,8 @@ TEST_LIST_BEGIN (stalker)
   STALKER_TESTENTRY (indirect_call_with_esp_and_dword_immediate)
   STALKER_TESTENTRY (indirect_jump_with_immediate)
   STALKER_TESTENTRY (indirect_jump_with_immediate_and_scaled_register)
+  STALKER_TESTENTRY (indirect_call_inline_cache)
+  STALKER_TESTENTRY (excluded_indirect_call)
   STALKER_TESTENTRY (direct_call_with_register)
   STALKER_TESTENTRY (popcnt)
 #if GLIB_SIZEOF_VOID_P == 4
@@ -57,7 +74,22 @@ TEST_LIST_BEGIN (stalker)
   STALKER_TESTENTRY (heap_api)
   STALKER_TESTENTRY (follow_syscall)
   STALKER_TESTENTRY (follow_thread)
+  STALKER_TESTENTRY (unfollow_spinning_thread)
+  STALKER_TESTENTRY (follow_threads)
   STALKER_TESTENTRY (performance)
+  STALKER_TESTENTRY (exec_event_performance)
+  STALKER_TESTENTRY (block_lookup_performance)
+  STALKER_TESTENTRY (block_lookup_table_grows)
+  STALKER_TESTENTRY (hot_trace_performance)
+  STALKER_TESTENTRY (code_budget_eviction)
+  STALKER_TESTENTRY (stats)
+  STALKER_TESTENTRY (call_counts)
+  STALKER_TESTENTRY (compact_event_encoding)
+  STALKER_TESTENTRY (compact_event_encoding_performance)
+  STALKER_TESTENTRY (shared_cache)
+  STALKER_TESTENTRY (write_tracking)
+  STALKER_TESTENTRY (write_tracking_forgets_unmapped_pages)
+  STALKER_TESTENTRY (write_tracking_notices_reprotected_pages)
 
 #ifdef G_OS_WIN32
 # if GLIB_SIZEOF_VOID_P == 4
@@ -217,6 +249,127 @@ stalker_victim (gpointer data)
   return NULL;
 }
 
+STALKER_TESTCASE (unfollow_spinning_thread)
+{
+  StalkerSpinnerContext ctx;
+  GThread * thread;
+  guint i;
+  gboolean pending_garbage = TRUE;
+
+  /* every lap goes straight through backpatched code */
+  gum_stalker_set_trust_threshold (fixture->stalker, 0);
+
+  ctx.fixture = fixture;
+  ctx.thread_id = 0;
+  ctx.laps = 0;
+  ctx.stop = FALSE;
+  ctx.followed_after_stop = TRUE;
+
+  thread = g_thread_create (stalker_spinner, &ctx, TRUE, NULL);
+
+  while (ctx.laps < 1000)
+    g_usleep (1000);
+
+  gum_stalker_unfollow (fixture->stalker, ctx.thread_id);
+
+  for (i = 0; i != 1000 && pending_garbage; i++)
+  {
+    g_usleep (1000);
+    pending_garbage = gum_stalker_garbage_collect (fixture->stalker);
+  }
+
+  ctx.stop = TRUE;
+  g_thread_join (thread);
+
+  g_assert (!pending_garbage);
+  g_assert (!ctx.followed_after_stop);
+}
+
+static gpointer
+stalker_spinner (gpointer data)
+{
+  StalkerSpinnerContext * ctx = (StalkerSpinnerContext *) data;
+  GumStalker * stalker = ctx->fixture->stalker;
+
+  ctx->thread_id = gum_process_get_current_thread_id ();
+
+  gum_stalker_follow_me (stalker, GUM_EVENT_SINK (ctx->fixture->sink));
+  while (!ctx->stop)
+    ctx->laps++;
+  ctx->followed_after_stop = gum_stalker_is_following_me (stalker);
+
+  return NULL;
+}
+
+STALKER_TESTCASE (follow_threads)
+{
+  StalkerBatchContext ctx[4];
+  GThread * threads[G_N_ELEMENTS (ctx)];
+  GumThreadId thread_ids[G_N_ELEMENTS (ctx)];
+  guint i, n_followed, attempt;
+
+  for (i = 0; i != G_N_ELEMENTS (ctx); i++)
+  {
+    ctx[i].fixture = fixture;
+    ctx[i].thread_id = 0;
+    ctx[i].followed = FALSE;
+    ctx[i].stop = FALSE;
+    threads[i] = g_thread_create (stalker_batch_spinner, &ctx[i], TRUE, NULL);
+  }
+
+  for (i = 0; i != G_N_ELEMENTS (ctx); i++)
+  {
+    while (ctx[i].thread_id == 0)
+      g_usleep (1000);
+    thread_ids[i] = ctx[i].thread_id;
+  }
+
+  gum_stalker_follow_threads (fixture->stalker, thread_ids,
+      G_N_ELEMENTS (thread_ids), GUM_EVENT_SINK (fixture->sink));
+
+  n_followed = 0;
+  for (attempt = 0; attempt != 1000 && n_followed != G_N_ELEMENTS (ctx);
+      attempt++)
+  {
+    g_usleep (1000);
+
+    n_followed = 0;
+    for (i = 0; i != G_N_ELEMENTS (ctx); i++)
+    {
+      if (ctx[i].followed)
+        n_followed++;
+    }
+  }
+
+  for (i = 0; i != G_N_ELEMENTS (ctx); i++)
+    gum_stalker_unfollow (fixture->stalker, thread_ids[i]);
+
+  for (i = 0; i != G_N_ELEMENTS (ctx); i++)
+  {
+    ctx[i].stop = TRUE;
+    g_thread_join (threads[i]);
+  }
+
+  g_assert_cmpuint (n_followed, ==, G_N_ELEMENTS (ctx));
+}
+
+static gpointer
+stalker_batch_spinner (gpointer data)
+{
+  StalkerBatchContext * ctx = (StalkerBatchContext *) data;
+  GumStalker * stalker = ctx->fixture->stalker;
+
+  ctx->thread_id = gum_process_get_current_thread_id ();
+
+  while (!ctx->stop)
+  {
+    if (!ctx->followed)
+      ctx->followed = gum_stalker_is_following_me (stalker);
+  }
+
+  return NULL;
+}
+
 STALKER_TESTCASE (performance)
 {
   GTimer * timer;
@@ -252,6 +405,614 @@ STALKER_TESTCASE (performance)
       duration_direct, duration_stalked, duration_stalked / duration_direct);
 }
 
+STALKER_TESTCASE (exec_event_performance)
+{
+  GTimer * timer;
+  gdouble duration;
+  guint n;
+
+  g_object_unref (fixture->sink);
+  fixture->sink = GUM_FAKE_EVENT_SINK (gum_fake_batch_event_sink_new ());
+  fixture->sink->mask = GUM_EXEC;
+
+  gum_stalker_set_trust_threshold (fixture->stalker, 0);
+  gum_stalker_follow_me (fixture->stalker, GUM_EVENT_SINK (fixture->sink));
+
+  /* warm-up */
+  pretend_workload ();
+  gum_fake_event_sink_reset (fixture->sink);
+
+  timer = g_timer_new ();
+  pretend_workload ();
+  duration = g_timer_elapsed (timer, NULL);
+  g_timer_destroy (timer);
+
+  gum_stalker_unfollow_me (fixture->stalker);
+
+  n = fixture->sink->events->len;
+  g_assert_cmpuint (n, >, 0);
+
+  g_print ("<n=%u per_event=%.1fns> ", n, (duration / n) * 1e9);
+}
+
+STALKER_TESTCASE (block_lookup_performance)
+{
+  const guint block_counts[] = { 1024, 4096, 16384 };
+  const guint repeats = 10;
+  GTimer * timer;
+  guint i;
+
+  fixture->sink->mask = GUM_NOTHING;
+
+  /* never backpatch, so that every transfer goes through a lookup */
+  gum_stalker_set_trust_threshold (fixture->stalker, G_MAXINT);
+
+  timer = g_timer_new ();
+
+  for (i = 0; i != G_N_ELEMENTS (block_counts); i++)
+  {
+    guint n = block_counts[i];
+    StalkerTestFunc func;
+    gdouble duration_insert, duration_total;
+
+    func = generate_block_chain (fixture, n, 1);
+    g_timer_reset (timer);
+    test_stalker_fixture_follow_and_invoke (fixture, func, 0);
+    duration_insert = g_timer_elapsed (timer, NULL);
+
+    func = generate_block_chain (fixture, n, 1 + repeats);
+    g_timer_reset (timer);
+    test_stalker_fixture_follow_and_invoke (fixture, func, 0);
+    duration_total = g_timer_elapsed (timer, NULL);
+
+    g_print ("<n=%u insert=%.0fns lookup=%.0fns> ", n,
+        (duration_insert / n) * 1e9,
+        ((duration_total - duration_insert) / (n * repeats)) * 1e9);
+  }
+
+  g_timer_destroy (timer);
+}
+
+STALKER_TESTCASE (block_lookup_table_grows)
+{
+  const guint n = 65536;
+  StalkerTestFunc func;
+  GumStalkerStats stats;
+  gboolean found;
+
+  fixture->sink->mask = GUM_NOTHING;
+
+  func = generate_block_chain (fixture, n, 1);
+
+  gum_stalker_follow_me (fixture->stalker, GUM_EVENT_SINK (fixture->sink));
+  func (0);
+  found = gum_stalker_get_thread_stats (fixture->stalker,
+      gum_process_get_current_thread_id (), &stats);
+  gum_stalker_unfollow_me (fixture->stalker);
+
+  g_assert (found);
+  g_assert_cmpuint (stats.blocks_compiled, >=, n);
+  g_assert_cmpuint (stats.mapping_count, >=, n);
+  g_assert_cmpuint (stats.mapping_capacity, >, stats.mapping_count);
+}
+
+static gdouble time_hot_trace_loop (TestStalkerFixture * fixture,
+    StalkerTestFunc func, gint hot_trace_threshold, gint * ret,
+    GumStalkerStats * stats);
+
+STALKER_TESTCASE (hot_trace_performance)
+{
+  const guint8 code[] = {
+    0xb9, 0x40, 0x42, 0x0f, 0x00,       /* mov ecx, 1000000  */
+    0x31, 0xc0,                         /* xor eax, eax      */
+    0xf7, 0xc1, 0xff, 0x00, 0x00, 0x00, /* test ecx, 0xff    */
+    0x74, 0x02,                         /* jz +2             */
+    0xff, 0xc0,                         /* inc eax           */
+    0xf7, 0xc1, 0xff, 0x01, 0x00, 0x00, /* test ecx, 0x1ff   */
+    0x74, 0x02,                         /* jz +2             */
+    0xff, 0xc0,                         /* inc eax           */
+    0xf7, 0xc1, 0xff, 0x03, 0x00, 0x00, /* test ecx, 0x3ff   */
+    0x74, 0x02,                         /* jz +2             */
+    0xff, 0xc0,                         /* inc eax           */
+    0xff, 0xc9,                         /* dec ecx           */
+    0x75, 0xde,                         /* jnz -34           */
+    0xc3                                /* ret               */
+  };
+  StalkerTestFunc func;
+  gint ret_blocks, ret_traces;
+  GumStalkerStats stats_blocks, stats_traces;
+  gdouble duration_blocks, duration_traces;
+
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+      test_stalker_fixture_dup_code (fixture, code, sizeof (code)));
+
+  fixture->sink->mask = GUM_NOTHING;
+
+  gum_stalker_set_trust_threshold (fixture->stalker, 0);
+  g_assert_cmpint (gum_stalker_get_hot_trace_threshold (fixture->stalker),
+      ==, -1);
+
+  duration_blocks =
+      time_hot_trace_loop (fixture, func, -1, &ret_blocks, &stats_blocks);
+  duration_traces =
+      time_hot_trace_loop (fixture, func, 64, &ret_traces, &stats_traces);
+
+  g_assert_cmpint (ret_blocks, ==, 3 * 1000000 - 3906 - 1953 - 976);
+  g_assert_cmpint (ret_traces, ==, ret_blocks);
+  g_assert_cmpuint (stats_blocks.traces_compiled, ==, 0);
+  g_assert_cmpuint (stats_traces.traces_compiled, >=, 1);
+
+  g_print ("<duration_blocks=%f duration_traces=%f ratio=%f> ",
+      duration_blocks, duration_traces, duration_traces / duration_blocks);
+}
+
+static gdouble
+time_hot_trace_loop (TestStalkerFixture * fixture,
+                     StalkerTestFunc func,
+                     gint hot_trace_threshold,
+                     gint * ret,
+                     GumStalkerStats * stats)
+{
+  GTimer * timer;
+  gdouble duration;
+
+  gum_stalker_set_hot_trace_threshold (fixture->stalker, hot_trace_threshold);
+  gum_stalker_follow_me (fixture->stalker, GUM_EVENT_SINK (fixture->sink));
+
+  timer = g_timer_new ();
+  *ret = func (0);
+  duration = g_timer_elapsed (timer, NULL);
+  g_timer_destroy (timer);
+
+  gum_stalker_get_thread_stats (fixture->stalker,
+      gum_process_get_current_thread_id (), stats);
+  gum_stalker_unfollow_me (fixture->stalker);
+
+  return duration;
+}
+
+STALKER_TESTCASE (compact_event_encoding)
+{
+  GArray * events;
+  guint8 * encoded;
+  gsize size;
+  GumEventEncoder encoder;
+  GumEventDecoder decoder;
+  GumFakeEventSink * decoded;
+  guint i;
+
+  fixture->sink->mask = (GumEventType) (GUM_CALL | GUM_RET | GUM_EXEC);
+  gum_stalker_follow_me (fixture->stalker, GUM_EVENT_SINK (fixture->sink));
+  pretend_workload ();
+  gum_stalker_unfollow_me (fixture->stalker);
+
+  events = fixture->sink->events;
+  g_assert_cmpuint (events->len, >, 0);
+
+  encoded = (guint8 *) g_malloc (events->len * GUM_EVENT_ENCODED_MAX_SIZE);
+  gum_event_encoder_init (&encoder);
+  size = gum_event_encoder_encode (&encoder, (GumEvent *) events->data,
+      events->len, encoded);
+  g_assert_cmpuint (size, <, events->len * sizeof (GumEvent));
+
+  decoded = GUM_FAKE_EVENT_SINK (gum_fake_event_sink_new ());
+  gum_event_decoder_init (&decoder);
+  gum_event_sink_process_encoded (GUM_EVENT_SINK (decoded), &decoder,
+      encoded, size);
+
+  g_assert_cmpuint (decoded->events->len, ==, events->len);
+  for (i = 0; i != events->len; i++)
+  {
+    GumEvent * expected = &g_array_index (events, GumEvent, i);
+    GumEvent * actual = &g_array_index (decoded->events, GumEvent, i);
+
+    g_assert_cmpint (actual->type, ==, expected->type);
+    if (expected->type == GUM_EXEC)
+    {
+      GUM_ASSERT_CMPADDR (actual->exec.location, ==,
+          expected->exec.location);
+    }
+    else
+    {
+      GUM_ASSERT_CMPADDR (actual->call.location, ==,
+          expected->call.location);
+      GUM_ASSERT_CMPADDR (actual->call.target, ==, expected->call.target);
+      g_assert_cmpint (actual->call.depth, ==, expected->call.depth);
+    }
+  }
+
+  g_object_unref (decoded);
+  g_free (encoded);
+}
+
+STALKER_TESTCASE (compact_event_encoding_performance)
+{
+  GArray * events;
+  guint8 * encoded;
+  gsize size;
+  GumEventEncoder encoder;
+  GumEventDecoder decoder;
+  GumEvent * decoded;
+  GTimer * timer;
+  gdouble duration_encode, duration_decode;
+
+  fixture->sink->mask = GUM_EXEC;
+  gum_stalker_follow_me (fixture->stalker, GUM_EVENT_SINK (fixture->sink));
+  pretend_workload ();
+  gum_stalker_unfollow_me (fixture->stalker);
+
+  /* one exec event per executed instruction */
+  events = fixture->sink->events;
+  encoded = (guint8 *) g_malloc (events->len * GUM_EVENT_ENCODED_MAX_SIZE);
+  decoded = g_new (GumEvent, events->len);
+
+  timer = g_timer_new ();
+
+  gum_event_encoder_init (&encoder);
+  g_timer_reset (timer);
+  size = gum_event_encoder_encode (&encoder, (GumEvent *) events->data,
+      events->len, encoded);
+  duration_encode = g_timer_elapsed (timer, NULL);
+
+  gum_event_decoder_init (&decoder);
+  g_timer_reset (timer);
+  gum_event_decoder_decode (&decoder, encoded, size, decoded, events->len,
+      NULL);
+  duration_decode = g_timer_elapsed (timer, NULL);
+
+  g_timer_destroy (timer);
+
+  g_print ("<n=%u raw=%u compact=%.2f bytes/insn encode=%.1fns "
+      "decode=%.1fns> ", events->len, (guint) sizeof (GumEvent),
+      (gdouble) size / events->len, (duration_encode / events->len) * 1e9,
+      (duration_decode / events->len) * 1e9);
+
+  g_free (decoded);
+  g_free (encoded);
+}
+
+STALKER_TESTCASE (shared_cache)
+{
+  GThread * threads[4];
+  GumStalkerStats first, before, after;
+  guint i;
+
+  fixture->sink->mask = GUM_NOTHING;
+  gum_stalker_set_shared_cache (fixture->stalker, TRUE);
+#if defined (HAVE_LINUX) && !defined (HAVE_ANDROID) && defined (__GNUC__)
+  g_assert (gum_stalker_get_shared_cache (fixture->stalker));
+#endif
+
+  /* once a thread is unfollowed, only the shared code is left in the stats */
+  shared_cache_worker (fixture);
+  gum_stalker_get_stats (fixture->stalker, &first);
+
+  for (i = 0; i != G_N_ELEMENTS (threads); i++)
+    threads[i] = g_thread_create (shared_cache_worker, fixture, TRUE, NULL);
+  for (i = 0; i != G_N_ELEMENTS (threads); i++)
+    g_thread_join (threads[i]);
+
+  /* blocks compiled so far get reused by this thread */
+  gum_stalker_get_stats (fixture->stalker, &before);
+  shared_cache_worker (fixture);
+  gum_stalker_get_stats (fixture->stalker, &after);
+
+  g_assert_cmpuint (fixture->sink->events->len, ==, 0);
+#if defined (HAVE_LINUX) && !defined (HAVE_ANDROID) && defined (__GNUC__)
+  g_assert_cmpuint (first.blocks_compiled, >, 0);
+  g_assert_cmpuint (after.blocks_compiled - before.blocks_compiled, <,
+      first.blocks_compiled / 2);
+#endif
+}
+
+static gpointer
+shared_cache_worker (gpointer data)
+{
+  TestStalkerFixture * fixture = (TestStalkerFixture *) data;
+
+  gum_stalker_follow_me (fixture->stalker, GUM_EVENT_SINK (fixture->sink));
+  pretend_workload ();
+  gum_stalker_unfollow_me (fixture->stalker);
+
+  return NULL;
+}
+
+STALKER_TESTCASE (code_budget_eviction)
+{
+  const gsize budget = 256 * 1024;
+  StalkerTestFunc func;
+  GumStalkerStats stats;
+
+  fixture->sink->mask = GUM_NOTHING;
+
+  g_assert_cmpuint (gum_stalker_get_code_budget (fixture->stalker), >,
+      budget);
+  gum_stalker_set_code_budget (fixture->stalker, budget);
+  g_assert_cmpuint (gum_stalker_get_code_budget (fixture->stalker), ==,
+      budget);
+
+  /* translating the whole chain takes several times the budget */
+  gum_stalker_set_trust_threshold (fixture->stalker, 0);
+  func = generate_block_chain (fixture, 8192, 3);
+  gum_stalker_follow_me (fixture->stalker, GUM_EVENT_SINK (fixture->sink));
+  func (0);
+  gum_stalker_get_thread_stats (fixture->stalker,
+      gum_process_get_current_thread_id (), &stats);
+  gum_stalker_unfollow_me (fixture->stalker);
+  g_assert_cmpuint (stats.evictions, >, 0);
+  g_assert_cmpuint (stats.code_slab_size, <=, budget);
+
+  gum_stalker_set_trust_threshold (fixture->stalker, -1);
+  func = generate_block_chain (fixture, 8192, 2);
+  gum_stalker_follow_me (fixture->stalker, GUM_EVENT_SINK (fixture->sink));
+  func (0);
+  gum_stalker_get_thread_stats (fixture->stalker,
+      gum_process_get_current_thread_id (), &stats);
+  gum_stalker_unfollow_me (fixture->stalker);
+  g_assert_cmpuint (stats.evictions, >, 0);
+  g_assert_cmpuint (stats.code_slab_size, <=, budget);
+
+  g_assert_cmpuint (fixture->sink->events->len, ==, 0);
+}
+
+STALKER_TESTCASE (write_tracking)
+{
+  const guint8 code[] = {
+    0xb8, 0x01, 0x00, 0x00, 0x00, /* mov eax, 1 */
+    0xc3                          /* ret        */
+  };
+  StalkerTestFunc func;
+  gint first, second;
+  GumStalkerStats stats;
+
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+      test_stalker_fixture_dup_code (fixture, code, sizeof (code)));
+
+  fixture->sink->mask = GUM_NOTHING;
+
+  gum_stalker_set_trust_threshold (fixture->stalker, 2);
+  g_assert (!gum_stalker_get_write_tracking (fixture->stalker));
+  gum_stalker_set_write_tracking (fixture->stalker, TRUE);
+  g_assert (gum_stalker_get_write_tracking (fixture->stalker));
+
+  gum_stalker_follow_me (fixture->stalker, GUM_EVENT_SINK (fixture->sink));
+  first = func (0);
+  fixture->code[1] = 2;
+  second = func (0);
+  gum_stalker_get_thread_stats (fixture->stalker,
+      gum_process_get_current_thread_id (), &stats);
+  gum_stalker_unfollow_me (fixture->stalker);
+
+  g_assert_cmpint (first, ==, 1);
+  g_assert_cmpint (second, ==, 2);
+  /* caught by the fault handler rather than by comparing a snapshot */
+  g_assert_cmpuint (stats.invalidations, ==, 1);
+  g_assert_cmpuint (stats.blocks_recompiled, ==, 0);
+}
+
+STALKER_TESTCASE (write_tracking_forgets_unmapped_pages)
+{
+  guint8 code[] = {
+    0xb8, 0x01, 0x00, 0x00, 0x00, /* mov eax, 1 */
+    0xc3                          /* ret        */
+  };
+  StalkerTestFunc func;
+  gint first, second;
+  GumStalkerStats stats;
+
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+      test_stalker_fixture_dup_code (fixture, code, sizeof (code)));
+
+  fixture->sink->mask = GUM_NOTHING;
+
+  gum_stalker_set_trust_threshold (fixture->stalker, 2);
+  gum_stalker_set_write_tracking (fixture->stalker, TRUE);
+
+  gum_stalker_follow_me (fixture->stalker, GUM_EVENT_SINK (fixture->sink));
+  first = func (0);
+  /* unmaps the old pages, and the new ones may well end up at their address */
+  code[1] = 2;
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+      test_stalker_fixture_dup_code (fixture, code, sizeof (code)));
+  second = func (0);
+  gum_stalker_get_thread_stats (fixture->stalker,
+      gum_process_get_current_thread_id (), &stats);
+  gum_stalker_unfollow_me (fixture->stalker);
+
+  g_assert_cmpint (first, ==, 1);
+  g_assert_cmpint (second, ==, 2);
+  g_assert_cmpuint (stats.invalidations, >=, 1);
+}
+
+STALKER_TESTCASE (write_tracking_notices_reprotected_pages)
+{
+  const guint8 code[] = {
+    0xb8, 0x01, 0x00, 0x00, 0x00, /* mov eax, 1 */
+    0xc3                          /* ret        */
+  };
+  StalkerTestFunc func;
+  gint first, second;
+  GumStalkerStats stats;
+
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+      test_stalker_fixture_dup_code (fixture, code, sizeof (code)));
+
+  fixture->sink->mask = GUM_NOTHING;
+
+  gum_stalker_set_trust_threshold (fixture->stalker, 2);
+  gum_stalker_set_write_tracking (fixture->stalker, TRUE);
+
+  gum_stalker_follow_me (fixture->stalker, GUM_EVENT_SINK (fixture->sink));
+  first = func (0);
+  /* writable again without faulting, like a JIT would patch its code */
+  gum_mprotect (fixture->code, gum_query_page_size (), GUM_PAGE_RWX);
+  fixture->code[1] = 2;
+  second = func (0);
+  gum_stalker_get_thread_stats (fixture->stalker,
+      gum_process_get_current_thread_id (), &stats);
+  gum_stalker_unfollow_me (fixture->stalker);
+
+  g_assert_cmpint (first, ==, 1);
+  g_assert_cmpint (second, ==, 2);
+  g_assert_cmpuint (stats.invalidations, ==, 1);
+  g_assert_cmpuint (stats.blocks_recompiled, ==, 0);
+}
+
+static void store_call_count (const GumCallCount * count,
+    gpointer user_data);
+
+STALKER_TESTCASE (call_counts)
+{
+  const guint8 code[] = {
+    0x31, 0xc0,                   /* xor eax, eax */
+    0xe8, 0x06, 0x00, 0x00, 0x00, /* call func    */
+    0xe8, 0x01, 0x00, 0x00, 0x00, /* call func    */
+    0xc3,                         /* ret          */
+
+    /* func: */
+    0xff, 0xc0,                   /* inc eax      */
+    0xc3                          /* ret          */
+  };
+  StalkerTestFunc func;
+  GHashTable * counts;
+  gint ret;
+
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+      test_stalker_fixture_dup_code (fixture, code, sizeof (code)));
+  counts = g_hash_table_new (NULL, NULL);
+
+  fixture->sink->mask = GUM_CALL_COUNT;
+
+  gum_stalker_follow_me (fixture->stalker, GUM_EVENT_SINK (fixture->sink));
+  ret = func (0);
+  gum_stalker_drain_call_counts (fixture->stalker,
+      GUM_EVENT_SINK (fixture->sink), store_call_count, counts);
+  gum_stalker_unfollow_me (fixture->stalker);
+
+  g_assert_cmpint (ret, ==, 2);
+  g_assert_cmpuint (fixture->sink->events->len, ==, 0);
+  g_assert_cmpuint (GPOINTER_TO_SIZE (
+      g_hash_table_lookup (counts, fixture->code + 13)), ==, 2);
+
+  /* counted after the last drain, and drained only once unfollowed */
+  g_hash_table_remove_all (counts);
+  gum_stalker_follow_me (fixture->stalker, GUM_EVENT_SINK (fixture->sink));
+  func (0);
+  func (0);
+  gum_stalker_unfollow_me (fixture->stalker);
+  g_assert_cmpuint (G_OBJECT (fixture->sink)->ref_count, ==, 1);
+  gum_stalker_drain_call_counts (fixture->stalker,
+      GUM_EVENT_SINK (fixture->sink), store_call_count, counts);
+  g_assert_cmpuint (GPOINTER_TO_SIZE (
+      g_hash_table_lookup (counts, fixture->code + 13)), ==, 4);
+
+  g_hash_table_remove_all (counts);
+  gum_stalker_drain_call_counts (fixture->stalker,
+      GUM_EVENT_SINK (fixture->sink), store_call_count, counts);
+  g_assert_cmpuint (g_hash_table_size (counts), ==, 0);
+
+  g_hash_table_unref (counts);
+}
+
+static void
+store_call_count (const GumCallCount * count,
+                  gpointer user_data)
+{
+  g_hash_table_insert ((GHashTable *) user_data, count->target,
+      GSIZE_TO_POINTER (count->count));
+}
+
+static gboolean count_block_stats (const GumBlockStats * stats,
+    gpointer user_data);
+
+STALKER_TESTCASE (stats)
+{
+  GumThreadId thread_id;
+  GumStalkerStats stats, totals;
+  gboolean found;
+  guint n_blocks = 0;
+
+  thread_id = gum_process_get_current_thread_id ();
+  fixture->sink->mask = GUM_NOTHING;
+
+  g_assert (!gum_stalker_get_thread_stats (fixture->stalker, thread_id,
+      &stats));
+
+  gum_stalker_follow_me (fixture->stalker, GUM_EVENT_SINK (fixture->sink));
+  pretend_workload ();
+  found = gum_stalker_get_thread_stats (fixture->stalker, thread_id, &stats);
+  gum_stalker_get_stats (fixture->stalker, &totals);
+  gum_stalker_enumerate_block_stats (fixture->stalker, count_block_stats,
+      &n_blocks);
+  gum_stalker_unfollow_me (fixture->stalker);
+
+  g_assert (found);
+  g_assert_cmpuint (stats.thread_id, ==, thread_id);
+  g_assert_cmpuint (stats.blocks_compiled, >, 0);
+  g_assert_cmpuint (stats.bytes_emitted, >, 0);
+  g_assert_cmpuint (stats.slow_paths, >=, stats.blocks_compiled);
+  g_assert_cmpuint (stats.obtain_cycles, >, 0);
+  g_assert_cmpuint (stats.obtain_cycles, <=, stats.total_cycles);
+  g_assert_cmpuint (stats.code_slab_used, >, 0);
+  g_assert_cmpuint (stats.code_slab_used, <=, stats.code_slab_size);
+  g_assert_cmpuint (stats.mapping_count, <=, stats.mapping_capacity);
+
+  g_assert_cmpuint (totals.blocks_compiled, >=, stats.blocks_compiled);
+  g_assert_cmpuint (n_blocks, >, 0);
+}
+
+static gboolean
+count_block_stats (const GumBlockStats * stats,
+                   gpointer user_data)
+{
+  guint * count = (guint *) user_data;
+
+  g_assert_cmpuint (stats->code_size, >, 0);
+
+  (*count)++;
+
+  return TRUE;
+}
+
+static StalkerTestFunc
+generate_block_chain (TestStalkerFixture * fixture,
+                      guint n_blocks,
+                      guint iterations)
+{
+  guint8 * code, * p;
+  guint size, i;
+  StalkerTestFunc func;
+
+  size = 5 + (n_blocks * 2) + 2 + 6 + 1;
+  code = (guint8 *) g_malloc (size);
+  p = code;
+
+  *p++ = 0xb9;                               /* mov ecx, iterations */
+  *((guint32 *) p) = iterations;
+  p += 4;
+
+  for (i = 0; i != n_blocks; i++)
+  {
+    *p++ = 0xeb;                             /* jmp short +0        */
+    *p++ = 0x00;
+  }
+
+  *p++ = 0xff;                               /* dec ecx             */
+  *p++ = 0xc9;
+  *p++ = 0x0f;                               /* jnz near loop       */
+  *p++ = 0x85;
+  *((gint32 *) p) = -((gint32) (n_blocks * 2) + 8);
+  p += 4;
+  *p++ = 0xc3;                               /* ret                 */
+
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+      test_stalker_fixture_dup_code (fixture, code, size));
+
+  g_free (code);
+
+  return func;
+}
+
 GUM_NOINLINE static void
 pretend_workload (void)
 {
@@ -312,35 +1073,268 @@ STALKER_TESTCASE (call)
   GUM_ASSERT_CMPADDR (ev->target, ==, func);
 }
 
-STALKER_TESTCASE (ret)
+STALKER_TESTCASE (ret)
+{
+  StalkerTestFunc func;
+  GumRetEvent * ev;
+
+  func = invoke_flat (fixture, GUM_RET);
+
+  g_assert_cmpuint (fixture->sink->events->len, ==, 1);
+  g_assert_cmpint (g_array_index (fixture->sink->events, GumEvent, 0).type,
+      ==, GUM_RET);
+  ev = &g_array_index (fixture->sink->events, GumEvent, 0).ret;
+  GUM_ASSERT_CMPADDR (ev->location,
+      ==, ((guint8 *) GSIZE_TO_POINTER (func)) + 6);
+  GUM_ASSERT_CMPADDR (ev->target, ==, fixture->last_invoke_retaddr);
+}
+
+STALKER_TESTCASE (exec)
+{
+  StalkerTestFunc func;
+  GumRetEvent * ev;
+
+  func = invoke_flat (fixture, GUM_EXEC);
+
+  g_assert_cmpuint (fixture->sink->events->len, ==, INVOKER_INSN_COUNT + 4);
+  g_assert_cmpint (g_array_index (fixture->sink->events, GumEvent,
+      INVOKER_IMPL_OFFSET).type, ==, GUM_EXEC);
+  ev = &g_array_index (fixture->sink->events, GumEvent,
+      INVOKER_IMPL_OFFSET).ret;
+  GUM_ASSERT_CMPADDR (ev->location, ==, func);
+}
+
+STALKER_TESTCASE (exec_batched)
+{
+  StalkerTestFunc func;
+  GumFakeBatchEventSink * sink;
+
+  g_object_unref (fixture->sink);
+  fixture->sink = GUM_FAKE_EVENT_SINK (gum_fake_batch_event_sink_new ());
+  sink = GUM_FAKE_BATCH_EVENT_SINK (fixture->sink);
+
+  func = invoke_flat (fixture, GUM_EXEC);
+
+  g_assert_cmpuint (fixture->sink->events->len, ==, INVOKER_INSN_COUNT + 4);
+  GUM_ASSERT_CMPADDR (NTH_EXEC_EVENT_LOCATION (INVOKER_IMPL_OFFSET), ==,
+      func);
+  g_assert_cmpuint (sink->batch_count, ==, 1);
+}
+
+STALKER_TESTCASE (exec_batched_flushes_when_full)
+{
+  const guint8 code[] =
+  {
+    0xb8, 0xe8, 0x03, 0x00, 0x00, /* mov eax, 1000 */
+    0xff, 0xc8,                   /* dec eax       */
+    0x75, 0xfc,                   /* jnz -4        */
+    0xc3,                         /* ret           */
+  };
+  StalkerTestFunc func;
+  GumFakeBatchEventSink * sink;
+  guint i;
+
+  g_object_unref (fixture->sink);
+  fixture->sink = GUM_FAKE_EVENT_SINK (gum_fake_batch_event_sink_new ());
+  sink = GUM_FAKE_BATCH_EVENT_SINK (fixture->sink);
+
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+      test_stalker_fixture_dup_code (fixture, code, sizeof (code)));
+
+  fixture->sink->mask = GUM_EXEC;
+  test_stalker_fixture_follow_and_invoke (fixture, func, 0);
+
+  g_assert_cmpuint (fixture->sink->events->len, ==,
+      INVOKER_INSN_COUNT + 1 + (2 * 1000) + 1);
+  g_assert_cmpuint (sink->batch_count, >=, 2);
+
+  GUM_ASSERT_CMPADDR (NTH_EXEC_EVENT_LOCATION (INVOKER_IMPL_OFFSET), ==,
+      func);
+  for (i = 0; i != 1000; i++)
+  {
+    guint n = INVOKER_IMPL_OFFSET + 1 + (2 * i);
+
+    GUM_ASSERT_CMPADDR (NTH_EXEC_EVENT_LOCATION (n), ==, fixture->code + 5);
+    GUM_ASSERT_CMPADDR (NTH_EXEC_EVENT_LOCATION (n + 1), ==,
+        fixture->code + 7);
+  }
+}
+
+STALKER_TESTCASE (exec_batched_flushes_periodically)
+{
+  StalkerTestFunc func;
+  GumFakeBatchEventSink * sink;
+  guint n_events_while_followed;
+
+  g_object_unref (fixture->sink);
+  fixture->sink = GUM_FAKE_EVENT_SINK (gum_fake_batch_event_sink_new ());
+  sink = GUM_FAKE_BATCH_EVENT_SINK (fixture->sink);
+
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+      test_stalker_fixture_dup_code (fixture, flat_code, sizeof (flat_code)));
+
+  fixture->sink->mask = GUM_CALL;
+  gum_stalker_follow_me (fixture->stalker, GUM_EVENT_SINK (fixture->sink));
+  g_usleep (50000);
+  /* never seen before, so guaranteed to take the slow path */
+  func (0);
+  n_events_while_followed = fixture->sink->events->len;
+  gum_stalker_unfollow_me (fixture->stalker);
+
+  g_assert_cmpuint (n_events_while_followed, >, 0);
+  g_assert_cmpuint (sink->batch_count, >=, 1);
+}
+
+STALKER_TESTCASE (exec_compact)
+{
+  const guint8 code[] =
+  {
+    0xb8, 0xe8, 0x03, 0x00, 0x00, /* mov eax, 1000 */
+    0xff, 0xc8,                   /* dec eax       */
+    0x75, 0xfc,                   /* jnz -4        */
+    0xc3,                         /* ret           */
+  };
+  StalkerTestFunc func;
+  GumFakeCompactEventSink * sink;
+  guint n_events, i;
+
+  g_object_unref (fixture->sink);
+  fixture->sink = GUM_FAKE_EVENT_SINK (gum_fake_compact_event_sink_new ());
+  sink = GUM_FAKE_COMPACT_EVENT_SINK (fixture->sink);
+
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+      test_stalker_fixture_dup_code (fixture, code, sizeof (code)));
+
+  fixture->sink->mask = GUM_EXEC;
+  test_stalker_fixture_follow_and_invoke (fixture, func, 0);
+
+  n_events = INVOKER_INSN_COUNT + 1 + (2 * 1000) + 1;
+  g_assert_cmpuint (fixture->sink->events->len, ==, n_events);
+  g_assert_cmpuint (sink->chunk_count, >=, 2);
+  g_assert_cmpuint (sink->byte_count, <, n_events * sizeof (GumEvent));
+
+  GUM_ASSERT_CMPADDR (NTH_EXEC_EVENT_LOCATION (INVOKER_IMPL_OFFSET), ==,
+      func);
+  for (i = 0; i != 1000; i++)
+  {
+    guint n = INVOKER_IMPL_OFFSET + 1 + (2 * i);
+
+    GUM_ASSERT_CMPADDR (NTH_EXEC_EVENT_LOCATION (n), ==, fixture->code + 5);
+    GUM_ASSERT_CMPADDR (NTH_EXEC_EVENT_LOCATION (n + 1), ==,
+        fixture->code + 7);
+  }
+}
+
+STALKER_TESTCASE (exec_batched_preserves_live_state)
+{
+  const guint8 code[] =
+  {
+    0x31, 0xc0,                   /* xor eax, eax  */
+    0xb9, 0x2a, 0x00, 0x00, 0x00, /* mov ecx, 42   */
+    0x74, 0x01,                   /* jz +1         */
+    0xc3,                         /* ret           */
+    0x91,                         /* xchg eax, ecx */
+    0xc3,                         /* ret           */
+  };
+  StalkerTestFunc func;
+  gint ret;
+
+  g_object_unref (fixture->sink);
+  fixture->sink = GUM_FAKE_EVENT_SINK (gum_fake_batch_event_sink_new ());
+
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+      test_stalker_fixture_dup_code (fixture, code, sizeof (code)));
+
+  fixture->sink->mask = GUM_EXEC;
+  ret = test_stalker_fixture_follow_and_invoke (fixture, func, 0);
+
+  g_assert_cmpint (ret, ==, 42);
+  g_assert_cmpuint (fixture->sink->events->len, ==, INVOKER_INSN_COUNT + 5);
+}
+
+static const guint8 block_loop_code[] =
+{
+  0xb8, 0x03, 0x00, 0x00, 0x00, /* mov eax, 3 */
+  0xff, 0xc8,                   /* dec eax    */
+  0x75, 0xfc,                   /* jnz -4     */
+  0xc3,                         /* ret        */
+};
+
+STALKER_TESTCASE (block)
+{
+  StalkerTestFunc func;
+  const GumBlockEvent * events[8];
+  guint n;
+
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+      test_stalker_fixture_dup_code (fixture, block_loop_code,
+          sizeof (block_loop_code)));
+
+  fixture->sink->mask = GUM_BLOCK;
+  test_stalker_fixture_follow_and_invoke (fixture, func, 0);
+
+  n = collect_block_events (fixture, GUM_BLOCK, sizeof (block_loop_code),
+      events, G_N_ELEMENTS (events));
+  g_assert_cmpuint (n, ==, 3);
+  GUM_ASSERT_CMPADDR (events[0]->begin, ==, fixture->code);
+  GUM_ASSERT_CMPADDR (events[0]->end, ==, fixture->code + 9);
+  GUM_ASSERT_CMPADDR (events[1]->begin, ==, fixture->code + 5);
+  GUM_ASSERT_CMPADDR (events[1]->end, ==, fixture->code + 9);
+  GUM_ASSERT_CMPADDR (events[2]->begin, ==, fixture->code + 9);
+  GUM_ASSERT_CMPADDR (events[2]->end, ==, fixture->code + 10);
+}
+
+STALKER_TESTCASE (block_exec)
 {
   StalkerTestFunc func;
-  GumRetEvent * ev;
+  const GumBlockEvent * events[8];
+  guint n;
 
-  func = invoke_flat (fixture, GUM_RET);
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+      test_stalker_fixture_dup_code (fixture, block_loop_code,
+          sizeof (block_loop_code)));
 
-  g_assert_cmpuint (fixture->sink->events->len, ==, 1);
-  g_assert_cmpint (g_array_index (fixture->sink->events, GumEvent, 0).type,
-      ==, GUM_RET);
-  ev = &g_array_index (fixture->sink->events, GumEvent, 0).ret;
-  GUM_ASSERT_CMPADDR (ev->location,
-      ==, ((guint8 *) GSIZE_TO_POINTER (func)) + 6);
-  GUM_ASSERT_CMPADDR (ev->target, ==, fixture->last_invoke_retaddr);
+  fixture->sink->mask = GUM_BLOCK_EXEC;
+  test_stalker_fixture_follow_and_invoke (fixture, func, 0);
+
+  n = collect_block_events (fixture, GUM_BLOCK_EXEC, sizeof (block_loop_code),
+      events, G_N_ELEMENTS (events));
+  g_assert_cmpuint (n, ==, 4);
+  GUM_ASSERT_CMPADDR (events[0]->begin, ==, fixture->code);
+  GUM_ASSERT_CMPADDR (events[1]->begin, ==, fixture->code + 5);
+  GUM_ASSERT_CMPADDR (events[1]->end, ==, fixture->code + 9);
+  GUM_ASSERT_CMPADDR (events[2]->begin, ==, fixture->code + 5);
+  GUM_ASSERT_CMPADDR (events[2]->end, ==, fixture->code + 9);
+  GUM_ASSERT_CMPADDR (events[3]->begin, ==, fixture->code + 9);
+  GUM_ASSERT_CMPADDR (events[3]->end, ==, fixture->code + 10);
 }
 
-STALKER_TESTCASE (exec)
+static guint
+collect_block_events (TestStalkerFixture * fixture,
+                      GumEventType type,
+                      gsize code_size,
+                      const GumBlockEvent ** events,
+                      guint max_events)
 {
-  StalkerTestFunc func;
-  GumRetEvent * ev;
+  GArray * all = fixture->sink->events;
+  guint n = 0, i;
 
-  func = invoke_flat (fixture, GUM_EXEC);
+  for (i = 0; i != all->len; i++)
+  {
+    const GumBlockEvent * ev;
 
-  g_assert_cmpuint (fixture->sink->events->len, ==, INVOKER_INSN_COUNT + 4);
-  g_assert_cmpint (g_array_index (fixture->sink->events, GumEvent,
-      INVOKER_IMPL_OFFSET).type, ==, GUM_EXEC);
-  ev = &g_array_index (fixture->sink->events, GumEvent,
-      INVOKER_IMPL_OFFSET).ret;
-  GUM_ASSERT_CMPADDR (ev->location, ==, func);
+    ev = gum_fake_event_sink_get_nth_event_as_block (fixture->sink, i);
+    g_assert_cmpint (ev->type, ==, type);
+
+    if ((guint8 *) ev->begin >= fixture->code &&
+        (guint8 *) ev->begin < fixture->code + code_size)
+    {
+      g_assert_cmpuint (n, <, max_events);
+      events[n++] = ev;
+    }
+  }
+
+  return n;
 }
 
 STALKER_TESTCASE (call_depth)
@@ -468,6 +1462,320 @@ probe_func_a_invocation (GumCallSite * site, gpointer user_data)
       ==, 0xaaaa4444);
 }
 
+static void count_probe_invocation (GumCallSite * site, gpointer user_data);
+
+STALKER_TESTCASE (call_probe_unlinks_chained_blocks)
+{
+  const guint8 code_template[] =
+  {
+    0xe8, 0x02, 0x00, 0x00, 0x00, /* call func_a */
+    0xc3,                         /* ret         */
+
+    0xcc,                         /* int 3       */
+
+    /* func_a: */
+    0xc3,                         /* ret         */
+
+    0xcc,                         /* int 3       */
+
+    /* func_b: */
+    0xc3,                         /* ret         */
+  };
+  StalkerTestFunc func, func_b;
+  guint probe_count = 0;
+  guint i;
+
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+      test_stalker_fixture_dup_code (fixture, code_template,
+          sizeof (code_template)));
+  func_b = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc, fixture->code + 9);
+
+  fixture->sink->mask = GUM_NOTHING;
+  gum_stalker_set_trust_threshold (fixture->stalker, 0);
+
+  gum_stalker_follow_me (fixture->stalker, GUM_EVENT_SINK (fixture->sink));
+  for (i = 0; i != 4; i++)
+  {
+    func (0);
+
+    if (i == 1)
+    {
+      gum_stalker_add_call_probe (fixture->stalker, fixture->code + 7,
+          count_probe_invocation, &probe_count, NULL);
+      /* never seen before, so guaranteed to take the slow path */
+      func_b (0);
+    }
+  }
+  gum_stalker_unfollow_me (fixture->stalker);
+
+  g_assert_cmpuint (probe_count, ==, 2);
+}
+
+static void
+count_probe_invocation (GumCallSite * site, gpointer user_data)
+{
+  guint * count = (guint *) user_data;
+
+  (*count)++;
+}
+
+typedef struct _BlockLookupQuery BlockLookupQuery;
+
+struct _BlockLookupQuery
+{
+  gpointer address;
+  gint lookups;
+};
+
+static gboolean find_block_lookups (const GumBlockStats * stats,
+    gpointer user_data);
+
+STALKER_TESTCASE (eager_chaining)
+{
+  const guint8 code_template[] =
+  {
+    0xe8, 0x02, 0x00, 0x00, 0x00, /* call func_a */
+    0xc3,                         /* ret         */
+
+    0xcc,                         /* int 3       */
+
+    /* func_a: */
+    0xc3,                         /* ret         */
+  };
+  StalkerTestFunc func, func_a;
+  BlockLookupQuery query;
+
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+      test_stalker_fixture_dup_code (fixture, code_template,
+          sizeof (code_template)));
+  func_a = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc, fixture->code + 7);
+
+  fixture->sink->mask = GUM_NOTHING;
+  gum_stalker_set_trust_threshold (fixture->stalker, 0);
+
+  query.address = fixture->code + 7;
+  query.lookups = -1;
+
+  gum_stalker_follow_me (fixture->stalker, GUM_EVENT_SINK (fixture->sink));
+  /* compile func_a first, so that the call in func is linked right away */
+  func_a (0);
+  func (0);
+  func (0);
+  gum_stalker_enumerate_block_stats (fixture->stalker, find_block_lookups,
+      &query);
+  gum_stalker_unfollow_me (fixture->stalker);
+
+  /* the call never went through the slow path to look func_a up */
+  g_assert_cmpint (query.lookups, ==, 0);
+}
+
+static gboolean
+find_block_lookups (const GumBlockStats * stats,
+                    gpointer user_data)
+{
+  BlockLookupQuery * query = (BlockLookupQuery *) user_data;
+
+  if (stats->address != query->address)
+    return TRUE;
+
+  query->lookups = stats->lookups;
+  return FALSE;
+}
+
+typedef struct _CallProbeWorkerContext CallProbeWorkerContext;
+
+struct _CallProbeWorkerContext
+{
+  TestStalkerFixture * fixture;
+  StalkerTestFunc func;
+  guint iterations;
+  volatile gint finished;
+};
+
+static gpointer call_probe_worker (gpointer data);
+static void count_probe_invocation_atomically (GumCallSite * site,
+    gpointer user_data);
+
+STALKER_TESTCASE (call_probe_while_updating)
+{
+  const guint8 code[] =
+  {
+    0xb8, 0x39, 0x05, 0x00, 0x00, /* mov eax, 1337 */
+    0xc3,                         /* ret           */
+  };
+  CallProbeWorkerContext ctx;
+  GThread * threads[4];
+  volatile gint count = 0;
+  volatile gint churn_count = 0;
+  guint i;
+
+  ctx.fixture = fixture;
+  ctx.func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+      test_stalker_fixture_dup_code (fixture, code, sizeof (code)));
+  ctx.iterations = 1000;
+  ctx.finished = 0;
+
+  fixture->sink->mask = GUM_NOTHING;
+  gum_stalker_add_call_probe (fixture->stalker, fixture->code,
+      count_probe_invocation_atomically, (gpointer) &count, NULL);
+
+  for (i = 0; i != G_N_ELEMENTS (threads); i++)
+    threads[i] = g_thread_create (call_probe_worker, &ctx, TRUE, NULL);
+
+  /* replace the probe set while the workers are dispatching through it */
+  while (g_atomic_int_get (&ctx.finished) != (gint) G_N_ELEMENTS (threads))
+  {
+    GumProbeId id;
+
+    id = gum_stalker_add_call_probe (fixture->stalker, fixture->code,
+        count_probe_invocation_atomically, (gpointer) &churn_count, NULL);
+    gum_stalker_remove_call_probe (fixture->stalker, id);
+  }
+
+  for (i = 0; i != G_N_ELEMENTS (threads); i++)
+    g_thread_join (threads[i]);
+
+  g_assert_cmpint (count, ==, G_N_ELEMENTS (threads) * ctx.iterations);
+}
+
+static gpointer
+call_probe_worker (gpointer data)
+{
+  CallProbeWorkerContext * ctx = (CallProbeWorkerContext *) data;
+  volatile StalkerTestFunc func = ctx->func;
+  guint i;
+
+  gum_stalker_follow_me (ctx->fixture->stalker,
+      GUM_EVENT_SINK (ctx->fixture->sink));
+  for (i = 0; i != ctx->iterations; i++)
+    g_assert_cmpint (func (i), ==, 1337);
+  gum_stalker_unfollow_me (ctx->fixture->stalker);
+
+  g_atomic_int_inc (&ctx->finished);
+
+  return NULL;
+}
+
+static void
+count_probe_invocation_atomically (GumCallSite * site,
+                                   gpointer user_data)
+{
+  volatile gint * count = (volatile gint *) user_data;
+
+  g_atomic_int_inc (count);
+}
+
+static void clobber_fp_state (GumCallSite * site, gpointer user_data);
+
+STALKER_TESTCASE (call_probe_needing_fpu_when_lazy)
+{
+  const guint8 code[] =
+  {
+    0xb8, 0x2a, 0x00, 0x00, 0x00, /* mov eax, 42    */
+    0x66, 0x0f, 0x6e, 0xc0,       /* movd xmm0, eax */
+    0xe8, 0x06, 0x00, 0x00, 0x00, /* call func      */
+    0x66, 0x0f, 0x7e, 0xc0,       /* movd eax, xmm0 */
+    0xc3,                         /* ret            */
+
+    0xcc,                         /* int 3          */
+
+    /* func: */
+    0xc3,                         /* ret            */
+  };
+  StalkerTestFunc func;
+  gdouble result = 0.0;
+  gint ret;
+
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+      test_stalker_fixture_dup_code (fixture, code, sizeof (code)));
+
+  gum_stalker_set_lazy_fp_save (fixture->stalker, TRUE);
+  gum_stalker_add_call_probe_full (fixture->stalker, fixture->code + 20,
+      clobber_fp_state, &result, NULL, GUM_CALL_PROBE_NEEDS_FPU);
+
+  fixture->sink->mask = GUM_NOTHING;
+  ret = test_stalker_fixture_follow_and_invoke (fixture, func, 0);
+
+  g_assert_cmpint (ret, ==, 42);
+  g_assert_cmpfloat (result, ==, 13.37);
+}
+
+static void
+clobber_fp_state (GumCallSite * site,
+                  gpointer user_data)
+{
+  gdouble * result = (gdouble *) user_data;
+
+  /* returned in XMM0 on x86-64 */
+  *result = g_ascii_strtod ("13.37", NULL);
+}
+
+typedef struct _TransformerContext TransformerContext;
+
+struct _TransformerContext
+{
+  guint8 * code;
+  gsize code_size;
+  guint n_seen;
+};
+
+static void replace_mov_eax (GumStalkerIterator * iterator,
+    GumStalkerWriter * output, gpointer user_data);
+
+STALKER_TESTCASE (transformer_replaces_instruction)
+{
+  const guint8 code[] =
+  {
+    0xb8, 0x01, 0x00, 0x00, 0x00, /* mov eax, 1 */
+    0xff, 0xc0,                   /* inc eax    */
+    0xc3,                         /* ret        */
+  };
+  StalkerTestFunc func;
+  TransformerContext tc;
+  gint ret;
+
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+      test_stalker_fixture_dup_code (fixture, code, sizeof (code)));
+
+  tc.code = fixture->code;
+  tc.code_size = sizeof (code);
+  tc.n_seen = 0;
+  gum_stalker_set_transformer (fixture->stalker, replace_mov_eax, &tc, NULL);
+
+  fixture->sink->mask = GUM_NOTHING;
+  ret = test_stalker_fixture_follow_and_invoke (fixture, func, 0);
+
+  g_assert_cmpint (ret, ==, 43);
+  g_assert_cmpuint (tc.n_seen, ==, 3);
+}
+
+static void
+replace_mov_eax (GumStalkerIterator * iterator,
+                 GumStalkerWriter * output,
+                 gpointer user_data)
+{
+  TransformerContext * tc = (TransformerContext *) user_data;
+  const GumStalkerInstruction * insn;
+
+  while (gum_stalker_iterator_next (iterator, &insn))
+  {
+    guint8 * code = (guint8 *) insn->begin;
+
+    if (code >= tc->code && code < tc->code + tc->code_size)
+    {
+      tc->n_seen++;
+
+      if (code[0] == 0xb8)
+      {
+        gum_x86_writer_put_mov_reg_u32 (output->x86, GUM_REG_EAX, 42);
+        continue;
+      }
+    }
+
+    gum_stalker_iterator_keep (iterator);
+  }
+}
+
 static const guint8 jumpy_code[] = {
     0x31, 0xc0,                   /* xor eax, eax */
     0xeb, 0x01,                   /* jmp short +1 */
@@ -756,6 +2064,66 @@ STALKER_TESTCASE (unfollow_deep)
       ==, 7 + UNFOLLOW_DEEP_EXTRA_INSN_COUNT);
 }
 
+#ifndef G_OS_WIN32
+
+static jmp_buf unwind_target;
+
+GUM_NOINLINE static gint
+longjmp_through (guint depth)
+{
+  if (depth == 0)
+    longjmp (unwind_target, 1);
+
+  return longjmp_through (depth - 1) + 1;
+}
+
+GUM_NOINLINE static gint
+setjmp_and_unwind (guint depth)
+{
+  if (setjmp (unwind_target) == 0)
+    longjmp_through (depth);
+
+  return 42;
+}
+
+GUM_NOINLINE static gint
+add_one (gint value)
+{
+  return value + 1;
+}
+
+STALKER_TESTCASE (ret_after_longjmp)
+{
+  GumThreadId thread_id;
+  GumStalkerStats before, after;
+  gint total = 0;
+  guint depth;
+
+  thread_id = gum_process_get_current_thread_id ();
+  fixture->sink->mask = GUM_NOTHING;
+
+  gum_stalker_follow_me (fixture->stalker, GUM_EVENT_SINK (fixture->sink));
+  gum_stalker_get_thread_stats (fixture->stalker, thread_id, &before);
+  /* shallow unwinds are popped through, deep ones fall back to the cache */
+  for (depth = 0; depth != 16; depth++)
+  {
+    total += setjmp_and_unwind (depth);
+    total = add_one (total);
+  }
+  gum_stalker_get_thread_stats (fixture->stalker, thread_id, &after);
+  gum_stalker_unfollow_me (fixture->stalker);
+
+  g_assert_cmpint (total, ==, 16 * 43);
+
+  /*
+   * Emptying the frame stack on every unwind would send the ret out of
+   * setjmp_and_unwind() through the slow path each time around the loop.
+   */
+  g_assert_cmpuint (after.ret_slow_paths - before.ret_slow_paths, <, 8);
+}
+
+#endif
+
 static void
 invoke_unfollow_deep_code (TestStalkerFixture * fixture)
 {
@@ -1290,6 +2658,91 @@ STALKER_TESTCASE (indirect_jump_with_immediate_and_scaled_register)
   invoke_jump (fixture, &jump_template);
 }
 
+static gboolean find_busiest_indirect_branch (
+    const GumIndirectBranchStats * stats, gpointer user_data);
+
+STALKER_TESTCASE (indirect_call_inline_cache)
+{
+  const guint8 code[] =
+  {
+    0xb8, 0x39, 0x05, 0x00, 0x00, /* mov eax, 1337 */
+    0xc3,                         /* ret           */
+  };
+  volatile StalkerTestFunc func;
+  GumIndirectBranchStats busiest = { 0, };
+  guint i;
+
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+      test_stalker_fixture_dup_code (fixture, code, sizeof (code)));
+
+  fixture->sink->mask = GUM_NOTHING;
+  gum_stalker_follow_me (fixture->stalker, GUM_EVENT_SINK (fixture->sink));
+  for (i = 0; i != 10; i++)
+    g_assert_cmpint (func (i), ==, 1337);
+  /* the sites go away with the thread's context once it is unfollowed */
+  gum_stalker_enumerate_indirect_branches (fixture->stalker,
+      find_busiest_indirect_branch, &busiest);
+  gum_stalker_unfollow_me (fixture->stalker);
+
+  g_assert_cmpuint (busiest.thread_id, ==,
+      gum_process_get_current_thread_id ());
+  g_assert_cmpuint (busiest.hits, >=, 8);
+  g_assert_cmpuint (busiest.misses, >=, 1);
+}
+
+static gboolean
+find_busiest_indirect_branch (const GumIndirectBranchStats * stats,
+                              gpointer user_data)
+{
+  GumIndirectBranchStats * busiest = (GumIndirectBranchStats *) user_data;
+
+  if (stats->hits > busiest->hits)
+    *busiest = *stats;
+
+  return TRUE;
+}
+
+STALKER_TESTCASE (excluded_indirect_call)
+{
+  const guint8 code[] =
+  {
+    0xb8, 0x39, 0x05, 0x00, 0x00, /* mov eax, 1337 */
+    0xc3,                         /* ret           */
+  };
+  volatile StalkerTestFunc func;
+  GumMemoryRange range;
+  GumAddress start, end;
+  guint i;
+
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+      test_stalker_fixture_dup_code (fixture, code, sizeof (code)));
+  start = GUM_ADDRESS (func);
+  end = start + sizeof (code);
+
+  /* overlapping ranges should be coalesced */
+  range.base_address = start;
+  range.size = 3;
+  gum_stalker_exclude (fixture->stalker, &range);
+  range.base_address = start + 2;
+  range.size = sizeof (code) - 2;
+  gum_stalker_exclude (fixture->stalker, &range);
+
+  fixture->sink->mask = GUM_EXEC;
+  gum_stalker_follow_me (fixture->stalker, GUM_EVENT_SINK (fixture->sink));
+  for (i = 0; i != 10; i++)
+    g_assert_cmpint (func (i), ==, 1337);
+  gum_stalker_unfollow_me (fixture->stalker);
+
+  g_assert_cmpuint (fixture->sink->events->len, >, 0);
+  for (i = 0; i != fixture->sink->events->len; i++)
+  {
+    GumAddress location = GUM_ADDRESS (
+        gum_fake_event_sink_get_nth_event_as_exec (fixture->sink, i)->location);
+
+    g_assert (location < start || location >= end);
+  }
+}
+
 #if GLIB_SIZEOF_VOID_P == 4
 
 typedef void (* ClobberFunc) (GumCpuContext * ctx);
@@ -76,6 +76,8 @@ struct _ListenerContext
   gsize last_seen_argument;
   gpointer last_return_value;
   GumCpuContext last_on_enter_cpu_context;
+  guint last_on_enter_stack_depth;
+  gboolean last_on_enter_was_current;
 };
 
 struct _ListenerContextClass
@@ -87,7 +89,7 @@ struct _TestInterceptorFixture
 {
   GumInterceptor * interceptor;
   GString * result;
-  ListenerContext * listener_context[2];
+  ListenerContext * listener_context[3];
 };
 
 static void listener_context_iface_init (gpointer g_iface,
@@ -192,11 +194,12 @@ test_interceptor_fixture_teardown (TestInterceptorFixture * fixture,
 }
 
 GumAttachReturn
-interceptor_fixture_try_attaching_listener (TestInterceptorFixture * h,
-                                            guint listener_index,
-                                            gpointer test_func,
-                                            gchar enter_char,
-                                            gchar leave_char)
+interceptor_fixture_try_attaching_listener_full (TestInterceptorFixture * h,
+                                                 guint listener_index,
+                                                 gpointer test_func,
+                                                 gchar enter_char,
+                                                 gchar leave_char,
+                                                 GumListenerFlags flags)
 {
   GumAttachReturn result;
   ListenerContext * ctx;
@@ -212,8 +215,8 @@ interceptor_fixture_try_attaching_listener (TestInterceptorFixture * h,
   ctx->enter_char = enter_char;
   ctx->leave_char = leave_char;
 
-  result = gum_interceptor_attach_listener (h->interceptor, test_func,
-      GUM_INVOCATION_LISTENER (ctx), NULL);
+  result = gum_interceptor_attach_listener_full (h->interceptor, test_func,
+      GUM_INVOCATION_LISTENER (ctx), NULL, flags);
   if (result == GUM_ATTACH_OK)
   {
     h->listener_context[listener_index] = ctx;
@@ -226,6 +229,17 @@ interceptor_fixture_try_attaching_listener (TestInterceptorFixture * h,
   return result;
 }
 
+GumAttachReturn
+interceptor_fixture_try_attaching_listener (TestInterceptorFixture * h,
+                                            guint listener_index,
+                                            gpointer test_func,
+                                            gchar enter_char,
+                                            gchar leave_char)
+{
+  return interceptor_fixture_try_attaching_listener_full (h, listener_index,
+      test_func, enter_char, leave_char, GUM_LISTENER_DEFAULT);
+}
+
 void
 interceptor_fixture_attach_listener (TestInterceptorFixture * h,
                                      guint listener_index,
@@ -238,6 +252,19 @@ interceptor_fixture_attach_listener (TestInterceptorFixture * h,
       GUM_ATTACH_OK);
 }
 
+void
+interceptor_fixture_attach_listener_full (TestInterceptorFixture * h,
+                                          guint listener_index,
+                                          gpointer test_func,
+                                          gchar enter_char,
+                                          gchar leave_char,
+                                          GumListenerFlags flags)
+{
+  g_assert_cmpint (interceptor_fixture_try_attaching_listener_full (h,
+      listener_index, test_func, enter_char, leave_char, flags), ==,
+      GUM_ATTACH_OK);
+}
+
 void
 interceptor_fixture_detach_listener (TestInterceptorFixture * h,
                                      guint listener_index)
@@ -260,6 +287,9 @@ listener_context_on_enter (GumInvocationListener * listener,
   self->last_seen_argument = (gsize)
       gum_invocation_context_get_nth_argument (context, 0);
   self->last_on_enter_cpu_context = *context->cpu_context;
+  self->last_on_enter_stack_depth = gum_interceptor_get_current_stack ()->len;
+  self->last_on_enter_was_current =
+      gum_interceptor_get_current_invocation () == context;
 
   self->last_thread_id = gum_invocation_context_get_thread_id (context);
 }
@@ -304,6 +334,7 @@ listener_context_init (ListenerContext * self)
 
 #ifdef G_OS_WIN32
 static gpointer hit_target_function_repeatedly (gpointer data);
+static gpointer hit_target_function_repeatedly_while_ignored (gpointer data);
 #endif
 static gpointer replacement_malloc (gsize size);
 static gpointer replacement_malloc_calling_malloc_and_replaced_free (
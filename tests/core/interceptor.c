@@ -35,11 +35,15 @@ TEST_LIST_BEGIN (interceptor)
 
   INTERCEPTOR_TESTENTRY (attach_one)
   INTERCEPTOR_TESTENTRY (attach_two)
+  INTERCEPTOR_TESTENTRY (attach_three)
+  INTERCEPTOR_TESTENTRY (attach_enter_only_and_leave_only)
+  INTERCEPTOR_TESTENTRY (attach_in_transaction)
   INTERCEPTOR_TESTENTRY (attach_to_special_function)
   INTERCEPTOR_TESTENTRY (attach_to_heap_api)
   INTERCEPTOR_TESTENTRY (attach_to_own_api)
 #ifdef G_OS_WIN32
   INTERCEPTOR_TESTENTRY (attach_detach_torture)
+  INTERCEPTOR_TESTENTRY (attach_detach_torture_with_ignored_thread)
 #endif
   INTERCEPTOR_TESTENTRY (thread_id)
   INTERCEPTOR_TESTENTRY (intercepted_free_in_thread_exit)
@@ -52,6 +56,8 @@ TEST_LIST_BEGIN (interceptor)
   INTERCEPTOR_TESTENTRY (ignore_current_thread_nested)
   INTERCEPTOR_TESTENTRY (ignore_other_threads)
   INTERCEPTOR_TESTENTRY (detach)
+  INTERCEPTOR_TESTENTRY (detach_during_invocation)
+  INTERCEPTOR_TESTENTRY (detach_while_other_thread_is_in_on_enter)
   INTERCEPTOR_TESTENTRY (listener_ref_count)
   INTERCEPTOR_TESTENTRY (function_data)
 
@@ -74,6 +80,60 @@ INTERCEPTOR_TESTCASE (attach_two)
   g_assert_cmpstr (fixture->result->str, ==, "ac|bd");
 }
 
+INTERCEPTOR_TESTCASE (attach_three)
+{
+  interceptor_fixture_attach_listener (fixture, 0, target_function, 'a', 'b');
+  interceptor_fixture_attach_listener (fixture, 1, target_function, 'c', 'd');
+  interceptor_fixture_attach_listener (fixture, 2, target_function, 'e', 'f');
+  target_function (fixture->result);
+  g_assert_cmpstr (fixture->result->str, ==, "ace|bdf");
+
+  interceptor_fixture_detach_listener (fixture, 1);
+  g_string_truncate (fixture->result, 0);
+  target_function (fixture->result);
+  g_assert_cmpstr (fixture->result->str, ==, "ae|bf");
+}
+
+INTERCEPTOR_TESTCASE (attach_enter_only_and_leave_only)
+{
+  interceptor_fixture_attach_listener_full (fixture, 0, target_function,
+      '>', '<', GUM_LISTENER_ENTER_ONLY);
+  target_function (fixture->result);
+  g_assert_cmpstr (fixture->result->str, ==, ">|");
+  g_assert_cmpuint (
+      fixture->listener_context[0]->last_on_enter_stack_depth, ==, 1);
+  g_assert (fixture->listener_context[0]->last_on_enter_was_current);
+  g_assert_cmpuint (gum_interceptor_get_current_stack ()->len, ==, 0);
+
+  g_string_truncate (fixture->result, 0);
+  interceptor_fixture_attach_listener_full (fixture, 1, target_function,
+      'a', 'b', GUM_LISTENER_LEAVE_ONLY);
+  target_function (fixture->result);
+  g_assert_cmpstr (fixture->result->str, ==, ">|b");
+  g_assert_cmpuint (
+      fixture->listener_context[0]->last_on_enter_stack_depth, ==, 1);
+}
+
+INTERCEPTOR_TESTCASE (attach_in_transaction)
+{
+  gum_interceptor_begin_transaction (fixture->interceptor);
+  interceptor_fixture_attach_listener (fixture, 0, target_function, 'a', 'b');
+  interceptor_fixture_attach_listener (fixture, 1, target_function, 'c', 'd');
+  gum_interceptor_end_transaction (fixture->interceptor);
+
+  target_function (fixture->result);
+  g_assert_cmpstr (fixture->result->str, ==, "ac|bd");
+
+  gum_interceptor_begin_transaction (fixture->interceptor);
+  interceptor_fixture_detach_listener (fixture, 0);
+  interceptor_fixture_detach_listener (fixture, 1);
+  gum_interceptor_end_transaction (fixture->interceptor);
+
+  g_string_truncate (fixture->result, 0);
+  target_function (fixture->result);
+  g_assert_cmpstr (fixture->result->str, ==, "|");
+}
+
 INTERCEPTOR_TESTCASE (attach_to_special_function)
 {
   interceptor_fixture_attach_listener (fixture, 0, special_function, '>', '<');
@@ -152,6 +212,27 @@ INTERCEPTOR_TESTCASE (attach_detach_torture)
   g_thread_join (th);
 }
 
+INTERCEPTOR_TESTCASE (attach_detach_torture_with_ignored_thread)
+{
+  GThread * th;
+  volatile guint n_passes = 100;
+
+  th = g_thread_create (hit_target_function_repeatedly_while_ignored,
+      (gpointer) &n_passes, TRUE, NULL);
+
+  g_thread_yield ();
+
+  do
+  {
+    interceptor_fixture_attach_listener (fixture, 0, target_function,
+        'a', 'b');
+    interceptor_fixture_detach_listener (fixture, 0);
+  }
+  while (--n_passes != 0);
+
+  g_thread_join (th);
+}
+
 #endif
 
 INTERCEPTOR_TESTCASE (thread_id)
@@ -284,6 +365,86 @@ INTERCEPTOR_TESTCASE (detach)
   g_assert_cmpstr (fixture->result->str, ==, "c|d");
 }
 
+static void
+detach_and_destroy_first_listener (gpointer user_data,
+                                   GumInvocationContext * context)
+{
+  TestInterceptorFixture * fixture = (TestInterceptorFixture *) user_data;
+
+  (void) context;
+
+  interceptor_fixture_detach_listener (fixture, 0);
+  g_object_unref (fixture->listener_context[0]);
+  fixture->listener_context[0] = NULL;
+}
+
+INTERCEPTOR_TESTCASE (detach_during_invocation)
+{
+  TestCallbackListener * listener;
+
+  interceptor_fixture_attach_listener (fixture, 0, target_function, 'a', 'b');
+
+  listener = test_callback_listener_new ();
+  listener->on_enter = detach_and_destroy_first_listener;
+  listener->user_data = fixture;
+  gum_interceptor_attach_listener (fixture->interceptor, target_function,
+      GUM_INVOCATION_LISTENER (listener), NULL);
+
+  target_function (fixture->result);
+  g_assert_cmpstr (fixture->result->str, ==, "a|");
+
+  gum_interceptor_detach_listener (fixture->interceptor,
+      GUM_INVOCATION_LISTENER (listener));
+  g_object_unref (listener);
+}
+
+typedef struct _LingeringEnterState LingeringEnterState;
+
+struct _LingeringEnterState
+{
+  volatile gboolean entered;
+  volatile gboolean finished;
+};
+
+static void
+linger_in_on_enter (gpointer user_data,
+                    GumInvocationContext * context)
+{
+  LingeringEnterState * state = (LingeringEnterState *) user_data;
+
+  (void) context;
+
+  state->entered = TRUE;
+  g_usleep (G_USEC_PER_SEC / 10);
+  state->finished = TRUE;
+}
+
+INTERCEPTOR_TESTCASE (detach_while_other_thread_is_in_on_enter)
+{
+  LingeringEnterState state = { FALSE, FALSE };
+  TestCallbackListener * listener;
+  GThread * th;
+
+  listener = test_callback_listener_new ();
+  listener->on_enter = linger_in_on_enter;
+  listener->user_data = &state;
+  gum_interceptor_attach_listener (fixture->interceptor, target_function,
+      GUM_INVOCATION_LISTENER (listener), NULL);
+
+  th = g_thread_create ((GThreadFunc) target_function, fixture->result, TRUE,
+      NULL);
+  while (!state.entered)
+    g_thread_yield ();
+
+  gum_interceptor_detach_listener (fixture->interceptor,
+      GUM_INVOCATION_LISTENER (listener));
+  g_assert (state.finished);
+  g_object_unref (listener);
+
+  g_thread_join (th);
+  g_assert_cmpstr (fixture->result->str, ==, "|");
+}
+
 INTERCEPTOR_TESTCASE (listener_ref_count)
 {
   interceptor_fixture_attach_listener (fixture, 0, target_function, 'a', 'b');
@@ -366,6 +527,15 @@ INTERCEPTOR_TESTCASE (function_data)
   g_assert_cmpstr (fd_listener->last_on_leave_data.invocation_data.arg,
       ==, "bdgr");
 
+  gum_interceptor_detach_listener (fixture->interceptor, listener);
+  test_function_data_listener_reset (fd_listener);
+
+  g_assert_cmpint (gum_interceptor_attach_listener (fixture->interceptor,
+      target_nop_function_a, listener, a_data), ==, GUM_ATTACH_OK);
+  target_nop_function_a ("badger");
+  g_assert_cmpuint (fd_listener->on_enter_call_count, ==, 1);
+  g_assert_cmpuint (fd_listener->init_thread_state_count, ==, 1);
+
   gum_interceptor_detach_listener (fixture->interceptor, listener);
   g_object_unref (fd_listener);
 }
@@ -550,6 +720,23 @@ hit_target_function_repeatedly (gpointer data)
   return NULL;
 }
 
+static gpointer
+hit_target_function_repeatedly_while_ignored (gpointer data)
+{
+  GumInterceptor * interceptor;
+  gpointer result;
+
+  interceptor = gum_interceptor_obtain ();
+  gum_interceptor_ignore_current_thread (interceptor);
+
+  result = hit_target_function_repeatedly (data);
+
+  gum_interceptor_unignore_current_thread (interceptor);
+  g_object_unref (interceptor);
+
+  return result;
+}
+
 #endif
 
 typedef gpointer (* MallocFunc) (gsize size);
@@ -88,6 +88,7 @@ TEST_LIST_BEGIN (script)
 #ifdef HAVE_I386
   SCRIPT_TESTENTRY (execution_can_be_traced)
   SCRIPT_TESTENTRY (call_can_be_probed)
+  SCRIPT_TESTENTRY (stalker_stats_can_be_queried)
 #endif
   SCRIPT_TESTENTRY (script_can_be_reloaded)
 TEST_LIST_END ()
@@ -416,6 +417,18 @@ SCRIPT_TESTCASE (call_can_be_probed)
   POST_MESSAGE ("{\"type\":\"stop\"}");
 }
 
+SCRIPT_TESTCASE (stalker_stats_can_be_queried)
+{
+  COMPILE_AND_LOAD_SCRIPT (
+    "var stats = Stalker.getStats();"
+    "send(typeof stats.blocksCompiled);"
+    "send(stats.retSlowPaths <= stats.slowPaths);"
+    "send(Stalker.getStats(0));");
+  EXPECT_SEND_MESSAGE_WITH ("\"number\"");
+  EXPECT_SEND_MESSAGE_WITH ("true");
+  EXPECT_SEND_MESSAGE_WITH ("null");
+}
+
 #endif /* HAVE_I386 */
 
 SCRIPT_TESTCASE (process_arch_is_available)
@@ -26,6 +26,16 @@ static GumEventType gum_fake_event_sink_query_mask (GumEventSink * sink);
 static void gum_fake_event_sink_process (GumEventSink * sink,
     const GumEvent * ev);
 
+static void gum_fake_batch_event_sink_iface_init (gpointer g_iface,
+    gpointer iface_data);
+static void gum_fake_batch_event_sink_process_batch (GumEventSink * sink,
+    const GumEvent * events, guint n_events);
+
+static void gum_fake_compact_event_sink_iface_init (gpointer g_iface,
+    gpointer iface_data);
+static void gum_fake_compact_event_sink_process_compact (GumEventSink * sink,
+    const guint8 * data, gsize size);
+
 G_DEFINE_TYPE_EXTENDED (GumFakeEventSink,
                         gum_fake_event_sink,
                         G_TYPE_OBJECT,
@@ -33,6 +43,20 @@ G_DEFINE_TYPE_EXTENDED (GumFakeEventSink,
                         G_IMPLEMENT_INTERFACE (GUM_TYPE_EVENT_SINK,
                                                gum_fake_event_sink_iface_init));
 
+G_DEFINE_TYPE_EXTENDED (GumFakeBatchEventSink,
+                        gum_fake_batch_event_sink,
+                        GUM_TYPE_FAKE_EVENT_SINK,
+                        0,
+                        G_IMPLEMENT_INTERFACE (GUM_TYPE_EVENT_SINK,
+                            gum_fake_batch_event_sink_iface_init));
+
+G_DEFINE_TYPE_EXTENDED (GumFakeCompactEventSink,
+                        gum_fake_compact_event_sink,
+                        GUM_TYPE_FAKE_EVENT_SINK,
+                        0,
+                        G_IMPLEMENT_INTERFACE (GUM_TYPE_EVENT_SINK,
+                            gum_fake_compact_event_sink_iface_init));
+
 static void
 gum_fake_event_sink_class_init (GumFakeEventSinkClass * klass)
 {
@@ -77,11 +101,82 @@ gum_fake_event_sink_new (void)
   return GUM_EVENT_SINK (sink);
 }
 
+static void
+gum_fake_batch_event_sink_class_init (GumFakeBatchEventSinkClass * klass)
+{
+}
+
+static void
+gum_fake_batch_event_sink_iface_init (gpointer g_iface,
+                                      gpointer iface_data)
+{
+  GumEventSinkIface * iface = (GumEventSinkIface *) g_iface;
+
+  iface->query_mask = gum_fake_event_sink_query_mask;
+  iface->process = gum_fake_event_sink_process;
+  iface->process_batch = gum_fake_batch_event_sink_process_batch;
+}
+
+static void
+gum_fake_batch_event_sink_init (GumFakeBatchEventSink * self)
+{
+}
+
+GumEventSink *
+gum_fake_batch_event_sink_new (void)
+{
+  GumFakeBatchEventSink * sink;
+
+  sink = g_object_new (GUM_TYPE_FAKE_BATCH_EVENT_SINK, NULL);
+
+  return GUM_EVENT_SINK (sink);
+}
+
+static void
+gum_fake_compact_event_sink_class_init (GumFakeCompactEventSinkClass * klass)
+{
+}
+
+static void
+gum_fake_compact_event_sink_iface_init (gpointer g_iface,
+                                        gpointer iface_data)
+{
+  GumEventSinkIface * iface = (GumEventSinkIface *) g_iface;
+
+  iface->query_mask = gum_fake_event_sink_query_mask;
+  iface->process = gum_fake_event_sink_process;
+  iface->process_compact = gum_fake_compact_event_sink_process_compact;
+}
+
+static void
+gum_fake_compact_event_sink_init (GumFakeCompactEventSink * self)
+{
+}
+
+GumEventSink *
+gum_fake_compact_event_sink_new (void)
+{
+  GumFakeCompactEventSink * sink;
+
+  sink = g_object_new (GUM_TYPE_FAKE_COMPACT_EVENT_SINK, NULL);
+
+  return GUM_EVENT_SINK (sink);
+}
+
 void
 gum_fake_event_sink_reset (GumFakeEventSink * self)
 {
   self->mask = 0;
   g_array_set_size (self->events, 0);
+
+  if (G_TYPE_CHECK_INSTANCE_TYPE (self, GUM_TYPE_FAKE_BATCH_EVENT_SINK))
+    GUM_FAKE_BATCH_EVENT_SINK (self)->batch_count = 0;
+
+  if (G_TYPE_CHECK_INSTANCE_TYPE (self, GUM_TYPE_FAKE_COMPACT_EVENT_SINK))
+  {
+    GUM_FAKE_COMPACT_EVENT_SINK (self)->chunk_count = 0;
+    GUM_FAKE_COMPACT_EVENT_SINK (self)->byte_count = 0;
+  }
 }
 
 const GumCallEvent *
@@ -114,6 +209,16 @@ gum_fake_event_sink_get_nth_event_as_exec (GumFakeEventSink * self, guint n)
   return &ev->exec;
 }
 
+const GumBlockEvent *
+gum_fake_event_sink_get_nth_event_as_block (GumFakeEventSink * self, guint n)
+{
+  const GumEvent * ev;
+
+  ev = &g_array_index (self->events, GumEvent, n);
+  g_assert (ev->type == GUM_BLOCK || ev->type == GUM_BLOCK_EXEC);
+  return &ev->block;
+}
+
 void
 gum_fake_event_sink_dump (GumFakeEventSink * self)
 {
@@ -136,6 +241,12 @@ gum_fake_event_sink_dump (GumFakeEventSink * self)
       case GUM_RET:
         g_print ("GUM_RET at %p, target=%p\n", ev->ret.location, ev->ret.target);
         break;
+      case GUM_BLOCK:
+        g_print ("GUM_BLOCK %p-%p\n", ev->block.begin, ev->block.end);
+        break;
+      case GUM_BLOCK_EXEC:
+        g_print ("GUM_BLOCK_EXEC %p-%p\n", ev->block.begin, ev->block.end);
+        break;
       default:
         g_print ("UNKNOWN EVENT\n");
         break;
@@ -159,3 +270,44 @@ gum_fake_event_sink_process (GumEventSink * sink,
 
   g_array_append_val (self->events, *ev);
 }
+
+static void
+gum_fake_batch_event_sink_process_batch (GumEventSink * sink,
+                                         const GumEvent * events,
+                                         guint n_events)
+{
+  GumFakeBatchEventSink * self = GUM_FAKE_BATCH_EVENT_SINK (sink);
+
+  g_array_append_vals (GUM_FAKE_EVENT_SINK (sink)->events, events, n_events);
+  self->batch_count++;
+}
+
+static void
+gum_fake_compact_event_sink_process_compact (GumEventSink * sink,
+                                             const guint8 * data,
+                                             gsize size)
+{
+  GumFakeCompactEventSink * self = GUM_FAKE_COMPACT_EVENT_SINK (sink);
+  GumEventDecoder decoder;
+  GumEvent events[64];
+
+  self->chunk_count++;
+  self->byte_count += size;
+
+  /* every chunk starts from a fresh encoder */
+  gum_event_decoder_init (&decoder);
+  while (size != 0)
+  {
+    guint n_events;
+    gsize consumed;
+
+    n_events = gum_event_decoder_decode (&decoder, data, size, events,
+        G_N_ELEMENTS (events), &consumed);
+    g_assert_cmpuint (consumed, !=, 0);
+    g_array_append_vals (GUM_FAKE_EVENT_SINK (sink)->events, events,
+        n_events);
+
+    data += consumed;
+    size -= consumed;
+  }
+}
@@ -35,8 +35,21 @@
 #define GUM_FAKE_EVENT_SINK_GET_CLASS(obj) (G_TYPE_INSTANCE_GET_CLASS (\
     (obj), GUM_TYPE_FAKE_EVENT_SINK, GumFakeEventSinkClass))
 
+#define GUM_TYPE_FAKE_BATCH_EVENT_SINK (gum_fake_batch_event_sink_get_type ())
+#define GUM_FAKE_BATCH_EVENT_SINK(obj) (G_TYPE_CHECK_INSTANCE_CAST ((obj),\
+    GUM_TYPE_FAKE_BATCH_EVENT_SINK, GumFakeBatchEventSink))
+
+#define GUM_TYPE_FAKE_COMPACT_EVENT_SINK \
+    (gum_fake_compact_event_sink_get_type ())
+#define GUM_FAKE_COMPACT_EVENT_SINK(obj) (G_TYPE_CHECK_INSTANCE_CAST ((obj),\
+    GUM_TYPE_FAKE_COMPACT_EVENT_SINK, GumFakeCompactEventSink))
+
 typedef struct _GumFakeEventSink GumFakeEventSink;
 typedef struct _GumFakeEventSinkClass GumFakeEventSinkClass;
+typedef struct _GumFakeBatchEventSink GumFakeBatchEventSink;
+typedef struct _GumFakeBatchEventSinkClass GumFakeBatchEventSinkClass;
+typedef struct _GumFakeCompactEventSink GumFakeCompactEventSink;
+typedef struct _GumFakeCompactEventSinkClass GumFakeCompactEventSinkClass;
 
 struct _GumFakeEventSink
 {
@@ -51,12 +64,45 @@ struct _GumFakeEventSinkClass
   GObjectClass parent_class;
 };
 
+struct _GumFakeBatchEventSink
+{
+  GumFakeEventSink parent;
+
+  guint batch_count;
+};
+
+struct _GumFakeBatchEventSinkClass
+{
+  GumFakeEventSinkClass parent_class;
+};
+
+struct _GumFakeCompactEventSink
+{
+  GumFakeEventSink parent;
+
+  guint chunk_count;
+  gsize byte_count;
+};
+
+struct _GumFakeCompactEventSinkClass
+{
+  GumFakeEventSinkClass parent_class;
+};
+
 G_BEGIN_DECLS
 
 GType gum_fake_event_sink_get_type (void) G_GNUC_CONST;
 
 GumEventSink * gum_fake_event_sink_new (void);
 
+GType gum_fake_batch_event_sink_get_type (void) G_GNUC_CONST;
+
+GumEventSink * gum_fake_batch_event_sink_new (void);
+
+GType gum_fake_compact_event_sink_get_type (void) G_GNUC_CONST;
+
+GumEventSink * gum_fake_compact_event_sink_new (void);
+
 void gum_fake_event_sink_reset (GumFakeEventSink * self);
 
 const GumCallEvent * gum_fake_event_sink_get_nth_event_as_call (
@@ -65,6 +111,8 @@ const GumRetEvent * gum_fake_event_sink_get_nth_event_as_ret (
     GumFakeEventSink * self, guint n);
 const GumExecEvent * gum_fake_event_sink_get_nth_event_as_exec (
     GumFakeEventSink * self, guint n);
+const GumBlockEvent * gum_fake_event_sink_get_nth_event_as_block (
+    GumFakeEventSink * self, guint n);
 
 void gum_fake_event_sink_dump (GumFakeEventSink * self);
 